@@ -70,60 +70,79 @@
 #include <arpa/tftp.h>
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
-#include "tftpsubs.h"
-
-/* Some systems define PKTSIZE in <arpa/tftp.h>.  */
-#ifndef PKTSIZE
-#define PKTSIZE SEGSIZE+4	/* should be moved to tftp.h */
-#endif
+#include "xalloc.h"
 
-struct bf
-{
-  int counter;			/* size of data in buffer, or flag */
-  char buf[PKTSIZE];		/* room for data packet */
-} bfs[2];
+#include "tftpsubs.h"
 
 				/* Values for bf.counter  */
 #define BF_ALLOC -3		/* alloc'd but not yet filled */
 #define BF_FREE  -2		/* free */
-/* [-1 .. SEGSIZE] = size of data in the data buffer */
+/* [-1 .. segsize] = size of data in the data buffer */
+
+/* Datagrams discarded by each call of recvmmsg() in synchnet.  */
+#define SYNCHBATCH	16
 
-static int nextone;		/* index of next buffer to use */
-static int current;		/* index of buffer in use */
+/* Give IO a ring of NBUFS buffers, for blocks of SEGSIZE bytes.  */
+void
+tftpio_init (struct tftpio *io, int segsize, int nbufs)
+{
+  int i;
+
+  tftpio_free (io);
+  io->segsize = segsize;
+  io->nbufs = nbufs < 2 ? 2 : nbufs;
+  io->bfs = xcalloc (io->nbufs, sizeof (*io->bfs));
+  for (i = 0; i < io->nbufs; i++)
+    io->bfs[i].buf = xmalloc (segsize + 4);
+}
+
+void
+tftpio_free (struct tftpio *io)
+{
+  int i;
 
-				/* control flags for crlf conversions */
-int newline = 0;		/* fillbuf: in middle of newline expansion */
-int prevchar = -1;		/* putbuf: previous char (cr check) */
+  for (i = 0; i < io->nbufs; i++)
+    free (io->bfs[i].buf);
+  free (io->bfs);
+  io->bfs = NULL;
+  io->nbufs = 0;
+}
 
-static struct tftphdr *rw_init (int);
+static struct tftphdr *rw_init (struct tftpio *, int);
 
 struct tftphdr *
-w_init (void)
+tftpio_w_init (struct tftpio *io)
 {
-  return rw_init (0);
+  return rw_init (io, 0);
 }				/* write-behind */
 struct tftphdr *
-r_init (void)
+tftpio_r_init (struct tftpio *io)
 {
-  return rw_init (1);
+  return rw_init (io, 1);
 }				/* read-ahead */
 
 /* init for either read-ahead or write-behind */
 /* zero for write-behind, one for read-head */
 static struct tftphdr *
-rw_init (int x)
+rw_init (struct tftpio *io, int x)
 {
-  newline = 0;			/* init crlf flag */
-  prevchar = -1;
-  bfs[0].counter = BF_ALLOC;	/* pass out the first buffer */
-  current = 0;
-  bfs[1].counter = BF_FREE;
-  nextone = x;			/* ahead or behind? */
-  return (struct tftphdr *) bfs[0].buf;
+  int i;
+
+  io->newline = 0;		/* init crlf flag */
+  io->prevchar = -1;
+  io->bfs[0].counter = BF_ALLOC;	/* pass out the first buffer */
+  io->current = 0;
+  for (i = 1; i < io->nbufs; i++)
+    io->bfs[i].counter = BF_FREE;
+  io->nextone = x;		/* ahead or behind? */
+  return (struct tftphdr *) io->bfs[0].buf;
 }
 
+#define NEXT(io, i)	(((i) + 1) % (io)->nbufs)
 
 /* Have emptied current buffer by sending to net and getting ack.
    Free it and return next buffer filled with data.
@@ -131,19 +150,34 @@ rw_init (int x)
 /* if true, convert to ascii */
 /* file opened for read */
 int
-readit (FILE * file, struct tftphdr **dpp, int convert)
+tftpio_readit (struct tftpio *io, FILE * file, struct tftphdr **dpp,
+	       int convert)
+{
+  io->bfs[io->current].counter = BF_FREE;	/* free old one */
+  io->current = NEXT (io, io->current);	/* "incr" current */
+
+  return tftpio_peek (io, file, 0, dpp, convert);
+}
+
+/* Return in *DPP the buffer N places after the current one, reading
+   the file up to it if needed, and return its size.  N must be less
+   than the number of buffers.  */
+int
+tftpio_peek (struct tftpio *io, FILE * file, int n, struct tftphdr **dpp,
+	     int convert)
 {
-  struct bf *b;
+  int i = (io->current + n) % io->nbufs;
 
-  bfs[current].counter = BF_FREE;	/* free old one */
-  current = !current;		/* "incr" current */
+  while (io->bfs[i].counter == BF_FREE)	/* if it's empty */
+    {
+      int next = io->nextone;
 
-  b = &bfs[current];		/* look at new buffer */
-  if (b->counter == BF_FREE)	/* if it's empty */
-    read_ahead (file, convert);	/* fill it */
-  /*      assert(b->counter != BF_FREE); *//* check */
-  *dpp = (struct tftphdr *) b->buf;	/* set caller's ptr */
-  return b->counter;
+      tftpio_read_ahead (io, file, convert);	/* fill it */
+      if (io->nextone == next)
+	return -1;		/* ring is full */
+    }
+  *dpp = (struct tftphdr *) io->bfs[i].buf;	/* set caller's ptr */
+  return io->bfs[i].counter;
 }
 
 /*
@@ -153,37 +187,36 @@ readit (FILE * file, struct tftphdr **dpp, int convert)
 /*	FILE *file;  file opened for read */
 /*	int convert;  if true, convert to ascii */
 void
-read_ahead (FILE * file, int convert)
+tftpio_read_ahead (struct tftpio *io, FILE * file, int convert)
 {
   register int i;
   register char *p;
   register int c;
-  struct bf *b;
+  int *counter;
   struct tftphdr *dp;
 
-  b = &bfs[nextone];		/* look at "next" buffer */
-  if (b->counter != BF_FREE)	/* nop if not free */
+  counter = &io->bfs[io->nextone].counter;	/* look at "next" buffer */
+  if (*counter != BF_FREE)	/* nop if not free */
     return;
-  nextone = !nextone;		/* "incr" next buffer ptr */
-
-  dp = (struct tftphdr *) b->buf;
+  dp = (struct tftphdr *) io->bfs[io->nextone].buf;
+  io->nextone = NEXT (io, io->nextone);	/* "incr" next buffer ptr */
 
   if (convert == 0)
     {
-      b->counter = read (fileno (file), dp->th_data, SEGSIZE);
+      *counter = read (fileno (file), dp->th_data, io->segsize);
       return;
     }
 
   p = dp->th_data;
-  for (i = 0; i < SEGSIZE; i++)
+  for (i = 0; i < io->segsize; i++)
     {
-      if (newline)
+      if (io->newline)
 	{
-	  if (prevchar == '\n')
+	  if (io->prevchar == '\n')
 	    c = '\n';		/* lf to cr,lf */
 	  else
 	    c = '\0';		/* cr to cr,nul */
-	  newline = 0;
+	  io->newline = 0;
 	}
       else
 	{
@@ -192,14 +225,14 @@ read_ahead (FILE * file, int convert)
 	    break;
 	  if (c == '\n' || c == '\r')
 	    {
-	      prevchar = c;
+	      io->prevchar = c;
 	      c = '\r';
-	      newline = 1;
+	      io->newline = 1;
 	    }
 	}
       *p++ = c;
     }
-  b->counter = (int) (p - dp->th_data);
+  *counter = (int) (p - dp->th_data);
 }
 
 /* Update count associated with the buffer, get new buffer
@@ -207,14 +240,15 @@ read_ahead (FILE * file, int convert)
    available.
  */
 int
-writeit (FILE * file, struct tftphdr **dpp, int ct, int convert)
+tftpio_writeit (struct tftpio *io, FILE * file, struct tftphdr **dpp,
+		int ct, int convert)
 {
-  bfs[current].counter = ct;	/* set size of data to write */
-  current = !current;		/* switch to other buffer */
-  if (bfs[current].counter != BF_FREE)	/* if not free */
-    write_behind (file, convert);	/* flush it */
-  bfs[current].counter = BF_ALLOC;	/* mark as alloc'd */
-  *dpp = (struct tftphdr *) bfs[current].buf;
+  io->bfs[io->current].counter = ct;	/* set size of data to write */
+  io->current = NEXT (io, io->current);	/* switch to other buffer */
+  if (io->bfs[io->current].counter != BF_FREE)	/* if not free */
+    tftpio_write_behind (io, file, convert);	/* flush it */
+  io->bfs[io->current].counter = BF_ALLOC;	/* mark as alloc'd */
+  *dpp = (struct tftphdr *) io->bfs[io->current].buf;
   return ct;			/* this is a lie of course */
 }
 
@@ -225,24 +259,24 @@ writeit (FILE * file, struct tftphdr **dpp, int ct, int convert)
  * CR followed by anything else.  In this case we leave it alone.
  */
 int
-write_behind (FILE * file, int convert)
+tftpio_write_behind (struct tftpio *io, FILE * file, int convert)
 {
   char *buf;
   int count;
   register int ct;
   register char *p;
   register int c;		/* current character */
-  struct bf *b;
+  int *counter;
   struct tftphdr *dp;
 
-  b = &bfs[nextone];
-  if (b->counter < -1)		/* anything to flush? */
+  counter = &io->bfs[io->nextone].counter;
+  if (*counter < -1)		/* anything to flush? */
     return 0;			/* just nop if nothing to do */
 
-  count = b->counter;		/* remember byte count */
-  b->counter = BF_FREE;		/* reset flag */
-  dp = (struct tftphdr *) b->buf;
-  nextone = !nextone;		/* incr for next time */
+  count = *counter;		/* remember byte count */
+  *counter = BF_FREE;		/* reset flag */
+  dp = (struct tftphdr *) io->bfs[io->nextone].buf;
+  io->nextone = NEXT (io, io->nextone);	/* incr for next time */
   buf = dp->th_data;
 
   if (count <= 0)
@@ -256,7 +290,7 @@ write_behind (FILE * file, int convert)
   while (ct--)
     {				/* loop over the buffer */
       c = *p++;			/* pick up a character */
-      if (prevchar == '\r')
+      if (io->prevchar == '\r')
 	{			/* if prev char was cr */
 	  if (c == '\n')	/* if have cr,lf then just */
 	    fseeko (file, -1, 1);	/* smash lf on top of the cr */
@@ -266,12 +300,11 @@ write_behind (FILE * file, int convert)
 	}
       putc (c, file);
     skipit:
-      prevchar = c;
+      io->prevchar = c;
     }
   return count;
 }
 
-
 /* When an error has occurred, it is possible that the two sides
  * are out of synch.  Ie: that what I think is the other side's
  * response to packet N is really their response to packet N-1.
@@ -283,12 +316,32 @@ write_behind (FILE * file, int convert)
  * when trace is active).
  */
 
-/*int	f;socket to flush */
+/* Discard the datagrams waiting at socket F, and return their
+   number.  With recvmmsg(), they are read in batches, all into the
+   same buffer.  */
 int
 synchnet (int f)
 {
-  int i, j = 0;
+  int j = 0;
   char rbuf[PKTSIZE];
+#ifdef HAVE_RECVMMSG
+  struct mmsghdr msgs[SYNCHBATCH];
+  struct iovec iov;
+  int i, n;
+
+  iov.iov_base = rbuf;
+  iov.iov_len = sizeof (rbuf);
+  memset (msgs, 0, sizeof (msgs));
+  for (i = 0; i < SYNCHBATCH; i++)
+    {
+      msgs[i].msg_hdr.msg_iov = &iov;
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+  while ((n = recvmmsg (f, msgs, SYNCHBATCH, MSG_DONTWAIT, NULL)) > 0)
+    j += n;
+  return j;
+#else /* !HAVE_RECVMMSG */
+  int i;
   struct sockaddr_storage from;
   socklen_t fromlen;
 
@@ -307,4 +360,5 @@ synchnet (int f)
 	  return (j);
 	}
     }
+#endif /* !HAVE_RECVMMSG */
 }
@@ -47,16 +47,58 @@
  * SUCH DAMAGE.
  */
 
+/* Some systems define PKTSIZE in <arpa/tftp.h>.  */
+#ifndef PKTSIZE
+# define PKTSIZE SEGSIZE+4	/* should be moved to tftp.h */
+#endif
+
+/* Option acknowledgement and its refusal, RFC 2347.  */
+#ifndef OACK
+# define OACK	06
+#endif
+#ifndef EOPTNEG
+# define EOPTNEG	8
+#endif
+
+/* Limits of the options blksize, RFC 2348, timeout, RFC 2349, and
+   windowsize, RFC 7440.  */
+#define TFTP_BLKSIZE_MIN	8
+#define TFTP_BLKSIZE_MAX	65464
+#define TFTP_TIMEOUT_MAX	255
+#define TFTP_WINDOW_MAX		65535
+
+/* State of the read-ahead or write-behind of one transfer.  Blocks
+   of SEGSIZE bytes are kept in a ring of NBUFS buffers, two for a
+   transfer in lock step, and more for a window of blocks.  */
+struct tftpio
+{
+  int segsize;			/* size of a full block */
+  int nbufs;			/* buffers in the ring */
+  struct tftpbuf
+  {
+    int counter;		/* size of data in buffer, or flag */
+    char *buf;			/* room for data packet */
+  } *bfs;
+  int nextone;			/* index of next buffer to use */
+  int current;			/* index of buffer in use */
+  int newline;			/* fillbuf: in middle of newline expansion */
+  int prevchar;			/* putbuf: previous char (cr check) */
+};
+
 /*
  * Prototypes for read-ahead/write-behind subroutines for tftp user and
  * server.
  */
-struct tftphdr *r_init (void);
-void read_ahead (FILE *, int);
-int readit (FILE *, struct tftphdr **, int);
+void tftpio_init (struct tftpio *, int, int);
+void tftpio_free (struct tftpio *);
 
-int synchnet (int);
+struct tftphdr *tftpio_r_init (struct tftpio *);
+void tftpio_read_ahead (struct tftpio *, FILE *, int);
+int tftpio_readit (struct tftpio *, FILE *, struct tftphdr **, int);
+int tftpio_peek (struct tftpio *, FILE *, int, struct tftphdr **, int);
+
+struct tftphdr *tftpio_w_init (struct tftpio *);
+int tftpio_write_behind (struct tftpio *, FILE *, int);
+int tftpio_writeit (struct tftpio *, FILE *, struct tftphdr **, int, int);
 
-struct tftphdr *w_init (void);
-int write_behind (FILE *, int);
-int writeit (FILE *, struct tftphdr **, int, int);
+int synchnet (int);
@@ -73,9 +73,17 @@
  *	service name			must be in /etc/services or must
  *					name a tcpmux service
  *	socket type			stream/dgram/raw/rdm/seqpacket
+ *	  [:option,...]			[TCP options: defer, fastopen]
  *	protocol			must be in /etc/protocols
  *	wait/nowait[.max]		single-threaded/multi-threaded
  *                                      [with an optional fork limit]
+ *	  [/rate[/children]]		[limits for each client of
+ *					a nowait stream service]
+ *	or pool[.min[-max]]		single-threaded servers started
+ *					in advance
+ *	or listen[.name]		single-threaded server started
+ *					with the sockets of all services
+ *					of that name
  *	user[:group] or user[.group]	user (and group) to run daemon as
  *	server program			full path name
  *	server program arguments	arguments starting with argv[0]
@@ -105,6 +113,7 @@
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <sys/time.h>
 #include <time.h>
@@ -113,14 +122,17 @@
 #endif
 
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
 #include <pwd.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -130,8 +142,12 @@
 #include <argp.h>
 #include <argp-version-etc.h>
 #include <progname.h>
-#include <sys/select.h>
+#include <poll.h>
 #include <grp.h>
+#if defined HAVE_SYS_EPOLL_H && defined HAVE_EPOLL_CREATE1
+# include <sys/epoll.h>
+# define USE_EPOLL 1
+#endif
 
 #include "libinetutils.h"
 #include "argcv.h"
@@ -145,20 +161,39 @@
 #define TOOMANY		1000	/* don't start more than TOOMANY */
 #define CNT_INTVL	60	/* servers in CNT_INTVL sec. */
 #define RETRYTIME	(60*10)	/* retry after bind or server fail */
+#define MAXINTERNAL	4096	/* connections served internally */
+#define POOLMAX		8	/* default most servers in a pool */
+#define POOLCHECK	50	/* msecs a request waits before a pool grows */
+#define SOURCEMAX	65536	/* most clients tracked for one service */
+#define CHILDHASH	1024	/* buckets of the table of children */
+#define CTLLINE		128	/* longest command on the control socket */
+#define ACCEPTMAX	64	/* connections accepted at one wakeup */
+#define DEFERSECS	5	/* default secs of `defer' */
+#define FASTOPENQ	16	/* default queue of `fastopen' */
+#define EXECFAILED	127	/* exit status of a child which could not
+				   execute its server */
 
 #ifndef SIGCHLD
 # define SIGCHLD	SIGCLD
 #endif
 #define SIGBLOCK	(sigmask(SIGCHLD)|sigmask(SIGHUP)|sigmask(SIGALRM))
 
+/* Servers are started with vfork, which needs the credentials of
+   each service known in advance.  */
+#if defined HAVE_WORKING_VFORK && defined HAVE_GETGROUPLIST
+# define USE_VFORK 1
+#endif
+
+#define MAXEVENTS	64	/* events handled per wakeup */
+
 bool debug = false;
 int nsock, maxsock;
-fd_set allsock;
 int options;
 int timingout;
 unsigned toomany = TOOMANY;
-char **Argv;
-char *LastArg;
+int max_internal = MAXINTERNAL;
+int source_prefix = 32;		/* bits of an IPv4 client address */
+int source_prefix6 = 64;	/* bits of an IPv6 client address */
 
 char **config_files;
 
@@ -166,14 +201,25 @@ static bool env_option = false;	       /* Set environment variables */
 static bool resolve_option = false;    /* Resolve IP addresses */
 static bool pidfile_option = true;     /* Record the PID in a file */
 static const char *pid_file = PATH_INETDPID;
+static const char *control_path;      /* control socket, or NULL */
+
+#if defined HAVE_SYS_RESOURCE_H && defined RLIMIT_NOFILE
+/* The limit of open files as inherited, to be passed on to servers,
+   while inetd raises its own to allow for many listening sockets.  */
+static struct rlimit nofile_limit;
+static bool nofile_raised = false;
+#endif
 
 const char args_doc[] = "[CONF-FILE [CONF-DIR]]...";
 const char doc[] = "Internet super-server.";
 
 /* Define keys for long options that do not have short counterparts. */
 enum {
-  OPT_ENVIRON = 256,
-  OPT_RESOLVE
+  OPT_CONTROL = 256,
+  OPT_ENVIRON,
+  OPT_MAX_INTERNAL,
+  OPT_RESOLVE,
+  OPT_SOURCE_PREFIX
 };
 
 const char *program_authors[] = {
@@ -184,10 +230,15 @@ const char *program_authors[] = {
 
 static struct argp_option argp_options[] = {
 #define GRP 0
+  {"control", OPT_CONTROL, "PATH", 0,
+   "accept commands for statistics and reloading on the local socket PATH",
+   GRP+1},
   {"debug", 'd', NULL, 0,
    "turn on debugging, run in foreground mode", GRP+1},
   {"environment", OPT_ENVIRON, NULL, 0,
    "pass local and remote socket information in environment variables", GRP+1},
+  {"max-internal", OPT_MAX_INTERNAL, "NUMBER", 0,
+   "maximum number of connections served internally at a time", GRP+1},
   { "pidfile", 'p', "PIDFILE", OPTION_ARG_OPTIONAL,
     "override pidfile (default: \"" PATH_INETDPID "\")",
     GRP+1 },
@@ -196,6 +247,9 @@ static struct argp_option argp_options[] = {
   {"resolve", OPT_RESOLVE, NULL, 0,
    "resolve IP addresses when setting environment variables "
    "(see --environment)", GRP+1},
+  {"source-prefix", OPT_SOURCE_PREFIX, "BITS[,BITS6]", 0,
+   "count clients with addresses alike in BITS (IPv4) and BITS6 (IPv6) "
+   "leading bits as one for the limits of a service", GRP+1},
 #undef GRP
   {NULL, 0, NULL, 0, NULL, 0}
 };
@@ -214,6 +268,10 @@ parse_opt (int key, char *arg,
       options |= SO_DEBUG;
       break;
 
+    case OPT_CONTROL:
+      control_path = arg;
+      break;
+
     case OPT_ENVIRON:
       env_option = true;
       break;
@@ -237,6 +295,34 @@ parse_opt (int key, char *arg,
       resolve_option = true;
       break;
 
+    case OPT_SOURCE_PREFIX:
+      number = strtol (arg, &p, 10);
+      if (number < 0 || number > 32 || p == arg || (*p && *p != ','))
+	{
+	  syslog (LOG_ERR, "--source-prefix %s: bad value", arg);
+	  break;
+	}
+      source_prefix = number;
+      if (*p)
+	{
+	  char *q = p + 1;
+
+	  number = strtol (q, &p, 10);
+	  if (number < 0 || number > 128 || p == q || *p)
+	    syslog (LOG_ERR, "--source-prefix %s: bad value", arg);
+	  else
+	    source_prefix6 = number;
+	}
+      break;
+
+    case OPT_MAX_INTERNAL:
+      number = strtol (arg, &p, 0);
+      if (number < 1 || *p)
+	syslog (LOG_ERR, "--max-internal %s: bad value", arg);
+      else
+	max_internal = number;
+      break;
+
     default:
       return ARGP_ERR_UNKNOWN;
     }
@@ -248,6 +334,28 @@ static struct argp argp =
   {argp_options, parse_opt, args_doc, doc, NULL, NULL, NULL};
 
 
+/* Counters of a service, reported on the control socket.  */
+struct servstats
+{
+  unsigned long accepts;	/* connections accepted by inetd */
+  unsigned long started;	/* servers started */
+  unsigned long failed;		/* servers which could not be started */
+  unsigned long refused;	/* connections refused for limits */
+  unsigned long terminated;	/* times turned off for looping */
+  unsigned long exited;		/* servers exited with status 0 */
+  unsigned long errors;		/* servers exited with another status */
+  unsigned long killed;		/* servers ended by a signal */
+  unsigned long long accept_usec;	/* sum of accept latencies */
+  unsigned long accept_max;	/* longest accept latency, in usecs */
+};
+
+/* A server in a pool.  */
+struct poolserver
+{
+  pid_t pid;
+  time_t start;			/* when it was started */
+};
+
 struct servtab
 {
   const char *se_file;
@@ -261,11 +369,16 @@ struct servtab
   short se_checked;		/* looked at during merge */
   char *se_user;		/* user name to run as */
   char *se_group;		/* group name to run as */
+  uid_t se_uid;			/* user ID, found when read */
+  gid_t se_gid;			/* group ID, found when read */
+  gid_t *se_groups;		/* supplementary groups, or NULL */
+  int se_ngroups;		/* number of se_groups */
   struct biltin *se_bi;		/* if built-in, description */
   char *se_server;		/* server program */
   char **se_argv;		/* program arguments */
   size_t se_argc;		/* number of arguments */
   int se_fd;			/* open descriptor */
+  short se_watched;		/* se_fd is in the event set */
   int se_type;			/* type */
   sa_family_t se_family;	/* address family of the socket */
   char se_v4mapped;		/* 1 = accept v4mapped connection, 0 = don't */
@@ -274,6 +387,24 @@ struct servtab
   unsigned se_refcnt;
   unsigned se_count;			/* number started since se_time */
   struct timeval se_time;	/* start of se_count */
+  unsigned se_pool_min;		/* pool: servers kept running */
+  unsigned se_pool_max;		/* pool: most servers, 0 if no pool */
+  struct poolserver *se_pool;	/* pool: running servers */
+  unsigned se_nworkers;		/* pool: number of running servers */
+  unsigned se_pool_done;	/* pool: servers done, to be replaced */
+  long long se_pool_due;	/* pool: msecs of next check, or 0 */
+  unsigned se_src_rate;		/* connections per minute from a client */
+  unsigned se_src_max;		/* servers running for a client */
+  struct source *se_src;	/* clients, a hash table */
+  unsigned se_srcsize;		/* size of se_src, a power of two */
+  unsigned se_srcused;		/* entries in use in se_src */
+  time_t se_srcpurged;		/* last purge of a full se_src */
+  time_t se_srcfull;		/* last report of a full se_src */
+  int se_defer;			/* TCP_DEFER_ACCEPT secs, or 0 */
+  int se_fastopen;		/* TCP_FASTOPEN queue length, or 0 */
+  char *se_listen;		/* listen: name of the group, or NULL */
+  struct servstats se_stats;	/* counters since the last reset */
+  unsigned se_children;		/* servers running */
   struct servtab *se_next;
 } *servtab;
 
@@ -285,15 +416,36 @@ struct servtab
 #define ISMUXPLUS(sep)	((sep)->se_type == MUXPLUS_TYPE)
 
 
+/* A client, as counted for the limits of a service: the leading bits
+   of its address, all others being zero.  IPv4 addresses mapped into
+   IPv6 count as IPv4.  */
+struct srckey
+{
+  sa_family_t family;
+  unsigned char addr[16];
+};
+
+struct source
+{
+  struct srckey key;		/* family is 0 in a free entry */
+  unsigned active;		/* servers running for the client */
+  unsigned count;		/* connections since TIME */
+  time_t time;			/* start of COUNT */
+  time_t logged;		/* last refusal logged */
+};
+
+
 /* Built-in services */
+struct bconn;
+
 void chargen_dg (int, struct servtab *);
-void chargen_stream (int, struct servtab *);
+void chargen_event (struct bconn *, int);
 void daytime_dg (int, struct servtab *);
 void daytime_stream (int, struct servtab *);
 void discard_dg (int, struct servtab *);
-void discard_stream (int, struct servtab *);
+void discard_event (struct bconn *, int);
 void echo_dg (int, struct servtab *);
-void echo_stream (int, struct servtab *);
+void echo_event (struct bconn *, int);
 void machtime_dg (int, struct servtab *);
 void machtime_stream (int, struct servtab *);
 void tcpmux (int s, struct servtab *sep);
@@ -305,27 +457,47 @@ struct biltin
   short bi_fork;		/* 1 if should fork before call */
   short bi_wait;		/* 1 if should wait for child */
   void (*bi_fn) (int s, struct servtab *);	/*function which performs it */
+  /* If the connection is served by the main loop, the function called
+     for its events.  */
+  void (*bi_event) (struct bconn *, int);
 } biltins[] =
   {
     /* Echo received data */
-    {"echo", SOCK_STREAM, 1, 0, echo_stream},
-    {"echo", SOCK_DGRAM, 0, 0, echo_dg},
+    {"echo", SOCK_STREAM, 0, 0, NULL, echo_event},
+    {"echo", SOCK_DGRAM, 0, 0, echo_dg, NULL},
     /* Internet /dev/null */
-    {"discard", SOCK_STREAM, 1, 0, discard_stream},
-    {"discard", SOCK_DGRAM, 0, 0, discard_dg},
+    {"discard", SOCK_STREAM, 0, 0, NULL, discard_event},
+    {"discard", SOCK_DGRAM, 0, 0, discard_dg, NULL},
     /* Return 32 bit time since 1900 */
-    {"time", SOCK_STREAM, 0, 0, machtime_stream},
-    {"time", SOCK_DGRAM, 0, 0, machtime_dg},
+    {"time", SOCK_STREAM, 0, 0, machtime_stream, NULL},
+    {"time", SOCK_DGRAM, 0, 0, machtime_dg, NULL},
     /* Return human-readable time */
-    {"daytime", SOCK_STREAM, 0, 0, daytime_stream},
-    {"daytime", SOCK_DGRAM, 0, 0, daytime_dg},
+    {"daytime", SOCK_STREAM, 0, 0, daytime_stream, NULL},
+    {"daytime", SOCK_DGRAM, 0, 0, daytime_dg, NULL},
     /* Familiar character generator */
-    {"chargen", SOCK_STREAM, 1, 0, chargen_stream},
-    {"chargen", SOCK_DGRAM, 0, 0, chargen_dg},
-    {"tcpmux", SOCK_STREAM, 1, 0, tcpmux},
-    {NULL, 0, 0, 0, NULL}
+    {"chargen", SOCK_STREAM, 0, 0, NULL, chargen_event},
+    {"chargen", SOCK_DGRAM, 0, 0, chargen_dg, NULL},
+    {"tcpmux", SOCK_STREAM, 1, 0, tcpmux, NULL},
+    {NULL, 0, 0, 0, NULL, NULL}
   };
 
+/* A stream connection served by the main loop.  */
+struct bconn
+{
+  int bc_fd;
+  struct biltin *bc_bi;		/* the service */
+  char *bc_buf;			/* echo: data yet to be sent back,
+				   control: command, then reply */
+  size_t bc_off;		/* echo: start of data in bc_buf,
+				   chargen: position in the pattern,
+				   control: length of command read */
+  size_t bc_len;		/* echo: length of data in bc_buf */
+  struct servtab *bc_sep;	/* service counting the client, or NULL */
+  struct srckey bc_src;		/* the client */
+};
+
+int nbconn;			/* connections served at present */
+
 #define NUMINT	(sizeof(intab) / sizeof(struct inent))
 
 struct biltin *
@@ -345,14 +517,15 @@ bi_lookup (const struct servtab *sep)
 
 #if defined HAVE_SIGACTION
 # define SIGSTATUS sigset_t
-# define sigstatus_empty(s) sigemptyset(&s)
-# define inetd_pause(s) sigsuspend(&s)
 #else
 # define SIGSTATUS long
-# define sigstatus_empty(s) s = 0
-# define inetd_pause(s) sigpause (s)
 #endif
 
+/* Signal mask of the main loop while it waits for events.  All
+   other time SIGCHLD, SIGHUP, and SIGALRM are blocked, so their
+   handlers run only while waiting.  */
+SIGSTATUS wait_sigstatus;
+
 void
 signal_set_handler (int signo, void (*handler) ())
 {
@@ -412,224 +585,1156 @@ signal_unblock (SIGSTATUS * status)
 #endif
 }
 
+
+/* Event notification
+
+   Descriptors are watched with epoll where available, so a wakeup
+   costs in proportion to the number of ready descriptors.  Elsewhere
+   poll() is used, with an array kept up to date as the set changes.
+   Each descriptor is looked up in FDTAB when it is ready, to find the
+   service listening on it, or the connection served internally.
+   Signal handlers change the set as well, and a byte written to a
+   pipe ends a poll() which began before such a change.  */
+
+struct fdent
+{
+  struct servtab *sep;		/* service listening on the descriptor */
+  struct bconn *conn;		/* connection served internally */
+  short events;			/* POLLIN and POLLOUT watched for */
+#ifndef USE_EPOLL
+  int pollidx;			/* index in POLLFDS, if watched */
+#endif
+};
+
+struct fdent *fdtab;
+int fdtab_size;
+int nwatched;			/* descriptors with nonzero events */
+
+#ifdef USE_EPOLL
+int epfd = -1;
+#else
+struct pollfd *pollfds;		/* wakeup pipe, then watched descriptors */
+int npollfds;
+int pollfds_size;
+int polling;			/* signals are unblocked in poll() */
+int wakeup_pipe[2] = { -1, -1 };
+#endif
+
+long long event_usec;		/* time the last wait for events ended */
+
+static long long
+usec_now (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+static long long
+msec_now (void)
+{
+  return usec_now () / 1000;
+}
+
 void
-run_service (int ctrl, struct servtab *sep)
+event_init (void)
 {
-  struct passwd *pwd;
-  struct group *grp = NULL;
-  char buf[50];
+#ifdef USE_EPOLL
+  epfd = epoll_create1 (EPOLL_CLOEXEC);
+  if (epfd < 0)
+    {
+      syslog (LOG_ERR, "epoll_create1: %m");
+      exit (EXIT_FAILURE);
+    }
+#else
+  int i;
 
-  if (sep->se_bi)
+  if (pipe (wakeup_pipe) < 0)
     {
-      (*sep->se_bi->bi_fn) (ctrl, sep);
+      syslog (LOG_ERR, "pipe: %m");
+      exit (EXIT_FAILURE);
     }
-  else
+  for (i = 0; i < 2; i++)
     {
-      if (debug)
-	fprintf (stderr, "%d execl %s\n", (int) getpid (), sep->se_server);
-      dup2 (ctrl, 0);
-      close (ctrl);
-      dup2 (0, 1);
-      dup2 (0, 2);
-      pwd = getpwnam (sep->se_user);
-      if (pwd == NULL)
-	{
-	  syslog (LOG_ERR, "%s/%s: %s: No such user",
-		  sep->se_service, sep->se_proto, sep->se_user);
-	  if (sep->se_socktype != SOCK_STREAM)
-	    recv (0, buf, sizeof buf, 0);
-	  _exit (EXIT_FAILURE);
-	}
-      if (sep->se_group && *sep->se_group)
+      fcntl (wakeup_pipe[i], F_SETFL, O_NONBLOCK);
+      fcntl (wakeup_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+  pollfds_size = 64;
+  pollfds = malloc (pollfds_size * sizeof (*pollfds));
+  if (!pollfds)
+    {
+      syslog (LOG_ERR, "Out of memory.");
+      exit (-1);
+    }
+  pollfds[0].fd = wakeup_pipe[0];
+  pollfds[0].events = POLLIN;
+  npollfds = 1;
+#endif
+}
+
+/* End a wait for events which began before a signal handler made
+   work for the main loop.  epoll_pwait() unblocks signals only while
+   it waits, so it always returns after a handler.  */
+void
+event_wakeup (void)
+{
+#ifndef USE_EPOLL
+  if (polling)
+    write (wakeup_pipe[1], "", 1);
+#endif
+}
+
+#ifndef USE_EPOLL
+/* Make the entry E of descriptor FD in POLLFDS watch for EVENTS.
+   The last entry fills the place of one removed.  */
+static void
+poll_change (int fd, struct fdent *e, short events)
+{
+  if (!e->events)
+    {
+      if (npollfds == pollfds_size)
 	{
-	  grp = getgrnam (sep->se_group);
-	  if (grp == NULL)
+	  pollfds_size *= 2;
+	  pollfds = realloc (pollfds, pollfds_size * sizeof (*pollfds));
+	  if (!pollfds)
 	    {
-	      syslog (LOG_ERR, "%s/%s: %s: No such group",
-		      sep->se_service, sep->se_proto, sep->se_group);
-	      if (sep->se_socktype != SOCK_STREAM)
-		recv (0, buf, sizeof buf, 0);
-	      _exit (EXIT_FAILURE);
+	      syslog (LOG_ERR, "Out of memory.");
+	      exit (-1);
 	    }
 	}
-      if (pwd->pw_uid)
-	{
-	  if (grp && grp->gr_gid)
-	    {
-	      if (setgid (grp->gr_gid) < 0)
-		{
-		  syslog (LOG_ERR, "%s: can't set gid %d: %m",
-			  sep->se_service, grp->gr_gid);
-		  _exit (EXIT_FAILURE);
-		}
-	    }
-	  else if (setgid (pwd->pw_gid) < 0)
-	    {
-	      syslog (LOG_ERR, "%s: can't set gid %d: %m",
-		      sep->se_service, pwd->pw_gid);
-	      _exit (EXIT_FAILURE);
-	    }
-#ifdef HAVE_INITGROUPS
-	  initgroups (pwd->pw_name,
-		      (grp && grp->gr_gid) ? grp->gr_gid : pwd->pw_gid);
+      e->pollidx = npollfds++;
+      pollfds[e->pollidx].fd = fd;
+      pollfds[e->pollidx].revents = 0;
+    }
+  else if (!events)
+    {
+      struct pollfd *last = &pollfds[--npollfds];
+
+      pollfds[e->pollidx] = *last;
+      fdtab[last->fd].pollidx = e->pollidx;
+      return;
+    }
+  pollfds[e->pollidx].events = events;
+
+  event_wakeup ();
+}
 #endif
-	  if (setuid (pwd->pw_uid) < 0)
-	    {
-	      syslog (LOG_ERR, "%s: can't set uid %d: %m",
-		      sep->se_service, pwd->pw_uid);
-	      _exit (EXIT_FAILURE);
-	    }
+
+/* Return the entry of descriptor FD in FDTAB, growing it as needed.  */
+struct fdent *
+fdent (int fd)
+{
+  if (fd >= fdtab_size)
+    {
+      int n = fdtab_size ? fdtab_size : 64;
+
+      while (n <= fd)
+	n *= 2;
+      fdtab = realloc (fdtab, n * sizeof (*fdtab));
+      if (!fdtab)
+	{
+	  syslog (LOG_ERR, "Out of memory.");
+	  exit (-1);
 	}
-      execv (sep->se_server, sep->se_argv);
-      if (sep->se_socktype != SOCK_STREAM)
-	recv (0, buf, sizeof buf, 0);
-      syslog (LOG_ERR, "cannot execute %s: %m", sep->se_server);
-      _exit (EXIT_FAILURE);
+      memset (fdtab + fdtab_size, 0, (n - fdtab_size) * sizeof (*fdtab));
+      fdtab_size = n;
     }
+  return &fdtab[fd];
 }
 
-void
-reapchild (int signo _GL_UNUSED_PARAMETER)
+/* Watch FD for EVENTS, a combination of POLLIN and POLLOUT, or stop
+   watching it if EVENTS is zero.  Return 0 on success.  */
+int
+event_set (int fd, short events)
 {
-  int status;
-  pid_t pid;
-  struct servtab *sep;
+  struct fdent *e = fdent (fd);
+#ifdef USE_EPOLL
+  struct epoll_event ev;
+  int op;
+#endif
 
-  for (;;)
+  if (e->events == events)
+    return 0;
+#ifdef USE_EPOLL
+  memset (&ev, 0, sizeof (ev));
+  if (events & POLLIN)
+    ev.events |= EPOLLIN;
+  if (events & POLLOUT)
+    ev.events |= EPOLLOUT;
+  ev.data.fd = fd;
+  op = !e->events ? EPOLL_CTL_ADD : !events ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+  if (epoll_ctl (epfd, op, fd, &ev) < 0)
     {
-#ifdef HAVE_WAIT3
-      pid = wait3 (&status, WNOHANG, NULL);
+      syslog (LOG_ERR, "epoll_ctl: %m");
+      return -1;
+    }
 #else
-      pid = wait (&status);
+  poll_change (fd, e, events);
 #endif
-      if (pid <= 0)
-	break;
-      if (debug)
-	fprintf (stderr, "%d reaped, status %#x\n", (int) pid, status);
-      for (sep = servtab; sep; sep = sep->se_next)
-	if (sep->se_wait == pid)
-	  {
-	    if (status)
-	      syslog (LOG_WARNING, "%s: exit status 0x%x",
-		      sep->se_server, status);
-	    if (debug)
-	      fprintf (stderr, "restored %s, fd %d\n",
-		       sep->se_service, sep->se_fd);
-	    FD_SET (sep->se_fd, &allsock);
-	    nsock++;
-	    sep->se_wait = 1;
-	  }
-    }
-}
-
-
-
-char *
-newstr (const char *cp)
-{
-  char *s;
-  s = strdup (cp ? cp : "");
-  if (s != NULL)
-    return s;
-  syslog (LOG_ERR, "strdup: %m");
-  exit (-1);
+  if (!e->events)
+    nwatched++;
+  else if (!events)
+    nwatched--;
+  e->events = events;
+  return 0;
 }
 
+/* Start watching the socket of SEP for requests.  */
 void
-dupmem (void **pptr, size_t size)
+watch_sep (struct servtab *sep)
 {
-  void *ptr = malloc (size);
-  if (!ptr)
-    {
-      syslog (LOG_ERR, "dupmem: %m");
-      exit (-1);
-    }
-  memcpy (ptr, *pptr, size);
-  *pptr = ptr;
+  if (sep->se_fd < 0 || sep->se_watched)
+    return;
+  if (event_set (sep->se_fd, POLLIN) < 0)
+    return;
+  fdent (sep->se_fd)->sep = sep;
+  sep->se_watched = 1;
+  nsock++;
 }
 
+/* Stop watching the socket of SEP.  This must precede closing it, as
+   a child may hold a copy of the socket.  */
 void
-dupstr (char **pstr)
+unwatch_sep (struct servtab *sep)
 {
-  if (*pstr)
-    dupmem ((void**)pstr, strlen (*pstr) + 1);
+  if (!sep->se_watched)
+    return;
+  event_set (sep->se_fd, 0);
+  fdent (sep->se_fd)->sep = NULL;
+  sep->se_watched = 0;
+  nsock--;
 }
 
-
-/*
- * print_service:
- *	Dump relevant information to stderr
- */
-void
-print_service (const char *action, struct servtab *sep)
+void handle_request (struct servtab *sep);
+void bconn_event (struct bconn *conn, int revents);
+void control_accept (void);
+int control_fd = -1;
+
+/* Handle REVENTS reported for descriptor FD.  */
+static void
+dispatch (int fd, int revents)
 {
-  fprintf (stderr,
-	   "%s:%d: %s: %s:%s proto=%s, wait=%d, max=%u, "
-	   "user=%s group=%s builtin=%s server=%s\n",
-	   sep->se_file, sep->se_line,
-	   action,
-	   ISMUX (sep) ? (ISMUXPLUS (sep) ? "tcpmuxplus" : "tcpmux")
-		      : (sep->se_node ? sep->se_node : "*"),
-	   sep->se_service, sep->se_proto,
-	   (int) sep->se_wait, sep->se_max,
-	   sep->se_user, sep->se_group,
-	   sep->se_bi ? sep->se_bi->bi_service : "no",
-	   sep->se_server);
+  struct fdent *e = &fdtab[fd];
+
+  if (e->conn)
+    bconn_event (e->conn, revents);
+  else if (e->sep && e->sep->se_watched)
+    handle_request (e->sep);
+  else if (fd == control_fd)
+    control_accept ();
 }
 
-
-/* Configuration */
-int
-setup (struct servtab *sep)
+/* Wait for requests for at most TIMEOUT msecs, or without limit if
+   TIMEOUT is negative, and handle them.  */
+void
+event_loop (int timeout)
 {
-  int err;
-  int on = 1;
+#ifdef USE_EPOLL
+  struct epoll_event events[MAXEVENTS];
+  int i, n;
 
- tryagain:
-  sep->se_fd = socket (sep->se_family, sep->se_socktype, 0);
-  if (sep->se_fd < 0)
+  n = epoll_pwait (epfd, events, MAXEVENTS, timeout, &wait_sigstatus);
+  event_usec = usec_now ();
+  if (n < 0)
     {
-      /* If we don't support creating AF_INET6 sockets, create AF_INET
-	 sockets.  */
-      if (errno == EAFNOSUPPORT && sep->se_family == AF_INET6
-	  && sep->se_v4mapped)
+      if (errno != EINTR)
 	{
-	  /* Fall back to IPv4 silently.  */
-	  sep->se_family = AF_INET;
-	  goto tryagain;
+	  syslog (LOG_WARNING, "epoll_wait: %m");
+	  sleep (1);
 	}
-
-      if (debug)
-	fprintf (stderr, "socket failed on %s/%s: %s\n",
-		 sep->se_service, sep->se_proto, strerror (errno));
-      syslog (LOG_ERR, "%s/%s: socket: %m",
-	      sep->se_service, sep->se_proto);
-      return 1;
+      return;
     }
-#ifdef IPV6
-  if (sep->se_family == AF_INET6)
+  for (i = 0; i < n; i++)
     {
-      /* Reverse the value of SEP->se_v4mapped, since otherwise if
-	 using `tcp6' as a protocol type, all connections will be
-	 mapped to IPv6, and with `tcp6only', IPv4 gets mapped to
-	 IPv6.  */
-      int val = sep->se_v4mapped ? 0 : 1;
-      if (setsockopt (sep->se_fd, IPPROTO_IPV6, IPV6_V6ONLY,
-		      (char *) &val, sizeof (val)) < 0)
-	syslog (LOG_ERR, "setsockopt (IPV6_V6ONLY): %m");
+      int revents = 0;
+
+      if (events[i].events & EPOLLIN)
+	revents |= POLLIN;
+      if (events[i].events & EPOLLOUT)
+	revents |= POLLOUT;
+      if (events[i].events & (EPOLLERR | EPOLLHUP))
+	revents |= POLLHUP;
+      dispatch (events[i].data.fd, revents);
     }
-#endif
-  if (strncmp (sep->se_proto, "tcp", 3) == 0 && (options & SO_DEBUG))
+#else
+  int i, n;
+
+  polling = 1;
+  signal_unblock (&wait_sigstatus);
+  n = poll (pollfds, npollfds, timeout);
+  signal_block (NULL);
+  polling = 0;
+  event_usec = usec_now ();
+  if (n <= 0)
     {
-      if (setsockopt (sep->se_fd, SOL_SOCKET, SO_DEBUG,
-		      (char *) &on, sizeof (on)) < 0
-	  && errno != EACCES)	/* Ignore insufficient permission.  */
-	syslog (LOG_ERR, "setsockopt (SO_DEBUG): %m");
+      if (n < 0 && errno != EINTR)
+	{
+	  syslog (LOG_WARNING, "poll: %m");
+	  sleep (1);
+	}
+      return;
     }
+  if (pollfds[0].revents)
+    {
+      char buf[64];
 
-  err = setsockopt (sep->se_fd, SOL_SOCKET, SO_REUSEADDR,
-		    (char *) &on, sizeof (on));
-  if (err < 0)
+      while (read (wakeup_pipe[0], buf, sizeof buf) > 0)
+	;
+      n--;
+    }
+  /* A handler may remove entries, moving the last one in its place,
+     or add others after the end, which have no events yet.  An entry
+     skipped that way is reported again by the next poll().  */
+  for (i = 1; n > 0 && i < npollfds; i++)
+    if (pollfds[i].revents)
+      {
+	int fd = pollfds[i].fd;
+	int revents = pollfds[i].revents;
+
+	n--;
+	pollfds[i].revents = 0;
+	if (revents & (POLLERR | POLLNVAL))
+	  revents |= POLLHUP;
+	dispatch (fd, revents);
+      }
+#endif
+}
+
+/* Take on the credentials of SEP.  Return the name of the call
+   failing, or NULL.  */
+static const char *
+set_credentials (struct servtab *sep)
+{
+  if (sep->se_uid == 0)
+    return NULL;
+  if (setgid (sep->se_gid) < 0)
+    return "setgid";
+#ifdef HAVE_GETGROUPLIST
+  if (sep->se_groups && setgroups (sep->se_ngroups, sep->se_groups) < 0)
+    return "setgroups";
+#elif defined HAVE_INITGROUPS
+  initgroups (sep->se_user, sep->se_gid);
+#endif
+  if (setuid (sep->se_uid) < 0)
+    return "setuid";
+  return NULL;
+}
+
+void
+run_service (int ctrl, struct servtab *sep)
+{
+  char buf[50];
+  const char *failed;
+
+  if (sep->se_bi)
+    {
+      (*sep->se_bi->bi_fn) (ctrl, sep);
+    }
+  else
+    {
+      if (debug)
+	fprintf (stderr, "%d execl %s\n", (int) getpid (), sep->se_server);
+      dup2 (ctrl, 0);
+      close (ctrl);
+      dup2 (0, 1);
+      dup2 (0, 2);
+      failed = set_credentials (sep);
+      if (failed)
+	{
+	  syslog (LOG_ERR, "%s: %s: %m", sep->se_service, failed);
+	  _exit (EXECFAILED);
+	}
+#if defined HAVE_SYS_RESOURCE_H && defined RLIMIT_NOFILE
+      if (nofile_raised)
+	setrlimit (RLIMIT_NOFILE, &nofile_limit);
+#endif
+      execv (sep->se_server, sep->se_argv);
+      if (sep->se_socktype != SOCK_STREAM)
+	recv (0, buf, sizeof buf, 0);
+      syslog (LOG_ERR, "cannot execute %s: %m", sep->se_server);
+      _exit (EXECFAILED);
+    }
+}
+
+#ifdef USE_VFORK
+/* Start the server of SEP on CTRL, and return its process ID, or -1.
+   The child shares the memory of inetd until it executes the server,
+   so it only makes system calls, and leaves any failure for the
+   parent to report.  */
+pid_t
+spawn_server (struct servtab *sep, int ctrl)
+{
+  static const char *volatile failed;
+  static volatile int failed_errno;
+  char buf[50];
+  pid_t pid;
+
+  failed = NULL;
+  pid = vfork ();
+  if (pid == 0)
+    {
+      sigset_t none;
+
+      /* No handler of inetd may run in here.  */
+      signal (SIGCHLD, SIG_DFL);
+      signal (SIGHUP, SIG_DFL);
+      signal (SIGALRM, SIG_DFL);
+      sigemptyset (&none);
+      sigprocmask (SIG_SETMASK, &none, NULL);
+      if (debug)
+	setsid ();
+
+      dup2 (ctrl, 0);
+      dup2 (0, 1);
+      dup2 (0, 2);
+# ifdef HAVE_CLOSE_RANGE
+      close_range (3, ~0U, 0);
+# else
+      /* All other descriptors of inetd close on exec.  */
+      if (ctrl > 2)
+	close (ctrl);
+# endif
+      failed = set_credentials (sep);
+      if (!failed)
+	{
+# if defined HAVE_SYS_RESOURCE_H && defined RLIMIT_NOFILE
+	  if (nofile_raised)
+	    setrlimit (RLIMIT_NOFILE, &nofile_limit);
+# endif
+	  execv (sep->se_server, sep->se_argv);
+	  failed = "execv";
+	}
+      failed_errno = errno;
+      if (sep->se_socktype != SOCK_STREAM)
+	recv (0, buf, sizeof buf, 0);
+      _exit (EXECFAILED);
+    }
+
+  if (pid > 0)
+    {
+      if (debug)
+	fprintf (stderr, "%d execl %s\n", (int) pid, sep->se_server);
+      if (failed)
+	{
+	  errno = failed_errno;
+	  if (strcmp (failed, "execv") == 0)
+	    syslog (LOG_ERR, "cannot execute %s: %m", sep->se_server);
+	  else
+	    syslog (LOG_ERR, "%s: %s: %m", sep->se_service, failed);
+	}
+    }
+  return pid;
+}
+#endif
+
+/* Server pools
+
+   A service with `pool' in place of `wait' keeps between se_pool_min
+   and se_pool_max servers running, all started with the listening
+   socket, as a `wait' server would be.  They take requests from the
+   socket themselves, so no fork or exec happens on the way of a
+   request.  Servers which exit are replaced as far as needed to keep
+   se_pool_min running.  While there is room for more, inetd watches
+   the socket as well; when a request is still queued POOLCHECK msecs
+   after it was seen, all servers are busy, and one more is started.  */
+
+int pool_recheck;		/* a pool may lack servers */
+long long pool_due;		/* msecs of the earliest check, or 0 */
+
+int count_start (struct servtab *sep);
+void child_setup (int ctrl);
+void child_add (pid_t pid, struct servtab *sep, const struct srckey *key);
+
+/* Start another server for the pool of SEP.  Return 0 on success.  */
+int
+pool_spawn (struct servtab *sep)
+{
+  pid_t pid;
+
+  if (!sep->se_pool)
+    {
+      sep->se_pool = calloc (sep->se_pool_max, sizeof (*sep->se_pool));
+      if (!sep->se_pool)
+	{
+	  syslog (LOG_ERR, "Out of memory.");
+	  exit (-1);
+	}
+    }
+  /* Replacing a server that did its work is no sign of looping.  */
+  if (sep->se_pool_done)
+    sep->se_pool_done--;
+  else if (count_start (sep))
+    return -1;
+#ifdef USE_VFORK
+  pid = spawn_server (sep, sep->se_fd);
+#else
+  pid = fork ();
+#endif
+  if (pid < 0)
+    {
+      syslog (LOG_ERR, "fork: %m");
+      sep->se_stats.failed++;
+      return -1;
+    }
+  if (pid == 0)
+    {
+      child_setup (sep->se_fd);
+      run_service (sep->se_fd, sep);
+    }
+  if (debug)
+    fprintf (stderr, "%s: pool server %d started\n",
+	     sep->se_service, (int) pid);
+  sep->se_pool[sep->se_nworkers].pid = pid;
+  time (&sep->se_pool[sep->se_nworkers++].start);
+  child_add (pid, sep, NULL);
+  return 0;
+}
+
+/* Forget the server PID in the pool of SEP, which ended with
+   STATUS.  Return nonzero if it was one.  */
+int
+pool_reap (struct servtab *sep, pid_t pid, int status)
+{
+  unsigned i;
+
+  for (i = 0; i < sep->se_nworkers; i++)
+    if (sep->se_pool[i].pid == pid)
+      {
+	/* A server that ran for a while and exited normally has done
+	   its work, and is replaced without counting as a start.  */
+	if (status == 0 && time (NULL) > sep->se_pool[i].start
+	    && sep->se_pool_done < sep->se_pool_max)
+	  sep->se_pool_done++;
+	sep->se_pool[i] = sep->se_pool[--sep->se_nworkers];
+	pool_recheck = 1;
+	return 1;
+      }
+  return 0;
+}
+
+/* Terminate the servers in the pool of SEP.  */
+void
+pool_stop (struct servtab *sep)
+{
+  unsigned i;
+
+  for (i = 0; i < sep->se_nworkers; i++)
+    kill (sep->se_pool[i].pid, SIGTERM);
+  sep->se_nworkers = 0;
+  sep->se_pool_done = 0;
+  free (sep->se_pool);
+  sep->se_pool = NULL;
+  sep->se_pool_due = 0;
+}
+
+/* A request arrived for the pool of SEP.  Look again after a while
+   whether its servers took it.  */
+void
+pool_request (struct servtab *sep)
+{
+  unwatch_sep (sep);
+  sep->se_pool_due = msec_now () + POOLCHECK;
+  if (!pool_due || sep->se_pool_due < pool_due)
+    pool_due = sep->se_pool_due;
+}
+
+/* Return the number of msecs until pools need a check, or -1.  */
+int
+pool_timeout (void)
+{
+  long long t;
+
+  if (pool_recheck)
+    return 0;
+  if (!pool_due)
+    return -1;
+  t = pool_due - msec_now ();
+  return t < 0 ? 0 : t > POOLCHECK ? POOLCHECK : t;
+}
+
+/* Bring all pools to their size, when due.  */
+void
+pool_run (void)
+{
+  struct servtab *sep;
+  long long now;
+
+  if (!pool_recheck && !(pool_due && msec_now () >= pool_due))
+    return;
+  now = msec_now ();
+  pool_recheck = 0;
+  pool_due = 0;
+  for (sep = servtab; sep; sep = sep->se_next)
+    {
+      if (!sep->se_pool_max || sep->se_fd < 0)
+	continue;
+      /* A server started as a plain `wait' server is still running.  */
+      if (sep->se_wait > 1)
+	continue;
+      if (sep->se_pool_due)
+	{
+	  if (now < sep->se_pool_due)
+	    {
+	      if (!pool_due || sep->se_pool_due < pool_due)
+		pool_due = sep->se_pool_due;
+	      continue;
+	    }
+	  sep->se_pool_due = 0;
+	  /* A request still queued finds every server busy.  */
+	  if (sep->se_nworkers < sep->se_pool_max)
+	    {
+	      struct pollfd pfd;
+
+	      pfd.fd = sep->se_fd;
+	      pfd.events = POLLIN;
+	      if (poll (&pfd, 1, 0) > 0 && pool_spawn (sep) < 0)
+		goto failed;
+	    }
+	}
+      while (sep->se_nworkers < sep->se_pool_min)
+	if (pool_spawn (sep) < 0)
+	  goto failed;
+      if (sep->se_nworkers < sep->se_pool_max)
+	watch_sep (sep);
+      else
+	unwatch_sep (sep);
+      continue;
+
+    failed:
+      /* The service may have been terminated, else try again later.  */
+      if (sep->se_fd >= 0)
+	{
+	  unwatch_sep (sep);
+	  sep->se_pool_due = now + 1000;
+	  if (!pool_due || sep->se_pool_due < pool_due)
+	    pool_due = sep->se_pool_due;
+	}
+    }
+}
+
+/* Limits for each client
+
+   A nowait stream service may limit the connections from one client
+   in a minute, and the servers running for one client at a time.
+   Connections beyond are closed at once, leaving the service to
+   everybody else.  Clients are kept in a hash table of each service,
+   with open addressing.  Entries are never deleted one by one, but
+   dropped once idle for CNT_INTVL seconds, when the table is rebuilt
+   to grow, or is full.  Servers running for a client are counted off
+   when they exit, see child_exit.  */
+
+static unsigned
+source_hash (const struct srckey *key)
+{
+  const unsigned char *p = (const unsigned char *) key;
+  unsigned h = 2166136261U;
+  size_t i;
+
+  for (i = 0; i < sizeof (*key); i++)
+    h = (h ^ p[i]) * 16777619U;
+  return h;
+}
+
+/* Fill KEY with the client at SA.  Return 0 if it has no address
+   known to us.  */
+static int
+source_key (struct sockaddr *sa, struct srckey *key)
+{
+  const unsigned char *addr;
+  int bits, i;
+
+  memset (key, 0, sizeof (*key));
+  switch (sa->sa_family)
+    {
+    case AF_INET:
+      addr = (const unsigned char *) &((struct sockaddr_in *) sa)->sin_addr;
+      key->family = AF_INET;
+      bits = source_prefix;
+      break;
+
+#ifdef IPV6
+    case AF_INET6:
+      addr = (const unsigned char *) &((struct sockaddr_in6 *) sa)->sin6_addr;
+      if (IN6_IS_ADDR_V4MAPPED ((struct in6_addr *) addr))
+	{
+	  addr += 12;
+	  key->family = AF_INET;
+	  bits = source_prefix;
+	}
+      else
+	{
+	  key->family = AF_INET6;
+	  bits = source_prefix6;
+	}
+      break;
+#endif
+
+    default:
+      return 0;
+    }
+
+  for (i = 0; bits >= 8; i++, bits -= 8)
+    key->addr[i] = addr[i];
+  if (bits)
+    key->addr[i] = addr[i] & (0xff << (8 - bits));
+  return 1;
+}
+
+/* Rebuild the table of SEP, without clients idle since before NOW
+   less CNT_INTVL, and with room for more.  */
+static void
+source_rehash (struct servtab *sep, time_t now)
+{
+  struct source *old = sep->se_src;
+  unsigned oldsize = sep->se_srcsize;
+  unsigned i, j, live = 0, size = 64;
+
+  for (i = 0; i < oldsize; i++)
+    if (old[i].key.family
+	&& (old[i].active || now - old[i].time <= CNT_INTVL))
+      live++;
+  while (size < 4 * (live + 1))
+    size *= 2;
+
+  sep->se_src = calloc (size, sizeof (*sep->se_src));
+  if (!sep->se_src)
+    {
+      syslog (LOG_ERR, "Out of memory.");
+      exit (-1);
+    }
+  sep->se_srcsize = size;
+  sep->se_srcused = live;
+  for (i = 0; i < oldsize; i++)
+    if (old[i].key.family
+	&& (old[i].active || now - old[i].time <= CNT_INTVL))
+      {
+	for (j = source_hash (&old[i].key) & (size - 1);
+	     sep->se_src[j].key.family; j = (j + 1) & (size - 1))
+	  ;
+	sep->se_src[j] = old[i];
+      }
+  free (old);
+}
+
+/* Return the entry of KEY in the table of SEP.  If there is none,
+   return NULL, unless CREATE is set, when a new one is made where
+   there is room.  A table holding SOURCEMAX clients is purged of the
+   idle ones at most once a second, and until then, or if all are
+   busy, no new client gets an entry.  */
+static struct source *
+source_find (struct servtab *sep, const struct srckey *key, int create,
+	     time_t now)
+{
+  unsigned i, mask;
+
+  if (sep->se_srcsize)
+    {
+      mask = sep->se_srcsize - 1;
+      for (i = source_hash (key) & mask; sep->se_src[i].key.family;
+	   i = (i + 1) & mask)
+	if (memcmp (&sep->se_src[i].key, key, sizeof (*key)) == 0)
+	  return &sep->se_src[i];
+    }
+  if (!create)
+    return NULL;
+
+  if ((sep->se_srcused + 1) * 2 > sep->se_srcsize)
+    {
+      if (sep->se_srcused >= SOURCEMAX)
+	{
+	  if (sep->se_srcpurged == now)
+	    return NULL;
+	  sep->se_srcpurged = now;
+	}
+      source_rehash (sep, now);
+      if (sep->se_srcused >= SOURCEMAX)
+	return NULL;
+    }
+
+  mask = sep->se_srcsize - 1;
+  for (i = source_hash (key) & mask; sep->se_src[i].key.family;
+       i = (i + 1) & mask)
+    ;
+  memset (&sep->se_src[i], 0, sizeof (sep->se_src[i]));
+  sep->se_src[i].key = *key;
+  sep->se_src[i].time = now;
+  sep->se_srcused++;
+  return &sep->se_src[i];
+}
+
+/* Decide whether SEP accepts a connection from the client at SA,
+   and fill KEY with it.  If so and the servers of the client are
+   counted, the caller must call source_release or child_add
+   later.  */
+int
+source_admit (struct servtab *sep, struct sockaddr *sa, socklen_t len,
+	      struct srckey *key)
+{
+  struct source *src;
+  time_t now;
+  const char *why;
+
+  if (!source_key (sa, key))
+    {
+      key->family = 0;
+      return 1;
+    }
+  time (&now);
+  src = source_find (sep, key, 1, now);
+  if (!src)
+    {
+      /* Too many clients, all of them active of late.  Those
+	 known are still held to their limits, while new ones are let
+	 through unlimited, lest a flood of addresses lock everybody
+	 else out.  The limit of the whole service still holds.  */
+      key->family = 0;
+      if (now - sep->se_srcfull > CNT_INTVL)
+	{
+	  syslog (LOG_WARNING, "%s/%s: too many clients, "
+		  "not limiting new ones", sep->se_service, sep->se_proto);
+	  sep->se_srcfull = now;
+	}
+      return 1;
+    }
+
+  if (now - src->time > CNT_INTVL)
+    {
+      src->time = now;
+      src->count = 0;
+    }
+  src->count++;
+  if (sep->se_src_rate && src->count > sep->se_src_rate)
+    why = "too many connections";
+  else if (sep->se_src_max && src->active >= sep->se_src_max)
+    why = "too many servers running";
+  else
+    {
+      if (sep->se_src_max)
+	src->active++;
+      return 1;
+    }
+
+  if (now - src->logged > CNT_INTVL)
+    {
+      char host[NI_MAXHOST];
+
+      if (getnameinfo (sa, len, host, sizeof (host), NULL, 0,
+		       NI_NUMERICHOST))
+	strcpy (host, "?");
+      syslog (LOG_WARNING, "%s/%s: refusing %s: %s",
+	      sep->se_service, sep->se_proto, host, why);
+      src->logged = now;
+    }
+  return 0;
+}
+
+/* A server for the client KEY of SEP has ended.  */
+void
+source_release (struct servtab *sep, const struct srckey *key)
+{
+  struct source *src;
+
+  if (!key->family)
+    return;
+  src = source_find (sep, key, 0, 0);
+  if (src && src->active)
+    src->active--;
+}
+
+/* Children
+
+   Every server started is kept in a hash table by its process ID, so
+   that it is counted off its service, and its client, when it exits.  */
+
+struct child
+{
+  pid_t pid;
+  struct servtab *sep;
+  struct srckey key;		/* the client, family 0 if not counted */
+  struct child *next;
+};
+
+struct child *children[CHILDHASH];
+
+/* Remember that child PID was started for SEP, serving the client
+   KEY if that is not NULL.  */
+void
+child_add (pid_t pid, struct servtab *sep, const struct srckey *key)
+{
+  struct child *ch;
+
+  sep->se_stats.started++;
+  ch = malloc (sizeof (*ch));
+  if (!ch)
+    {
+      if (key)
+	source_release (sep, key);
+      return;
+    }
+  ch->pid = pid;
+  ch->sep = sep;
+  if (key)
+    ch->key = *key;
+  else
+    ch->key.family = 0;
+  ch->next = children[pid % CHILDHASH];
+  children[pid % CHILDHASH] = ch;
+  sep->se_children++;
+}
+
+/* Child PID has exited with STATUS.  */
+void
+child_exit (pid_t pid, int status)
+{
+  struct child **pp, *ch;
+
+  for (pp = &children[pid % CHILDHASH]; (ch = *pp); pp = &ch->next)
+    if (ch->pid == pid)
+      {
+	struct servtab *sep = ch->sep;
+
+	sep->se_children--;
+	if (WIFSIGNALED (status))
+	  sep->se_stats.killed++;
+	else if (WEXITSTATUS (status) == EXECFAILED)
+	  {
+	    /* The server never ran: count it as not started.  */
+	    if (sep->se_stats.started)
+	      sep->se_stats.started--;
+	    sep->se_stats.failed++;
+	  }
+	else if (WEXITSTATUS (status))
+	  sep->se_stats.errors++;
+	else
+	  sep->se_stats.exited++;
+	source_release (sep, &ch->key);
+	*pp = ch->next;
+	free (ch);
+	return;
+      }
+}
+
+/* SEP goes away: forget its children and connections.  */
+void
+forget_service (struct servtab *sep)
+{
+  struct child **pp, *ch;
+  int i;
+
+  for (i = 0; i < CHILDHASH; i++)
+    for (pp = &children[i]; (ch = *pp); )
+      if (ch->sep == sep)
+	{
+	  *pp = ch->next;
+	  free (ch);
+	}
+      else
+	pp = &ch->next;
+  for (i = 0; i < fdtab_size; i++)
+    if (fdtab[i].conn && fdtab[i].conn->bc_sep == sep)
+      fdtab[i].conn->bc_sep = NULL;
+}
+
+void
+reapchild (int signo _GL_UNUSED_PARAMETER)
+{
+  int status;
+  pid_t pid;
+  struct servtab *sep;
+
+  for (;;)
+    {
+#ifdef HAVE_WAIT3
+      pid = wait3 (&status, WNOHANG, NULL);
+#else
+      pid = wait (&status);
+#endif
+      if (pid <= 0)
+	break;
+      if (debug)
+	fprintf (stderr, "%d reaped, status %#x\n", (int) pid, status);
+      child_exit (pid, status);
+      for (sep = servtab; sep; sep = sep->se_next)
+	if (sep->se_wait == pid)
+	  {
+	    if (status)
+	      syslog (LOG_WARNING, "%s: exit status 0x%x",
+		      sep->se_server, status);
+	    if (debug)
+	      fprintf (stderr, "restored %s, fd %d\n",
+		       sep->se_service, sep->se_fd);
+	    sep->se_wait = 1;
+	    if (sep->se_pool_max)
+	      {
+		pool_recheck = 1;
+		event_wakeup ();
+	      }
+	    else
+	      watch_sep (sep);
+	  }
+	else if (sep->se_nworkers && pool_reap (sep, pid, status))
+	  {
+	    if (status)
+	      syslog (LOG_WARNING, "%s: exit status 0x%x",
+		      sep->se_server, status);
+	    event_wakeup ();
+	  }
+    }
+}
+
+
+
+char *
+newstr (const char *cp)
+{
+  char *s;
+  s = strdup (cp ? cp : "");
+  if (s != NULL)
+    return s;
+  syslog (LOG_ERR, "strdup: %m");
+  exit (-1);
+}
+
+void
+dupmem (void **pptr, size_t size)
+{
+  void *ptr = malloc (size);
+  if (!ptr)
+    {
+      syslog (LOG_ERR, "dupmem: %m");
+      exit (-1);
+    }
+  memcpy (ptr, *pptr, size);
+  *pptr = ptr;
+}
+
+void
+dupstr (char **pstr)
+{
+  if (*pstr)
+    dupmem ((void**)pstr, strlen (*pstr) + 1);
+}
+
+
+/*
+ * print_service:
+ *	Dump relevant information to stderr
+ */
+void
+print_service (const char *action, struct servtab *sep)
+{
+  fprintf (stderr,
+	   "%s:%d: %s: %s:%s proto=%s, wait=%d, max=%u, pool=%u-%u, "
+	   "per client=%u/%u, defer=%d, fastopen=%d, listen=%s, "
+	   "user=%s group=%s builtin=%s server=%s\n",
+	   sep->se_file, sep->se_line,
+	   action,
+	   ISMUX (sep) ? (ISMUXPLUS (sep) ? "tcpmuxplus" : "tcpmux")
+		      : (sep->se_node ? sep->se_node : "*"),
+	   sep->se_service, sep->se_proto,
+	   (int) sep->se_wait, sep->se_max,
+	   sep->se_pool_min, sep->se_pool_max,
+	   sep->se_src_rate, sep->se_src_max,
+	   sep->se_defer, sep->se_fastopen,
+	   sep->se_listen ? sep->se_listen : "-",
+	   sep->se_user, sep->se_group,
+	   sep->se_bi ? sep->se_bi->bi_service : "no",
+	   sep->se_server);
+}
+
+
+/* Configuration */
+/* Have the socket of SEP block, unless inetd itself accepts its
+   connections, as many as are queued at a wakeup.  */
+static void
+set_blocking (struct servtab *sep)
+{
+  int flags = fcntl (sep->se_fd, F_GETFL);
+
+  if (flags < 0)
+    return;
+  if (!sep->se_wait && sep->se_socktype == SOCK_STREAM)
+    flags |= O_NONBLOCK;
+  else
+    flags &= ~O_NONBLOCK;
+  fcntl (sep->se_fd, F_SETFL, flags);
+}
+
+/* Set the options of a TCP socket given with the socket type of SEP.  */
+static void
+set_tcp_options (struct servtab *sep)
+{
+  if (sep->se_socktype != SOCK_STREAM || strncmp (sep->se_proto, "tcp", 3))
+    return;
+#ifdef TCP_DEFER_ACCEPT
+  if (setsockopt (sep->se_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+		  (char *) &sep->se_defer, sizeof (sep->se_defer)) < 0)
+    syslog (LOG_ERR, "%s/%s: setsockopt (TCP_DEFER_ACCEPT): %m",
+	    sep->se_service, sep->se_proto);
+#endif
+#ifdef TCP_FASTOPEN
+  if (setsockopt (sep->se_fd, IPPROTO_TCP, TCP_FASTOPEN,
+		  (char *) &sep->se_fastopen, sizeof (sep->se_fastopen)) < 0)
+    syslog (LOG_ERR, "%s/%s: setsockopt (TCP_FASTOPEN): %m",
+	    sep->se_service, sep->se_proto);
+#endif
+}
+
+int
+setup (struct servtab *sep)
+{
+  int err;
+  int on = 1;
+
+ tryagain:
+  sep->se_fd = socket (sep->se_family, sep->se_socktype, 0);
+  if (sep->se_fd < 0)
+    {
+      /* If we don't support creating AF_INET6 sockets, create AF_INET
+	 sockets.  */
+      if (errno == EAFNOSUPPORT && sep->se_family == AF_INET6
+	  && sep->se_v4mapped)
+	{
+	  /* Fall back to IPv4 silently.  */
+	  sep->se_family = AF_INET;
+	  goto tryagain;
+	}
+
+      if (debug)
+	fprintf (stderr, "socket failed on %s/%s: %s\n",
+		 sep->se_service, sep->se_proto, strerror (errno));
+      syslog (LOG_ERR, "%s/%s: socket: %m",
+	      sep->se_service, sep->se_proto);
+      return 1;
+    }
+  /* Servers get the socket as their standard input only.  */
+  fcntl (sep->se_fd, F_SETFD, FD_CLOEXEC);
+  set_blocking (sep);
+#ifdef IPV6
+  if (sep->se_family == AF_INET6)
+    {
+      /* Reverse the value of SEP->se_v4mapped, since otherwise if
+	 using `tcp6' as a protocol type, all connections will be
+	 mapped to IPv6, and with `tcp6only', IPv4 gets mapped to
+	 IPv6.  */
+      int val = sep->se_v4mapped ? 0 : 1;
+      if (setsockopt (sep->se_fd, IPPROTO_IPV6, IPV6_V6ONLY,
+		      (char *) &val, sizeof (val)) < 0)
+	syslog (LOG_ERR, "setsockopt (IPV6_V6ONLY): %m");
+    }
+#endif
+  if (strncmp (sep->se_proto, "tcp", 3) == 0 && (options & SO_DEBUG))
+    {
+      if (setsockopt (sep->se_fd, SOL_SOCKET, SO_DEBUG,
+		      (char *) &on, sizeof (on)) < 0
+	  && errno != EACCES)	/* Ignore insufficient permission.  */
+	syslog (LOG_ERR, "setsockopt (SO_DEBUG): %m");
+    }
+
+  err = setsockopt (sep->se_fd, SOL_SOCKET, SO_REUSEADDR,
+		    (char *) &on, sizeof (on));
+  if (err < 0)
     syslog (LOG_ERR, "setsockopt (SO_REUSEADDR): %m");
 
   err = bind (sep->se_fd, (struct sockaddr *) &sep->se_ctrladdr,
@@ -670,6 +1775,10 @@ setup (struct servtab *sep)
 	}
       return 1;
     }
+  if (sep->se_defer || sep->se_fastopen)
+    set_tcp_options (sep);
+  if (sep->se_socktype == SOCK_STREAM)
+    listen (sep->se_fd, SOMAXCONN);
   return 0;
 }
 
@@ -679,10 +1788,7 @@ servent_setup (struct servtab *sep)
   sep->se_checked = 1;
   if (sep->se_fd == -1 && setup (sep) == 0)
     {
-      if (sep->se_socktype == SOCK_STREAM)
-	listen (sep->se_fd, 10);
-      FD_SET (sep->se_fd, &allsock);
-      nsock++;
+      watch_sep (sep);
       if (sep->se_fd > maxsock)
 	maxsock = sep->se_fd;
       if (debug)
@@ -697,8 +1803,13 @@ retry (int signo _GL_UNUSED_PARAMETER)
 
   timingout = 0;
   for (sep = servtab; sep; sep = sep->se_next)
-    if (sep->se_fd == -1 && !ISMUX (sep))
-      setup (sep);
+    if (sep->se_fd == -1 && !ISMUX (sep) && setup (sep) == 0)
+      {
+	watch_sep (sep);
+	if (sep->se_fd > maxsock)
+	  maxsock = sep->se_fd;
+      }
+  pool_recheck = 1;
 }
 
 /*
@@ -709,15 +1820,15 @@ close_sep (struct servtab *sep)
 {
   if (sep->se_fd >= 0)
     {
-      nsock--;
-      FD_CLR (sep->se_fd, &allsock);
+      unwatch_sep (sep);
       close (sep->se_fd);
       sep->se_fd = -1;
     }
   sep->se_count = 0;
+  pool_stop (sep);
   /*
    * Don't keep the pid of this running deamon: when reapchild()
-   * reaps this pid, it would erroneously increment nsock.
+   * reaps this pid, it would erroneously watch a closed socket.
    */
   if (sep->se_wait > 1)
     sep->se_wait = 1;
@@ -749,6 +1860,33 @@ enter (struct servtab *cp)
        */
       if (cp->se_bi == 0 && (sep->se_wait == 1 || cp->se_wait == 0))
 	sep->se_wait = cp->se_wait;
+      free (sep->se_listen);
+      sep->se_listen = cp->se_listen;
+      dupstr (&sep->se_listen);
+      if (sep->se_fd >= 0)
+	{
+	  set_blocking (sep);
+	  if (sep->se_defer != cp->se_defer
+	      || sep->se_fastopen != cp->se_fastopen)
+	    {
+	      sep->se_defer = cp->se_defer;
+	      sep->se_fastopen = cp->se_fastopen;
+	      set_tcp_options (sep);
+	    }
+	}
+      sep->se_defer = cp->se_defer;
+      sep->se_fastopen = cp->se_fastopen;
+      sep->se_src_rate = cp->se_src_rate;
+      sep->se_src_max = cp->se_src_max;
+      if (sep->se_pool_min != cp->se_pool_min
+	  || sep->se_pool_max != cp->se_pool_max)
+	{
+	  pool_stop (sep);
+	  sep->se_pool_min = cp->se_pool_min;
+	  sep->se_pool_max = cp->se_pool_max;
+	  if (!sep->se_pool_max && sep->se_wait <= 1)
+	    watch_sep (sep);
+	}
 #define SWAP(a, b) { char *c = a; a = b; b = c; }
       if (cp->se_user)
 	SWAP (sep->se_user, cp->se_user);
@@ -756,6 +1894,14 @@ enter (struct servtab *cp)
 	SWAP (sep->se_group, cp->se_group);
       if (cp->se_server)
 	SWAP (sep->se_server, cp->se_server);
+      sep->se_uid = cp->se_uid;
+      sep->se_gid = cp->se_gid;
+      free (sep->se_groups);
+      sep->se_groups = cp->se_groups;
+      sep->se_ngroups = cp->se_ngroups;
+      if (sep->se_groups)
+	dupmem ((void**)&sep->se_groups,
+		sep->se_ngroups * sizeof (sep->se_groups[0]));
       argcv_free (sep->se_argc, sep->se_argv);
       sep->se_argc = cp->se_argc;
       sep->se_argv = cp->se_argv;
@@ -784,9 +1930,13 @@ enter (struct servtab *cp)
   dupstr (&sep->se_user);
   dupstr (&sep->se_group);
   dupstr (&sep->se_server);
+  dupstr (&sep->se_listen);
   dupmem ((void**)&sep->se_argv, sep->se_argc * sizeof (sep->se_argv[0]));
   for (i = 0; i < sep->se_argc; i++)
     dupstr (&sep->se_argv[i]);
+  if (sep->se_groups)
+    dupmem ((void**)&sep->se_groups,
+	    sep->se_ngroups * sizeof (sep->se_groups[0]));
 
   sep->se_fd = -1;
   signal_block (&sigstatus);
@@ -947,7 +2097,11 @@ freeconfig (struct servtab *cp)
   free (cp->se_user);
   free (cp->se_group);
   free (cp->se_server);
+  free (cp->se_listen);
   argcv_free (cp->se_argc, cp->se_argv);
+  free (cp->se_pool);
+  free (cp->se_src);
+  free (cp->se_groups);
 }
 
 #define INETD_SERVICE      0	/* service name */
@@ -986,6 +2140,57 @@ next_node_sep (struct servtab *sep)
   return sep;
 }
 
+/* Read the options OPTS given after the socket type of SEP, on LINE
+   of FILE.  */
+static void
+parse_sockopts (struct servtab *sep, char *opts, const char *file,
+		size_t line)
+{
+  char *opt, *val, *next, *end;
+  long n = 0;
+
+  for (opt = opts; opt; opt = next)
+    {
+      next = strchr (opt, ',');
+      if (next)
+	*next++ = 0;
+      val = strchr (opt, '=');
+      if (val)
+	{
+	  *val++ = 0;
+	  n = strtol (val, &end, 10);
+	}
+      if (val && (*end || end == val || n < 0 || n > INT_MAX))
+	{
+	  syslog (LOG_WARNING, "%s:%lu: invalid value of %s",
+		  file, (unsigned long) line, opt);
+	  continue;
+	}
+      if (sep->se_socktype != SOCK_STREAM)
+	{
+	  syslog (LOG_WARNING, "%s:%lu: %s needs a stream socket",
+		  file, (unsigned long) line, opt);
+	  continue;
+	}
+#ifdef TCP_DEFER_ACCEPT
+      if (strcmp (opt, "defer") == 0)
+	{
+	  sep->se_defer = val ? n : DEFERSECS;
+	  continue;
+	}
+#endif
+#ifdef TCP_FASTOPEN
+      if (strcmp (opt, "fastopen") == 0)
+	{
+	  sep->se_fastopen = val ? n : FASTOPENQ;
+	  continue;
+	}
+#endif
+      syslog (LOG_WARNING, "%s:%lu: unsupported socket option %s",
+	      file, (unsigned long) line, opt);
+    }
+}
+
 struct servtab *
 getconfigent (FILE *fconfig, const char *file, size_t *line)
 {
@@ -994,7 +2199,7 @@ getconfigent (FILE *fconfig, const char *file, size_t *line)
   int argc = 0;
   size_t i;
   char **argv = NULL;
-  char *node, *service;
+  char *node, *service, *sockopts;
   static char TCPMUX_TOKEN[] = "tcpmux/";
 #define MUX_LEN		(sizeof(TCPMUX_TOKEN)-1)
 
@@ -1089,6 +2294,9 @@ getconfigent (FILE *fconfig, const char *file, size_t *line)
 	  sep->se_type = NORM_TYPE;
 	}
 
+      sockopts = strchr (argv[INETD_SOCKET], ':');
+      if (sockopts)
+	*sockopts++ = 0;
       if (strcmp (argv[INETD_SOCKET], "stream") == 0)
 	sep->se_socktype = SOCK_STREAM;
       else if (strcmp (argv[INETD_SOCKET], "dgram") == 0)
@@ -1105,6 +2313,8 @@ getconfigent (FILE *fconfig, const char *file, size_t *line)
 		  file, (unsigned long) *line);
 	  sep->se_socktype = -1;
 	}
+      if (sockopts)
+	parse_sockopts (sep, sockopts, file, *line);
 
       sep->se_proto = newstr (argv[INETD_PROTOCOL]);
 
@@ -1141,8 +2351,11 @@ getconfigent (FILE *fconfig, const char *file, size_t *line)
       sep->se_family = AF_INET;
 #endif
       {
-	char *p, *q;
+	char *p, *q, *l;
 
+	l = strchr (argv[INETD_WAIT], '/');
+	if (l)
+	  *l++ = 0;
 	p = strchr(argv[INETD_WAIT], '.');
 	if (p)
 	  *p++ = 0;
@@ -1150,6 +2363,35 @@ getconfigent (FILE *fconfig, const char *file, size_t *line)
 	  sep->se_wait = 1;
 	else if (strcmp (argv[INETD_WAIT], "nowait") == 0)
 	  sep->se_wait = 0;
+	else if (strcmp (argv[INETD_WAIT], "pool") == 0)
+	  {
+	    sep->se_wait = 1;
+	    sep->se_pool_min = 1;
+	    sep->se_pool_max = POOLMAX;
+	    if (p)
+	      {
+		sep->se_pool_min = strtoul (p, &q, 10);
+		sep->se_pool_max = sep->se_pool_min;
+		if (*q == '-')
+		  sep->se_pool_max = strtoul (q + 1, &q, 10);
+		if (*q || q == p || sep->se_pool_max < 1
+		    || sep->se_pool_max < sep->se_pool_min)
+		  {
+		    syslog (LOG_WARNING, "%s:%lu: invalid pool size (%s)",
+			    file, (unsigned long) *line, p);
+		    sep->se_pool_min = 1;
+		    sep->se_pool_max = POOLMAX;
+		  }
+		p = NULL;
+	      }
+	  }
+	else if (strcmp (argv[INETD_WAIT], "listen") == 0)
+	  {
+	    /* The name defaults to the server program, see below.  */
+	    sep->se_wait = 1;
+	    sep->se_listen = newstr (p);
+	    p = NULL;
+	  }
 	else
 	  {
 	    syslog (LOG_WARNING, "%s:%lu: bad wait type",
@@ -1162,6 +2404,21 @@ getconfigent (FILE *fconfig, const char *file, size_t *line)
 	      syslog (LOG_WARNING, "%s:%lu: invalid number (%s)",
 		      file, (unsigned long) *line, p);
 	  }
+	if (l)
+	  {
+	    sep->se_src_rate = strtoul (l, &q, 10);
+	    if (*q == '/')
+	      sep->se_src_max = strtoul (q + 1, &q, 10);
+	    if (*q)
+	      syslog (LOG_WARNING, "%s:%lu: invalid client limits (%s)",
+		      file, (unsigned long) *line, l);
+	    if (sep->se_wait || sep->se_socktype != SOCK_STREAM)
+	      {
+		syslog (LOG_WARNING, "%s:%lu: client limits need a nowait "
+			"stream service", file, (unsigned long) *line);
+		sep->se_src_rate = sep->se_src_max = 0;
+	      }
+	  }
       }
 
       if (ISMUX (sep))
@@ -1171,6 +2428,9 @@ getconfigent (FILE *fconfig, const char *file, size_t *line)
 	   * they don't have an assigned port to listen on.
 	   */
 	  sep->se_wait = 0;
+	  sep->se_pool_min = sep->se_pool_max = 0;
+	  free (sep->se_listen);
+	  sep->se_listen = NULL;
 
 	  if (strncmp (sep->se_proto, "tcp", 3))
 	    {
@@ -1219,9 +2479,19 @@ getconfigent (FILE *fconfig, const char *file, size_t *line)
 	      continue;
 	    }
 	  sep->se_wait = sep->se_bi->bi_wait;
+	  sep->se_pool_min = sep->se_pool_max = 0;
+	  free (sep->se_listen);
+	  sep->se_listen = NULL;
 	}
       else
-	sep->se_bi = NULL;
+	{
+	  sep->se_bi = NULL;
+	  if (sep->se_listen && !*sep->se_listen)
+	    {
+	      free (sep->se_listen);
+	      sep->se_listen = newstr (sep->se_server);
+	    }
+	}
 
       sep->se_argc = argc - INETD_FIELDS_MIN + 1;
       sep->se_argv = calloc (sep->se_argc + 1, sizeof sep->se_argv[0]);
@@ -1256,6 +2526,34 @@ getconfigent (FILE *fconfig, const char *file, size_t *line)
   return next_node_sep (sep);
 }
 
+#ifdef HAVE_GETGROUPLIST
+/* Store the supplementary groups of the user of SEP in it.  */
+static void
+cache_groups (struct servtab *sep)
+{
+  int n = 16;
+
+  for (;;)
+    {
+      int want = n;
+
+      sep->se_groups = realloc (sep->se_groups,
+				n * sizeof (sep->se_groups[0]));
+      if (!sep->se_groups)
+	{
+	  syslog (LOG_ERR, "Out of memory.");
+	  exit (-1);
+	}
+      if (getgrouplist (sep->se_user, sep->se_gid, sep->se_groups, &want) >= 0)
+	{
+	  sep->se_ngroups = want;
+	  return;
+	}
+      n = want > n ? want : 2 * n;
+    }
+}
+#endif
+
 void
 nextconfig (const char *file)
 {
@@ -1285,6 +2583,8 @@ nextconfig (const char *file)
 		  sep->se_service, sep->se_proto, sep->se_user);
 	  continue;
 	}
+      sep->se_uid = pwd->pw_uid;
+      sep->se_gid = pwd->pw_gid;
       if (sep->se_group && *sep->se_group)
 	{
 	  grp = getgrnam (sep->se_group);
@@ -1294,7 +2594,14 @@ nextconfig (const char *file)
 		      sep->se_service, sep->se_proto, sep->se_group);
 	      continue;
 	    }
+	  if (grp->gr_gid)
+	    sep->se_gid = grp->gr_gid;
 	}
+#ifdef HAVE_GETGROUPLIST
+      /* Look the groups up now, instead of for every server.  */
+      if (sep->se_uid)
+	cache_groups (sep);
+#endif
       if (ISMUX (sep))
 	{
 	  sep->se_fd = -1;
@@ -1325,6 +2632,7 @@ nextconfig (const char *file)
       *sepp = sep->se_next;
       if (sep->se_fd >= 0)
 	close_sep (sep);
+      forget_service (sep);
       if (debug)
 	print_service ("FREE", sep);
       freeconfig (sep);
@@ -1461,65 +2769,155 @@ config (int signo)
   linebufsize = 0;
 
   fix_tcpmux ();
+  pool_recheck = 1;
 }
 
 
+/*
+ * Internet services provided internally by inetd:
+ */
+#define BUFSIZE	8192
 
-void
-set_proc_title (char *a, int s)
+/*
+ * Stream connections to echo, discard, and chargen are served by the
+ * main loop, without a process of their own.  Their sockets do not
+ * block, and the function of the service is called whenever the
+ * socket is ready, with REVENTS zero for a new connection.
+ */
+static int bconn_full;		/* refusal of connections was logged */
+
+/* Serve the connection FD with BI.  SEP, if not NULL, counts the
+   servers of the client SRC.  Return -1 if the connection was
+   refused.  */
+int
+bconn_start (int fd, struct biltin *bi, struct servtab *sep,
+	     struct srckey *src)
 {
-  socklen_t size;
-  char *cp;
-#ifdef IPV6
-  struct sockaddr_storage saddr;
-#else
-  struct sockaddr_in saddr;
-#endif
-  char buf[80];
+  struct bconn *conn;
 
-  cp = Argv[0];
-  size = sizeof saddr;
-  if (getpeername (s, (struct sockaddr *) &saddr, &size) == 0)
+  if (nbconn >= max_internal)
     {
-#ifdef IPV6
-      int err;
-      char buf2[80];
+      if (!bconn_full)
+	syslog (LOG_WARNING, "%d internal connections, refusing more",
+		nbconn);
+      bconn_full = 1;
+      close (fd);
+      if (sep)
+	source_release (sep, src);
+      return -1;
+    }
 
-      err = getnameinfo ((struct sockaddr *) &saddr, sizeof (saddr), buf2,
-			 sizeof (buf2), NULL, 0, NI_NUMERICHOST);
-      if (!err)
-	snprintf (buf, sizeof buf, "-%s [%s]", a, buf2);
-      else
-	snprintf (buf, sizeof buf, "-%s", a);
-#else
-      snprintf (buf, sizeof buf, "-%s [%s]", a, inet_ntoa (saddr.sin_addr));
-#endif
+  conn = calloc (1, sizeof (*conn));
+  if (!conn)
+    {
+      syslog (LOG_ERR, "Out of memory.");
+      close (fd);
+      if (sep)
+	source_release (sep, src);
+      return -1;
     }
-  else
-    snprintf (buf, sizeof buf, "-%s", a);
-  strncpy (cp, buf, LastArg - cp);
-  cp += strlen (cp);
-  while (cp < LastArg)
-    *cp++ = ' ';
+  fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+  fcntl (fd, F_SETFD, FD_CLOEXEC);
+  conn->bc_fd = fd;
+  conn->bc_bi = bi;
+  if (sep)
+    {
+      conn->bc_sep = sep;
+      conn->bc_src = *src;
+    }
+  fdent (fd)->conn = conn;
+  nbconn++;
+  (*bi->bi_event) (conn, 0);
+  return 0;
 }
 
-/*
- * Internet services provided internally by inetd:
- */
-#define BUFSIZE	8192
+void
+bconn_close (struct bconn *conn)
+{
+  event_set (conn->bc_fd, 0);
+  fdent (conn->bc_fd)->conn = NULL;
+  close (conn->bc_fd);
+  if (conn->bc_sep)
+    source_release (conn->bc_sep, &conn->bc_src);
+  free (conn->bc_buf);
+  free (conn);
+  if (--nbconn < max_internal)
+    bconn_full = 0;
+}
+
+void
+bconn_event (struct bconn *conn, int revents)
+{
+  (*conn->bc_bi->bi_event) (conn, revents);
+}
+
+/* Close CONN if the result N of reading or writing is an error other
+   than having to wait.  Return nonzero if it was closed.  */
+static int
+bconn_failed (struct bconn *conn, ssize_t n)
+{
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return 0;
+  if (n > 0)
+    return 0;
+  bconn_close (conn);
+  return 1;
+}
 
 /* Echo service -- echo data back */
 void
-echo_stream (int s, struct servtab *sep)
+echo_event (struct bconn *conn, int revents)
 {
   char buffer[BUFSIZE];
-  int i;
+  ssize_t n, w;
 
-  set_proc_title (sep->se_service, s);
-  while ((i = read (s, buffer, sizeof buffer)) > 0
-	 && write (s, buffer, i) > 0)
-    ;
-  exit (EXIT_SUCCESS);
+  /* Data not sent back yet stops reading, until it is written.  */
+  if (conn->bc_len)
+    {
+      n = write (conn->bc_fd, conn->bc_buf + conn->bc_off, conn->bc_len);
+      if (bconn_failed (conn, n) || n < 0)
+	return;
+      conn->bc_off += n;
+      conn->bc_len -= n;
+      if (conn->bc_len == 0)
+	{
+	  free (conn->bc_buf);
+	  conn->bc_buf = NULL;
+	  event_set (conn->bc_fd, POLLIN);
+	}
+      return;
+    }
+
+  if (revents == 0)
+    {
+      if (event_set (conn->bc_fd, POLLIN) < 0)
+	bconn_close (conn);
+      return;
+    }
+
+  n = read (conn->bc_fd, buffer, sizeof buffer);
+  if (bconn_failed (conn, n) || n < 0)
+    return;
+  w = write (conn->bc_fd, buffer, n);
+  if (w < 0)
+    {
+      if (bconn_failed (conn, w))
+	return;
+      w = 0;
+    }
+  if (w < n)
+    {
+      conn->bc_buf = malloc (n - w);
+      if (!conn->bc_buf)
+	{
+	  bconn_close (conn);
+	  return;
+	}
+      memcpy (conn->bc_buf, buffer + w, n - w);
+      conn->bc_off = 0;
+      conn->bc_len = n - w;
+      event_set (conn->bc_fd, POLLOUT);
+    }
 }
 
 /* Echo service -- echo data back */
@@ -1544,20 +2942,17 @@ echo_dg (int s, struct servtab *sep _GL_UNUSED_PARAMETER)
 
 /* Discard service -- ignore data */
 void
-discard_stream (int s, struct servtab *sep)
+discard_event (struct bconn *conn, int revents)
 {
-  int ret;
   char buffer[BUFSIZE];
 
-  set_proc_title (sep->se_service, s);
-  while (1)
+  if (revents == 0)
     {
-      while ((ret = read (s, buffer, sizeof buffer)) > 0)
-	;
-      if (ret == 0 || errno != EINTR)
-	break;
+      if (event_set (conn->bc_fd, POLLIN) < 0)
+	bconn_close (conn);
+      return;
     }
-  exit (EXIT_SUCCESS);
+  bconn_failed (conn, read (conn->bc_fd, buffer, sizeof buffer));
 }
 
 void
@@ -1586,39 +2981,61 @@ initring (void)
       *endring++ = i;
 }
 
+/* The stream of chargen repeats after one line for every character
+   in the ring.  PATTERN holds two periods, so that a full period can
+   be written from any position.  */
+char *chargen_pattern;
+size_t chargen_period;
+
 /* Character generator */
 void
-chargen_stream (int s, struct servtab *sep)
+chargen_event (struct bconn *conn, int revents)
 {
-  int len;
-  char *rs, text[LINESIZ + 2];
-
-  set_proc_title (sep->se_service, s);
+  ssize_t n;
 
-  if (!endring)
+  if (!chargen_pattern)
     {
-      initring ();
-      rs = ring;
+      char *p, *rs;
+      int len;
+
+      if (!endring)
+	initring ();
+      chargen_period = (endring - ring) * (LINESIZ + 2);
+      chargen_pattern = malloc (2 * chargen_period);
+      if (!chargen_pattern)
+	{
+	  bconn_close (conn);
+	  return;
+	}
+      for (p = chargen_pattern, rs = ring;
+	   p < chargen_pattern + 2 * chargen_period; p += LINESIZ + 2)
+	{
+	  len = endring - rs;
+	  if (len >= LINESIZ)
+	    memmove (p, rs, LINESIZ);
+	  else
+	    {
+	      memmove (p, rs, len);
+	      memmove (p + len, ring, LINESIZ - len);
+	    }
+	  p[LINESIZ] = '\r';
+	  p[LINESIZ + 1] = '\n';
+	  if (++rs == endring)
+	    rs = ring;
+	}
     }
 
-  text[LINESIZ] = '\r';
-  text[LINESIZ + 1] = '\n';
-  for (rs = ring;;)
+  if (revents == 0)
     {
-      len = endring - rs;
-      if (len >= LINESIZ)
-	memmove (text, rs, LINESIZ);
-      else
-	{
-	  memmove (text, rs, len);
-	  memmove (text + len, ring, LINESIZ - len);
-	}
-      if (++rs == endring)
-	rs = ring;
-      if (write (s, text, sizeof text) != sizeof text)
-	break;
+      if (event_set (conn->bc_fd, POLLOUT) < 0)
+	bconn_close (conn);
+      return;
     }
-  exit (EXIT_SUCCESS);
+
+  n = write (conn->bc_fd, chargen_pattern + conn->bc_off, chargen_period);
+  if (bconn_failed (conn, n) || n < 0)
+    return;
+  conn->bc_off = (conn->bc_off + n) % chargen_period;
 }
 
 /* Character generator */
@@ -1749,196 +3166,779 @@ daytime_dg (int s, struct servtab *sep _GL_UNUSED_PARAMETER)
   sendto (s, buffer, strlen (buffer), 0, (struct sockaddr *) &sa, sizeof sa);
 }
 
-/*
- *  Based on TCPMUX.C by Mark K. Lottor November 1988
- *  sri-nic::ps:<mkl>tcpmux.c
- */
+/*
+ *  Based on TCPMUX.C by Mark K. Lottor November 1988
+ *  sri-nic::ps:<mkl>tcpmux.c
+ */
+
+
+/* # of characters upto \r,\n or \0 */
+static int
+fd_getline (int fd, char *buf, int len)
+{
+  int count = 0, n;
+
+  do
+    {
+      n = read (fd, buf, len - count);
+      if (n == 0)
+	return count;
+      if (n < 0)
+	return -1;
+      while (--n >= 0)
+	{
+	  if (*buf == '\r' || *buf == '\n' || *buf == '\0')
+	    return count;
+	  count++;
+	  buf++;
+	}
+    }
+  while (count < len);
+  return count;
+}
+
+#define MAX_SERV_LEN	(256+2)	/* 2 bytes for \r\n */
+
+#define strwrite(fd, buf)	write(fd, buf, sizeof(buf)-1)
+
+void
+tcpmux (int s, struct servtab *sep)
+{
+  char service[MAX_SERV_LEN + 1];
+  int len;
+
+  /* Get requested service name */
+  len = fd_getline (s, service, MAX_SERV_LEN);
+  if (len < 0)
+    {
+      strwrite (s, "-Error reading service name\r\n");
+      _exit (EXIT_FAILURE);
+    }
+  service[len] = '\0';
+
+  if (debug)
+    fprintf (stderr, "tcpmux: someone wants %s\n", service);
+
+  /*
+   * Help is a required command, and lists available services,
+   * one per line.
+   */
+  if (!strcasecmp (service, "help"))
+    {
+      for (sep = servtab; sep; sep = sep->se_next)
+	{
+	  if (!ISMUX (sep))
+	    continue;
+	  write (s, sep->se_service, strlen (sep->se_service));
+	  strwrite (s, "\r\n");
+	}
+      _exit (EXIT_FAILURE);
+    }
+
+  /* Try matching a service in inetd.conf with the request */
+  for (sep = servtab; sep; sep = sep->se_next)
+    {
+      if (ISMUX (sep) && !strcasecmp (service, sep->se_service))
+	{
+	  if (ISMUXPLUS (sep))
+	    {
+	      strwrite (s, "+Go\r\n");
+	    }
+	  run_service (s, sep);
+	  return;
+	}
+    }
+  strwrite (s, "-Service not available\r\n");
+  exit (EXIT_FAILURE);
+}
+
+/* Set TCP environment variables, modelled after djb's ucspi-tcp tools:
+   http://cr.yp.to/ucspi-tcp/environment.html
+*/
+void
+prepenv (int ctrl, struct sockaddr *sa_client, socklen_t sa_len)
+{
+  char str[16];
+  /* IP is used both for numeric addresses and for symbolic ones.
+   * Being statically allocated, and only for logging purposes,
+   * a full MAXPATHLEN is exaggerated, so a compromise is made.  */
+  char ip[4 * INET6_ADDRSTRLEN];
+  int ret;
+#ifdef IPV6
+  struct sockaddr_storage sa_server;
+#else
+  struct sockaddr_in sa_server;
+#endif
+  socklen_t len = sizeof (sa_server);
+
+  setenv ("PROTO", "TCP", 1);
+  unsetenv ("TCPLOCALIP");
+  unsetenv ("TCPLOCALHOST");
+  unsetenv ("TCPLOCALPORT");
+  unsetenv ("TCPREMOTEIP");
+  unsetenv ("TCPREMOTEPORT");
+  unsetenv ("TCPREMOTEHOST");
+
+  if (getsockname (ctrl, (struct sockaddr *) &sa_server, &len) < 0)
+    syslog (LOG_WARNING, "getsockname(): %m");
+  else
+    {
+      ret = getnameinfo ((struct sockaddr *) &sa_server, len,
+			  ip, sizeof (ip), str, sizeof (str),
+			  NI_NUMERICHOST | NI_NUMERICSERV);
+      if (ret == 0)
+	{
+	  if (setenv ("TCPLOCALIP", ip, 1) < 0)
+	    syslog (LOG_WARNING, "setenv (TCPLOCALIP): %m");
+	  else if (debug)
+	    fprintf (stderr, "Assigned TCPLOCALIP = %s\n", ip);
+
+	  if (setenv ("TCPLOCALPORT", str, 1) < 0)
+	    syslog (LOG_WARNING, "setenv (TCPLOCALPORT): %m");
+	}
+      else
+	syslog (LOG_WARNING, "getnameinfo: %s", gai_strerror (ret));
+
+      if (resolve_option)
+	{
+	  ret = getnameinfo ((struct sockaddr *) &sa_server, len,
+			      ip, sizeof (ip), NULL, 0, 0);
+	  if (ret != 0)
+	    syslog (LOG_WARNING, "getnameinfo: %s", gai_strerror (ret));
+	  else if (setenv ("TCPLOCALHOST", ip, 1) < 0)
+	    syslog (LOG_WARNING, "setenv(TCPLOCALHOST): %m");
+	}
+    }
+
+  ret = getnameinfo (sa_client, sa_len, ip, sizeof (ip), str, sizeof (str),
+		      NI_NUMERICHOST | NI_NUMERICSERV);
+  if (ret == 0)
+    {
+      if (setenv ("TCPREMOTEIP", ip, 1) < 0)
+	syslog (LOG_WARNING, "setenv(TCPREMOTEIP): %m");
+      else if (debug)
+	fprintf (stderr, "Assigned TCPREMOTEIP = %s\n", ip);
+
+      if (setenv ("TCPREMOTEPORT", str, 1) < 0)
+	syslog (LOG_WARNING, "setenv(TCPREMOTEPORT): %m");
+
+      if (resolve_option)
+	{
+	  ret = getnameinfo (sa_client, sa_len, ip, sizeof (ip), NULL, 0, 0);
+	  if (ret != 0)
+	    syslog (LOG_WARNING, "getnameinfo: %s", gai_strerror (ret));
+	  else if (setenv ("TCPREMOTEHOST", ip, 1) < 0)
+	    syslog (LOG_WARNING, "setenv(TCPREMOTEHOST): %m");
+	  else if (debug)
+	    fprintf (stderr, "Assigned TCPREMOTEHOST = %s\n", ip);
+	}
+    }
+  else
+    syslog (LOG_WARNING, "getnameinfo: %s", gai_strerror (ret));
+}
+
+
+
+/* Socket activation
+
+   Services giving `listen' in place of `wait' with the same name form
+   a group, whose server is started with the sockets of them all, as
+   systemd passes them on: as descriptors from 3 on, with environment
+   variables LISTEN_FDS, LISTEN_PID, and LISTEN_FDNAMES.  Its standard
+   input and output are /dev/null.  While it runs, none of the sockets
+   is watched, as for `wait'.  The child must learn its own process ID
+   for LISTEN_PID, so the server is started with fork, not vfork.  */
+
+#define LISTEN_FDS_START	3
+
+/* Tell whether S is a member of the group of SEP with a socket.  */
+static int
+listen_member (struct servtab *sep, struct servtab *s)
+{
+  return s->se_listen && s->se_fd >= 0
+    && strcmp (s->se_listen, sep->se_listen) == 0;
+}
+
+/* Execute the server of the group of SEP, in a child.  */
+void
+run_listen (struct servtab *sep)
+{
+  struct servtab *s;
+  int n = 0, i, fd, *fds;
+  size_t len = 1;
+  char *names, buf[32];
+  const char *failed;
+
+  for (s = servtab; s; s = s->se_next)
+    if (listen_member (sep, s))
+      {
+	n++;
+	len += strlen (s->se_service) + 1;
+      }
+  fds = malloc (n * sizeof (*fds));
+  names = malloc (len);
+  if (!fds || !names)
+    {
+      syslog (LOG_ERR, "Out of memory.");
+      _exit (EXECFAILED);
+    }
+
+  /* Move the sockets out of the way of their places, first.  */
+  *names = '\0';
+  i = 0;
+  for (s = servtab; s; s = s->se_next)
+    if (listen_member (sep, s))
+      {
+	fds[i] = fcntl (s->se_fd, F_DUPFD, LISTEN_FDS_START + n);
+	if (fds[i++] < 0)
+	  {
+	    syslog (LOG_ERR, "%s: fcntl: %m", sep->se_service);
+	    _exit (EXECFAILED);
+	  }
+	if (*names)
+	  strcat (names, ":");
+	strcat (names, s->se_service);
+      }
+  fd = open ("/dev/null", O_RDWR);
+  if (fd >= 0)
+    {
+      dup2 (fd, 0);
+      dup2 (fd, 1);
+      dup2 (fd, 2);
+      if (fd > 2)
+	close (fd);
+    }
+  for (i = 0; i < n; i++)
+    {
+      dup2 (fds[i], LISTEN_FDS_START + i);
+      close (fds[i]);
+    }
+#ifdef HAVE_CLOSE_RANGE
+  close_range (LISTEN_FDS_START + n, ~0U, 0);
+#endif
+  /* All other descriptors of inetd close on exec.  */
+
+  snprintf (buf, sizeof (buf), "%d", n);
+  setenv ("LISTEN_FDS", buf, 1);
+  snprintf (buf, sizeof (buf), "%d", (int) getpid ());
+  setenv ("LISTEN_PID", buf, 1);
+  setenv ("LISTEN_FDNAMES", names, 1);
+
+  failed = set_credentials (sep);
+  if (failed)
+    {
+      syslog (LOG_ERR, "%s: %s: %m", sep->se_service, failed);
+      _exit (EXECFAILED);
+    }
+#if defined HAVE_SYS_RESOURCE_H && defined RLIMIT_NOFILE
+  if (nofile_raised)
+    setrlimit (RLIMIT_NOFILE, &nofile_limit);
+#endif
+  execv (sep->se_server, sep->se_argv);
+  syslog (LOG_ERR, "cannot execute %s: %m", sep->se_server);
+  _exit (EXECFAILED);
+}
+
+/* A request arrived for the group of SEP: start its server.  */
+void
+listen_start (struct servtab *sep)
+{
+  struct servtab *s;
+  pid_t pid;
+
+  if (count_start (sep))
+    return;
+  pid = fork ();
+  if (pid < 0)
+    {
+      syslog (LOG_ERR, "fork: %m");
+      sep->se_stats.failed++;
+      sleep (1);
+      return;
+    }
+  if (pid == 0)
+    {
+      signal_unblock (NULL);
+      if (debug)
+	setsid ();
+      run_listen (sep);
+    }
+  if (debug)
+    fprintf (stderr, "%d execl %s, listen %s\n", (int) pid,
+	     sep->se_server, sep->se_listen);
+  child_add (pid, sep, NULL);
+  for (s = servtab; s; s = s->se_next)
+    if (listen_member (sep, s))
+      {
+	s->se_wait = pid;
+	unwatch_sep (s);
+      }
+}
+
+/* Control socket
+
+   With `--control', inetd accepts commands on a local stream socket,
+   one command per connection, given as a line of text.  The reply is
+   sent back, and the connection closed.  Connections are served by
+   the main loop, as those to built-in services are.
+
+     stats	a line `inetd key=value...' about inetd, then a line
+		`service key=value...' for every service
+     reset	set all counters of services to zero
+     reload	read the configuration again, as on SIGHUP  */
+
+void control_event (struct bconn *conn, int revents);
+
+struct biltin control_bi =
+  { "control", SOCK_STREAM, 0, 0, NULL, control_event };
+
+int control_reload;		/* the configuration is to be read again */
+time_t control_since;		/* time of the last reset of counters */
+
+/* A reply being built.  */
+struct ctlreply
+{
+  char *buf;
+  size_t len;
+  size_t size;
+};
+
+static void
+reply_printf (struct ctlreply *r, const char *fmt, ...)
+{
+  va_list ap;
+  int n;
+
+  for (;;)
+    {
+      va_start (ap, fmt);
+      n = vsnprintf (r->buf + r->len, r->size - r->len, fmt, ap);
+      va_end (ap);
+      if (n < 0)
+	return;
+      if (r->len + n < r->size)
+	{
+	  r->len += n;
+	  return;
+	}
+      r->size = 2 * (r->len + n + 1);
+      r->buf = realloc (r->buf, r->size);
+      if (!r->buf)
+	{
+	  syslog (LOG_ERR, "Out of memory.");
+	  exit (-1);
+	}
+    }
+}
+
+static void
+control_stats (struct ctlreply *r)
+{
+  struct servtab *sep;
+  unsigned children = 0;
+  int services = 0;
+
+  for (sep = servtab; sep; sep = sep->se_next)
+    {
+      services++;
+      children += sep->se_children;
+    }
+  reply_printf (r, "inetd pid=%d since=%ld services=%d children=%u"
+		" internal=%d\n", (int) getpid (), (long) control_since,
+		services, children, nbconn);
+
+  for (sep = servtab; sep; sep = sep->se_next)
+    {
+      struct servstats *st = &sep->se_stats;
+
+      reply_printf (r, "service name=%s proto=%s node=%s file=%s line=%d"
+		    " active=%d", sep->se_service, sep->se_proto,
+		    sep->se_node ? sep->se_node : "*", sep->se_file,
+		    sep->se_line, sep->se_fd >= 0);
+      reply_printf (r, " accepts=%lu started=%lu failed=%lu refused=%lu"
+		    " terminated=%lu children=%u exited=%lu errors=%lu"
+		    " killed=%lu", st->accepts, st->started, st->failed,
+		    st->refused, st->terminated, sep->se_children,
+		    st->exited, st->errors, st->killed);
+      reply_printf (r, " accept_usec_avg=%lu accept_usec_max=%lu\n",
+		    st->accepts
+		    ? (unsigned long) (st->accept_usec / st->accepts) : 0UL,
+		    st->accept_max);
+    }
+}
+
+/* Carry out the command read on CONN, and start sending the reply.  */
+static void
+control_command (struct bconn *conn)
+{
+  struct ctlreply r;
+  char *cmd = conn->bc_buf;
+  size_t len = strlen (cmd);
+  struct servtab *sep;
 
+  while (len && (cmd[len - 1] == '\r' || cmd[len - 1] == ' '
+		 || cmd[len - 1] == '\t'))
+    cmd[--len] = '\0';
+  while (*cmd == ' ' || *cmd == '\t')
+    cmd++;
 
-/* # of characters upto \r,\n or \0 */
-static int
-fd_getline (int fd, char *buf, int len)
-{
-  int count = 0, n;
+  r.size = 256;
+  r.len = 0;
+  r.buf = malloc (r.size);
+  if (!r.buf)
+    {
+      bconn_close (conn);
+      return;
+    }
 
-  do
+  if (strcmp (cmd, "stats") == 0)
+    control_stats (&r);
+  else if (strcmp (cmd, "reset") == 0)
     {
-      n = read (fd, buf, len - count);
-      if (n == 0)
-	return count;
-      if (n < 0)
-	return -1;
-      while (--n >= 0)
-	{
-	  if (*buf == '\r' || *buf == '\n' || *buf == '\0')
-	    return count;
-	  count++;
-	  buf++;
-	}
+      for (sep = servtab; sep; sep = sep->se_next)
+	memset (&sep->se_stats, 0, sizeof (sep->se_stats));
+      time (&control_since);
+      reply_printf (&r, "ok\n");
     }
-  while (count < len);
-  return count;
+  else if (strcmp (cmd, "reload") == 0)
+    {
+      /* Not here: sockets may be closed and their descriptors used
+	 again while their events are still being dispatched.  */
+      control_reload = 1;
+      reply_printf (&r, "ok\n");
+    }
+  else
+    reply_printf (&r, "error unknown command\n");
+
+  if (debug)
+    fprintf (stderr, "control: %s\n", cmd);
+  free (conn->bc_buf);
+  conn->bc_buf = r.buf;
+  conn->bc_off = 0;
+  conn->bc_len = r.len;
+  if (event_set (conn->bc_fd, POLLOUT) < 0)
+    bconn_close (conn);
 }
 
-#define MAX_SERV_LEN	(256+2)	/* 2 bytes for \r\n */
+void
+control_event (struct bconn *conn, int revents)
+{
+  ssize_t n;
+  char *nl;
 
-#define strwrite(fd, buf)	write(fd, buf, sizeof(buf)-1)
+  if (conn->bc_len)
+    {
+      n = write (conn->bc_fd, conn->bc_buf + conn->bc_off, conn->bc_len);
+      if (bconn_failed (conn, n) || n < 0)
+	return;
+      conn->bc_off += n;
+      conn->bc_len -= n;
+      if (conn->bc_len == 0)
+	bconn_close (conn);
+      return;
+    }
+
+  if (revents == 0)
+    {
+      conn->bc_buf = malloc (CTLLINE);
+      if (!conn->bc_buf || event_set (conn->bc_fd, POLLIN) < 0)
+	bconn_close (conn);
+      return;
+    }
+
+  n = read (conn->bc_fd, conn->bc_buf + conn->bc_off,
+	    CTLLINE - 1 - conn->bc_off);
+  if (n < 0)
+    {
+      bconn_failed (conn, n);
+      return;
+    }
+  if (n == 0 && conn->bc_off == 0)
+    {
+      bconn_close (conn);
+      return;
+    }
+  conn->bc_off += n;
+  conn->bc_buf[conn->bc_off] = '\0';
+  nl = strchr (conn->bc_buf, '\n');
+  if (nl)
+    *nl = '\0';
+  else if (n > 0 && conn->bc_off < CTLLINE - 1)
+    return;			/* The rest of the line is yet to come.  */
+  control_command (conn);
+}
 
 void
-tcpmux (int s, struct servtab *sep)
+control_accept (void)
 {
-  char service[MAX_SERV_LEN + 1];
-  int len;
+  int fd = accept (control_fd, NULL, NULL);
 
-  /* Get requested service name */
-  len = fd_getline (s, service, MAX_SERV_LEN);
-  if (len < 0)
+  if (fd < 0)
     {
-      strwrite (s, "-Error reading service name\r\n");
-      _exit (EXIT_FAILURE);
+      if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+	syslog (LOG_WARNING, "accept (for %s): %m", control_path);
+      return;
     }
-  service[len] = '\0';
+  bconn_start (fd, &control_bi, NULL, NULL);
+}
 
-  if (debug)
-    fprintf (stderr, "tcpmux: someone wants %s\n", service);
+/* Listen on the control socket.  A socket left at its place by an
+   earlier inetd is removed, but no other file.  */
+void
+control_init (void)
+{
+  struct sockaddr_un addr;
+  struct stat st;
+  mode_t mask;
+  int fd;
 
-  /*
-   * Help is a required command, and lists available services,
-   * one per line.
-   */
-  if (!strcasecmp (service, "help"))
+  time (&control_since);
+  if (strlen (control_path) >= sizeof (addr.sun_path))
     {
-      for (sep = servtab; sep; sep = sep->se_next)
-	{
-	  if (!ISMUX (sep))
-	    continue;
-	  write (s, sep->se_service, strlen (sep->se_service));
-	  strwrite (s, "\r\n");
-	}
-      _exit (EXIT_FAILURE);
+      syslog (LOG_ERR, "%s: name too long", control_path);
+      return;
+    }
+  fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    {
+      syslog (LOG_ERR, "socket (for %s): %m", control_path);
+      return;
+    }
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, control_path);
+  if (lstat (control_path, &st) == 0 && S_ISSOCK (st.st_mode))
+    unlink (control_path);
+
+  mask = umask (077);
+  if (bind (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0
+      || listen (fd, 8) < 0)
+    {
+      syslog (LOG_ERR, "%s: %m", control_path);
+      umask (mask);
+      close (fd);
+      return;
+    }
+  umask (mask);
+  fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+  fcntl (fd, F_SETFD, FD_CLOEXEC);
+  if (event_set (fd, POLLIN) < 0)
+    {
+      close (fd);
+      return;
     }
+  control_fd = fd;
+}
 
-  /* Try matching a service in inetd.conf with the request */
-  for (sep = servtab; sep; sep = sep->se_next)
+/* Count a server started for SEP.  If it is started too often,
+   terminate the service and return 1.  */
+int
+count_start (struct servtab *sep)
+{
+  if (sep->se_count++ == 0)
+    gettimeofday (&sep->se_time, NULL);
+  else if ((sep->se_max && sep->se_count > sep->se_max)
+	   || sep->se_count >= toomany)
     {
-      if (ISMUX (sep) && !strcasecmp (service, sep->se_service))
+      struct timeval now;
+
+      gettimeofday (&now, NULL);
+      if (now.tv_sec - sep->se_time.tv_sec > CNT_INTVL)
 	{
-	  if (ISMUXPLUS (sep))
+	  sep->se_time = now;
+	  sep->se_count = 1;
+	}
+      else
+	{
+	  syslog (LOG_ERR,
+		  "%s/%s server failing (looping), service terminated",
+		  sep->se_service, sep->se_proto);
+	  sep->se_stats.terminated++;
+	  close_sep (sep);
+	  if (!timingout)
 	    {
-	      strwrite (s, "+Go\r\n");
+	      timingout = 1;
+	      alarm (RETRYTIME);
 	    }
-	  run_service (s, sep);
-	  return;
+	  return 1;
 	}
     }
-  strwrite (s, "-Service not available\r\n");
-  exit (EXIT_FAILURE);
+  return 0;
 }
 
-/* Set TCP environment variables, modelled after djb's ucspi-tcp tools:
-   http://cr.yp.to/ucspi-tcp/environment.html
-*/
+/* Prepare a child to serve on CTRL.  */
 void
-prepenv (int ctrl, struct sockaddr *sa_client, socklen_t sa_len)
+child_setup (int ctrl)
 {
-  char str[16];
-  /* IP is used both for numeric addresses and for symbolic ones.
-   * Being statically allocated, and only for logging purposes,
-   * a full MAXPATHLEN is exaggerated, so a compromise is made.  */
-  char ip[4 * INET6_ADDRSTRLEN];
-  int ret;
-#ifdef IPV6
-  struct sockaddr_storage sa_server;
+#ifndef HAVE_CLOSE_RANGE
+  int sock;
+#endif
+
+  signal_unblock (NULL);
+  if (debug)
+    setsid ();
+#ifdef HAVE_CLOSE_RANGE
+  if (ctrl > 3)
+    close_range (3, ctrl - 1, 0);
+  close_range (ctrl < 3 ? 3 : ctrl + 1, ~0U, 0);
 #else
-  struct sockaddr_in sa_server;
+  if (debug)
+    fprintf (stderr, "+ Closing from %d\n", maxsock);
+  for (sock = maxsock; sock > 2; sock--)
+    if (sock != ctrl)
+      close (sock);
 #endif
-  socklen_t len = sizeof (sa_server);
+}
 
-  setenv ("PROTO", "TCP", 1);
-  unsetenv ("TCPLOCALIP");
-  unsetenv ("TCPLOCALHOST");
-  unsetenv ("TCPLOCALPORT");
-  unsetenv ("TCPREMOTEIP");
-  unsetenv ("TCPREMOTEPORT");
-  unsetenv ("TCPREMOTEHOST");
+/* Accept or receive a request for SEP, and start its server.  Return
+   -1 if there was no request to accept, or no server was started for
+   want of processes.  */
+int
+serve_request (struct servtab *sep)
+{
+  int ctrl, dofork;
+  pid_t pid;
+  struct servtab *counted = NULL;	/* counts servers of the client */
+  struct srckey src;
 
-  if (getsockname (ctrl, (struct sockaddr *) &sa_server, &len) < 0)
-    syslog (LOG_WARNING, "getsockname(): %m");
-  else
+  if (!sep->se_wait && sep->se_socktype == SOCK_STREAM)
     {
-      ret = getnameinfo ((struct sockaddr *) &sa_server, len,
-			  ip, sizeof (ip), str, sizeof (str),
-			  NI_NUMERICHOST | NI_NUMERICSERV);
-      if (ret == 0)
-	{
-	  if (setenv ("TCPLOCALIP", ip, 1) < 0)
-	    syslog (LOG_WARNING, "setenv (TCPLOCALIP): %m");
-	  else if (debug)
-	    fprintf (stderr, "Assigned TCPLOCALIP = %s\n", ip);
+#ifdef IPV6
+      struct sockaddr_storage sa_client;
+#else
+      struct sockaddr_in sa_client;
+#endif
+      socklen_t len = sizeof (sa_client);
+      long long usec;
 
-	  if (setenv ("TCPLOCALPORT", str, 1) < 0)
-	    syslog (LOG_WARNING, "setenv (TCPLOCALPORT): %m");
+#ifdef HAVE_ACCEPT4
+      ctrl = accept4 (sep->se_fd, (struct sockaddr *) &sa_client, &len,
+		      SOCK_CLOEXEC);
+#else
+      ctrl = accept (sep->se_fd, (struct sockaddr *) &sa_client, &len);
+      /* Some systems pass O_NONBLOCK of the listening socket on.  */
+      if (ctrl >= 0)
+	fcntl (ctrl, F_SETFL, fcntl (ctrl, F_GETFL) & ~O_NONBLOCK);
+#endif
+      if (ctrl < 0)
+	{
+	  if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+	    syslog (LOG_WARNING, "accept (for %s): %m", sep->se_service);
+	  return -1;
 	}
-      else
-	syslog (LOG_WARNING, "getnameinfo: %s", gai_strerror (ret));
-
-      if (resolve_option)
+      if (debug)
+	fprintf (stderr, "accept, ctrl %d\n", ctrl);
+      /* The time since the wakeup which reported the connection.  */
+      usec = usec_now () - event_usec;
+      if (usec < 0)
+	usec = 0;
+      sep->se_stats.accepts++;
+      sep->se_stats.accept_usec += usec;
+      if ((unsigned long) usec > sep->se_stats.accept_max)
+	sep->se_stats.accept_max = usec;
+
+      if ((sep->se_src_rate || sep->se_src_max)
+	  && !source_admit (sep, (struct sockaddr *) &sa_client, len, &src))
 	{
-	  ret = getnameinfo ((struct sockaddr *) &sa_server, len,
-			      ip, sizeof (ip), NULL, 0, 0);
-	  if (ret != 0)
-	    syslog (LOG_WARNING, "getnameinfo: %s", gai_strerror (ret));
-	  else if (setenv ("TCPLOCALHOST", ip, 1) < 0)
-	    syslog (LOG_WARNING, "setenv(TCPLOCALHOST): %m");
+	  sep->se_stats.refused++;
+	  close (ctrl);
+	  return 0;
+	}
+      if (sep->se_src_max)
+	counted = sep;
+      if (sep->se_bi && sep->se_bi->bi_event)
+	{
+	  if (bconn_start (ctrl, sep->se_bi, counted, &src) < 0)
+	    sep->se_stats.refused++;
+	  return 0;
 	}
+      if (env_option)
+	prepenv (ctrl, (struct sockaddr *) &sa_client, len);
     }
+  else
+    ctrl = sep->se_fd;
 
-  ret = getnameinfo (sa_client, sa_len, ip, sizeof (ip), str, sizeof (str),
-		      NI_NUMERICHOST | NI_NUMERICSERV);
-  if (ret == 0)
+  pid = 0;
+  dofork = (sep->se_bi == 0 || sep->se_bi->bi_fork);
+  if (dofork)
     {
-      if (setenv ("TCPREMOTEIP", ip, 1) < 0)
-	syslog (LOG_WARNING, "setenv(TCPREMOTEIP): %m");
-      else if (debug)
-	fprintf (stderr, "Assigned TCPREMOTEIP = %s\n", ip);
-
-      if (setenv ("TCPREMOTEPORT", str, 1) < 0)
-	syslog (LOG_WARNING, "setenv(TCPREMOTEPORT): %m");
-
-      if (resolve_option)
+      if (count_start (sep))
 	{
-	  ret = getnameinfo (sa_client, sa_len, ip, sizeof (ip), NULL, 0, 0);
-	  if (ret != 0)
-	    syslog (LOG_WARNING, "getnameinfo: %s", gai_strerror (ret));
-	  else if (setenv ("TCPREMOTEHOST", ip, 1) < 0)
-	    syslog (LOG_WARNING, "setenv(TCPREMOTEHOST): %m");
-	  else if (debug)
-	    fprintf (stderr, "Assigned TCPREMOTEHOST = %s\n", ip);
+	  if (!sep->se_wait && sep->se_socktype == SOCK_STREAM)
+	    close (ctrl);
+	  if (counted)
+	    source_release (counted, &src);
+	  return 0;
 	}
+#ifdef USE_VFORK
+      if (!sep->se_bi)
+	pid = spawn_server (sep, ctrl);
+      else
+#endif
+	pid = fork ();
+    }
+  if (pid < 0)
+    {
+      syslog (LOG_ERR, "fork: %m");
+      sep->se_stats.failed++;
+      if (!sep->se_wait && sep->se_socktype == SOCK_STREAM)
+	close (ctrl);
+      if (counted)
+	source_release (counted, &src);
+      sleep (1);
+      return -1;
+    }
+  if (pid)
+    child_add (pid, sep, counted ? &src : NULL);
+  if (pid && sep->se_wait)
+    {
+      sep->se_wait = pid;
+      unwatch_sep (sep);
+    }
+  if (pid == 0)
+    {
+      if (dofork)
+	child_setup (ctrl);
+      run_service (ctrl, sep);
+      if (counted)
+	source_release (counted, &src);
+    }
+  if (!sep->se_wait && sep->se_socktype == SOCK_STREAM)
+    close (ctrl);
+  return 0;
+}
+
+void
+handle_request (struct servtab *sep)
+{
+  int n;
+
+  if (debug)
+    fprintf (stderr, "someone wants %s\n", sep->se_service);
+  if (sep->se_pool_max)
+    pool_request (sep);
+  else if (sep->se_listen)
+    listen_start (sep);
+  else if (!sep->se_wait && sep->se_socktype == SOCK_STREAM)
+    {
+      /* Take the connections queued, as many wakeups saved, but leave
+	 some for the next wakeup under a flood.  */
+      for (n = 0; n < ACCEPTMAX && sep->se_watched; n++)
+	if (serve_request (sep) < 0)
+	  break;
     }
   else
-    syslog (LOG_WARNING, "getnameinfo: %s", gai_strerror (ret));
+    serve_request (sep);
 }
 
-
 
 int
-main (int argc, char *argv[], char *envp[])
+main (int argc, char *argv[])
 {
   int index;
-  struct servtab *sep;
-  int dofork;
-  pid_t pid;
 
   set_program_name (argv[0]);
 
-  Argv = argv;
-  if (envp == 0 || *envp == 0)
-    envp = argv;
-  while (*envp)
-    envp++;
-  LastArg = envp[-1] + strlen (envp[-1]);
-
   /* Parse command line */
   iu_argp_init ("inetd", program_authors);
   argp_parse (&argp, argc, argv, 0, &index, NULL);
@@ -1989,151 +3989,37 @@ main (int argc, char *argv[], char *envp[])
 	      strerror (errno));
   }
 
+#if defined HAVE_SYS_RESOURCE_H && defined RLIMIT_NOFILE
+  if (getrlimit (RLIMIT_NOFILE, &nofile_limit) == 0
+      && nofile_limit.rlim_cur < nofile_limit.rlim_max)
+    {
+      struct rlimit rl = nofile_limit;
+
+      rl.rlim_cur = rl.rlim_max;
+      if (setrlimit (RLIMIT_NOFILE, &rl) == 0)
+	nofile_raised = true;
+    }
+#endif
+
+  event_init ();
+  signal_block (&wait_sigstatus);
+
   signal_set_handler (SIGALRM, retry);
   config (0);
   signal_set_handler (SIGHUP, config);
   signal_set_handler (SIGCHLD, reapchild);
   signal_set_handler (SIGPIPE, SIG_IGN);
-
-  {
-    /* space for daemons to overwrite environment for ps */
-#define DUMMYSIZE	100
-    char dummy[DUMMYSIZE];
-
-    memset (dummy, 'x', DUMMYSIZE - 1);
-    dummy[DUMMYSIZE - 1] = '\0';
-    setenv ("inetd_dummy", dummy, 1);
-  }
+  if (control_path)
+    control_init ();
 
   for (;;)
     {
-      int n, ctrl;
-      fd_set readable;
-
-      if (nsock == 0)
+      event_loop (pool_timeout ());
+      if (control_reload)
 	{
-	  SIGSTATUS stat;
-	  sigstatus_empty (stat);
-
-	  signal_block (NULL);
-	  while (nsock == 0)
-	    inetd_pause (stat);
-	  signal_unblock (NULL);
-	}
-      readable = allsock;
-      n = select (maxsock + 1, &readable, NULL, NULL, NULL);
-      if (n <= 0)
-	{
-	  if (n < 0 && errno != EINTR)
-	    syslog (LOG_WARNING, "select: %m");
-	  sleep (1);
-	  continue;
+	  control_reload = 0;
+	  config (SIGHUP);
 	}
-      for (sep = servtab; n && sep; sep = sep->se_next)
-	if (sep->se_fd != -1 && FD_ISSET (sep->se_fd, &readable))
-	  {
-	    n--;
-	    if (debug)
-	      fprintf (stderr, "someone wants %s\n", sep->se_service);
-	    if (!sep->se_wait && sep->se_socktype == SOCK_STREAM)
-	      {
-#ifdef IPV6
-		struct sockaddr_storage sa_client;
-#else
-		struct sockaddr_in sa_client;
-#endif
-		socklen_t len = sizeof (sa_client);
-
-		ctrl = accept (sep->se_fd, (struct sockaddr *) &sa_client,
-			       &len);
-		if (debug)
-		  fprintf (stderr, "accept, ctrl %d\n", ctrl);
-		if (ctrl < 0)
-		  {
-		    if (errno != EINTR)
-		      syslog (LOG_WARNING, "accept (for %s): %m",
-			      sep->se_service);
-		    continue;
-		  }
-		if (env_option)
-		  prepenv (ctrl, (struct sockaddr *) &sa_client, len);
-	      }
-	    else
-	      ctrl = sep->se_fd;
-
-	    signal_block (NULL);
-	    pid = 0;
-	    dofork = (sep->se_bi == 0 || sep->se_bi->bi_fork);
-	    if (dofork)
-	      {
-		if (sep->se_count++ == 0)
-		  gettimeofday (&sep->se_time, NULL);
-		else if ((sep->se_max && sep->se_count > sep->se_max)
-			 || sep->se_count >= toomany)
-		  {
-		    struct timeval now;
-
-		    gettimeofday (&now, NULL);
-		    if (now.tv_sec - sep->se_time.tv_sec > CNT_INTVL)
-		      {
-			sep->se_time = now;
-			sep->se_count = 1;
-		      }
-		    else
-		      {
-			syslog (LOG_ERR,
-				"%s/%s server failing (looping), service terminated",
-				sep->se_service, sep->se_proto);
-			close_sep (sep);
-			if (! sep->se_wait && sep->se_socktype == SOCK_STREAM)
-			  close (ctrl);
-			signal_unblock (NULL);
-			if (!timingout)
-			  {
-			    timingout = 1;
-			    alarm (RETRYTIME);
-			  }
-			continue;
-		      }
-		  }
-		pid = fork ();
-	      }
-	    if (pid < 0)
-	      {
-		syslog (LOG_ERR, "fork: %m");
-		if (!sep->se_wait && sep->se_socktype == SOCK_STREAM)
-		  close (ctrl);
-		signal_unblock (NULL);
-		sleep (1);
-		continue;
-	      }
-	    if (pid && sep->se_wait)
-	      {
-		sep->se_wait = pid;
-		if (sep->se_fd >= 0)
-		  {
-		    FD_CLR (sep->se_fd, &allsock);
-		    nsock--;
-		  }
-	      }
-	    signal_unblock (NULL);
-	    if (pid == 0)
-	      {
-		if (debug && dofork)
-		  setsid ();
-		if (dofork)
-		  {
-		    int sock;
-		    if (debug)
-		      fprintf (stderr, "+ Closing from %d\n", maxsock);
-		    for (sock = maxsock; sock > 2; sock--)
-		      if (sock != ctrl)
-			close (sock);
-		  }
-		run_service (ctrl, sep);
-	      }
-	    if (!sep->se_wait && sep->se_socktype == SOCK_STREAM)
-	      close (ctrl);
-	  }
+      pool_run ();
     }
 }
@@ -0,0 +1,321 @@
+/*
+  Copyright (C) 2017 Free Software Foundation, Inc.
+
+  This file is part of GNU Inetutils.
+
+  GNU Inetutils is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or (at
+  your option) any later version.
+
+  GNU Inetutils is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see `http://www.gnu.org/licenses/'. */
+
+/* Print the messages kept by syslogd in a message ring, see the
+   action `%FILE' in syslog.conf.  */
+
+#include <config.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_MMAP
+# include <sys/mman.h>
+#endif
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <argp.h>
+#include <libinetutils.h>
+#include <progname.h>
+#include <ctype.h>
+#include <error.h>
+#include <errno.h>
+#include <xalloc.h>
+
+#define SYSLOG_NAMES
+#include <syslog.h>
+#ifndef HAVE_SYSLOG_INTERNAL
+# include "logprio.h"
+#endif
+
+#include "logring.h"
+
+/* Largest record accepted, far above what syslogd writes.  */
+#define MAXREC		8192
+
+/* Pause between looks for new messages, in milliseconds.  */
+#define FOLLOW_MSEC	200
+
+static int follow;
+static long lines = -1;
+static int maxlevel = LOG_DEBUG;
+static int facility = -1;
+static char *match;
+static int precise;
+
+static struct logring_head *ring;
+static char *data;
+
+static int
+decode (char *name, CODE *codetab, const char *what)
+{
+  CODE *cp;
+
+  if (isdigit (*name))
+    return atoi (name);
+
+  for (cp = codetab; cp->c_name; cp++)
+    {
+      if (strcasecmp (name, cp->c_name) == 0)
+	return cp->c_val;
+    }
+  error (EXIT_FAILURE, 0, "unknown %s name: %s", what, name);
+  return -1; /* to pacify gcc */
+}
+
+/* Tell whether the LEN bytes at S contain the string PAT.  */
+static int
+contains (const char *s, size_t len, const char *pat)
+{
+  size_t n = strlen (pat);
+
+  for (; len >= n; s++, len--)
+    if (memcmp (s, pat, n) == 0)
+      return 1;
+  return 0;
+}
+
+/* Copy the record at offset POS into BUF.  Return its length, or
+   zero if the record was overwritten while it was read.  */
+static uint32_t
+read_record (uint64_t pos, uint64_t *buf)
+{
+  uint64_t off = pos % ring->size;
+  uint32_t len = ((struct logring_rec *) (data + off))->len;
+
+  if (len < 2 * sizeof (uint32_t) || len > ring->size - off || len > MAXREC)
+    {
+      LOGRING_BARRIER ();
+      if (ring->tail > pos)
+	return 0;
+      error (EXIT_FAILURE, 0, "damaged message ring");
+    }
+  memcpy (buf, data + off, len);
+  LOGRING_BARRIER ();
+  if (ring->tail > pos)
+    return 0;
+  return len;
+}
+
+static void
+print_record (struct logring_rec *rec)
+{
+  const char *host = (const char *) (rec + 1);
+  char stamp[64];
+  time_t t = rec->sec;
+  struct tm *tm = localtime (&t);
+
+  if ((int) LOG_PRI (rec->pri) > maxlevel
+      || (facility >= 0 && (int) (rec->pri & LOG_FACMASK) != facility))
+    return;
+  if (match && !contains (host + rec->hostlen, rec->msglen, match))
+    return;
+
+  if (precise)
+    {
+      size_t n = strftime (stamp, sizeof (stamp), "%Y-%m-%dT%H:%M:%S", tm);
+      snprintf (stamp + n, sizeof (stamp) - n, ".%06lu",
+		(unsigned long) rec->usec);
+    }
+  else
+    strftime (stamp, sizeof (stamp), "%b %e %H:%M:%S", tm);
+
+  printf ("%s %.*s %.*s\n", stamp, (int) rec->hostlen, host,
+	  (int) rec->msglen, host + rec->hostlen);
+}
+
+/* Return the offset of the last LINES records in the ring.  */
+static uint64_t
+find_last (void)
+{
+  uint64_t *offs = xcalloc (lines, sizeof (*offs));
+  uint64_t pos, head = ring->head;
+  unsigned long n = 0;
+  uint64_t buf[MAXREC / sizeof (uint64_t)];
+
+  LOGRING_BARRIER ();
+  for (pos = ring->tail; pos < head; )
+    {
+      struct logring_rec *rec = (struct logring_rec *) buf;
+      uint32_t len = read_record (pos, buf);
+
+      if (len == 0)
+	{
+	  pos = ring->tail;	/* Overtaken by the writer.  */
+	  n = 0;
+	  continue;
+	}
+      if (rec->pri != LOGRING_PAD)
+	offs[n++ % lines] = pos;
+      pos += len;
+    }
+
+  pos = n < (unsigned long) lines ? ring->tail : offs[n % lines];
+  free (offs);
+  return pos;
+}
+
+const char args_doc[] = "FILE";
+const char doc[] = "Print the messages kept in a syslogd message ring.";
+
+static struct argp_option argp_options[] = {
+#define GRP 10
+  { "follow", 'f', NULL, 0,
+    "keep printing messages as they arrive", GRP },
+  { "lines", 'n', "NUM", 0,
+    "begin with the last NUM messages", GRP },
+  { "priority", 'p', "LEVEL", 0,
+    "print messages at LEVEL or higher only", GRP },
+  { "facility", 'F', "FAC", 0,
+    "print messages of facility FAC only", GRP },
+  { "match", 'm', "TEXT", 0,
+    "print messages containing TEXT only", GRP },
+  { "precise", 'P', NULL, 0,
+    "print time stamps with date and microseconds", GRP },
+#undef GRP
+  {NULL, 0, NULL, 0, NULL, 0 }
+};
+
+static error_t
+parse_opt (int key, char *arg, struct argp_state *state)
+{
+  char *end;
+
+  switch (key)
+    {
+    case 'f':
+      follow = 1;
+      break;
+
+    case 'n':
+      lines = strtol (arg, &end, 10);
+      if (*end || end == arg || lines < 0)
+	argp_error (state, "invalid number of lines: %s", arg);
+      break;
+
+    case 'p':
+      maxlevel = decode (arg, prioritynames, "priority");
+      break;
+
+    case 'F':
+      facility = decode (arg, facilitynames, "facility");
+      break;
+
+    case 'm':
+      match = arg;
+      break;
+
+    case 'P':
+      precise = 1;
+      break;
+
+    default:
+      return ARGP_ERR_UNKNOWN;
+    }
+
+  return 0;
+}
+
+static struct argp argp =
+  {argp_options, parse_opt, args_doc, doc, NULL, NULL, NULL};
+
+int
+main (int argc, char *argv[])
+{
+  int index;
+#ifdef HAVE_MMAP
+  int fd;
+  struct stat st;
+#endif
+  uint64_t pos, head, seq = 0;
+  uint64_t buf[MAXREC / sizeof (uint64_t)];
+  int seen = 0;
+
+  set_program_name (argv[0]);
+  iu_argp_init ("logring", default_program_authors);
+  argp_parse (&argp, argc, argv, 0, &index, NULL);
+
+  if (argc - index != 1)
+    error (EXIT_FAILURE, 0, "expected exactly one ring file");
+
+#ifndef HAVE_MMAP
+  error (EXIT_FAILURE, ENOSYS, "%s", argv[index]);
+#else
+  fd = open (argv[index], O_RDONLY);
+  if (fd < 0 || fstat (fd, &st) < 0)
+    error (EXIT_FAILURE, errno, "%s", argv[index]);
+  if ((size_t) st.st_size < sizeof (*ring))
+    error (EXIT_FAILURE, 0, "%s: not a message ring", argv[index]);
+
+  ring = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (ring == MAP_FAILED)
+    error (EXIT_FAILURE, errno, "%s", argv[index]);
+  close (fd);
+  if (ring->magic != LOGRING_MAGIC || ring->version != LOGRING_VERSION
+      || ring->size + sizeof (*ring) > (uint64_t) st.st_size)
+    error (EXIT_FAILURE, 0, "%s: not a message ring", argv[index]);
+  data = LOGRING_DATA (ring);
+#endif
+
+  if (lines < 0)
+    pos = ring->tail;
+  else if (lines == 0)
+    pos = ring->head;
+  else
+    pos = find_last ();
+
+  for (;;)
+    {
+      head = ring->head;
+      LOGRING_BARRIER ();
+      while (pos < head)
+	{
+	  struct logring_rec *rec = (struct logring_rec *) buf;
+	  uint32_t len = 0;
+
+	  if (pos >= ring->tail)
+	    len = read_record (pos, buf);
+	  if (len == 0)
+	    {
+	      pos = ring->tail;	/* Overtaken by the writer.  */
+	      continue;
+	    }
+	  pos += len;
+	  if (rec->pri == LOGRING_PAD)
+	    continue;
+
+	  if (seen && rec->seq > seq)
+	    error (0, 0, "%llu messages lost",
+		   (unsigned long long) (rec->seq - seq));
+	  seq = rec->seq + 1;
+	  seen = 1;
+	  print_record (rec);
+	}
+
+      if (!follow)
+	break;
+      fflush (stdout);
+      poll (NULL, 0, FOLLOW_MSEC);
+    }
+
+  exit (EXIT_SUCCESS);
+}
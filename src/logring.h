@@ -0,0 +1,78 @@
+/*
+  Copyright (C) 2017 Free Software Foundation, Inc.
+
+  This file is part of GNU Inetutils.
+
+  GNU Inetutils is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or (at
+  your option) any later version.
+
+  GNU Inetutils is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see `http://www.gnu.org/licenses/'. */
+
+/* Layout of the message ring, a file mapped into memory, which is
+   written by syslogd and read by logring.
+
+   The file begins with a `struct logring_head', followed by SIZE
+   bytes of data.  Records are stored in the data one after the
+   other, each a `struct logring_rec' followed by the host name and
+   the message text, padded to a multiple of eight bytes.  Offsets
+   HEAD and TAIL only ever grow, a record at offset N being found at
+   N % SIZE within the data.  A record never wraps around the end of
+   the data, the remainder is filled by a record of type LOGRING_PAD.
+
+   The writer first moves TAIL past all records it is about to
+   overwrite, then stores the new record, and finally moves HEAD
+   past it.  A reader copies a record, and keeps it only if TAIL has
+   not passed the record's offset meanwhile.  */
+
+#ifndef LOGRING_H
+# define LOGRING_H
+
+# include <stdint.h>
+
+# define LOGRING_MAGIC		0x49554c52	/* "IULR" */
+# define LOGRING_VERSION	1
+
+/* Type of a record filling the data up to its end.  */
+# define LOGRING_PAD		0xffffffffU
+
+# define LOGRING_ALIGN(n)	(((n) + 7) & ~(uint64_t) 7)
+
+struct logring_head
+{
+  uint32_t magic;		/* LOGRING_MAGIC.  */
+  uint32_t version;		/* LOGRING_VERSION.  */
+  uint64_t size;		/* Bytes of data after this header.  */
+  volatile uint64_t head;	/* Offset past the newest record.  */
+  volatile uint64_t tail;	/* Offset of the oldest record.  */
+  volatile uint64_t seq;	/* Sequence number of the next record.  */
+};
+
+struct logring_rec
+{
+  uint32_t len;			/* Size of the record, including padding.  */
+  uint32_t pri;			/* Facility and priority, or LOGRING_PAD.  */
+  uint64_t seq;			/* Sequence number.  */
+  int64_t sec;			/* Time of the message.  */
+  uint32_t usec;
+  uint16_t hostlen;		/* Length of the host name.  */
+  uint16_t msglen;		/* Length of the message text.  */
+};
+
+# define LOGRING_DATA(h)	((char *) (h) + sizeof (struct logring_head))
+
+/* Order the stores, or loads, to the ring before and after it.  */
+# if defined __GNUC__
+#  define LOGRING_BARRIER()	__sync_synchronize ()
+# else
+#  define LOGRING_BARRIER()
+# endif
+
+#endif /* LOGRING_H */
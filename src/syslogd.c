@@ -73,11 +73,14 @@
 
 #define IOVCNT          6	/* size of the iovec array */
 #define MAXLINE		1024	/* Maximum line length.  */
+#define KMSGSIZE	8192	/* Largest record read from PATH_KMSG.  */
+#define KMSGBATCH	64	/* Kernel records read in one go.  */
 #define MAXSVLINE	240	/* Maximum saved line length.  */
 #define DEFUPRI		(LOG_USER|LOG_NOTICE)
 #define DEFSPRI		(LOG_KERN|LOG_CRIT)
 #define TIMERINTVL	30	/* Interval for checking flush, mark.  */
 #define TTYMSGTIME      10	/* Time out passed to ttymsg.  */
+#define RECVBATCH	16	/* Datagrams drained per wakeup.  */
 
 #include <sys/param.h>
 #include <sys/ioctl.h>
@@ -89,6 +92,9 @@
 #include <sys/time.h>
 #include <time.h>
 #include <sys/resource.h>
+#ifdef HAVE_MMAP
+# include <sys/mman.h>
+#endif
 #include <poll.h>
 #include <sys/types.h>
 
@@ -104,6 +110,7 @@
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <dirent.h>
 #include <unistd.h>
@@ -133,12 +140,24 @@
 #  define LOG_MAKEPRI(fac, p)	((fac) | (p))
 #endif
 
+#ifndef MSG_DONTWAIT
+# define MSG_DONTWAIT	0
+#endif
+
+/* Building with SYSLOGD_PROFILE defined makes syslogd account the
+   processor time spent in the stages of message handling, which
+   SIGUSR2 reports along with the other statistics.  */
+#if defined SYSLOGD_PROFILE && !defined CLOCK_PROCESS_CPUTIME_ID
+# undef SYSLOGD_PROFILE
+#endif
+
 #include <error.h>
 #include <progname.h>
 #include <libinetutils.h>
 #include <readutmp.h>		/* May define UTMP_NAME_FUNCTION.  */
 #include "unused-parameter.h"
 #include "xalloc.h"
+#include "logring.h"
 
 /* A mask of all facilities mentioned explicitly in the configuration file
  *
@@ -157,12 +176,23 @@ char ctty[] = PATH_CONSOLE;	/* Default console to send message info.  */
 
 static int dbg_output;		/* If true, print debug output in debug mode.  */
 static int restart;		/* If 1, indicates SIGHUP was dropped.  */
+static int want_stats;		/* If 1, indicates SIGUSR2 was dropped.  */
+static int sigs_held;		/* Nonzero while a batch blocks signals.  */
+
+/* Counters kept for every receiving socket.  */
+struct sockstat
+{
+  unsigned long recv;		/* Datagrams received.  */
+  unsigned long drop;		/* Datagrams dropped by the kernel.  */
+  unsigned long drop_seen;	/* Drop count last reported.  */
+};
 
 /* Unix socket family to listen.  */
 struct funix
 {
   const char *name;
   int fd;
+  struct sockstat st;
 } *funix;
 
 size_t nfunix;			/* Number of unix sockets in the funix array.  */
@@ -176,6 +206,13 @@ size_t nfunix;			/* Number of unix sockets in the funix array.  */
 #define ADDDATE		0x004	/* Add a date to the message.  */
 #define MARK		0x008	/* This message is a mark.  */
 
+/* A message awaiting output to a stalled destination.  */
+struct outmsg
+{
+  char *data;
+  size_t len;
+};
+
 /* This structure represents the files that will have log copies
    printed.  */
 
@@ -202,20 +239,79 @@ struct filed
     char *f_fname;		/* Name use for Files|Pipes|TTYs.  */
   } f_un;
   char f_prevline[MAXSVLINE];	/* Last message logged.  */
-  char f_lasttime[16];		/* Time of last occurrence.  */
+  char f_lasttime[33];		/* Time of last occurrence.  */
   char *f_prevhost;		/* Host from which recd.  */
   char *f_progname;		/* Submitting program.  */
   int f_prognlen;		/* Length of the same.  */
   int f_prevpri;		/* Pri of f_prevline.  */
   int f_prevlen;		/* Length of f_prevline.  */
   int f_prevcount;		/* Repetition cnt of prevline.  */
+  unsigned int f_prevhash;	/* Hash of f_prevline.  */
+  int f_seq;			/* Position in configuration.  */
   size_t f_repeatcount;		/* Number of "repeated" msgs.  */
   int f_flags;			/* Additional flags see below.  */
+  char *f_buf;			/* Output buffer of F_FILE.  */
+  size_t f_bufsize;		/* Size of f_buf, zero if unbuffered.  */
+  size_t f_buflen;		/* Bytes pending in f_buf.  */
+  long long f_flushdue;		/* Deadline for pending bytes.  */
+  int f_flushms;		/* Longest delay of buffered lines.  */
+  int f_flushpri;		/* Flush at this priority or higher.  */
+  int f_syncms;			/* Group commit interval, or zero.  */
+  long long f_syncdue;		/* Deadline of a pending fsync.  */
+  struct outmsg *f_queue;	/* Ring of messages awaiting output.  */
+  int f_qmax;			/* Capacity of f_queue, zero if unqueued.  */
+  int f_qhead;			/* Oldest entry in f_queue.  */
+  int f_qlen;			/* Number of entries in f_queue.  */
+  size_t f_qoff;		/* Bytes of oldest entry already written.  */
+  int f_qpolicy;		/* Action on a full queue, see below.  */
+  unsigned long f_qdrop;	/* Messages lost to a full queue.  */
+  unsigned long f_qdrop_seen;	/* Losses last reported.  */
+  time_t f_retry;		/* Next TCP connection attempt.  */
+  off_t f_size;			/* Bytes written to F_FILE so far.  */
+  off_t f_rotsize;		/* Rotate at this size, or zero.  */
+  time_t f_rotage;		/* Rotate after seconds, or zero.  */
+  time_t f_rotstart;		/* When the current file was opened.  */
+  int f_rotkeep;		/* Number of rotated files to keep.  */
+  pid_t f_gzpid;		/* Compressor of the newest rotated file.  */
+  char *f_cfline;		/* Configuration line, kept for reloads.  */
+  int f_named;			/* Facilities named by the selector.  */
+  struct logring_head *f_ring;	/* Mapped file of F_RING.  */
+  size_t f_maplen;		/* Length of the mapping.  */
 };
 
 struct filed *Files;		/* Linked list of files to log to.  */
+struct filed *OldFiles;		/* Previous list, during a reload.  */
 struct filed consfile;		/* Console `file'.  */
 
+/* Compressors still running for files closed by a reload.  */
+#define GZORPHANS 8
+pid_t gzorphans[GZORPHANS];
+
+/* Entries with a program selector, hashed by program name.  */
+struct progsel
+{
+  struct progsel *next;		/* Next in hash chain.  */
+  const char *name;		/* The program name.  */
+  int len;			/* Its length.  */
+  unsigned int hash;		/* Its hash value.  */
+  struct filed **vec;		/* NULL terminated, in config order.  */
+  int nvec;			/* Entries in vec.  */
+};
+
+#define PROGHASHSIZE	64	/* Chains in proghash.  */
+#define MAXPROGMATCH	8	/* Program selectors used for dispatch.  */
+
+/* Characters continuing a program name, not ending it.  */
+#define PROGCHAR(c)	(isalnum ((unsigned char) (c)) \
+			 || (c) == '-' || (c) == '_')
+
+/* Entries without program selector, for every facility and level.  */
+struct filed **dispatch[LOG_NFACILITIES + 1][LOG_PRIMASK + 1];
+struct filed **dispatch_pool;	/* Storage of all vectors in dispatch.  */
+struct progsel *proghash[PROGHASHSIZE];
+int *proglens;			/* Distinct lengths of program names.  */
+int nproglens;
+
 /* Values for f_type.  */
 #define F_UNUSED	0	/* Unused entry.  */
 #define F_FILE		1	/* Regular file.  */
@@ -227,6 +323,7 @@ struct filed consfile;		/* Console `file'.  */
 #define F_FORW_SUSP	7	/* Suspended host forwarding.  */
 #define F_FORW_UNKN	8	/* Unknown host forwarding.  */
 #define F_PIPE		9	/* Named pipe.  */
+#define F_RING		10	/* Message ring in shared memory.  */
 
 const char *TypeNames[] = {
   "UNUSED",
@@ -238,11 +335,55 @@ const char *TypeNames[] = {
   "WALL",
   "FORW(SUSPENDED)",
   "FORW(UNKNOWN)",
-  "PIPE"
+  "PIPE",
+  "RING"
 };
 
 /* Flags in filed.f_flags.  */
 #define OMIT_SYNC	0x001	/* Omit fsync after printing.  */
+#define SYNC_DUE	0x002	/* An fsync awaits f_syncdue.  */
+#define FORW_TCP	0x004	/* Forward over TCP, framed per RFC 6587.  */
+#define FORW_DOWN	0x008	/* TCP peer reported as unreachable.  */
+#define PRECISE_TIME	0x010	/* RFC 3339 time stamps in microseconds.  */
+#define ROT_COMPRESS	0x020	/* Compress rotated files with gzip.  */
+#define GZIP_DUE	0x040	/* FILE.1 awaits its compressor.  */
+
+/* Values for f_qpolicy.  */
+#define Q_DROP_NEWEST	0	/* Discard the arriving message.  */
+#define Q_DROP_OLDEST	1	/* Discard the oldest queued message.  */
+#define Q_BLOCK		2	/* Wait until the destination drains.  */
+
+#define DEFQUEUE	256	/* Default queue length.  */
+#define DEFRINGSIZE	(1024 * 1024)	/* Data in a message ring.  */
+#define MINRINGSIZE	(16 * 1024)
+#define DEFROTKEEP	5	/* Rotated files kept by default.  */
+#define MAXROTKEEP	999	/* Most rotated files kept.  */
+#define DEFSPOOL	4096	/* Default queue length for TCP peers.  */
+#define QBATCH		64	/* Queued messages written at once.  */
+
+/* Ancillary data of received datagrams.  */
+#if defined SO_PASSCRED && defined SCM_CREDENTIALS
+# define RECV_CREDS	1	/* Credentials of local senders.  */
+# define CREDSPACE	CMSG_SPACE (sizeof (struct ucred))
+#else
+# define CREDSPACE	0
+#endif
+#if defined SO_RXQ_OVFL || defined RECV_CREDS
+# define RECV_CTL	1
+#endif
+
+/* Rate limits.  */
+#define BUCKETHASH	256	/* Chains in buckets.  */
+#define MAXBUCKETS	4096	/* Senders and programs tracked.  */
+
+/* TCP transport.  */
+#define TCP_RETRY	10	/* Seconds between connection attempts.  */
+#define MAXTCPCONN	256	/* Incoming connections at a time.  */
+#define TCPBUFSIZE	(2 * MAXLINE + 32)	/* Holds any whole frame.  */
+
+/* Defaults of the action options `buffer' and `flush'.  */
+#define DEFFLUSHMS	1000	/* Milliseconds.  */
+#define MINBUFSIZE	(4 * MAXLINE)
 
 /* Constants for the F_FORW_UNKN retry feature.  */
 #define INET_SUSPEND_TIME 180	/* Number of seconds between attempts.  */
@@ -266,20 +407,49 @@ int repeatinterval[] = { 30, 60 };	/* Number of seconds before flush.  */
 extern int waitdaemon (int nochdir, int noclose, int maxwait);
 
 void cfline (const char *, struct filed *);
+static int cfoptions (char *, struct filed *);
+static void cfratelimit (char *);
 const char *cvthname (struct sockaddr *, socklen_t);
+static void start_resolver (void);
+static void stop_resolver (void);
+static int dns_replies (void);
 int decode (const char *, CODE *);
 void die (int);
 void doexit (int);
 void domark (int);
 void find_inet_port (const char *);
 void fprintlog (struct filed *, const char *, int, const char *);
+static void flush_file (struct filed *);
+static void request_sync (struct filed *);
+static void buffer_line (struct filed *, struct iovec *, int);
+static void finish_file (struct filed *);
+static int rotation_due (struct filed *);
+static void rotate_file (struct filed *);
+static int flush_due (void);
+static int output_fd (struct filed *);
+static unsigned long poll_outputs (struct pollfd **, size_t *,
+				   unsigned long);
+static void drain_queue (struct filed *);
+static void enqueue (struct filed *, const char *, size_t);
+static void enqueue_iov (struct filed *, struct iovec *, size_t);
+static void discard_queue (struct filed *);
+static ssize_t write_queued (struct filed *, struct iovec *);
+static struct filed *reuse_filed (const char *);
 static int load_conffile (const char *, struct filed **);
 static int load_confdir (const char *, struct filed **);
 void init (int);
 void logerror (const char *);
 void logmsg (int, const char *, const char *, int);
+static void logmsg_at (int, const char *, const char *, int,
+		       const struct timeval *);
+static unsigned int strhash (const char *, size_t);
+static void compile_selectors (void);
+static void free_selectors (void);
 void printline (const char *, const char *);
 void printsys (const char *);
+static int kmsg_read (void);
+static void ring_write (struct filed *, int, const char *, size_t,
+			const char *, const struct timeval *);
 char *ttymsg (struct iovec *, int, char *, int);
 void wallmsg (struct filed *, struct iovec *);
 char **crunch_list (char **oldlist, char *list);
@@ -287,9 +457,22 @@ char *textpri (int pri);
 void dbg_toggle (int);
 static void dbg_printf (const char *, ...);
 void trigger_restart (int);
+void trigger_stats (int);
+static void dump_stats (void);
+static void report_drops (void);
+static void recv_batch (int fd, struct sockstat *st, int inet);
 static void add_funix (const char *path);
 static int create_unix_socket (const char *path);
-static void create_inet_socket (int af, int fd46[2]);
+static void create_inet_socket (int af, int socktype, int fd46[2]);
+static unsigned long poll_conns (struct pollfd **, size_t *, unsigned long);
+static void tcp_accept (int fd);
+struct tcpconn;
+static void tcp_read (struct tcpconn *c);
+static void tcp_connect (struct filed *f);
+struct ratelimit;
+static int rate_ok (const struct ratelimit *rl, const char *key);
+static long long clock_ms (void);
+static void report_ratelimits (int sweep);
 
 char *LocalHostName;		/* Our hostname.  */
 char *LocalDomain;		/* Our local domain name.  */
@@ -302,14 +485,149 @@ char portstr[8];		/* Fallback port number.  */
 #endif
 char addrstr[INET6_ADDRSTRLEN];	/* Common address presentation.  */
 char addrname[NI_MAXHOST];	/* Common name lookup.  */
+
+/* Cache of reverse lookups made by cvthname().  */
+struct dnskey
+{
+  int family;
+  unsigned int scope;
+  unsigned char addr[16];
+};
+
+struct dnsent
+{
+  struct dnsent *hnext;		/* Next in hash chain.  */
+  struct dnsent *prev, *next;	/* LRU list, most recent first.  */
+  struct dnskey key;
+  char *name;			/* Host name, or NULL if unknown.  */
+  time_t expires;		/* End of validity.  */
+  int pending;			/* Waiting for the resolver process.  */
+};
+
+/* Messages exchanged with the resolver process.  */
+struct dnsreq
+{
+  struct sockaddr_storage addr;
+  socklen_t len;
+};
+
+struct dnsreply
+{
+  struct sockaddr_storage addr;
+  socklen_t len;
+  int err;
+  long ms;			/* Time spent in getnameinfo().  */
+  char name[NI_MAXHOST];
+};
+
+struct dnsent **dnshash;	/* Hash chains of the cache.  */
+unsigned int dnsbuckets;
+struct dnsent *dnslru;		/* Most recently used entry.  */
+struct dnsent *dnslru_tail;	/* Least recently used entry.  */
+int dnscount;			/* Entries in the cache.  */
+int DnsCacheSize = 256;		/* Largest number of entries.  */
+int DnsTTL = 600;		/* Seconds to keep names.  */
+int DnsNegTTL = 60;		/* Seconds to keep failed lookups.  */
+int AsyncDns;			/* Use a resolver process.  */
+pid_t resolver_pid = -1;
+int resolver_out = -1;		/* Requests to the resolver.  */
+int resolver_in = -1;		/* Answers from the resolver.  */
+
+struct
+{
+  unsigned long hits, misses, lookups;
+  unsigned long total_ms, max_ms;
+} dnsstats;
 int usefamily = AF_INET;	/* Address family for INET services.
 				 * Each of the values `AF_INET' and `AF_INET6'
 				 * produces a single-stacked server.  */
 int finet[2] = {-1, -1};	/* Internet datagram socket fd.  */
 #define IU_FD_IP4	0	/* Indices for the address families.  */
 #define IU_FD_IP6	1
+struct sockstat finet_st[2];	/* Counters for the INET sockets.  */
+int fwd_sock[2] = {-1, -1};	/* Forwarding without finet.  */
+
+/* An incoming TCP connection.  */
+struct tcpconn
+{
+  int fd;
+  struct sockaddr_storage addr;	/* The sender.  */
+  socklen_t addrlen;
+  char buf[TCPBUFSIZE + 1];	/* Received, but not yet framed.  */
+  size_t len;
+  size_t skip;			/* Rest of an overlong frame.  */
+  int skipline;			/* Discard up to a newline.  */
+};
+
+int TcpListen;			/* Receive also over TCP.  */
+int ftcp[2] = {-1, -1};		/* Listening TCP sockets.  */
+struct sockstat ftcp_st;	/* Messages received over TCP.  */
+struct tcpconn **tcpconns;	/* Open incoming connections.  */
+int ntcpconns;
+
+/* A token bucket limit, set by a `ratelimit' line.  */
+struct ratelimit
+{
+  int interval;			/* Seconds, zero if unlimited.  */
+  int burst;			/* Messages per interval.  */
+};
+
+struct ratelimit rl_sender;	/* Per process or remote host.  */
+struct ratelimit rl_program;	/* Per program name.  */
+
+struct bucket
+{
+  struct bucket *next;		/* Next in hash chain.  */
+  const struct ratelimit *rl;
+  long long stamp;		/* Time of last refill, milliseconds.  */
+  long tokens;			/* Thousandths of a message.  */
+  long long rest;		/* Refill not yet a whole thousandth.  */
+  unsigned long suppressed;	/* Not yet reported.  */
+  char key[48];			/* Sender or program.  */
+};
+
+struct bucket *buckets[BUCKETHASH];
+int nbuckets;
+int RecvBatch = RECVBATCH;	/* Datagrams to drain per wakeup.  */
 int fklog = -1;			/* Kernel log device fd.  */
+int kmsg_mode;			/* True if fklog reads PATH_KMSG.  */
+unsigned long long kmsg_next;	/* Sequence number of next record.  */
+int kmsg_started;		/* True once a record was read.  */
+unsigned long kmsg_records;	/* Kernel records logged.  */
+unsigned long kmsg_lost;	/* Records overwritten before reading.  */
 char *LogPortText = NULL;	/* Service/port for INET connections.  */
+
+#ifdef SYSLOGD_PROFILE
+/* Stages of message handling.  The time of a stage includes that
+   of the stages it calls, printline() calling logmsg(), which calls
+   fprintlog().  */
+enum { PROF_PRINTLINE, PROF_LOGMSG, PROF_FPRINTLOG, PROF_STAGES };
+
+const char *prof_names[PROF_STAGES] = { "printline", "logmsg", "fprintlog" };
+
+struct
+{
+  unsigned long calls;
+  unsigned long long nsec;	/* Processor time.  */
+} prof[PROF_STAGES];
+
+static unsigned long long
+prof_clock (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+# define PROF_BEGIN	unsigned long long prof_start = prof_clock ()
+# define PROF_END(stage) \
+  (prof[stage].calls++, prof[stage].nsec += prof_clock () - prof_start)
+#else
+# define PROF_BEGIN	(void) 0
+# define PROF_END(stage)	(void) 0
+#endif
+
 char *LogForwardPort = NULL;	/* Target port for message forwarding.  */
 int Initialized;		/* True when we are initialized. */
 int MarkInterval = 20 * 60;	/* Interval between marks in seconds.  */
@@ -326,6 +644,9 @@ int NoKLog;			/* Don't attempt to log kernel device.  */
 int NoUnixAF;			/* Don't listen to unix sockets. */
 int NoForward;			/* Don't forward messages.  */
 time_t now;			/* Time use for mark and forward supending.  */
+int deferred_output;		/* Some file is buffered or group synced.  */
+struct filed **pollowner;	/* Destinations polled for output.  */
+size_t queued_msgs;		/* Messages in all output queues.  */
 int force_sync;			/* GNU/Linux behaviour to sync on every line.
 				   This off by default. Set to 1 to enable.  */
 int set_local_time = 0;		/* Record local time, not message time.  */
@@ -338,7 +659,13 @@ enum {
   OPT_NO_FORWARD = 256,
   OPT_NO_KLOG,
   OPT_NO_UNIXAF,
-  OPT_IPANY
+  OPT_IPANY,
+  OPT_RECV_BATCH,
+  OPT_DNS_CACHE,
+  OPT_DNS_TTL,
+  OPT_DNS_NEG_TTL,
+  OPT_ASYNC_DNS,
+  OPT_TCP
 };
 
 static struct argp_option argp_options[] = {
@@ -356,6 +683,8 @@ static struct argp_option argp_options[] = {
   {"ipv4", '4', NULL, 0, "restrict to IPv4 transport (default)", GRP+1},
   {"ipv6", '6', NULL, 0, "restrict to IPv6 transport", GRP+1},
   {"ipany", OPT_IPANY, NULL, 0, "allow transport with IPv4 and IPv6", GRP+1},
+  {"tcp", OPT_TCP, NULL, 0, "receive remote messages also via TCP, "
+   "at the same port (implies --inet)", GRP+1},
   {"bind", 'b', "ADDR", 0, "bind listener to this address/name", GRP+1},
   {"bind-port", 'B', "PORT", 0, "bind listener to this port", GRP+1},
   {"mark", 'm', "INTVL", 0, "specify timestamp interval in minutes"
@@ -363,7 +692,10 @@ static struct argp_option argp_options[] = {
   {"no-detach", 'n', NULL, 0, "do not enter daemon mode", GRP+1},
   {"no-forward", OPT_NO_FORWARD, NULL, 0, "do not forward any messages "
    "(overrides --hop)", GRP+1},
-#ifdef PATH_KLOG
+#ifdef PATH_KMSG
+  {"no-klog", OPT_NO_KLOG, NULL, 0, "do not listen to kernel log device "
+   PATH_KMSG, GRP+1},
+#elif defined PATH_KLOG
   {"no-klog", OPT_NO_KLOG, NULL, 0, "do not listen to kernel log device "
    PATH_KLOG, GRP+1},
 #endif
@@ -380,6 +712,16 @@ static struct argp_option argp_options[] = {
    GRP+1},
   {"sync", 'S', NULL, 0, "force a file sync on every line", GRP+1},
   {"local-time", 'T', NULL, 0, "set local time on received messages", GRP+1},
+  {"recv-batch", OPT_RECV_BATCH, "NUM", 0, "read at most NUM datagrams "
+   "from a socket per wakeup (default 16)", GRP+1},
+  {"dns-cache", OPT_DNS_CACHE, "NUM", 0, "cache up to NUM host names "
+   "of remote senders (default 256, 0 disables)", GRP+1},
+  {"dns-ttl", OPT_DNS_TTL, "SECS", 0, "keep cached host names for SECS "
+   "seconds (default 600)", GRP+1},
+  {"dns-negative-ttl", OPT_DNS_NEG_TTL, "SECS", 0, "keep failed lookups "
+   "for SECS seconds (default 60)", GRP+1},
+  {"async-dns", OPT_ASYNC_DNS, NULL, 0, "look up host names in a separate "
+   "process, never delaying reception", GRP+1},
 #undef GRP
   {NULL, 0, NULL, 0, NULL, 0}
 };
@@ -485,6 +827,36 @@ parse_opt (int key, char *arg, struct argp_state *state)
       set_local_time = 1;
       break;
 
+    case OPT_RECV_BATCH:
+      v = strtol (arg, &endptr, 10);
+      if (*endptr || v < 1)
+	argp_error (state, "invalid value (`%s' near `%s')", arg, endptr);
+      RecvBatch = v;
+      break;
+
+    case OPT_DNS_CACHE:
+    case OPT_DNS_TTL:
+    case OPT_DNS_NEG_TTL:
+      v = strtol (arg, &endptr, 10);
+      if (*endptr || v < 0)
+	argp_error (state, "invalid value (`%s' near `%s')", arg, endptr);
+      if (key == OPT_DNS_CACHE)
+	DnsCacheSize = v;
+      else if (key == OPT_DNS_TTL)
+	DnsTTL = v;
+      else
+	DnsNegTTL = v;
+      break;
+
+    case OPT_ASYNC_DNS:
+      AsyncDns = 1;
+      break;
+
+    case OPT_TCP:
+      AcceptRemote = 1;
+      TcpListen = 1;
+      break;
+
     default:
       return ARGP_ERR_UNKNOWN;
     }
@@ -501,12 +873,14 @@ main (int argc, char *argv[])
   size_t i;
   FILE *fp;
   char *p;
-  char line[MAXLINE + 1];
   char kline[MAXLINE + 1];
   int kline_len = 0;
   pid_t ppid = 0;		/* We run in debug mode and didn't fork.  */
   struct pollfd *fdarray;
-  unsigned long nfds = 0;
+  unsigned long nfds = 0;	/* Entries for receiving descriptors.  */
+  unsigned long nconn;		/* Including TCP senders.  */
+  unsigned long npoll;		/* Including stalled destinations.  */
+  size_t fdalloc;
 #ifdef HAVE_SIGACTION
   struct sigaction sa;
 #endif
@@ -590,6 +964,7 @@ main (int argc, char *argv[])
   consfile.f_un.f_fname = strdup (ctty);
 
   signal (SIGTERM, die);
+  signal (SIGPIPE, SIG_IGN);	/* Lost TCP peers are seen by write.  */
   signal (SIGINT, NoDetach ? die : SIG_IGN);
   signal (SIGQUIT, NoDetach ? die : SIG_IGN);
 
@@ -603,35 +978,69 @@ main (int argc, char *argv[])
 
   sa.sa_handler = NoDetach ? dbg_toggle : SIG_IGN;
   (void) sigaction (SIGUSR1, &sa, NULL);
+
+  sa.sa_handler = trigger_stats;
+  (void) sigaction (SIGUSR2, &sa, NULL);
 #else /* !HAVE_SIGACTION */
   signal (SIGALRM, domark);
   signal (SIGUSR1, NoDetach ? dbg_toggle : SIG_IGN);
+  signal (SIGUSR2, trigger_stats);
 #endif
 
   alarm (TIMERINTVL);
 
-  /* We add  3 = 1(klog) + 2(inet,inet6), even if they may stay unused.  */
-  fdarray = (struct pollfd *) malloc ((nfunix + 3) * sizeof (*fdarray));
+  /* We add  6 = 1(klog) + 2(inet,inet6) + 2(tcp,tcp6) + 1(resolver),
+     even if they may stay unused.  */
+  fdalloc = nfunix + 6;
+  fdarray = (struct pollfd *) malloc (fdalloc * sizeof (*fdarray));
   if (fdarray == NULL)
     error (EXIT_FAILURE, errno, "can't allocate fd table");
 
+  /* Fork the resolver before any socket is opened.  */
+  if (AsyncDns && DnsCacheSize > 0)
+    start_resolver ();
+  if (resolver_in >= 0)
+    {
+      fdarray[nfds].fd = resolver_in;
+      fdarray[nfds].events = POLLIN;
+      nfds++;
+    }
+
   /* read configuration file */
   init (0);
 
-#ifdef PATH_KLOG
-  /* Initialize kernel logging and add to the list.  */
+#if defined PATH_KMSG || defined PATH_KLOG
+  /* Initialize kernel logging and add to the list.  The record
+     oriented PATH_KMSG is preferred, where the system has it.  */
   if (!NoKLog)
     {
-      fklog = open (PATH_KLOG, O_RDONLY, 0);
+      const char *klogname = NULL;
+
+# ifdef PATH_KMSG
+      klogname = PATH_KMSG;
+      fklog = open (PATH_KMSG, O_RDONLY | O_NONBLOCK, 0);
+      kmsg_mode = fklog >= 0;
+      /* Records from before the start were logged by an earlier
+	 instance, if at all, and are left to dmesg.  */
+      if (kmsg_mode)
+	lseek (fklog, 0, SEEK_END);
+# endif
+# ifdef PATH_KLOG
+      if (fklog < 0)
+	{
+	  klogname = PATH_KLOG;
+	  fklog = open (PATH_KLOG, O_RDONLY, 0);
+	}
+# endif
       if (fklog >= 0)
 	{
 	  fdarray[nfds].fd = fklog;
 	  fdarray[nfds].events = POLLIN | POLLPRI;
 	  nfds++;
-	  dbg_printf ("Klog open %s\n", PATH_KLOG);
+	  dbg_printf ("Klog open %s\n", klogname);
 	}
       else
-	dbg_printf ("Can't open %s: %s\n", PATH_KLOG, strerror (errno));
+	dbg_printf ("Can't open %s: %s\n", klogname, strerror (errno));
     }
 #endif
 
@@ -657,7 +1066,7 @@ main (int argc, char *argv[])
   /* Initialize inet socket and add it to the list.  */
   if (AcceptRemote)
     {
-      create_inet_socket (usefamily, finet);
+      create_inet_socket (usefamily, SOCK_DGRAM, finet);
       if (finet[IU_FD_IP4] >= 0)
 	{
 	  /* IPv4 socket is present.  */
@@ -678,6 +1087,23 @@ main (int argc, char *argv[])
 	dbg_printf ("Can't open UDP port: %s\n", strerror (errno));
     }
 
+  /* Listen for TCP connections at the same port.  */
+  if (AcceptRemote && TcpListen)
+    {
+      create_inet_socket (usefamily, SOCK_STREAM, ftcp);
+      for (i = 0; i < 2; i++)
+	if (ftcp[i] >= 0)
+	  {
+	    fdarray[nfds].fd = ftcp[i];
+	    fdarray[nfds].events = POLLIN;
+	    nfds++;
+	    dbg_printf ("Opened syslog TCP/%s port.\n",
+			i == IU_FD_IP4 ? "IPv4" : "IPv6");
+	  }
+      if (ftcp[IU_FD_IP4] < 0 && ftcp[IU_FD_IP6] < 0)
+	dbg_printf ("Can't open TCP port: %s\n", strerror (errno));
+    }
+
   /* Tuck my process id away.  */
   fp = fopen (PidFile, "w");
   if (fp != NULL)
@@ -711,8 +1137,17 @@ main (int argc, char *argv[])
 
   for (;;)
     {
-      int nready;
-      nready = poll (fdarray, nfds, -1);
+      int nready, timeout;
+
+      /* Write out buffered files, and learn the next deadline.  */
+      timeout = flush_due ();
+
+      /* Wait also for TCP senders, and destinations that have
+	 fallen behind.  */
+      nconn = poll_conns (&fdarray, &fdalloc, nfds);
+      npoll = poll_outputs (&fdarray, &fdalloc, nconn);
+
+      nready = poll (fdarray, npoll, timeout);
       if (nready == 0)		/* ??  noop */
 	continue;
 
@@ -725,6 +1160,13 @@ main (int argc, char *argv[])
 	  continue;
 	}
 
+      /* Sigusr2 was dropped.  */
+      if (want_stats)
+	{
+	  want_stats = 0;
+	  dump_stats ();
+	}
+
       if (nready < 0)
 	{
 	  if (errno != EINTR)
@@ -734,13 +1176,30 @@ main (int argc, char *argv[])
 
       /*dbg_printf ("got a message (%d)\n", nready); */
 
+      for (i = nconn; i < npoll; i++)
+	if (fdarray[i].revents)
+	  drain_queue (pollowner[i - nconn]);
+
+      for (i = nfds; i < nconn; i++)
+	if (fdarray[i].revents)
+	  tcp_read (tcpconns[i - nfds]);
+
       for (i = 0; i < nfds; i++)
 	if (fdarray[i].revents & (POLLIN | POLLPRI))
 	  {
 	    int result;
-	    socklen_t len;
 	    if (fdarray[i].fd == -1)
 	      continue;
+	    else if (fdarray[i].fd == resolver_in)
+	      {
+		if (!dns_replies ())
+		  fdarray[i].fd = -1;
+	      }
+	    else if (fdarray[i].fd == fklog && kmsg_mode)
+	      {
+		if (!kmsg_read ())
+		  fdarray[i].fd = -1;
+	      }
 	    else if (fdarray[i].fd == fklog)
 	      {
 		result = read (fdarray[i].fd, &kline[kline_len],
@@ -819,37 +1278,22 @@ main (int argc, char *argv[])
 		      }
 		  }
 	      }
-	    else if (fdarray[i].fd == finet[IU_FD_IP4]
-		     || fdarray[i].fd == finet[IU_FD_IP6])
-	      {
-		struct sockaddr_storage frominet;
-		/*dbg_printf ("inet message\n"); */
-		len = sizeof (frominet);
-		memset (line, '\0', sizeof (line));
-		result = recvfrom (fdarray[i].fd, line, MAXLINE, 0,
-				   (struct sockaddr *) &frominet, &len);
-		if (result > 0)
-		  {
-		    line[result] = '\0';
-		    printline (cvthname ((struct sockaddr *) &frominet, len), line);
-		  }
-		else if (result < 0 && errno != EINTR)
-		  logerror ("recvfrom inet");
-	      }
+	    else if (fdarray[i].fd == finet[IU_FD_IP4])
+	      recv_batch (fdarray[i].fd, &finet_st[IU_FD_IP4], 1);
+	    else if (fdarray[i].fd == finet[IU_FD_IP6])
+	      recv_batch (fdarray[i].fd, &finet_st[IU_FD_IP6], 1);
+	    else if (fdarray[i].fd == ftcp[IU_FD_IP4]
+		     || fdarray[i].fd == ftcp[IU_FD_IP6])
+	      tcp_accept (fdarray[i].fd);
 	    else
 	      {
-		struct sockaddr_un fromunix;
-		/*dbg_printf ("unix message\n"); */
-		len = sizeof (fromunix);
-		result = recvfrom (fdarray[i].fd, line, MAXLINE, 0,
-				   (struct sockaddr *) &fromunix, &len);
-		if (result > 0)
-		  {
-		    line[result] = '\0';
-		    printline (LocalHostName, line);
-		  }
-		else if (result < 0 && errno != EINTR)
-		  logerror ("recvfrom unix");
+		size_t j;
+
+		for (j = 0; j < nfunix; j++)
+		  if (funix[j].fd == fdarray[i].fd)
+		    break;
+		if (j < nfunix)
+		  recv_batch (fdarray[i].fd, &funix[j].st, 0);
 	      }
 	  }
 	else if (fdarray[i].revents & POLLNVAL)
@@ -877,9 +1321,25 @@ add_funix (const char *name)
 
   funix[nfunix].name = name;
   funix[nfunix].fd = -1;
+  memset (&funix[nfunix].st, 0, sizeof (funix[nfunix].st));
   nfunix++;
 }
 
+/* Ask the kernel to report its count of datagrams dropped at FD,
+   which recv_batch() picks up as ancillary data.  */
+static void
+set_drop_counter (int fd)
+{
+#ifdef SO_RXQ_OVFL
+  int yes = 1;
+
+  if (setsockopt (fd, SOL_SOCKET, SO_RXQ_OVFL, &yes, sizeof (yes)) < 0)
+    dbg_printf ("Failed to set SO_RXQ_OVFL: %s\n", strerror (errno));
+#else
+  (void) fd;
+#endif
+}
+
 static int
 create_unix_socket (const char *path)
 {
@@ -912,11 +1372,23 @@ create_unix_socket (const char *path)
       close (fd);
       fd = -1;
     }
+  else
+    {
+      set_drop_counter (fd);
+#ifdef RECV_CREDS
+      {
+	int yes = 1;
+
+	/* Identify senders for rate limits.  */
+	setsockopt (fd, SOL_SOCKET, SO_PASSCRED, &yes, sizeof (yes));
+      }
+#endif
+    }
   return fd;
 }
 
 static void
-create_inet_socket (int af, int fd46[2])
+create_inet_socket (int af, int socktype, int fd46[2])
 {
   int err, fd = -1;
   struct addrinfo hints, *rp, *ai;
@@ -932,10 +1404,16 @@ create_inet_socket (int af, int fd46[2])
 
   memset (&hints, 0, sizeof (hints));
   hints.ai_family = af;
-  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_socktype = socktype;
   hints.ai_flags = AI_PASSIVE;
 
   err = getaddrinfo (BindAddress, LogPortText, &hints, &rp);
+  if (err == EAI_SERVICE && socktype == SOCK_STREAM)
+    {
+      /* Services commonly list syslog for UDP only.  */
+      hints.ai_socktype = SOCK_DGRAM;
+      err = getaddrinfo (BindAddress, LogPortText, &hints, &rp);
+    }
   if (err)
     {
       logerror ("lookup error, suspending inet service");
@@ -946,7 +1424,7 @@ create_inet_socket (int af, int fd46[2])
     {
       int yes = 1;
 
-      fd = socket (ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+      fd = socket (ai->ai_family, socktype, 0);
       if (fd < 0)
 	continue;
 
@@ -966,6 +1444,20 @@ create_inet_socket (int af, int fd46[2])
 	  fd = -1;
 	  continue;
 	}
+
+      if (socktype == SOCK_STREAM)
+	{
+	  if (listen (fd, SOMAXCONN) < 0)
+	    {
+	      close (fd);
+	      fd = -1;
+	      continue;
+	    }
+	  fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+	}
+      else
+	set_drop_counter (fd);
+
       /* Register any success.  */
       if (ai->ai_family == AF_INET && fd46[IU_FD_IP4] < 0)
 	fd46[IU_FD_IP4] = fd;
@@ -982,208 +1474,349 @@ create_inet_socket (int af, int fd46[2])
   return;
 }
 
-char **
-crunch_list (char **oldlist, char *list)
+/* Buffers for a batch of received datagrams.  */
+struct recvslot
 {
-  int count, i;
-  char *p, *q;
+  char line[MAXLINE + 1];
+  size_t len;
+  struct sockaddr_storage from;
+  struct iovec iov;
+#ifdef RECV_CTL
+  char ctl[CMSG_SPACE (sizeof (uint32_t)) + CREDSPACE];
+#endif
+};
 
-  p = list;
+static struct recvslot *rslots;
 
-  /* Strip off trailing delimiters.  */
-  while (p[strlen (p) - 1] == LIST_DELIMITER)
+#ifdef HAVE_RECVMMSG
+static struct mmsghdr *rmsgs;
+# define RECV_HDR(i)	(rmsgs[i].msg_hdr)
+#else
+static struct msghdr *rmsgs;
+# define RECV_HDR(i)	(rmsgs[i])
+#endif
+
+static void
+reset_recvslot (int i)
+{
+  struct msghdr *mh = &RECV_HDR (i);
+
+  mh->msg_name = &rslots[i].from;
+  mh->msg_namelen = sizeof (rslots[i].from);
+  mh->msg_iov = &rslots[i].iov;
+  mh->msg_iovlen = 1;
+#ifdef RECV_CTL
+  mh->msg_control = rslots[i].ctl;
+  mh->msg_controllen = sizeof (rslots[i].ctl);
+#endif
+  mh->msg_flags = 0;
+}
+
+/* Read up to RecvBatch datagrams already queued at FD, and pass
+   them on to printline() with signals blocked only once for the
+   whole batch.  INET is true for Internet sockets, whose senders
+   are to be looked up.  */
+static void
+recv_batch (int fd, struct sockstat *st, int inet)
+{
+  int i, n;
+#ifdef HAVE_SIGACTION
+  sigset_t sigs, osigs;
+#else
+  int omask;
+#endif
+
+  if (rslots == NULL)
     {
-      p[strlen (p) - 1] = '\0';
+      rslots = xcalloc (RecvBatch, sizeof (*rslots));
+      rmsgs = xcalloc (RecvBatch, sizeof (*rmsgs));
+      for (i = 0; i < RecvBatch; i++)
+	{
+	  rslots[i].iov.iov_base = rslots[i].line;
+	  rslots[i].iov.iov_len = MAXLINE;
+	  reset_recvslot (i);
+	}
     }
-  /* Cut off leading delimiters.  */
-  while (p[0] == LIST_DELIMITER)
+
+#ifdef HAVE_RECVMMSG
+  n = recvmmsg (fd, rmsgs, RecvBatch, MSG_DONTWAIT, NULL);
+  if (n < 0)
     {
-      p++;
+      if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+	logerror (inet ? "recvmmsg inet" : "recvmmsg unix");
+      return;
     }
+  for (i = 0; i < n; i++)
+    rslots[i].len = rmsgs[i].msg_len;
+#else /* !HAVE_RECVMMSG */
+  for (n = 0; n < RecvBatch; n++)
+    {
+      ssize_t result = recvmsg (fd, &rmsgs[n], MSG_DONTWAIT);
 
-  /* Bailout early the string is empty.  */
-  if (*p == '\0')
-    return oldlist;
-
-  /* Count delimiters to calculate elements.  */
-  for (count = 1, i = 0; p[i]; i++)
-    if (p[i] == LIST_DELIMITER)
-      count++;
+      if (result < 0)
+	{
+	  if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+	    logerror (inet ? "recvmsg inet" : "recvmsg unix");
+	  break;
+	}
+      rslots[n].len = result;
+    }
+#endif /* !HAVE_RECVMMSG */
 
-  /* Count how many we add in the old list.  */
-  for (i = 0; oldlist && oldlist[i]; i++)
-    ;
+  if (n <= 0)
+    return;
 
-  /* allocate enough space */
-  oldlist = (char **) realloc (oldlist, (i + count + 1) * sizeof (*oldlist));
-  if (oldlist == NULL)
-    error (EXIT_FAILURE, errno, "can't allocate memory");
+  st->recv += n;
 
-  /*
-     We now can assume that the first and last
-     characters are different from any delimiters,
-     so we don't have to care about it anymore.  */
+#ifdef HAVE_SIGACTION
+  sigemptyset (&sigs);
+  sigaddset (&sigs, SIGHUP);
+  sigaddset (&sigs, SIGALRM);
+  sigprocmask (SIG_BLOCK, &sigs, &osigs);
+#else
+  omask = sigblock (sigmask (SIGHUP) | sigmask (SIGALRM));
+#endif
+  sigs_held = 1;
 
-  /* Start from where we left last time.  */
-  for (count = i; (q = strchr (p, LIST_DELIMITER)) != NULL;
-       count++, p = q, p++)
+  for (i = 0; i < n; i++)
     {
-      oldlist[count] = (char *) malloc ((q - p + 1) * sizeof (char));
-      if (oldlist[count] == NULL)
-        error (EXIT_FAILURE, errno, "can't allocate memory");
+      struct msghdr *mh = &RECV_HDR (i);
+      const char *hname;
+      char sender[48];
+#ifdef RECV_CTL
+      struct cmsghdr *cm;
+#endif
 
-      strncpy (oldlist[count], p, q - p);
-      oldlist[count][q - p] = '\0';
-    }
+      sender[0] = '\0';
+#ifdef RECV_CTL
+      for (cm = CMSG_FIRSTHDR (mh); cm; cm = CMSG_NXTHDR (mh, cm))
+	{
+# ifdef SO_RXQ_OVFL
+	  /* The kernel reports a running total.  */
+	  if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SO_RXQ_OVFL)
+	    {
+	      uint32_t drops;
 
-  /* take the last one */
-  oldlist[count] = (char *) xmalloc ((strlen (p) + 1) * sizeof (char));
-  if (oldlist[count] == NULL)
-    error (EXIT_FAILURE, errno, "can't allocate memory");
+	      memcpy (&drops, CMSG_DATA (cm), sizeof (drops));
+	      st->drop = drops;
+	    }
+# endif
+# ifdef RECV_CREDS
+	  if (cm->cmsg_level == SOL_SOCKET
+	      && cm->cmsg_type == SCM_CREDENTIALS)
+	    {
+	      struct ucred cred;
 
-  strcpy (oldlist[count], p);
+	      memcpy (&cred, CMSG_DATA (cm), sizeof (cred));
+	      snprintf (sender, sizeof (sender), "pid %d", (int) cred.pid);
+	    }
+# endif
+	}
+#endif
 
-  oldlist[++count] = NULL;	/* terminate the array with a NULL */
+      if (rslots[i].len > 0)
+	{
+	  rslots[i].line[rslots[i].len] = '\0';
+	  if (inet)
+	    {
+	      hname = cvthname ((struct sockaddr *) &rslots[i].from,
+				mh->msg_namelen);
+	      snprintf (sender, sizeof (sender), "host %s", hname);
+	    }
+	  else
+	    hname = LocalHostName;
 
-  if (Debug)
-    {
-      for (count = 0; oldlist[count]; count++)
-	printf ("#%d: %s\n", count, oldlist[count]);
+	  if (!*sender || rate_ok (&rl_sender, sender))
+	    printline (hname, rslots[i].line);
+	}
+      reset_recvslot (i);
     }
-  return oldlist;
+
+  sigs_held = 0;
+#ifdef HAVE_SIGACTION
+  sigprocmask (SIG_SETMASK, &osigs, 0);
+#else
+  sigsetmask (omask);
+#endif
 }
 
-/* Take a raw input line, decode the message, and print the message on
-   the appropriate log files.  */
-void
-printline (const char *hname, const char *msg)
+/* Accept a connection at the listening TCP socket FD.  */
+static void
+tcp_accept (int fd)
 {
-  int c, pri;
-  const char *p;
-  char *q, line[MAXLINE + 1];
+  struct sockaddr_storage addr;
+  socklen_t addrlen = sizeof (addr);
+  struct tcpconn *c;
+  int s;
 
-  /* test for special codes */
-  pri = DEFUPRI;
-  p = msg;
-  if (*p == '<')
+  s = accept (fd, (struct sockaddr *) &addr, &addrlen);
+  if (s < 0)
     {
-      pri = 0;
-      while (isdigit (*++p))
-	pri = 10 * pri + (*p - '0');
-      if (*p == '>')
-	++p;
+      if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK
+	  && errno != ECONNABORTED)
+	logerror ("accept");
+      return;
     }
 
-  /* This overrides large positive and overflowing negative values.  */
-  if (pri & ~(LOG_FACMASK | LOG_PRIMASK))
-    pri = DEFUPRI;
+  if (ntcpconns >= MAXTCPCONN)
+    {
+      dbg_printf ("Refusing TCP connection, %d are open.\n", ntcpconns);
+      close (s);
+      return;
+    }
+  fcntl (s, F_SETFL, fcntl (s, F_GETFL) | O_NONBLOCK);
 
-  /* Avoid undefined facilities.  */
-  if (LOG_FAC (pri) > LOG_NFACILITIES)
-    pri = DEFUPRI;
+  c = xzalloc (sizeof (*c));
+  c->fd = s;
+  memcpy (&c->addr, &addr, addrlen);
+  c->addrlen = addrlen;
 
-  /* Do not allow users to log kernel messages.  */
-  if (LOG_FAC (pri) == (LOG_KERN >> 3))
-    pri = LOG_MAKEPRI (LOG_USER, LOG_PRI (pri));
+  tcpconns = xrealloc (tcpconns, (ntcpconns + 1) * sizeof (*tcpconns));
+  tcpconns[ntcpconns++] = c;
+}
 
-  q = line;
-  while ((c = *p++) != '\0' && q < &line[sizeof (line) - 1])
-    if (iscntrl (c))
-      if (c == '\n')
-	*q++ = ' ';
-      else if (c == '\t')
-	*q++ = '\t';
-      else if (c >= 0177)
-	*q++ = c;
-      else
-	{
-	  *q++ = '^';
-	  *q++ = c ^ 0100;
-	}
-    else
-      *q++ = c;
-  *q = '\0';
+/* Log the LEN bytes at MSG, received over TCP from HNAME.  */
+static void
+tcp_deliver (const char *hname, char *msg, size_t len)
+{
+  char save;
 
-  /* This for the default behaviour on GNU/Linux syslogd who
-     sync on every line.  */
-  if (force_sync)
-    logmsg (pri, line, hname, SYNC_FILE);
-  else
-    logmsg (pri, line, hname, 0);
+  while (len > 0 && (msg[len - 1] == '\n' || msg[len - 1] == '\r'))
+    len--;
+  if (len == 0)
+    return;
+
+  ftcp_st.recv++;
+  if (rl_sender.interval)
+    {
+      char sender[48];
+
+      snprintf (sender, sizeof (sender), "host %s", hname);
+      if (!rate_ok (&rl_sender, sender))
+	return;
+    }
+
+  /* The buffer has room for a terminator past any frame.  */
+  save = msg[len];
+  msg[len] = '\0';
+  printline (hname, msg);
+  msg[len] = save;
 }
 
-/* Take a raw input line from /dev/klog, split and format similar to
-   syslog().  */
-void
-printsys (const char *msg)
+/* Split the data received on C into messages, as framed by RFC 6587:
+   either preceded by their length in octets, or ended by a newline.
+   At EOF, a trailing unterminated message is taken as complete.  */
+static void
+tcp_frames (struct tcpconn *c, int eof)
 {
-  int c, pri, flags;
-  char *lp, *q, line[MAXLINE + 1];
-  const char *p;
+  const char *hname;
+  char *p = c->buf, *end = c->buf + c->len;
 
-  strcpy (line, "vmunix: ");
-  lp = line + strlen (line);
-  for (p = msg; *p != '\0';)
+  hname = cvthname ((struct sockaddr *) &c->addr, c->addrlen);
+
+  while (p < end)
     {
-      flags = SYNC_FILE | ADDDATE;	/* Fsync after write.  */
-      pri = DEFSPRI;
-      if (*p == '<')
+      char *q, *nl;
+      size_t mlen, n;
+
+      if (c->skip)
 	{
-	  pri = 0;
-	  while (isdigit (*++p))
-	    pri = 10 * pri + (*p - '0');
-	  if (*p == '>')
-	    ++p;
+	  n = (size_t) (end - p) < c->skip ? (size_t) (end - p) : c->skip;
+	  p += n;
+	  c->skip -= n;
+	  continue;
 	}
-      else
+
+      if (c->skipline)
 	{
-	  /* kernel printf's come out on console */
-	  flags |= IGN_CONS;
+	  nl = memchr (p, '\n', end - p);
+	  if (nl == NULL)
+	    {
+	      p = end;
+	      break;
+	    }
+	  p = nl + 1;
+	  c->skipline = 0;
+	  continue;
 	}
-      if (pri & ~(LOG_FACMASK | LOG_PRIMASK))
-	pri = DEFSPRI;
-      q = lp;
-      while (*p != '\0' && (c = *p++) != '\n' && q < &line[MAXLINE])
-	*q++ = c;
-      *q = '\0';
-      logmsg (pri, line, LocalHostName, flags);
-    }
-}
 
-/* Decode a priority into textual information like auth.emerg.  */
-char *
-textpri (int pri)
-{
-  static char res[20];
-  CODE *c_pri, *c_fac;
+      /* Octet counting: "LEN SP MSG".  */
+      if (isdigit ((unsigned char) *p))
+	{
+	  for (q = p, mlen = 0; q < end && q - p < 9
+		 && isdigit ((unsigned char) *q); q++)
+	    mlen = 10 * mlen + (*q - '0');
 
-  for (c_fac = facilitynames; c_fac->c_name
-       && !(c_fac->c_val == LOG_FAC (pri) << 3); c_fac++);
-  for (c_pri = prioritynames; c_pri->c_name
-       && !(c_pri->c_val == LOG_PRI (pri)); c_pri++);
+	  if (q == end)
+	    break;		/* Incomplete length.  */
 
-  snprintf (res, sizeof (res), "%s.%s", c_fac->c_name, c_pri->c_name);
+	  if (*q == ' ' && mlen > 0)
+	    {
+	      q++;
+	      n = mlen < MAXLINE ? mlen : MAXLINE;
+	      if ((size_t) (end - q) < n)
+		{
+		  if (eof)
+		    ftcp_st.drop++;
+		  break;
+		}
+	      tcp_deliver (hname, q, n);
+	      p = q + n;
+	      c->skip = mlen - n;
+	      continue;
+	    }
+	  /* Otherwise a newline terminated message.  */
+	}
 
-  return res;
+      nl = memchr (p, '\n', end - p);
+      if (nl)
+	{
+	  tcp_deliver (hname, p, nl - p);
+	  p = nl + 1;
+	}
+      else if (end - p >= MAXLINE)
+	{
+	  /* Truncate, as for datagrams.  */
+	  tcp_deliver (hname, p, MAXLINE);
+	  p += MAXLINE;
+	  c->skipline = 1;
+	}
+      else
+	{
+	  if (eof)
+	    {
+	      tcp_deliver (hname, p, end - p);
+	      p = end;
+	    }
+	  break;
+	}
+    }
+
+  c->len = end - p;
+  memmove (c->buf, p, c->len);
 }
 
-/* Log a message to the appropriate log files, users, etc. based on
-   the priority.  */
-void
-logmsg (int pri, const char *msg, const char *from, int flags)
+/* Read from the TCP connection C and log its complete messages.  */
+static void
+tcp_read (struct tcpconn *c)
 {
-  struct filed *f;
-  int fac, msglen, prilev;
+  ssize_t n;
+  int eof;
 #ifdef HAVE_SIGACTION
   sigset_t sigs, osigs;
 #else
   int omask;
 #endif
 
-  const char *timestamp;
+  if (c->fd < 0)
+    return;
 
-  dbg_printf ("(logmsg): %s (%d), flags %x, from %s, msg %s\n",
-	      textpri (pri), pri, flags, from, msg);
+  n = read (c->fd, c->buf + c->len, TCPBUFSIZE - c->len);
+  if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+    return;
+  eof = n <= 0;
+  if (n > 0)
+    c->len += n;
 
 #ifdef HAVE_SIGACTION
   sigemptyset (&sigs);
@@ -1193,418 +1826,2532 @@ logmsg (int pri, const char *msg, const char *from, int flags)
 #else
   omask = sigblock (sigmask (SIGHUP) | sigmask (SIGALRM));
 #endif
+  sigs_held = 1;
 
-  /* Check to see if msg looks non-standard.  */
-  msglen = strlen (msg);
-  if (msglen < 16 || msg[3] != ' ' || msg[6] != ' ' ||
-      msg[9] != ':' || msg[12] != ':' || msg[15] != ' ')
-    flags |= ADDDATE;
+  tcp_frames (c, eof);
 
-  time (&now);
-  if (flags & ADDDATE)
-    timestamp = ctime (&now) + 4;
-  else
+  sigs_held = 0;
+#ifdef HAVE_SIGACTION
+  sigprocmask (SIG_SETMASK, &osigs, 0);
+#else
+  sigsetmask (omask);
+#endif
+
+  if (eof)
     {
-      if (set_local_time)
-	timestamp = ctime (&now) + 4;
-      else
-	timestamp = msg;
-      msg += 16;
-      msglen -= 16;
+      close (c->fd);
+      c->fd = -1;		/* Released by poll_conns().  */
     }
+}
 
-  /* Extract facility and priority level.  */
-  if (flags & MARK)
-#ifdef INTERNAL_MARK
-    fac = LOG_FAC (INTERNAL_MARK);
-#else
-    fac = LOG_NFACILITIES;
-#endif
-  else
-    fac = LOG_FAC (pri);
-  prilev = LOG_PRI (pri);
+/* Release closed TCP connections, and append an entry for each open
+   one to *FDARRAY, after its NFDS entries.  The entry at NFDS + I is
+   for tcpconns[I].  Return the new number of entries.  */
+static unsigned long
+poll_conns (struct pollfd **fdarray, size_t *alloc, unsigned long nfds)
+{
+  unsigned long n = nfds;
+  int i, j;
 
-  /* Log the message to the particular outputs. */
-  if (!Initialized)
+  for (i = j = 0; i < ntcpconns; i++)
     {
-      f = &consfile;
-      f->f_file = open (ctty, O_WRONLY, 0);
-      f->f_prevhost = strdup (LocalHostName);
-      if (f->f_file >= 0)
+      if (tcpconns[i]->fd < 0)
 	{
-	  fprintlog (f, from, flags, msg);
-	  close (f->f_file);
+	  free (tcpconns[i]);
+	  continue;
 	}
-#ifdef HAVE_SIGACTION
-      sigprocmask (SIG_SETMASK, &osigs, 0);
-#else
-      sigsetmask (omask);
-#endif
-      return;
+      tcpconns[j++] = tcpconns[i];
     }
-  for (f = Files; f; f = f->f_next)
+  ntcpconns = j;
+
+  for (i = 0; i < ntcpconns; i++)
     {
-      /* Skip messages that are incorrect priority. */
-      if (!(f->f_pmask[fac] & LOG_MASK (prilev)))
-	continue;
+      if (n >= *alloc)
+	{
+	  *alloc *= 2;
+	  *fdarray = xrealloc (*fdarray, *alloc * sizeof (**fdarray));
+	}
+      (*fdarray)[n].fd = tcpconns[i]->fd;
+      (*fdarray)[n].events = POLLIN;
+      (*fdarray)[n].revents = 0;
+      n++;
+    }
 
-      if (f->f_type == F_CONSOLE && (flags & IGN_CONS))
-	continue;
+  return n;
+}
 
-      /* Don't output marks to recently written files.  */
-      if ((flags & MARK) && (now - f->f_time) < MarkInterval / 2)
-	continue;
+static void
+log_sockstat (const char *name, struct sockstat *st)
+{
+  char buf[MAXLINE + 1];
 
-      if (f->f_progname)
-	{
-	  /* The usual, and desirable, formattings are:
-	   *
-	   *   prg: message text
-	   *   prg[PIDNO]: message text
-	   */
+  snprintf (buf, sizeof (buf), "syslogd: %s: received %lu, dropped %lu",
+	    name, st->recv, st->drop);
+  logmsg (LOG_SYSLOG | LOG_INFO, buf, LocalHostName, ADDDATE);
+}
 
-	  /* Skip on selector mismatch.  */
-	  if (strncmp (msg, f->f_progname, f->f_prognlen))
-	    continue;
+/* Name the destination F in statistics.  */
+static const char *
+output_name (struct filed *f)
+{
+  switch (f->f_type)
+    {
+    case F_FORW:
+    case F_FORW_SUSP:
+    case F_FORW_UNKN:
+      return f->f_un.f_forw.f_hname;
 
-	  /* Avoid matching on prefixes.  */
-	  if (isalnum (msg[f->f_prognlen])
-	      || msg[f->f_prognlen] == '-'
-	      || msg[f->f_prognlen] == '_')
-	    continue;
-	}
+    case F_USERS:
+    case F_WALL:
+    case F_UNUSED:
+      return TypeNames[f->f_type];
 
-      /* Suppress duplicate lines to this file.  */
-      if ((flags & MARK) == 0 && msglen == f->f_prevlen && f->f_prevhost
-	  && !strcmp (msg, f->f_prevline) && !strcmp (from, f->f_prevhost))
-	{
-	  strncpy (f->f_lasttime, timestamp, sizeof (f->f_lasttime) - 1);
-	  f->f_prevcount++;
-	  dbg_printf ("msg repeated %d times, %ld sec of %d\n",
-		      f->f_prevcount, now - f->f_time,
-		      repeatinterval[f->f_repeatcount]);
-	  /* If domark would have logged this by now, flush it now (so we
-	     don't hold isolated messages), but back off so we'll flush
-	     less often in the future.  */
-	  if (now > REPEATTIME (f))
-	    {
-	      fprintlog (f, from, flags, (char *) NULL);
-	      BACKOFF (f);
-	    }
-	}
-      else
-	{
-	  /* New line, save it.  */
-	  if (f->f_prevcount)
-	    fprintlog (f, from, 0, (char *) NULL);
-	  f->f_repeatcount = 0;
-	  strncpy (f->f_lasttime, timestamp, sizeof (f->f_lasttime) - 1);
-	  free (f->f_prevhost);
-	  f->f_prevhost = strdup (from);
-	  if (msglen < MAXSVLINE)
-	    {
-	      f->f_prevlen = msglen;
-	      f->f_prevpri = pri;
-	      strcpy (f->f_prevline, msg);
-	      fprintlog (f, from, flags, (char *) NULL);
-	    }
-	  else
-	    {
-	      f->f_prevline[0] = 0;
-	      f->f_prevlen = 0;
-	      fprintlog (f, from, flags, msg);
-	    }
-	}
+    default:
+      return f->f_un.f_fname;
     }
-#ifdef HAVE_SIGACTION
-  sigprocmask (SIG_SETMASK, &osigs, 0);
-#else
-  sigsetmask (omask);
-#endif
 }
 
-void
-fprintlog (struct filed *f, const char *from, int flags, const char *msg)
+/* Log the counters of all receiving sockets and output queues.  */
+static void
+dump_stats (void)
 {
-  struct iovec iov[IOVCNT];
-  struct iovec *v;
-  int l;
-  char line[MAXLINE + 1], repbuf[80], greetings[200];
-  time_t fwd_suspend;
+  struct filed *f;
+  char buf[MAXLINE + 1];
+  size_t i;
 
-  v = iov;
-  /* Be paranoid.  */
-  memset (v, 0, sizeof (struct iovec) * IOVCNT);
-  if (f->f_type == F_WALL)
-    {
-      v->iov_base = greetings;
-      snprintf (greetings, sizeof (greetings),
-		"\r\n\7Message from syslogd@%s at %.24s ...\r\n",
-		f->f_prevhost, ctime (&now));
-      v->iov_len = strlen (greetings);
-      v++;
-      v->iov_base = (char *) "";
-      v->iov_len = 0;
-      v++;
-    }
-  else
+  for (f = Files; f; f = f->f_next)
+    if (f->f_qmax)
+      {
+	snprintf (buf, sizeof (buf), "syslogd: %s: queued %d, dropped %lu",
+		  output_name (f), f->f_qlen, f->f_qdrop);
+	logmsg (LOG_SYSLOG | LOG_INFO, buf, LocalHostName, ADDDATE);
+      }
+
+  for (i = 0; i < nfunix; i++)
+    if (funix[i].fd >= 0)
+      log_sockstat (funix[i].name, &funix[i].st);
+  if (finet[IU_FD_IP4] >= 0)
+    log_sockstat ("udp4", &finet_st[IU_FD_IP4]);
+  if (finet[IU_FD_IP6] >= 0)
+    log_sockstat ("udp6", &finet_st[IU_FD_IP6]);
+  if (ftcp[IU_FD_IP4] >= 0 || ftcp[IU_FD_IP6] >= 0)
+    log_sockstat ("tcp", &ftcp_st);
+
+  if (fklog >= 0 && kmsg_mode)
     {
-      v->iov_base = f->f_lasttime;
-      v->iov_len = sizeof (f->f_lasttime) - 1;
-      v++;
-      v->iov_base = (char *) " ";
-      v->iov_len = 1;
-      v++;
+      snprintf (buf, sizeof (buf),
+		"syslogd: kernel log: %lu records, %lu lost",
+		kmsg_records, kmsg_lost);
+      logmsg (LOG_SYSLOG | LOG_INFO, buf, LocalHostName, ADDDATE);
     }
-  if (f->f_prevhost)
+
+  if (DnsCacheSize > 0)
     {
-      v->iov_base = f->f_prevhost;
-      v->iov_len = strlen (v->iov_base);
-      v++;
+      snprintf (buf, sizeof (buf),
+		"syslogd: dns cache: %d entries, %lu hits, %lu misses, "
+		"%lu lookups, average %lu ms, max %lu ms", dnscount,
+		dnsstats.hits, dnsstats.misses, dnsstats.lookups,
+		dnsstats.lookups ? dnsstats.total_ms / dnsstats.lookups : 0,
+		dnsstats.max_ms);
+      logmsg (LOG_SYSLOG | LOG_INFO, buf, LocalHostName, ADDDATE);
     }
-  v->iov_base = (char *) " ";
-  v->iov_len = 1;
-  v++;
 
-  if (msg)
+#ifdef SYSLOGD_PROFILE
+  for (i = 0; i < PROF_STAGES; i++)
     {
-      v->iov_base = (char *) msg;
-      v->iov_len = strlen (msg);
+      snprintf (buf, sizeof (buf),
+		"syslogd: cpu %s: %lu calls, %llu us, %llu ns per call",
+		prof_names[i], prof[i].calls, prof[i].nsec / 1000,
+		prof[i].calls ? prof[i].nsec / prof[i].calls : 0);
+      logmsg (LOG_SYSLOG | LOG_INFO, buf, LocalHostName, ADDDATE);
     }
-  else if (f->f_prevcount > 1)
-    {
-      v->iov_base = repbuf;
-      snprintf (repbuf, sizeof (repbuf), "last message repeated %d times",
+#endif
+}
+
+static void
+report_drop (const char *name, struct sockstat *st)
+{
+  char buf[MAXLINE + 1];
+
+  if (st->drop <= st->drop_seen)
+    return;
+
+  snprintf (buf, sizeof (buf),
+	    "syslogd: %s: %lu datagrams dropped by kernel", name,
+	    st->drop - st->drop_seen);
+  st->drop_seen = st->drop;
+  logmsg (LOG_SYSLOG | LOG_WARNING, buf, LocalHostName, ADDDATE);
+}
+
+/* Take a token from the bucket of KEY under the limit RL.  Return
+   zero if the message is to be suppressed.  */
+static int
+rate_ok (const struct ratelimit *rl, const char *key)
+{
+  struct bucket *b;
+  unsigned int h;
+  long long t, fill, gain;
+  long full;
+
+  if (rl->interval == 0)
+    return 1;
+
+  t = clock_ms ();
+  full = rl->burst * 1000L;
+  h = strhash (key, strlen (key)) % BUCKETHASH;
+  for (b = buckets[h]; b; b = b->next)
+    if (b->rl == rl && strcmp (b->key, key) == 0)
+      break;
+
+  if (b == NULL)
+    {
+      /* Beyond the table, let messages pass.  */
+      if (nbuckets >= MAXBUCKETS)
+	return 1;
+      b = xzalloc (sizeof (*b));
+      b->rl = rl;
+      b->tokens = full;
+      b->stamp = t;
+      strncpy (b->key, key, sizeof (b->key) - 1);
+      b->next = buckets[h];
+      buckets[h] = b;
+      nbuckets++;
+    }
+
+  /* Refill at BURST tokens per INTERVAL.  Keep what falls short of
+     a thousandth, lest frequent calls never earn anything.  */
+  gain = (t - b->stamp) * rl->burst + b->rest;
+  fill = b->tokens + gain / rl->interval;
+  b->rest = gain % rl->interval;
+  if (fill >= full)
+    {
+      fill = full;
+      b->rest = 0;
+    }
+  b->tokens = fill;
+  b->stamp = t;
+
+  if (b->tokens >= 1000)
+    {
+      b->tokens -= 1000;
+      return 1;
+    }
+  b->suppressed++;
+  return 0;
+}
+
+/* Log the number of messages suppressed by every bucket, and free
+   the buckets that have filled up again, or all of them if ALL.  */
+static void
+report_ratelimits (int all)
+{
+  struct bucket *b, **pb;
+  char buf[MAXLINE + 1];
+  long long t = clock_ms ();
+  int i;
+
+  for (i = 0; i < BUCKETHASH; i++)
+    for (pb = &buckets[i]; (b = *pb) != NULL;)
+      {
+	if (b->suppressed)
+	  {
+	    snprintf (buf, sizeof (buf),
+		      "syslogd: rate limit: %lu messages of %s suppressed",
+		      b->suppressed, b->key);
+	    b->suppressed = 0;
+	    logmsg (LOG_SYSLOG | LOG_WARNING, buf, LocalHostName, ADDDATE);
+	  }
+
+	if (all || b->rl->interval == 0
+	    || b->tokens + ((t - b->stamp) * b->rl->burst + b->rest)
+			   / b->rl->interval >= b->rl->burst * 1000L)
+	  {
+	    *pb = b->next;
+	    free (b);
+	    nbuckets--;
+	  }
+	else
+	  pb = &b->next;
+      }
+}
+
+/* Announce any new kernel or queue drops since the last call.  */
+static void
+report_drops (void)
+{
+  struct filed *f;
+  char buf[MAXLINE + 1];
+  size_t i;
+
+  for (f = Files; f; f = f->f_next)
+    if (f->f_qdrop > f->f_qdrop_seen)
+      {
+	snprintf (buf, sizeof (buf),
+		  "syslogd: %s: %lu messages dropped from full queue",
+		  output_name (f), f->f_qdrop - f->f_qdrop_seen);
+	f->f_qdrop_seen = f->f_qdrop;
+	logmsg (LOG_SYSLOG | LOG_WARNING, buf, LocalHostName, ADDDATE);
+      }
+
+  for (i = 0; i < nfunix; i++)
+    if (funix[i].fd >= 0)
+      report_drop (funix[i].name, &funix[i].st);
+  if (finet[IU_FD_IP4] >= 0)
+    report_drop ("udp4", &finet_st[IU_FD_IP4]);
+  if (finet[IU_FD_IP6] >= 0)
+    report_drop ("udp6", &finet_st[IU_FD_IP6]);
+}
+
+char **
+crunch_list (char **oldlist, char *list)
+{
+  int count, i;
+  char *p, *q;
+
+  p = list;
+
+  /* Strip off trailing delimiters.  */
+  while (p[strlen (p) - 1] == LIST_DELIMITER)
+    {
+      p[strlen (p) - 1] = '\0';
+    }
+  /* Cut off leading delimiters.  */
+  while (p[0] == LIST_DELIMITER)
+    {
+      p++;
+    }
+
+  /* Bailout early the string is empty.  */
+  if (*p == '\0')
+    return oldlist;
+
+  /* Count delimiters to calculate elements.  */
+  for (count = 1, i = 0; p[i]; i++)
+    if (p[i] == LIST_DELIMITER)
+      count++;
+
+  /* Count how many we add in the old list.  */
+  for (i = 0; oldlist && oldlist[i]; i++)
+    ;
+
+  /* allocate enough space */
+  oldlist = (char **) realloc (oldlist, (i + count + 1) * sizeof (*oldlist));
+  if (oldlist == NULL)
+    error (EXIT_FAILURE, errno, "can't allocate memory");
+
+  /*
+     We now can assume that the first and last
+     characters are different from any delimiters,
+     so we don't have to care about it anymore.  */
+
+  /* Start from where we left last time.  */
+  for (count = i; (q = strchr (p, LIST_DELIMITER)) != NULL;
+       count++, p = q, p++)
+    {
+      oldlist[count] = (char *) malloc ((q - p + 1) * sizeof (char));
+      if (oldlist[count] == NULL)
+        error (EXIT_FAILURE, errno, "can't allocate memory");
+
+      strncpy (oldlist[count], p, q - p);
+      oldlist[count][q - p] = '\0';
+    }
+
+  /* take the last one */
+  oldlist[count] = (char *) xmalloc ((strlen (p) + 1) * sizeof (char));
+  if (oldlist[count] == NULL)
+    error (EXIT_FAILURE, errno, "can't allocate memory");
+
+  strcpy (oldlist[count], p);
+
+  oldlist[++count] = NULL;	/* terminate the array with a NULL */
+
+  if (Debug)
+    {
+      for (count = 0; oldlist[count]; count++)
+	printf ("#%d: %s\n", count, oldlist[count]);
+    }
+  return oldlist;
+}
+
+/* Fields of an RFC 5424 header, pointing into the received line.  */
+struct rfc5424
+{
+  struct timeval tv;		/* The time stamp, if HAS_TIME.  */
+  int has_time;
+  const char *app;		/* APP-NAME, or NULL.  */
+  int applen;
+  const char *procid;		/* PROCID, or NULL.  */
+  int procidlen;
+  const char *sd;		/* STRUCTURED-DATA, or NULL.  */
+  int sdlen;
+  const char *msg;		/* MSG, up to the terminating null.  */
+};
+
+/* Return the value of the N decimal digits at S, or -1.  */
+static int
+digits (const char *s, int n)
+{
+  int v = 0;
+
+  while (n-- > 0)
+    {
+      if (!isdigit ((unsigned char) *s))
+	return -1;
+      v = 10 * v + (*s++ - '0');
+    }
+  return v;
+}
+
+/* Convert the RFC 3339 time stamp of LEN bytes at S into TV.  */
+static int
+parse_rfc3339 (const char *s, int len, struct timeval *tv)
+{
+  const char *end = s + len;
+  int y, mo, d, h, mi, sec, off = 0, n;
+  long usec = 0, era, yoe, doy, doe;
+  long long days;
+
+  if (len < 20 || s[4] != '-' || s[7] != '-' || (s[10] != 'T' && s[10] != 't')
+      || s[13] != ':' || s[16] != ':')
+    return 0;
+
+  y = digits (s, 4);
+  mo = digits (s + 5, 2);
+  d = digits (s + 8, 2);
+  h = digits (s + 11, 2);
+  mi = digits (s + 14, 2);
+  sec = digits (s + 17, 2);
+  if (y < 0 || mo < 1 || mo > 12 || d < 1 || d > 31
+      || h < 0 || h > 23 || mi < 0 || mi > 59 || sec < 0 || sec > 60)
+    return 0;
+  s += 19;
+
+  if (*s == '.')
+    {
+      for (s++, n = 0; s < end && isdigit ((unsigned char) *s); s++, n++)
+	if (n < 6)
+	  usec = 10 * usec + (*s - '0');
+      if (n == 0)
+	return 0;
+      for (; n < 6; n++)
+	usec *= 10;
+    }
+
+  if (s < end && (*s == 'Z' || *s == 'z'))
+    s++;
+  else if (end - s == 6 && (*s == '+' || *s == '-') && s[3] == ':')
+    {
+      int oh = digits (s + 1, 2), om = digits (s + 4, 2);
+
+      if (oh < 0 || om < 0)
+	return 0;
+      off = (*s == '-') ? -(oh * 60 + om) : oh * 60 + om;
+      s += 6;
+    }
+  if (s != end)
+    return 0;
+
+  /* Days since the epoch in the proleptic Gregorian calendar.  */
+  y -= mo <= 2;
+  era = (y >= 0 ? y : y - 399) / 400;
+  yoe = y - era * 400;
+  doy = (153 * (mo > 2 ? mo - 3 : mo + 9) + 2) / 5 + d - 1;
+  doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  days = era * 146097LL + doe - 719468;
+
+  tv->tv_sec = days * 86400 + h * 3600 + mi * 60 + sec - off * 60;
+  tv->tv_usec = usec;
+  return 1;
+}
+
+/* Split the RFC 5424 message P, following its priority, into R
+   without copying.  Return zero if P is not of that format.  */
+static int
+parse_rfc5424 (const char *p, struct rfc5424 *r)
+{
+  const char *field[5];		/* TIMESTAMP to MSGID.  */
+  int len[5], i;
+
+  if (p[0] != '1' || p[1] != ' ')
+    return 0;
+  p += 2;
+
+  for (i = 0; i < 5; i++)
+    {
+      field[i] = p;
+      while (*p && *p != ' ')
+	p++;
+      len[i] = p - field[i];
+      if (*p != ' ' || len[i] == 0)
+	return 0;
+      p++;
+    }
+
+  r->has_time = !(len[0] == 1 && *field[0] == '-');
+  if (r->has_time && !parse_rfc3339 (field[0], len[0], &r->tv))
+    return 0;
+
+  /* Limits of RFC 5424, section 6.  */
+  if (len[2] > 48 || len[3] > 128)
+    return 0;
+  r->app = (*field[2] == '-' && len[2] == 1) ? NULL : field[2];
+  r->applen = len[2];
+  r->procid = (*field[3] == '-' && len[3] == 1) ? NULL : field[3];
+  r->procidlen = len[3];
+
+  if (*p == '-')
+    {
+      r->sd = NULL;
+      r->sdlen = 0;
+      p++;
+    }
+  else if (*p == '[')
+    {
+      r->sd = p;
+      while (*p == '[')
+	{
+	  int quoted = 0;
+
+	  for (p++; *p && (quoted || *p != ']'); p++)
+	    if (quoted && *p == '\\' && p[1])
+	      p++;
+	    else if (*p == '"')
+	      quoted = !quoted;
+	  if (*p != ']')
+	    return 0;
+	  p++;
+	}
+      r->sdlen = p - r->sd;
+    }
+  else
+    return 0;
+
+  if (*p == ' ')
+    p++;
+  else if (*p)
+    return 0;
+
+  /* Drop the byte order mark of UTF-8.  */
+  if ((unsigned char) p[0] == 0xef && (unsigned char) p[1] == 0xbb
+      && (unsigned char) p[2] == 0xbf)
+    p += 3;
+  r->msg = p;
+  return 1;
+}
+
+/* Copy the text from P to PEND, or to a null byte if PEND is NULL,
+   to Q with control characters made visible, but not beyond END.
+   Return the new end of Q.  */
+static char *
+escape_text (char *q, char *end, const char *p, const char *pend)
+{
+  int c;
+
+  while ((pend ? p < pend : *p != '\0') && q < end)
+    {
+      c = *p++;
+      if (iscntrl (c))
+	if (c == '\n')
+	  *q++ = ' ';
+	else if (c == '\t')
+	  *q++ = '\t';
+	else if (c >= 0177)
+	  *q++ = c;
+	else if (q + 1 < end)
+	  {
+	    *q++ = '^';
+	    *q++ = c ^ 0100;
+	  }
+	else
+	  break;
+      else
+	*q++ = c;
+    }
+  return q;
+}
+
+/* Take a raw input line, decode the message, and print the message on
+   the appropriate log files.  */
+void
+printline (const char *hname, const char *msg)
+{
+  int pri, flags, is5424;
+  const char *p;
+  char *q, *end, line[MAXLINE + 1];
+  struct rfc5424 r;
+  PROF_BEGIN;
+
+  /* test for special codes */
+  pri = DEFUPRI;
+  p = msg;
+  if (*p == '<')
+    {
+      pri = 0;
+      while (isdigit (*++p))
+	pri = 10 * pri + (*p - '0');
+      if (*p == '>')
+	++p;
+    }
+
+  /* This overrides large positive and overflowing negative values.  */
+  if (pri & ~(LOG_FACMASK | LOG_PRIMASK))
+    pri = DEFUPRI;
+
+  /* Avoid undefined facilities.  */
+  if (LOG_FAC (pri) > LOG_NFACILITIES)
+    pri = DEFUPRI;
+
+  /* Do not allow users to log kernel messages.  */
+  if (LOG_FAC (pri) == (LOG_KERN >> 3))
+    pri = LOG_MAKEPRI (LOG_USER, LOG_PRI (pri));
+
+  /* This for the default behaviour on GNU/Linux syslogd who
+     sync on every line.  */
+  flags = force_sync ? SYNC_FILE : 0;
+
+  q = line;
+  end = &line[sizeof (line) - 1];
+  is5424 = msg[0] == '<' && parse_rfc5424 (p, &r);
+
+  /* Limit each program, known by its tag.  */
+  if (rl_program.interval)
+    {
+      const char *tag = p;
+      char key[48];
+      int n;
+
+      if (is5424)
+	tag = r.app ? r.app : "";
+      else if (strlen (tag) >= 16 && tag[3] == ' ' && tag[6] == ' '
+	       && tag[9] == ':' && tag[12] == ':' && tag[15] == ' ')
+	tag += 16;
+
+      n = strcspn (tag, "[: \t");
+      if (n > 0)
+	{
+	  snprintf (key, sizeof (key), "program %.*s", n, tag);
+	  if (!rate_ok (&rl_program, key))
+	    {
+	      PROF_END (PROF_PRINTLINE);
+	      return;
+	    }
+	}
+    }
+
+  if (is5424)
+    {
+      /* Log as "APP[PROCID]: [SD] MSG", in the traditional way.  */
+      if (r.app && r.procid)
+	q += sprintf (q, "%.*s[%.*s]: ", r.applen, r.app,
+		      r.procidlen, r.procid);
+      else if (r.app)
+	q += sprintf (q, "%.*s: ", r.applen, r.app);
+      if (r.sd)
+	{
+	  q = escape_text (q, end, r.sd, r.sd + r.sdlen);
+	  if (*r.msg && q < end)
+	    *q++ = ' ';
+	}
+      q = escape_text (q, end, r.msg, NULL);
+      *q = '\0';
+
+      if (r.has_time)
+	logmsg_at (pri, line, hname, flags, &r.tv);
+      else
+	logmsg (pri, line, hname, flags | ADDDATE);
+      PROF_END (PROF_PRINTLINE);
+      return;
+    }
+
+  q = escape_text (q, end, p, NULL);
+  *q = '\0';
+
+  logmsg (pri, line, hname, flags);
+  PROF_END (PROF_PRINTLINE);
+}
+
+/* Take a raw input line from /dev/klog, split and format similar to
+   syslog().  */
+void
+printsys (const char *msg)
+{
+  int c, pri, flags;
+  char *lp, *q, line[MAXLINE + 1];
+  const char *p;
+
+  strcpy (line, "vmunix: ");
+  lp = line + strlen (line);
+  for (p = msg; *p != '\0';)
+    {
+      flags = SYNC_FILE | ADDDATE;	/* Fsync after write.  */
+      pri = DEFSPRI;
+      if (*p == '<')
+	{
+	  pri = 0;
+	  while (isdigit (*++p))
+	    pri = 10 * pri + (*p - '0');
+	  if (*p == '>')
+	    ++p;
+	}
+      else
+	{
+	  /* kernel printf's come out on console */
+	  flags |= IGN_CONS;
+	}
+      if (pri & ~(LOG_FACMASK | LOG_PRIMASK))
+	pri = DEFSPRI;
+      q = lp;
+      while (*p != '\0' && (c = *p++) != '\n' && q < &line[MAXLINE])
+	*q++ = c;
+      *q = '\0';
+      logmsg (pri, line, LocalHostName, flags);
+    }
+}
+
+#ifdef PATH_KMSG
+/* Read the records waiting at PATH_KMSG.  Each has the form
+
+     PRI,SEQ,USEC,FLAGS[,...];TEXT\n[ KEY=VALUE\n...]
+
+   with USEC the time since boot.  Records overwritten before they
+   were read are noticed by a gap in SEQ, and reported.  The header
+   is at least as long as "vmunix: ", so that prefix is written over
+   its end, and the text logged straight from the read buffer.
+   Return zero if the device failed, and was closed.  */
+static int
+kmsg_read (void)
+{
+  static char buf[KMSGSIZE + 1];
+  struct timespec mono;
+  struct timeval tv;
+  long long boot;
+  int n;
+#ifdef HAVE_SIGACTION
+  sigset_t sigs, osigs;
+#else
+  int omask;
+#endif
+
+  /* Kernel time stamps count from boot, on the monotonic clock.  */
+  gettimeofday (&tv, NULL);
+  clock_gettime (CLOCK_MONOTONIC, &mono);
+  boot = (long long) tv.tv_sec * 1000000 + tv.tv_usec
+    - ((long long) mono.tv_sec * 1000000 + mono.tv_nsec / 1000);
+
+#ifdef HAVE_SIGACTION
+  sigemptyset (&sigs);
+  sigaddset (&sigs, SIGHUP);
+  sigaddset (&sigs, SIGALRM);
+  sigprocmask (SIG_BLOCK, &sigs, &osigs);
+#else
+  omask = sigblock (sigmask (SIGHUP) | sigmask (SIGALRM));
+#endif
+  sigs_held = 1;
+
+  for (n = 0; n < KMSGBATCH; n++)
+    {
+      ssize_t len = read (fklog, buf, KMSGSIZE);
+      unsigned long long seq, usec;
+      unsigned long pri;
+      char *p, *text;
+
+      if (len < 0)
+	{
+	  /* EPIPE tells of overwritten records, the next read
+	     continues with the oldest one left.  */
+	  if (errno == EINTR || errno == EPIPE)
+	    continue;
+	  if (errno != EAGAIN && errno != EWOULDBLOCK)
+	    {
+	      logerror ("klog");
+	      close (fklog);
+	      fklog = -1;
+	    }
+	  break;
+	}
+      if (len == 0)
+	break;
+      buf[len] = '\0';
+
+      pri = strtoul (buf, &p, 10);
+      if (*p != ',')
+	continue;
+      seq = strtoull (p + 1, &p, 10);
+      if (*p != ',')
+	continue;
+      usec = strtoull (p + 1, &p, 10);
+      if (*p != ',')
+	continue;
+
+      /* Then come FLAGS, and perhaps further fields.  Lines are
+	 joined by the kernel, so even continuation records, with
+	 flag `c' or `+', are logged as they are.  */
+      text = strchr (p, ';');
+      if (text == NULL || text + 1 - buf < 8)
+	continue;
+      *text++ = '\0';
+      p = strchr (text, '\n');
+      if (p)
+	*p = '\0';
+
+      if (kmsg_started && seq > kmsg_next)
+	{
+	  char msg[100];
+
+	  kmsg_lost += seq - kmsg_next;
+	  snprintf (msg, sizeof (msg),
+		    "syslogd: %llu kernel messages lost", seq - kmsg_next);
+	  logmsg (LOG_SYSLOG | LOG_WARNING, msg, LocalHostName, ADDDATE);
+	}
+      kmsg_next = seq + 1;
+      kmsg_started = 1;
+      kmsg_records++;
+
+      if (pri & ~(LOG_FACMASK | LOG_PRIMASK))
+	pri = DEFSPRI;
+
+      /* Messages of other facilities were written by user space
+	 processes, and carry their own tag.  */
+      if (LOG_FAC (pri) == LOG_FAC (LOG_KERN))
+	{
+	  text -= 8;
+	  memcpy (text, "vmunix: ", 8);
+	}
+
+      tv.tv_sec = (boot + (long long) usec) / 1000000;
+      tv.tv_usec = (boot + (long long) usec) % 1000000;
+      logmsg_at (pri, text, LocalHostName, SYNC_FILE, &tv);
+    }
+
+  sigs_held = 0;
+#ifdef HAVE_SIGACTION
+  sigprocmask (SIG_SETMASK, &osigs, 0);
+#else
+  sigsetmask (omask);
+#endif
+
+  return fklog >= 0;
+}
+#else /* !PATH_KMSG */
+static int
+kmsg_read (void)
+{
+  return 1;
+}
+#endif
+
+/* Decode a priority into textual information like auth.emerg.  */
+char *
+textpri (int pri)
+{
+  static char res[20];
+  CODE *c_pri, *c_fac;
+
+  for (c_fac = facilitynames; c_fac->c_name
+       && !(c_fac->c_val == LOG_FAC (pri) << 3); c_fac++);
+  for (c_pri = prioritynames; c_pri->c_name
+       && !(c_pri->c_val == LOG_PRI (pri)); c_pri++);
+
+  snprintf (res, sizeof (res), "%s.%s", c_fac->c_name, c_pri->c_name);
+
+  return res;
+}
+
+/* Return true if the entry F selects a message of facility FAC and
+   level PRILEV, with text MSG.  */
+static int
+selects (struct filed *f, int fac, int prilev, const char *msg)
+{
+  /* Skip messages that are incorrect priority. */
+  if (!(f->f_pmask[fac] & LOG_MASK (prilev)))
+    return 0;
+
+  if (f->f_progname)
+    {
+      /* The usual, and desirable, formattings are:
+       *
+       *   prg: message text
+       *   prg[PIDNO]: message text
+       */
+
+      /* Skip on selector mismatch.  */
+      if (strncmp (msg, f->f_progname, f->f_prognlen))
+	return 0;
+
+      /* Avoid matching on prefixes.  */
+      if (PROGCHAR (msg[f->f_prognlen]))
+	return 0;
+    }
+
+  return 1;
+}
+
+/* Hash LEN characters of STR, in the manner of FNV-1a.  */
+static unsigned int
+strhash (const char *str, size_t len)
+{
+  unsigned int h = 2166136261U;
+
+  while (len--)
+    h = (h ^ (unsigned char) *str++) * 16777619U;
+  return h;
+}
+
+/* Free the tables built by compile_selectors().  */
+static void
+free_selectors (void)
+{
+  struct progsel *ps, *next;
+  int i;
+
+  free (dispatch_pool);
+  dispatch_pool = NULL;
+  memset (dispatch, 0, sizeof (dispatch));
+
+  for (i = 0; i < PROGHASHSIZE; i++)
+    {
+      for (ps = proghash[i]; ps; ps = next)
+	{
+	  next = ps->next;
+	  free (ps->vec);
+	  free (ps);
+	}
+      proghash[i] = NULL;
+    }
+
+  free (proglens);
+  proglens = NULL;
+  nproglens = 0;
+}
+
+/* Find the program selector of LEN characters matching MSG.  */
+static struct progsel *
+find_progsel (const char *msg, int len, unsigned int h)
+{
+  struct progsel *ps;
+
+  for (ps = proghash[h % PROGHASHSIZE]; ps; ps = ps->next)
+    if (ps->hash == h && ps->len == len
+	&& memcmp (ps->name, msg, len) == 0)
+      return ps;
+  return NULL;
+}
+
+/* Compile the list Files into a table, which for every facility and
+   level lists the entries without program selector, and into a hash
+   of entries by program selector.  Either list is kept in the order
+   of Files, and thus of the configuration.  */
+static void
+compile_selectors (void)
+{
+  struct filed *f, **slot;
+  size_t total;
+  int fac, pri, seq = 0;
+
+  free_selectors ();
+
+  for (f = Files; f; f = f->f_next)
+    f->f_seq = seq++;
+
+  /* One terminating NULL for every vector.  */
+  total = (LOG_NFACILITIES + 1) * (LOG_PRIMASK + 1);
+  for (f = Files; f; f = f->f_next)
+    if (!f->f_progname)
+      for (fac = 0; fac <= LOG_NFACILITIES; fac++)
+	for (pri = 0; pri <= LOG_PRIMASK; pri++)
+	  if (f->f_pmask[fac] & LOG_MASK (pri))
+	    total++;
+
+  dispatch_pool = xcalloc (total, sizeof (*dispatch_pool));
+  slot = dispatch_pool;
+  for (fac = 0; fac <= LOG_NFACILITIES; fac++)
+    for (pri = 0; pri <= LOG_PRIMASK; pri++)
+      {
+	dispatch[fac][pri] = slot;
+	for (f = Files; f; f = f->f_next)
+	  if (!f->f_progname && (f->f_pmask[fac] & LOG_MASK (pri)))
+	    *slot++ = f;
+	slot++;
+      }
+
+  for (f = Files; f; f = f->f_next)
+    {
+      struct progsel *ps;
+      unsigned int h;
+      int i;
+
+      if (!f->f_progname)
+	continue;
+
+      h = strhash (f->f_progname, f->f_prognlen);
+      ps = find_progsel (f->f_progname, f->f_prognlen, h);
+      if (ps == NULL)
+	{
+	  ps = xzalloc (sizeof (*ps));
+	  ps->name = f->f_progname;
+	  ps->len = f->f_prognlen;
+	  ps->hash = h;
+	  ps->next = proghash[h % PROGHASHSIZE];
+	  proghash[h % PROGHASHSIZE] = ps;
+
+	  for (i = 0; i < nproglens; i++)
+	    if (proglens[i] == ps->len)
+	      break;
+	  if (i == nproglens)
+	    {
+	      proglens = xrealloc (proglens,
+				   (nproglens + 1) * sizeof (*proglens));
+	      proglens[nproglens++] = ps->len;
+	    }
+	}
+
+      ps->vec = xrealloc (ps->vec, (ps->nvec + 2) * sizeof (*ps->vec));
+      ps->vec[ps->nvec++] = f;
+      ps->vec[ps->nvec] = NULL;
+    }
+}
+
+/* Collect in CURSORS the vectors of entries that might select a
+   message of facility FAC and level PRILEV, with text MSG of length
+   MSGLEN, and store their number in *NCURSORS.  Return zero if
+   there is no table, or more than MAXPROGMATCH program vectors.  */
+static int
+match_outputs (int fac, int prilev, const char *msg, int msglen,
+	       struct filed ***cursors, int *ncursors)
+{
+  int i, n = 0;
+
+  /* Not compiled while init() loads the configuration.  */
+  if (dispatch_pool == NULL)
+    return 0;
+
+  cursors[n++] = dispatch[fac][prilev];
+
+  for (i = 0; i < nproglens; i++)
+    {
+      struct progsel *ps;
+      int len = proglens[i];
+
+      if (len > msglen || PROGCHAR (msg[len]))
+	continue;
+
+      ps = find_progsel (msg, len, strhash (msg, len));
+      if (ps == NULL)
+	continue;
+
+      if (n > MAXPROGMATCH)
+	return 0;
+      cursors[n++] = ps->vec;
+    }
+
+  *ncursors = n;
+  return 1;
+}
+
+/* Advance the cursors and return the next entry in configuration
+   order, which selects facility FAC and level PRILEV.  */
+static struct filed *
+next_output (struct filed ***cursors, int ncursors, int fac, int prilev)
+{
+  struct filed *best = NULL;
+  int i, which = 0;
+
+  for (i = 0; i < ncursors; i++)
+    {
+      /* Program vectors contain all levels.  */
+      while (*cursors[i]
+	     && !((*cursors[i])->f_pmask[fac] & LOG_MASK (prilev)))
+	cursors[i]++;
+
+      if (*cursors[i] && (best == NULL || (*cursors[i])->f_seq < best->f_seq))
+	{
+	  best = *cursors[i];
+	  which = i;
+	}
+    }
+
+  if (best)
+    cursors[which]++;
+  return best;
+}
+
+/* Time stamps of a second, formatted once and kept for reuse.  */
+struct stampcache
+{
+  time_t t;
+  int valid;
+  char bsd[16];			/* "Mmm dd hh:mm:ss".  */
+  char date[20];		/* "YYYY-MM-DDThh:mm:ss".  */
+  char zone[7];			/* "+hh:mm".  */
+};
+
+/* Return the formatted time stamps of T.  Messages arrive in the
+   current second, or carry their own time, so two entries serve.  */
+static struct stampcache *
+stamp_cache (time_t t)
+{
+  static const char months[12][4] = {
+    "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+    "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+  };
+  static struct stampcache cache[2];
+  static int last;
+  struct stampcache *c;
+  struct tm tm, gm;
+  int off;
+
+  if (cache[last].valid && cache[last].t == t)
+    return &cache[last];
+  last = !last;
+  c = &cache[last];
+  if (c->valid && c->t == t)
+    return c;
+
+  gm = *gmtime (&t);
+  tm = *localtime (&t);
+
+  snprintf (c->bsd, sizeof (c->bsd), "%s %2d %02d:%02d:%02d",
+	    months[tm.tm_mon], tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+  /* Beyond the year 9999, or before year 0, the nearest time
+     that RFC 3339 can express stands in.  */
+  if (strftime (c->date, sizeof (c->date), "%Y-%m-%dT%H:%M:%S", &tm) == 0)
+    strcpy (c->date, tm.tm_year < 0 ? "0000-01-01T00:00:00"
+	    : "9999-12-31T23:59:59");
+
+  /* Offset from UTC in minutes, portably.  */
+  off = (tm.tm_hour - gm.tm_hour) * 60 + tm.tm_min - gm.tm_min;
+  if (tm.tm_year != gm.tm_year)
+    off += (tm.tm_year > gm.tm_year) ? 1440 : -1440;
+  else if (tm.tm_yday != gm.tm_yday)
+    off += (tm.tm_yday > gm.tm_yday) ? 1440 : -1440;
+  /* Offsets stay within a day, so the hours take two digits.  */
+  c->zone[0] = off < 0 ? '-' : '+';
+  off = abs (off);
+  c->zone[1] = '0' + off / 600;
+  c->zone[2] = '0' + off / 60 % 10;
+  c->zone[3] = ':';
+  c->zone[4] = '0' + off % 60 / 10;
+  c->zone[5] = '0' + off % 10;
+  c->zone[6] = '\0';
+
+  c->t = t;
+  c->valid = 1;
+  return c;
+}
+
+/* Record the time of the latest message for F, either from the
+   traditional TIMESTAMP, or from TV in the format of RFC 3339.  */
+static void
+set_lasttime (struct filed *f, const char *timestamp,
+	      const struct timeval *tv)
+{
+  if (f->f_flags & PRECISE_TIME)
+    {
+      struct stampcache *c = stamp_cache (tv->tv_sec);
+
+      snprintf (f->f_lasttime, sizeof (f->f_lasttime), "%s.%06ld%s",
+		c->date, (long) tv->tv_usec, c->zone);
+    }
+  else
+    {
+      memcpy (f->f_lasttime, timestamp, 15);
+      f->f_lasttime[15] = '\0';
+    }
+}
+
+#ifdef HAVE_MMAP
+/* Map the ring file NAME of F, with SIZE bytes of data.  A ring of
+   the same size left by an earlier run is continued.  */
+static int
+ring_open (struct filed *f, const char *name, size_t size)
+{
+  struct logring_head *h;
+  struct stat st;
+  size_t len = sizeof (*h) + size;
+  int fd;
+
+  fd = open (name, O_RDWR | O_CREAT, 0644);
+  if (fd < 0)
+    return -1;
+  if (fstat (fd, &st) < 0
+      || ((size_t) st.st_size != len && ftruncate (fd, len) < 0))
+    {
+      close (fd);
+      return -1;
+    }
+
+  h = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (h == MAP_FAILED)
+    {
+      close (fd);
+      return -1;
+    }
+
+  if (h->magic != LOGRING_MAGIC || h->version != LOGRING_VERSION
+      || h->size != size || h->head - h->tail > size)
+    {
+      memset (h, 0, sizeof (*h));
+      h->size = size;
+      h->version = LOGRING_VERSION;
+      LOGRING_BARRIER ();
+      h->magic = LOGRING_MAGIC;
+    }
+
+  f->f_file = fd;
+  f->f_ring = h;
+  f->f_maplen = len;
+  return 0;
+}
+
+/* Store a message in the ring of F.  This neither allocates memory
+   nor makes a system call.  */
+static void
+ring_write (struct filed *f, int pri, const char *msg, size_t msglen,
+	    const char *from, const struct timeval *tv)
+{
+  struct logring_head *h = f->f_ring;
+  struct logring_rec *rec;
+  char *data = LOGRING_DATA (h);
+  size_t hostlen = strlen (from);
+  uint64_t head = h->head, pos, len, need;
+
+  if (hostlen > MAXHOSTNAMELEN)
+    hostlen = MAXHOSTNAMELEN;
+  if (msglen > MAXLINE)
+    msglen = MAXLINE;
+  len = LOGRING_ALIGN (sizeof (*rec) + hostlen + msglen);
+
+  /* Records do not wrap, so any rest at the end is skipped.  */
+  pos = head % h->size;
+  need = len;
+  if (h->size - pos < len)
+    need += h->size - pos;
+
+  /* Give up the oldest records, as far as they are in the way.  */
+  while (h->tail + h->size < head + need)
+    {
+      uint32_t n = ((struct logring_rec *) (data + h->tail % h->size))->len;
+
+      if (n == 0 || n > h->size)
+	{
+	  h->tail = head;	/* Damaged, start afresh.  */
+	  break;
+	}
+      h->tail += n;
+    }
+  LOGRING_BARRIER ();
+
+  if (need > len)
+    {
+      rec = (struct logring_rec *) (data + pos);
+      rec->len = h->size - pos;
+      rec->pri = LOGRING_PAD;
+      pos = 0;
+    }
+
+  rec = (struct logring_rec *) (data + pos);
+  rec->len = len;
+  rec->pri = pri;
+  rec->seq = h->seq;
+  rec->sec = tv->tv_sec;
+  rec->usec = tv->tv_usec;
+  rec->hostlen = hostlen;
+  rec->msglen = msglen;
+  memcpy ((char *) (rec + 1), from, hostlen);
+  memcpy ((char *) (rec + 1) + hostlen, msg, msglen);
+  LOGRING_BARRIER ();
+
+  h->seq++;
+  h->head = head + need;
+  f->f_time = now;
+}
+#else /* !HAVE_MMAP */
+static int
+ring_open (struct filed *f _GL_UNUSED_PARAMETER,
+	   const char *name _GL_UNUSED_PARAMETER,
+	   size_t size _GL_UNUSED_PARAMETER)
+{
+  errno = ENOSYS;
+  return -1;
+}
+
+static void
+ring_write (struct filed *f _GL_UNUSED_PARAMETER,
+	    int pri _GL_UNUSED_PARAMETER,
+	    const char *msg _GL_UNUSED_PARAMETER,
+	    size_t msglen _GL_UNUSED_PARAMETER,
+	    const char *from _GL_UNUSED_PARAMETER,
+	    const struct timeval *tv _GL_UNUSED_PARAMETER)
+{
+}
+#endif
+
+/* Log a message to the entry F, which has selected it.  HASH is
+   computed from MSG of length MSGLEN for suppression of duplicates.
+   TIMESTAMP and TV give the time of the message.  */
+static void
+deliver (struct filed *f, int pri, const char *msg, int msglen,
+	 unsigned int hash, const char *from, const char *timestamp,
+	 const struct timeval *tv, int flags)
+{
+  if (f->f_type == F_CONSOLE && (flags & IGN_CONS))
+    return;
+
+  /* Don't output marks to recently written files.  */
+  if ((flags & MARK) && (now - f->f_time) < MarkInterval / 2)
+    return;
+
+  /* A ring keeps every message, as it comes.  */
+  if (f->f_type == F_RING)
+    {
+      ring_write (f, pri, msg, msglen, from, tv);
+      return;
+    }
+
+  /* Suppress duplicate lines to this file.  */
+  if ((flags & MARK) == 0 && msglen == f->f_prevlen && f->f_prevhost
+      && hash == f->f_prevhash
+      && !strcmp (msg, f->f_prevline) && !strcmp (from, f->f_prevhost))
+    {
+      set_lasttime (f, timestamp, tv);
+      f->f_prevcount++;
+      dbg_printf ("msg repeated %d times, %ld sec of %d\n",
+		  f->f_prevcount, now - f->f_time,
+		  repeatinterval[f->f_repeatcount]);
+      /* If domark would have logged this by now, flush it now (so we
+	 don't hold isolated messages), but back off so we'll flush
+	 less often in the future.  */
+      if (now > REPEATTIME (f))
+	{
+	  fprintlog (f, from, flags, (char *) NULL);
+	  BACKOFF (f);
+	}
+    }
+  else
+    {
+      /* New line, save it.  */
+      if (f->f_prevcount)
+	fprintlog (f, from, 0, (char *) NULL);
+      f->f_repeatcount = 0;
+      set_lasttime (f, timestamp, tv);
+      if (f->f_prevhost == NULL || strcmp (from, f->f_prevhost))
+	{
+	  free (f->f_prevhost);
+	  f->f_prevhost = strdup (from);
+	}
+      f->f_prevpri = pri;
+      if (msglen < MAXSVLINE)
+	{
+	  f->f_prevlen = msglen;
+	  f->f_prevhash = hash;
+	  strcpy (f->f_prevline, msg);
+	  fprintlog (f, from, flags, (char *) NULL);
+	}
+      else
+	{
+	  f->f_prevline[0] = 0;
+	  f->f_prevlen = 0;
+	  fprintlog (f, from, flags, msg);
+	}
+    }
+}
+
+/* Log a message to the appropriate log files, users, etc. based on
+   the priority.  */
+void
+logmsg (int pri, const char *msg, const char *from, int flags)
+{
+  logmsg_at (pri, msg, from, flags, NULL);
+}
+
+/* Like logmsg(), for a message MSG whose time STAMP, unless NULL,
+   was taken off the message already.  */
+static void
+logmsg_at (int pri, const char *msg, const char *from, int flags,
+	   const struct timeval *stamp)
+{
+  struct filed *f;
+  struct timeval tv;
+  struct filed **cursors[MAXPROGMATCH + 1];
+  int fac, msglen, prilev, held, ncursors;
+  unsigned int hash;
+#ifdef HAVE_SIGACTION
+  sigset_t sigs, osigs;
+#else
+  int omask;
+#endif
+
+  const char *timestamp;
+  PROF_BEGIN;
+
+  dbg_printf ("(logmsg): %s (%d), flags %x, from %s, msg %s\n",
+	      textpri (pri), pri, flags, from, msg);
+
+  /* A batch from recv_batch() has blocked signals already.  */
+  held = sigs_held;
+  if (!held)
+    {
+#ifdef HAVE_SIGACTION
+      sigemptyset (&sigs);
+      sigaddset (&sigs, SIGHUP);
+      sigaddset (&sigs, SIGALRM);
+      sigprocmask (SIG_BLOCK, &sigs, &osigs);
+#else
+      omask = sigblock (sigmask (SIGHUP) | sigmask (SIGALRM));
+#endif
+    }
+
+  gettimeofday (&tv, NULL);
+  now = tv.tv_sec;
+  msglen = strlen (msg);
+
+  if (stamp)
+    {
+      if (!set_local_time)
+	tv = *stamp;
+      timestamp = stamp_cache (tv.tv_sec)->bsd;
+    }
+  else
+    {
+      /* Check to see if msg looks non-standard.  */
+      if (msglen < 16 || msg[3] != ' ' || msg[6] != ' ' ||
+	  msg[9] != ':' || msg[12] != ':' || msg[15] != ' ')
+	flags |= ADDDATE;
+
+      /* A traditional stamp has no finer time, take that of receipt.  */
+      if (flags & ADDDATE)
+	timestamp = stamp_cache (now)->bsd;
+      else
+	{
+	  if (set_local_time)
+	    timestamp = stamp_cache (now)->bsd;
+	  else
+	    timestamp = msg;
+	  msg += 16;
+	  msglen -= 16;
+	}
+    }
+  hash = (msglen < MAXSVLINE) ? strhash (msg, msglen) : 0;
+
+  /* Extract facility and priority level.  */
+  if (flags & MARK)
+#ifdef INTERNAL_MARK
+    fac = LOG_FAC (INTERNAL_MARK);
+#else
+    fac = LOG_NFACILITIES;
+#endif
+  else
+    fac = LOG_FAC (pri);
+  prilev = LOG_PRI (pri);
+
+  /* Log the message to the particular outputs. */
+  if (!Initialized)
+    {
+      f = &consfile;
+      f->f_file = open (ctty, O_WRONLY, 0);
+      f->f_prevhost = strdup (LocalHostName);
+      if (f->f_file >= 0)
+	{
+	  fprintlog (f, from, flags, msg);
+	  close (f->f_file);
+	}
+      if (!held)
+#ifdef HAVE_SIGACTION
+	sigprocmask (SIG_SETMASK, &osigs, 0);
+#else
+	sigsetmask (omask);
+#endif
+      PROF_END (PROF_LOGMSG);
+      return;
+    }
+  if (match_outputs (fac, prilev, msg, msglen, cursors, &ncursors))
+    while ((f = next_output (cursors, ncursors, fac, prilev)) != NULL)
+      deliver (f, pri, msg, msglen, hash, from, timestamp, &tv, flags);
+  else
+    {
+      /* Too many program selectors matched, walk the whole list.  */
+      for (f = Files; f; f = f->f_next)
+	if (selects (f, fac, prilev, msg))
+	  deliver (f, pri, msg, msglen, hash, from, timestamp, &tv, flags);
+    }
+  if (!held)
+#ifdef HAVE_SIGACTION
+    sigprocmask (SIG_SETMASK, &osigs, 0);
+#else
+    sigsetmask (omask);
+#endif
+  PROF_END (PROF_LOGMSG);
+}
+
+void
+fprintlog (struct filed *f, const char *from, int flags, const char *msg)
+{
+  struct iovec iov[IOVCNT];
+  struct iovec *v;
+  int l;
+  char line[MAXLINE + 1], repbuf[80], greetings[200];
+  time_t fwd_suspend;
+  PROF_BEGIN;
+
+  v = iov;
+  /* Be paranoid.  */
+  memset (v, 0, sizeof (struct iovec) * IOVCNT);
+  if (f->f_type == F_WALL)
+    {
+      v->iov_base = greetings;
+      snprintf (greetings, sizeof (greetings),
+		"\r\n\7Message from syslogd@%s at %.24s ...\r\n",
+		f->f_prevhost, ctime (&now));
+      v->iov_len = strlen (greetings);
+      v++;
+      v->iov_base = (char *) "";
+      v->iov_len = 0;
+      v++;
+    }
+  else
+    {
+      v->iov_base = f->f_lasttime;
+      v->iov_len = strlen (f->f_lasttime);
+      v++;
+      v->iov_base = (char *) " ";
+      v->iov_len = 1;
+      v++;
+    }
+  if (f->f_prevhost)
+    {
+      v->iov_base = f->f_prevhost;
+      v->iov_len = strlen (v->iov_base);
+      v++;
+    }
+  v->iov_base = (char *) " ";
+  v->iov_len = 1;
+  v++;
+
+  if (msg)
+    {
+      v->iov_base = (char *) msg;
+      v->iov_len = strlen (msg);
+    }
+  else if (f->f_prevcount > 1)
+    {
+      v->iov_base = repbuf;
+      snprintf (repbuf, sizeof (repbuf), "last message repeated %d times",
 		f->f_prevcount);
       v->iov_len = strlen (repbuf);
     }
   else
     {
-      v->iov_base = f->f_prevline;
-      v->iov_len = f->f_prevlen;
+      v->iov_base = f->f_prevline;
+      v->iov_len = f->f_prevlen;
+    }
+  v++;
+
+  dbg_printf ("Logging to %s", TypeNames[f->f_type]);
+
+  switch (f->f_type)
+    {
+    case F_UNUSED:
+      f->f_time = now;
+      dbg_printf ("\n");
+      break;
+
+    case F_FORW_SUSP:
+      fwd_suspend = time ((time_t *) 0) - f->f_time;
+      if (fwd_suspend >= INET_SUSPEND_TIME)
+	{
+	  dbg_printf ("\nForwarding suspension over, retrying FORW ");
+	  f->f_type = F_FORW;
+	  goto f_forw;
+	}
+      else
+	{
+	  dbg_printf (" %s\n", f->f_un.f_forw.f_hname);
+	  dbg_printf ("Forwarding suspension not over, time left: %d.\n",
+		      INET_SUSPEND_TIME - fwd_suspend);
+	}
+      break;
+
+    case F_FORW_UNKN:
+      dbg_printf (" %s\n", f->f_un.f_forw.f_hname);
+      fwd_suspend = time ((time_t *) 0) - f->f_time;
+      if (fwd_suspend >= INET_SUSPEND_TIME)
+	{
+	  struct addrinfo hints, *rp;
+	  int err;
+
+	  memset (&hints, 0, sizeof (hints));
+	  hints.ai_family = usefamily;
+#ifdef AI_ADDRCONFIG
+	  if (usefamily == AF_UNSPEC)
+	    hints.ai_flags |= AI_ADDRCONFIG;
+#endif
+	  err = getaddrinfo (f->f_un.f_forw.f_hname, LogForwardPort,
+			     &hints, &rp);
+	  if (err)
+	    {
+	      dbg_printf ("Failure: %s\n", gai_strerror (err));
+	      dbg_printf ("Retries: %d\n", f->f_prevcount);
+	      if (--f->f_prevcount < 0)
+		{
+		  f->f_type = F_UNUSED;
+		  free (f->f_un.f_forw.f_hname);
+		  f->f_un.f_forw.f_hname = NULL;
+		}
+	    }
+	  else
+	    {
+	      dbg_printf ("%s found, resuming.\n", f->f_un.f_forw.f_hname);
+	      f->f_un.f_forw.f_addrlen = rp->ai_addrlen;
+	      memcpy (&f->f_un.f_forw.f_addr, rp->ai_addr, rp->ai_addrlen);
+	      freeaddrinfo (rp);
+	      f->f_prevcount = 0;
+	      f->f_type = F_FORW;
+	      goto f_forw;
+	    }
+	}
+      else
+	dbg_printf ("Forwarding suspension not over, time left: %d\n",
+		    INET_SUSPEND_TIME - fwd_suspend);
+      break;
+
+    case F_FORW:
+    f_forw:
+      dbg_printf (" %s\n", f->f_un.f_forw.f_hname);
+      if (strcasecmp (from, LocalHostName) && NoHops)
+	dbg_printf ("Not forwarding remote message.\n");
+      else if (NoForward)
+	dbg_printf ("Not forwarding because forwarding is disabled.\n");
+      else
+	{
+	  int fd;
+
+	  f->f_time = now;
+	  snprintf (line, sizeof (line), "<%d>%.15s %s",
+		    f->f_prevpri, (char *) iov[0].iov_base,
+		    (char *) iov[4].iov_base);
+	  l = strlen (line);
+	  if (l > MAXLINE)
+	    l = MAXLINE;
+
+	  if (f->f_flags & FORW_TCP)
+	    {
+	      char frame[MAXLINE + 16];
+	      int hl;
+
+	      /* Octet counted, and written in batches by drain_queue().  */
+	      hl = snprintf (frame, sizeof (frame), "%d ", l);
+	      memcpy (frame + hl, line, l);
+	      enqueue (f, frame, hl + l);
+	      if (f->f_file < 0)
+		tcp_connect (f);
+	      break;
+	    }
+
+	  fd = output_fd (f);
+	  if (fd < 0)
+	    {
+	      dbg_printf ("Not forwarding for lack of a socket.\n");
+	      break;
+	    }
+
+	  if (f->f_qmax && f->f_qlen)
+	    enqueue (f, line, l);	/* Keep the order.  */
+	  else if (sendto (fd, line, l, f->f_qmax ? MSG_DONTWAIT : 0,
+			   (struct sockaddr *) &f->f_un.f_forw.f_addr,
+			   f->f_un.f_forw.f_addrlen) != l)
+	    {
+	      int e = errno;
+
+	      if (f->f_qmax
+		  && (e == EAGAIN || e == EWOULDBLOCK || e == ENOBUFS))
+		enqueue (f, line, l);
+	      else
+		{
+		  dbg_printf ("INET sendto error: %d = %s.\n", e,
+			      strerror (e));
+		  f->f_type = F_FORW_SUSP;
+		  errno = e;
+		  logerror ("sendto");
+		}
+	    }
+	}
+      break;
+
+    case F_CONSOLE:
+      f->f_time = now;
+      if (flags & IGN_CONS)
+	{
+	  dbg_printf (" (ignored)\n");
+	  break;
+	}
+
+    case F_TTY:
+    case F_FILE:
+    case F_PIPE:
+      f->f_time = now;
+      dbg_printf (" %s\n", f->f_un.f_fname);
+      if (f->f_type == F_TTY || f->f_type == F_CONSOLE)
+	{
+	  v->iov_base = (char *) "\r\n";
+	  v->iov_len = 2;
+	}
+      else
+	{
+	  v->iov_base = (char *) "\n";
+	  v->iov_len = 1;
+	}
+      if (f->f_type == F_FILE && (f->f_rotsize || f->f_rotage))
+	{
+	  size_t len;
+	  int i;
+
+	  if (rotation_due (f))
+	    {
+	      rotate_file (f);
+	      if (f->f_type != F_FILE)
+		break;
+	    }
+	  for (len = 0, i = 0; i < IOVCNT; i++)
+	    len += iov[i].iov_len;
+	  f->f_size += len;
+	}
+      if (f->f_type == F_FILE && f->f_bufsize)
+	{
+	  buffer_line (f, iov, flags);
+	  break;
+	}
+    again:
+      if ((f->f_qmax ? write_queued (f, iov) : writev (f->f_file, iov,
+						       IOVCNT)) < 0)
+	{
+	  int e = errno;
+
+	  /* XXX: If a named pipe is full, ignore it.  */
+	  if (f->f_type == F_PIPE && e == EAGAIN)
+	    break;
+
+	  close (f->f_file);
+	  /* Check for errors on TTY's due to loss of tty. */
+	  if ((e == EIO || e == EBADF)
+	      && (f->f_type == F_TTY || f->f_type == F_CONSOLE))
+	    {
+	      f->f_file = open (f->f_un.f_fname, O_WRONLY | O_APPEND
+				| (f->f_qmax ? O_NONBLOCK : 0), 0);
+	      if (f->f_file < 0)
+		{
+		  f->f_type = F_UNUSED;
+		  discard_queue (f);
+		  logerror (f->f_un.f_fname);
+		  free (f->f_un.f_fname);
+		  f->f_un.f_fname = NULL;
+		}
+	      else
+		goto again;
+	    }
+	  else
+	    {
+	      f->f_type = F_UNUSED;
+	      discard_queue (f);
+	      errno = e;
+	      logerror (f->f_un.f_fname);
+	      free (f->f_un.f_fname);
+	      f->f_un.f_fname = NULL;
+	    }
+	}
+      else if ((flags & SYNC_FILE) && !(f->f_flags & OMIT_SYNC))
+	request_sync (f);
+      break;
+
+    case F_USERS:
+    case F_WALL:
+      f->f_time = now;
+      dbg_printf ("\n");
+      v->iov_base = (char *) "\r\n";
+      v->iov_len = 2;
+      wallmsg (f, iov);
+      break;
+    }
+
+  if (f->f_type != F_FORW_UNKN)
+    f->f_prevcount = 0;
+  PROF_END (PROF_FPRINTLOG);
+}
+
+/* Milliseconds on the clock used for output deadlines.  */
+static long long
+clock_ms (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return (long long) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/* Retire the file F after a failed write.  */
+static void
+file_error (struct filed *f, int e)
+{
+  close (f->f_file);
+  f->f_type = F_UNUSED;
+  f->f_buflen = 0;
+  f->f_flags &= ~SYNC_DUE;
+  errno = e;
+  logerror (f->f_un.f_fname);
+  free (f->f_un.f_fname);
+  f->f_un.f_fname = NULL;
+}
+
+/* Write out the buffered lines of F.  */
+static void
+flush_file (struct filed *f)
+{
+  size_t done = 0;
+
+  while (done < f->f_buflen)
+    {
+      ssize_t n = write (f->f_file, f->f_buf + done, f->f_buflen - done);
+
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  file_error (f, errno);
+	  return;
+	}
+      done += n;
+    }
+  f->f_buflen = 0;
+}
+
+/* Sync the file F, at once or at its group commit deadline.  */
+static void
+request_sync (struct filed *f)
+{
+  if (f->f_syncms == 0)
+    {
+      flush_file (f);
+      if (f->f_type == F_FILE)
+	fsync (f->f_file);
+    }
+  else if (!(f->f_flags & SYNC_DUE))
+    {
+      f->f_flags |= SYNC_DUE;
+      f->f_syncdue = clock_ms () + f->f_syncms;
+    }
+}
+
+/* Append the formatted line IOV to the output buffer of F, which is
+   written when full, when its deadline passes, or at once if the
+   message is urgent enough.  */
+static void
+buffer_line (struct filed *f, struct iovec *iov, int flags)
+{
+  size_t len;
+  int i;
+
+  for (len = 0, i = 0; i < IOVCNT; i++)
+    len += iov[i].iov_len;
+
+  if (f->f_buflen + len > f->f_bufsize)
+    {
+      flush_file (f);
+      if (f->f_type != F_FILE)
+	return;
+    }
+
+  if (f->f_buflen == 0)
+    f->f_flushdue = clock_ms () + f->f_flushms;
+
+  for (i = 0; i < IOVCNT; i++)
+    {
+      memcpy (f->f_buf + f->f_buflen, iov[i].iov_base, iov[i].iov_len);
+      f->f_buflen += iov[i].iov_len;
+    }
+
+  if (LOG_PRI (f->f_prevpri) <= f->f_flushpri)
+    flush_file (f);
+
+  if (f->f_type == F_FILE
+      && (flags & SYNC_FILE) && !(f->f_flags & OMIT_SYNC))
+    request_sync (f);
+}
+
+/* Tell whether the file F has outgrown its size or age limit.  */
+static int
+rotation_due (struct filed *f)
+{
+  return ((f->f_rotsize && f->f_size >= f->f_rotsize)
+	  || (f->f_rotage && f->f_size > 0
+	      && now - f->f_rotstart >= f->f_rotage));
+}
+
+/* Tell whether the compressor *PID is still running.  Once it has
+   finished, collect it and clear *PID.  */
+static int
+compressor_busy (pid_t *pid)
+{
+  if (*pid > 0 && waitpid (*pid, NULL, WNOHANG) == 0)
+    return 1;
+  *pid = 0;
+  return 0;
+}
+
+/* Run gzip on the newest rotated copy of F, in the background.
+   Called from the main loop only, never from a signal handler.  */
+static void
+compress_file (struct filed *f)
+{
+#ifdef HAVE_SIGACTION
+  sigset_t none;
+#endif
+  char *name;
+  size_t len;
+  pid_t pid;
+  int fd;
+
+  f->f_flags &= ~GZIP_DUE;
+  len = strlen (f->f_un.f_fname) + sizeof (".1");
+  name = xmalloc (len);
+  snprintf (name, len, "%s.1", f->f_un.f_fname);
+
+  pid = fork ();
+  if (pid != 0)
+    {
+      if (pid < 0)
+	logerror ("fork");
+      else
+	f->f_gzpid = pid;
+      free (name);
+      return;
+    }
+
+#ifdef HAVE_SIGACTION
+  sigemptyset (&none);
+  sigprocmask (SIG_SETMASK, &none, NULL);
+#else
+  sigsetmask (0);
+#endif
+  signal (SIGTERM, SIG_DFL);
+  signal (SIGINT, SIG_DFL);
+  signal (SIGQUIT, SIG_DFL);
+  signal (SIGHUP, SIG_DFL);
+  signal (SIGALRM, SIG_DFL);
+  for (fd = getdtablesize () - 1; fd > 2; fd--)
+    close (fd);
+  execlp ("gzip", "gzip", "-f", name, (char *) NULL);
+  _exit (127);
+}
+
+/* Rotate the file F: shift NAME.1 ... NAME.(KEEP-1), compressed or
+   not, up by one, dropping the oldest, move NAME itself to NAME.1,
+   and continue in a new, empty NAME.  Other actions are untouched.  */
+static void
+rotate_file (struct filed *f)
+{
+  static const char *const suffix[] = { "", ".gz" };
+  const char *name = f->f_un.f_fname;
+  size_t len = strlen (name) + sizeof (".999.gz");
+  char *from, *to;
+  int i, j, fd;
+
+  /* The previous generation must be compressed before it moves,
+     since gzip removes its input by name.  Until then, keep writing
+     to the current file.  */
+  if ((f->f_flags & GZIP_DUE) || compressor_busy (&f->f_gzpid))
+    return;
+
+  finish_file (f);
+  if (f->f_type != F_FILE)
+    return;
+
+  dbg_printf ("rotating %s\n", name);
+
+  from = xmalloc (len);
+  to = xmalloc (len);
+  for (i = f->f_rotkeep; i > 0; i--)
+    for (j = 0; j < 2; j++)
+      {
+	snprintf (from, len, "%s.%d%s", name, i, suffix[j]);
+	if (i == f->f_rotkeep)
+	  unlink (from);
+	else
+	  {
+	    snprintf (to, len, "%s.%d%s", name, i + 1, suffix[j]);
+	    rename (from, to);
+	  }
+      }
+
+  snprintf (to, len, "%s.1", name);
+  if (f->f_rotkeep ? rename (name, to) : unlink (name))
+    logerror (name);
+  close (f->f_file);
+
+  fd = open (name, O_WRONLY | O_APPEND | O_CREAT, 0644);
+  if (fd < 0)
+    {
+      f->f_file = -1;
+      file_error (f, errno);
+    }
+  else
+    {
+      f->f_file = fd;
+      f->f_size = 0;
+      f->f_rotstart = now;
+      /* Rotation may happen in domark(), so leave the fork
+	 to flush_due() in the main loop.  */
+      if (f->f_rotkeep && (f->f_flags & ROT_COMPRESS))
+	{
+	  f->f_flags |= GZIP_DUE;
+	  deferred_output = 1;
+	}
     }
-  v++;
+  free (from);
+  free (to);
+}
 
-  dbg_printf ("Logging to %s", TypeNames[f->f_type]);
+/* Write out everything pending for F, ahead of closing it.  */
+static void
+finish_file (struct filed *f)
+{
+  if (f->f_type != F_FILE)
+    return;
 
-  switch (f->f_type)
-    {
-    case F_UNUSED:
-      f->f_time = now;
-      dbg_printf ("\n");
-      break;
+  flush_file (f);
+  if (f->f_type == F_FILE && (f->f_flags & SYNC_DUE))
+    fsync (f->f_file);
+  f->f_flags &= ~SYNC_DUE;
+}
 
-    case F_FORW_SUSP:
-      fwd_suspend = time ((time_t *) 0) - f->f_time;
-      if (fwd_suspend >= INET_SUSPEND_TIME)
+/* Write out buffers, perform syncs, and rotate files whose deadlines
+   have passed, and start pending compressors.  Return the number of
+   milliseconds until the next deadline, or -1 if nothing is pending.  */
+static int
+flush_due (void)
+{
+  struct filed *f;
+  long long next = -1, t;
+#ifdef HAVE_SIGACTION
+  sigset_t sigs, osigs;
+#else
+  int omask;
+#endif
+
+  if (!deferred_output)
+    return -1;
+
+  /* Keep domark() and restarts from altering the buffers.  */
+#ifdef HAVE_SIGACTION
+  sigemptyset (&sigs);
+  sigaddset (&sigs, SIGHUP);
+  sigaddset (&sigs, SIGALRM);
+  sigprocmask (SIG_BLOCK, &sigs, &osigs);
+#else
+  omask = sigblock (sigmask (SIGHUP) | sigmask (SIGALRM));
+#endif
+
+  t = clock_ms ();
+  for (f = Files; f; f = f->f_next)
+    {
+      /* Reconnect to TCP peers holding messages.  */
+      if (f->f_type == F_FORW && (f->f_flags & FORW_TCP)
+	  && f->f_file < 0 && f->f_qlen > 0)
 	{
-	  dbg_printf ("\nForwarding suspension over, retrying FORW ");
-	  f->f_type = F_FORW;
-	  goto f_forw;
+	  if (f->f_retry * 1000LL <= t)
+	    tcp_connect (f);
+	  if (f->f_file < 0 && (next < 0 || f->f_retry * 1000LL < next))
+	    next = f->f_retry * 1000LL;
 	}
-      else
+
+      if (f->f_type != F_FILE)
+	continue;
+
+      if (f->f_buflen && f->f_flushdue <= t)
+	flush_file (f);
+      if ((f->f_flags & SYNC_DUE) && f->f_syncdue <= t)
 	{
-	  dbg_printf (" %s\n", f->f_un.f_forw.f_hname);
-	  dbg_printf ("Forwarding suspension not over, time left: %d.\n",
-		      INET_SUSPEND_TIME - fwd_suspend);
+	  flush_file (f);
+	  if (f->f_type == F_FILE)
+	    fsync (f->f_file);
+	  f->f_flags &= ~SYNC_DUE;
 	}
-      break;
 
-    case F_FORW_UNKN:
-      dbg_printf (" %s\n", f->f_un.f_forw.f_hname);
-      fwd_suspend = time ((time_t *) 0) - f->f_time;
-      if (fwd_suspend >= INET_SUSPEND_TIME)
+      /* No line may arrive to rotate an aged file, so do it here.
+	 An empty file merely starts a new period.  */
+      if (f->f_rotage)
 	{
-	  struct addrinfo hints, *rp;
-	  int err;
+	  long long due;
 
-	  memset (&hints, 0, sizeof (hints));
-	  hints.ai_family = usefamily;
-#ifdef AI_ADDRCONFIG
-	  if (usefamily == AF_UNSPEC)
-	    hints.ai_flags |= AI_ADDRCONFIG;
-#endif
-	  err = getaddrinfo (f->f_un.f_forw.f_hname, LogForwardPort,
-			     &hints, &rp);
-	  if (err)
-	    {
-	      dbg_printf ("Failure: %s\n", gai_strerror (err));
-	      dbg_printf ("Retries: %d\n", f->f_prevcount);
-	      if (--f->f_prevcount < 0)
-		{
-		  f->f_type = F_UNUSED;
-		  free (f->f_un.f_forw.f_hname);
-		  f->f_un.f_forw.f_hname = NULL;
-		}
-	    }
-	  else
+	  now = t / 1000;
+	  if (now - f->f_rotstart >= f->f_rotage)
 	    {
-	      dbg_printf ("%s found, resuming.\n", f->f_un.f_forw.f_hname);
-	      f->f_un.f_forw.f_addrlen = rp->ai_addrlen;
-	      memcpy (&f->f_un.f_forw.f_addr, rp->ai_addr, rp->ai_addrlen);
-	      freeaddrinfo (rp);
-	      f->f_prevcount = 0;
-	      f->f_type = F_FORW;
-	      goto f_forw;
+	      if (f->f_size == 0)
+		f->f_rotstart = now;
+	      else
+		rotate_file (f);
+	      if (f->f_type != F_FILE)
+		continue;
 	    }
+
+	  /* Retry in a second while a compressor holds it up.  */
+	  due = (f->f_rotstart + f->f_rotage) * 1000LL;
+	  if (due <= t)
+	    due = t + 1000;
+	  if (next < 0 || due < next)
+	    next = due;
 	}
-      else
-	dbg_printf ("Forwarding suspension not over, time left: %d\n",
-		    INET_SUSPEND_TIME - fwd_suspend);
-      break;
+      if (f->f_flags & GZIP_DUE)
+	compress_file (f);
+
+      if (f->f_buflen && (next < 0 || f->f_flushdue < next))
+	next = f->f_flushdue;
+      if ((f->f_flags & SYNC_DUE) && (next < 0 || f->f_syncdue < next))
+	next = f->f_syncdue;
+    }
+
+#ifdef HAVE_SIGACTION
+  sigprocmask (SIG_SETMASK, &osigs, 0);
+#else
+  sigsetmask (omask);
+#endif
+
+  if (next < 0)
+    return -1;
+  return (next > t) ? (int) (next - t) : 0;
+}
+
+/* Return a lasting datagram socket of family AF for forwarding,
+   the receiving socket if it exists.  */
+static int
+forward_socket (int af)
+{
+  int i = (af == AF_INET) ? IU_FD_IP4 : IU_FD_IP6;
+
+  if (finet[i] >= 0)
+    return finet[i];
+
+  if (fwd_sock[i] < 0)
+    {
+      fwd_sock[i] = socket (af, SOCK_DGRAM, 0);
+      if (fwd_sock[i] < 0)
+	logerror ("forwarding socket");
+    }
+  return fwd_sock[i];
+}
+
+/* Start connecting to the TCP peer of F, unless it was tried
+   within the last TCP_RETRY seconds.  */
+static void
+tcp_connect (struct filed *f)
+{
+  time_t t = time (NULL);
+  int fd;
+
+  if (f->f_file >= 0 || t < f->f_retry)
+    return;
+  f->f_retry = t + TCP_RETRY;
+
+  fd = socket (f->f_un.f_forw.f_addr.ss_family, SOCK_STREAM, 0);
+  if (fd < 0)
+    {
+      logerror ("socket");
+      return;
+    }
+  fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+
+  /* Completion, or failure, shows when the queue is drained.  */
+  if (connect (fd, (struct sockaddr *) &f->f_un.f_forw.f_addr,
+	       f->f_un.f_forw.f_addrlen) < 0 && errno != EINPROGRESS)
+    {
+      dbg_printf ("Connecting to %s failed: %s.\n",
+		  f->f_un.f_forw.f_hname, strerror (errno));
+      close (fd);
+      return;
+    }
+  f->f_file = fd;
+}
+
+/* Close the failed TCP connection of F, whose queue is kept until
+   a new connection is made.  The message in transit is sent again,
+   as its frame was broken.  */
+static void
+tcp_lost (struct filed *f, int e)
+{
+  char buf[MAXLINE + 1];
+
+  close (f->f_file);
+  f->f_file = -1;
+  f->f_qoff = 0;
+
+  if (!(f->f_flags & FORW_DOWN))
+    {
+      f->f_flags |= FORW_DOWN;
+      snprintf (buf, sizeof (buf), "forwarding to %s",
+		f->f_un.f_forw.f_hname);
+      errno = e;
+      logerror (buf);
+    }
+}
+
+/* Check that the TCP peer of F has not closed the connection, which
+   a write would only show after its data were lost.  */
+static int
+tcp_alive (struct filed *f)
+{
+  char c;
+  ssize_t n;
+
+  n = recv (f->f_file, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  if (n > 0 || (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK
+			  || errno == EINTR || errno == ENOTCONN)))
+    return 1;
+
+  tcp_lost (f, n ? errno : EPIPE);
+  return 0;
+}
+
+/* Return the descriptor written for the destination F, if any.  */
+static int
+output_fd (struct filed *f)
+{
+  switch (f->f_type)
+    {
+    case F_PIPE:
+    case F_TTY:
+    case F_CONSOLE:
+      return f->f_file;
 
     case F_FORW:
-    f_forw:
-      dbg_printf (" %s\n", f->f_un.f_forw.f_hname);
-      if (strcasecmp (from, LocalHostName) && NoHops)
-	dbg_printf ("Not forwarding remote message.\n");
-      else if (NoForward)
-	dbg_printf ("Not forwarding because forwarding is disabled.\n");
-      else
+      if (f->f_flags & FORW_TCP)
+	return f->f_file;
+      return forward_socket (f->f_un.f_forw.f_addr.ss_family);
+
+    default:
+      return -1;
+    }
+}
+
+/* Forget all messages queued for F.  */
+static void
+discard_queue (struct filed *f)
+{
+  while (f->f_qlen > 0)
+    {
+      free (f->f_queue[f->f_qhead].data);
+      f->f_qhead = (f->f_qhead + 1) % f->f_qmax;
+      f->f_qlen--;
+      queued_msgs--;
+    }
+  f->f_qoff = 0;
+}
+
+/* Wait for the stalled destination F to make room in its queue.
+   This stalls intake from every socket, but is the chosen policy.  */
+static void
+wait_queue (struct filed *f)
+{
+  struct pollfd pfd;
+
+  while (f->f_qlen == f->f_qmax && output_fd (f) >= 0)
+    {
+      pfd.fd = output_fd (f);
+      pfd.events = POLLOUT;
+      if (poll (&pfd, 1, -1) < 0 && errno != EINTR)
+	break;
+      drain_queue (f);
+    }
+}
+
+/* Add the allocated message DATA to the queue of F, applying the
+   overflow policy of F when the queue is full.  */
+static void
+push_msg (struct filed *f, char *data, size_t len)
+{
+  struct outmsg *m;
+
+  if (f->f_qlen == f->f_qmax)
+    {
+      if (f->f_qpolicy == Q_BLOCK)
+	wait_queue (f);
+      else if (f->f_qpolicy == Q_DROP_OLDEST && f->f_qoff == 0)
 	{
-	  int temp_finet, *pfinet;	/* PFINET points to active fd.  */
+	  /* A partially written message must be completed.  */
+	  free (f->f_queue[f->f_qhead].data);
+	  f->f_qhead = (f->f_qhead + 1) % f->f_qmax;
+	  f->f_qlen--;
+	  queued_msgs--;
+	  f->f_qdrop++;
+	}
+    }
 
-	  if (f->f_un.f_forw.f_addr.ss_family == AF_INET)
-	    pfinet = &finet[IU_FD_IP4];
-	  else	/* AF_INET6 */
-	    pfinet = &finet[IU_FD_IP6];
+  if (f->f_qlen == f->f_qmax
+      || (output_fd (f) < 0 && !(f->f_flags & FORW_TCP)))
+    {
+      f->f_qdrop++;
+      free (data);
+      return;
+    }
 
-	  temp_finet = *pfinet;
+  if (f->f_queue == NULL)
+    f->f_queue = xcalloc (f->f_qmax, sizeof (*f->f_queue));
 
-	  if (temp_finet < 0)
-	    {
-	      int err;
-	      struct addrinfo hints, *rp;
-
-	      /* Forwarding needs a temporary socket.
-	       * The source port is fixed!  */
-	      memset (&hints, 0, sizeof (hints));
-	      hints.ai_family = f->f_un.f_forw.f_addr.ss_family;
-	      hints.ai_socktype = SOCK_DGRAM;
-	      hints.ai_flags = AI_PASSIVE;
-
-	      err = getaddrinfo (NULL, LogForwardPort, &hints, &rp);
-	      if (err)
-		{
-		  dbg_printf ("Not forwarding due to lookup failure: %s.\n",
-			      gai_strerror(err));
-		  break;
-		}
-	      temp_finet = socket (rp->ai_family, rp->ai_socktype,
-				   rp->ai_protocol);
-	      if (temp_finet < 0)
-		{
-		  dbg_printf ("Not forwarding due to socket failure.\n");
-		  freeaddrinfo (rp);
-		  break;
-		}
+  m = &f->f_queue[(f->f_qhead + f->f_qlen) % f->f_qmax];
+  m->data = data;
+  m->len = len;
+  f->f_qlen++;
+  queued_msgs++;
+}
 
-	      err = bind (temp_finet, rp->ai_addr, rp->ai_addrlen);
-	      freeaddrinfo (rp);
-	      if (err)
-		{
-		  dbg_printf ("Not forwarding due to bind error: %s.\n",
-			      strerror (errno));
-		  break;
-		}
-	    } /* Creation of temporary outgoing socket since "finet < 0" */
+/* Queue a copy of the LEN bytes at MSG for output to F.  */
+static void
+enqueue (struct filed *f, const char *msg, size_t len)
+{
+  char *data = malloc (len);
+
+  if (data == NULL)
+    {
+      f->f_qdrop++;
+      return;
+    }
+  memcpy (data, msg, len);
+  push_msg (f, data, len);
+}
+
+/* Queue the line IOV for output to F, except for its first SKIP
+   bytes, which were written already.  */
+static void
+enqueue_iov (struct filed *f, struct iovec *iov, size_t skip)
+{
+  size_t len;
+  char *data;
+  int i;
+
+  for (len = 0, i = 0; i < IOVCNT; i++)
+    len += iov[i].iov_len;
+  len -= skip;
+
+  data = malloc (len);
+  if (data == NULL)
+    {
+      f->f_qdrop++;
+      return;
+    }
+
+  for (len = 0, i = 0; i < IOVCNT; i++)
+    {
+      char *base = iov[i].iov_base;
+      size_t n = iov[i].iov_len;
+
+      if (skip >= n)
+	{
+	  skip -= n;
+	  continue;
+	}
+      memcpy (data + len, base + skip, n - skip);
+      len += n - skip;
+      skip = 0;
+    }
+  push_msg (f, data, len);
+}
+
+/* Write IOV to the queued destination F, keeping whatever it does
+   not accept at once for drain_queue().  Return -1 on any error
+   other than a stall.  */
+static ssize_t
+write_queued (struct filed *f, struct iovec *iov)
+{
+  ssize_t n;
+  size_t len;
+  int i;
+
+  /* Keep the order of messages.  */
+  if (f->f_qlen)
+    {
+      enqueue_iov (f, iov, 0);
+      return 0;
+    }
+
+  n = writev (f->f_file, iov, IOVCNT);
+  if (n < 0)
+    {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+	return -1;
+      n = 0;
+    }
+
+  for (len = 0, i = 0; i < IOVCNT; i++)
+    len += iov[i].iov_len;
+  if ((size_t) n < len)
+    enqueue_iov (f, iov, n);
+
+  return n;
+}
+
+/* Write queued messages to F, until it would block again.  */
+static void
+drain_queue (struct filed *f)
+{
+#ifdef HAVE_SIGACTION
+  sigset_t sigs, osigs;
+#else
+  int omask;
+#endif
+
+#ifdef HAVE_SIGACTION
+  sigemptyset (&sigs);
+  sigaddset (&sigs, SIGHUP);
+  sigaddset (&sigs, SIGALRM);
+  sigprocmask (SIG_BLOCK, &sigs, &osigs);
+#else
+  omask = sigblock (sigmask (SIGHUP) | sigmask (SIGALRM));
+#endif
 
-	  f->f_time = now;
-	  snprintf (line, sizeof (line), "<%d>%.15s %s",
-		    f->f_prevpri, (char *) iov[0].iov_base,
-		    (char *) iov[4].iov_base);
-	  l = strlen (line);
-	  if (l > MAXLINE)
-	    l = MAXLINE;
-	  if (sendto (temp_finet, line, l, 0,
-		      (struct sockaddr *) &f->f_un.f_forw.f_addr,
-		      f->f_un.f_forw.f_addrlen) != l)
-	    {
-	      int e = errno;
-	      dbg_printf ("INET sendto error: %d = %s.\n", e, strerror (e));
-	      f->f_type = F_FORW_SUSP;
-	      errno = e;
-	      logerror ("sendto");
-	    }
+  if ((f->f_flags & FORW_TCP) && f->f_file >= 0 && f->f_qlen > 0)
+    tcp_alive (f);
 
-	  if (*pfinet < 0)
-	    close (temp_finet);	/* Only temporary socket may be closed.  */
-	}
-      break;
+  while (f->f_qlen > 0)
+    {
+      struct outmsg *m = &f->f_queue[f->f_qhead];
+      struct iovec iov[QBATCH];
+      size_t len = 0;
+      ssize_t n;
+      int i;
 
-    case F_CONSOLE:
-      f->f_time = now;
-      if (flags & IGN_CONS)
+      if (output_fd (f) < 0)
 	{
-	  dbg_printf (" (ignored)\n");
+	  /* A TCP peer keeps its messages while disconnected.  */
+	  if (f->f_flags & FORW_TCP)
+	    tcp_connect (f);
+	  else
+	    discard_queue (f);
 	  break;
 	}
 
-    case F_TTY:
-    case F_FILE:
-    case F_PIPE:
-      f->f_time = now;
-      dbg_printf (" %s\n", f->f_un.f_fname);
-      if (f->f_type == F_TTY || f->f_type == F_CONSOLE)
-	{
-	  v->iov_base = (char *) "\r\n";
-	  v->iov_len = 2;
-	}
+      if (f->f_type == F_FORW && !(f->f_flags & FORW_TCP))
+	n = sendto (output_fd (f), m->data, m->len, MSG_DONTWAIT,
+		    (struct sockaddr *) &f->f_un.f_forw.f_addr,
+		    f->f_un.f_forw.f_addrlen);
       else
 	{
-	  v->iov_base = (char *) "\n";
-	  v->iov_len = 1;
+	  /* Streams take many messages per call.  */
+	  for (i = 0; i < QBATCH && i < f->f_qlen; i++)
+	    {
+	      struct outmsg *q = &f->f_queue[(f->f_qhead + i) % f->f_qmax];
+	      size_t off = i ? 0 : f->f_qoff;
+
+	      iov[i].iov_base = q->data + off;
+	      iov[i].iov_len = q->len - off;
+	      len += q->len - off;
+	    }
+	  n = writev (f->f_file, iov, i);
 	}
-    again:
-      if (writev (f->f_file, iov, IOVCNT) < 0)
+
+      if (n < 0)
 	{
 	  int e = errno;
 
-	  /* XXX: If a named pipe is full, ignore it.  */
-	  if (f->f_type == F_PIPE && e == EAGAIN)
+	  if (e == EINTR)
+	    continue;
+	  if (e == EAGAIN || e == EWOULDBLOCK || e == ENOBUFS)
 	    break;
 
-	  close (f->f_file);
-	  /* Check for errors on TTY's due to loss of tty. */
-	  if ((e == EIO || e == EBADF)
-	      && (f->f_type == F_TTY || f->f_type == F_CONSOLE))
+	  if (f->f_flags & FORW_TCP)
 	    {
-	      f->f_file = open (f->f_un.f_fname, O_WRONLY | O_APPEND, 0);
-	      if (f->f_file < 0)
-		{
-		  f->f_type = F_UNUSED;
-		  logerror (f->f_un.f_fname);
-		  free (f->f_un.f_fname);
-		  f->f_un.f_fname = NULL;
-		}
-	      else
-		goto again;
+	      tcp_lost (f, e);
+	      break;
+	    }
+
+	  discard_queue (f);
+	  if (f->f_type == F_FORW)
+	    {
+	      f->f_type = F_FORW_SUSP;
+	      f->f_time = now;
+	      errno = e;
+	      logerror ("sendto");
 	    }
 	  else
 	    {
+	      close (f->f_file);
 	      f->f_type = F_UNUSED;
 	      errno = e;
 	      logerror (f->f_un.f_fname);
 	      free (f->f_un.f_fname);
 	      f->f_un.f_fname = NULL;
 	    }
+	  break;
 	}
-      else if ((flags & SYNC_FILE) && !(f->f_flags & OMIT_SYNC))
-	fsync (f->f_file);
-      break;
+      f->f_flags &= ~FORW_DOWN;
 
-    case F_USERS:
-    case F_WALL:
-      f->f_time = now;
-      dbg_printf ("\n");
-      v->iov_base = (char *) "\r\n";
-      v->iov_len = 2;
-      wallmsg (f, iov);
-      break;
+      if (f->f_type == F_FORW && !(f->f_flags & FORW_TCP))
+	n = m->len;		/* A datagram is sent whole.  */
+      else
+	len -= n;
+
+      /* Release every message written in full.  */
+      while (n > 0)
+	{
+	  m = &f->f_queue[f->f_qhead];
+	  if ((size_t) n < m->len - f->f_qoff)
+	    {
+	      f->f_qoff += n;
+	      break;
+	    }
+	  n -= m->len - f->f_qoff;
+	  free (m->data);
+	  m->data = NULL;
+	  f->f_qhead = (f->f_qhead + 1) % f->f_qmax;
+	  f->f_qlen--;
+	  f->f_qoff = 0;
+	  queued_msgs--;
+	}
+
+      if (len > 0)
+	break;			/* Partial write, wait for room.  */
     }
 
-  if (f->f_type != F_FORW_UNKN)
-    f->f_prevcount = 0;
+#ifdef HAVE_SIGACTION
+  sigprocmask (SIG_SETMASK, &osigs, 0);
+#else
+  sigsetmask (omask);
+#endif
+}
+
+/* Append to *FDARRAY, after its NFDS receiving descriptors, an entry
+   for every destination with queued output, while recording the
+   destination in POLLOWNER.  Return the new number of entries.  */
+static unsigned long
+poll_outputs (struct pollfd **fdarray, size_t *alloc, unsigned long nfds)
+{
+  static size_t owners;
+  struct filed *f;
+  unsigned long n = nfds;
+
+  if (queued_msgs == 0)
+    return n;
+
+  for (f = Files; f; f = f->f_next)
+    {
+      if (f->f_qlen == 0 || output_fd (f) < 0)
+	continue;
+
+      if (n >= *alloc)
+	{
+	  *alloc *= 2;
+	  *fdarray = xrealloc (*fdarray, *alloc * sizeof (**fdarray));
+	}
+      if (n - nfds >= owners)
+	{
+	  owners = owners ? 2 * owners : 8;
+	  pollowner = xrealloc (pollowner, owners * sizeof (*pollowner));
+	}
+
+      (*fdarray)[n].fd = output_fd (f);
+      (*fdarray)[n].events = POLLOUT;
+      (*fdarray)[n].revents = 0;
+      pollowner[n - nfds] = f;
+      n++;
+    }
+
+  return n;
 }
 
 /* Write the specified message to either the entire world,
@@ -1644,45 +4391,359 @@ wallmsg (struct filed *f, struct iovec *iov)
       line[sizeof (utp->ut_line)] = '\0';
       if (f->f_type == F_WALL)
 	{
-	  /* Note we're using our own version of ttymsg
-	     which does a double fork () to not have
-	     zombies.  No need to waitpid().  */
-	  p = ttymsg (iov, IOVCNT, line, TTYMSGTIME);
-	  if (p != NULL)
-	    {
-	      errno = 0;	/* Already in message. */
-	      logerror (p);
-	    }
-	  continue;
+	  /* Note we're using our own version of ttymsg
+	     which does a double fork () to not have
+	     zombies.  No need to waitpid().  */
+	  p = ttymsg (iov, IOVCNT, line, TTYMSGTIME);
+	  if (p != NULL)
+	    {
+	      errno = 0;	/* Already in message. */
+	      logerror (p);
+	    }
+	  continue;
+	}
+      /* Should we send the message to this user? */
+      for (i = 0; i < f->f_un.f_user.f_nusers; i++)
+	if (!strncmp (f->f_un.f_user.f_unames[i], UT_USER (utp),
+		      sizeof (UT_USER (utp))))
+	  {
+	    p = ttymsg (iov, IOVCNT, line, TTYMSGTIME);
+	    if (p != NULL)
+	      {
+		errno = 0;	/* Already in message. */
+		logerror (p);
+	      }
+	    break;
+	  }
+    }
+#if defined UTMP_NAME_FUNCTION || !defined HAVE_GETUTXENT
+  free (utmpbuf);
+#else /* !UTMP_NAME_FUNCTION && HAVE_GETUTXENT */
+  endutxent ();
+#endif
+  reenter = 0;
+}
+
+/* Reduce the host NAME, whenever a domain is to be stripped,
+   or the host is to be logged by its short name.  */
+static void
+trim_hostname (char *name)
+{
+  char *p;
+  int count;
+
+  p = strchr (name, '.');
+  if (p == NULL)
+    return;
+
+  if (strcasecmp (p + 1, LocalDomain) == 0)
+    {
+      *p = '\0';
+      return;
+    }
+
+  if (StripDomains)
+    for (count = 0; StripDomains[count]; count++)
+      if (strcasecmp (p + 1, StripDomains[count]) == 0)
+	{
+	  *p = '\0';
+	  return;
+	}
+
+  if (LocalHosts)
+    for (count = 0; LocalHosts[count]; count++)
+      if (strcasecmp (name, LocalHosts[count]) == 0)
+	{
+	  *p = '\0';
+	  return;
+	}
+}
+
+/* Extract the cache key of the address F.  Return zero for
+   unsupported families.  */
+static int
+dns_key (struct sockaddr *f, struct dnskey *key)
+{
+  memset (key, 0, sizeof (*key));
+  key->family = f->sa_family;
+
+  switch (f->sa_family)
+    {
+    case AF_INET:
+      memcpy (key->addr, &((struct sockaddr_in *) f)->sin_addr,
+	      sizeof (struct in_addr));
+      return 1;
+
+    case AF_INET6:
+      memcpy (key->addr, &((struct sockaddr_in6 *) f)->sin6_addr,
+	      sizeof (struct in6_addr));
+      key->scope = ((struct sockaddr_in6 *) f)->sin6_scope_id;
+      return 1;
+
+    default:
+      return 0;
+    }
+}
+
+static unsigned int
+dns_hash (struct dnskey *key)
+{
+  return strhash ((const char *) key, sizeof (*key)) % dnsbuckets;
+}
+
+/* Unlink E from the LRU list.  */
+static void
+dns_unlink (struct dnsent *e)
+{
+  if (e->prev)
+    e->prev->next = e->next;
+  else
+    dnslru = e->next;
+  if (e->next)
+    e->next->prev = e->prev;
+  else
+    dnslru_tail = e->prev;
+  e->prev = e->next = NULL;
+}
+
+/* Put E first in the LRU list.  */
+static void
+dns_touch (struct dnsent *e)
+{
+  if (dnslru == e)
+    return;
+  if (e->prev || e->next || dnslru_tail == e)
+    dns_unlink (e);
+  e->next = dnslru;
+  if (dnslru)
+    dnslru->prev = e;
+  dnslru = e;
+  if (dnslru_tail == NULL)
+    dnslru_tail = e;
+}
+
+static struct dnsent *
+dns_lookup (struct dnskey *key)
+{
+  struct dnsent *e;
+
+  if (dnshash == NULL)
+    return NULL;
+
+  for (e = dnshash[dns_hash (key)]; e; e = e->hnext)
+    if (memcmp (&e->key, key, sizeof (*key)) == 0)
+      {
+	dns_touch (e);
+	return e;
+      }
+  return NULL;
+}
+
+/* Record NAME, or a failed lookup if NULL, for the address KEY,
+   evicting the least recently used entry from a full cache.  */
+static struct dnsent *
+dns_insert (struct dnskey *key, const char *name, int ttl)
+{
+  struct dnsent *e, **pp;
+
+  if (dnshash == NULL)
+    {
+      for (dnsbuckets = 16; dnsbuckets < (unsigned) DnsCacheSize;)
+	dnsbuckets *= 2;
+      dnshash = xcalloc (dnsbuckets, sizeof (*dnshash));
+    }
+
+  e = dns_lookup (key);
+  if (e == NULL)
+    {
+      if (dnscount >= DnsCacheSize)
+	{
+	  /* Recycle the oldest entry.  */
+	  e = dnslru_tail;
+	  for (pp = &dnshash[dns_hash (&e->key)]; *pp != e;
+	       pp = &(*pp)->hnext)
+	    ;
+	  *pp = e->hnext;
+	  dns_unlink (e);
+	  free (e->name);
+	}
+      else
+	{
+	  e = xzalloc (sizeof (*e));
+	  dnscount++;
+	}
+
+      e->key = *key;
+      e->name = NULL;
+      e->hnext = dnshash[dns_hash (key)];
+      dnshash[dns_hash (key)] = e;
+      dns_touch (e);
+    }
+
+  free (e->name);
+  e->name = name ? strdup (name) : NULL;
+  e->pending = 0;
+  e->expires = time (NULL) + ttl;
+  return e;
+}
+
+/* Account for a resolver call lasting MS milliseconds.  */
+static void
+dns_account (long ms)
+{
+  dnsstats.lookups++;
+  dnsstats.total_ms += ms;
+  if (ms > (long) dnsstats.max_ms)
+    dnsstats.max_ms = ms;
+}
+
+/* Serve reverse lookups in a child process, reading requests
+   from IN and writing answers to OUT, until IN is closed.  */
+static void
+resolver_loop (int in, int out)
+{
+  struct dnsreq req;
+  struct dnsreply rep;
+  long long t;
+
+  while (read (in, &req, sizeof (req)) == sizeof (req))
+    {
+      memset (&rep, 0, sizeof (rep));
+      rep.addr = req.addr;
+      rep.len = req.len;
+
+      t = clock_ms ();
+      rep.err = getnameinfo ((struct sockaddr *) &req.addr, req.len,
+			     rep.name, sizeof (rep.name), NULL, 0,
+			     NI_NAMEREQD);
+      rep.ms = clock_ms () - t;
+
+      if (write (out, &rep, sizeof (rep)) != sizeof (rep))
+	break;
+    }
+}
+
+/* Fork the process serving asynchronous lookups.  */
+static void
+start_resolver (void)
+{
+  int req[2], rep[2];
+  pid_t pid;
+
+  if (pipe (req) < 0)
+    {
+      logerror ("resolver pipe");
+      return;
+    }
+  if (pipe (rep) < 0)
+    {
+      logerror ("resolver pipe");
+      close (req[0]);
+      close (req[1]);
+      return;
+    }
+
+  pid = fork ();
+  if (pid < 0)
+    {
+      logerror ("resolver fork");
+      close (req[0]);
+      close (req[1]);
+      close (rep[0]);
+      close (rep[1]);
+      return;
+    }
+
+  if (pid == 0)
+    {
+      signal (SIGTERM, SIG_DFL);
+      signal (SIGINT, SIG_DFL);
+      signal (SIGQUIT, SIG_DFL);
+      signal (SIGHUP, SIG_IGN);
+      signal (SIGALRM, SIG_IGN);
+      signal (SIGUSR1, SIG_IGN);
+      signal (SIGUSR2, SIG_IGN);
+      close (req[1]);
+      close (rep[0]);
+      resolver_loop (req[0], rep[1]);
+      _exit (EXIT_SUCCESS);
+    }
+
+  close (req[0]);
+  close (rep[1]);
+  resolver_pid = pid;
+  resolver_out = req[1];
+  fcntl (resolver_out, F_SETFL, fcntl (resolver_out, F_GETFL) | O_NONBLOCK);
+  resolver_in = rep[0];
+  fcntl (resolver_in, F_SETFL, fcntl (resolver_in, F_GETFL) | O_NONBLOCK);
+  dbg_printf ("Started resolver process %d.\n", (int) pid);
+}
+
+/* Stop using the resolver process, which is not restarted.  Lookups
+   it never answered are forgotten, so a later message from such a
+   host is looked up again, synchronously.  */
+static void
+stop_resolver (void)
+{
+  struct dnsent *e;
+
+  for (e = dnslru; e; e = e->next)
+    if (e->pending)
+      {
+	e->pending = 0;
+	e->expires = 0;
+      }
+  if (resolver_out >= 0)
+    close (resolver_out);
+  if (resolver_in >= 0)
+    close (resolver_in);
+  resolver_out = resolver_in = -1;
+  if (resolver_pid > 0)
+    waitpid (resolver_pid, NULL, WNOHANG);
+  resolver_pid = -1;
+}
+
+/* Enter answers from the resolver process into the cache.  Return
+   zero once the resolver has gone away.  */
+static int
+dns_replies (void)
+{
+  struct dnsreply rep;
+  struct dnskey key;
+  ssize_t n;
+
+  while ((n = read (resolver_in, &rep, sizeof (rep))) == sizeof (rep))
+    {
+      dns_account (rep.ms);
+      if (!dns_key ((struct sockaddr *) &rep.addr, &key))
+	continue;
+      rep.name[sizeof (rep.name) - 1] = '\0';
+      if (rep.err)
+	dns_insert (&key, NULL, DnsNegTTL);
+      else
+	{
+	  trim_hostname (rep.name);
+	  dns_insert (&key, rep.name, DnsTTL);
 	}
-      /* Should we send the message to this user? */
-      for (i = 0; i < f->f_un.f_user.f_nusers; i++)
-	if (!strncmp (f->f_un.f_user.f_unames[i], UT_USER (utp),
-		      sizeof (UT_USER (utp))))
-	  {
-	    p = ttymsg (iov, IOVCNT, line, TTYMSGTIME);
-	    if (p != NULL)
-	      {
-		errno = 0;	/* Already in message. */
-		logerror (p);
-	      }
-	    break;
-	  }
     }
-#if defined UTMP_NAME_FUNCTION || !defined HAVE_GETUTXENT
-  free (utmpbuf);
-#else /* !UTMP_NAME_FUNCTION && HAVE_GETUTXENT */
-  endutxent ();
-#endif
-  reenter = 0;
+
+  if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+    {
+      logerror ("resolver process lost");
+      stop_resolver ();
+      return 0;
+    }
+  return 1;
 }
 
 /* Return a printable representation of a host address.  */
 const char *
 cvthname (struct sockaddr *f, socklen_t len)
 {
-  int err;
-  char *p;
+  struct dnskey key;
+  struct dnsent *e;
+  long long t;
+  int err, cached;
 
   err = getnameinfo (f, len, addrstr, sizeof (addrstr),
 		     NULL, 0, NI_NUMERICHOST);
@@ -1695,51 +4756,52 @@ cvthname (struct sockaddr *f, socklen_t len)
 
   dbg_printf ("cvthname(%s)\n", addrstr);
 
-  err = getnameinfo (f, len, addrname, sizeof (addrname),
-		     NULL, 0, NI_NAMEREQD);
-  if (err)
+  cached = DnsCacheSize > 0 && dns_key (f, &key);
+  if (cached)
     {
-      dbg_printf ("Host name for your address (%s) unknown.\n", addrstr);
-      return addrstr;
-    }
+      e = dns_lookup (&key);
+      if (e && (e->pending || e->expires > time (NULL)))
+	{
+	  dnsstats.hits++;
+	  if (e->name == NULL)
+	    return addrstr;
+	  strncpy (addrname, e->name, sizeof (addrname) - 1);
+	  return addrname;
+	}
+      dnsstats.misses++;
 
-  p = strchr (addrname, '.');
-  if (p != NULL)
-    {
-      if (strcasecmp (p + 1, LocalDomain) == 0)
-	*p = '\0';
-      else
+      /* Log by address until the resolver has answered.  */
+      if (resolver_out >= 0 && len <= sizeof (struct sockaddr_storage))
 	{
-	  int count;
+	  struct dnsreq req;
 
-	  if (StripDomains)
-	    {
-	      count = 0;
-	      while (StripDomains[count])
-		{
-		  if (strcasecmp (p + 1, StripDomains[count]) == 0)
-		    {
-		      *p = '\0';
-		      return addrname;
-		    }
-		  count++;
-		}
-	    }
-	  if (LocalHosts)
+	  memset (&req, 0, sizeof (req));
+	  memcpy (&req.addr, f, len);
+	  req.len = len;
+	  if (write (resolver_out, &req, sizeof (req)) == sizeof (req))
 	    {
-	      count = 0;
-	      while (LocalHosts[count])
-		{
-		  if (strcasecmp (addrname, LocalHosts[count]) == 0)
-		    {
-		      *p = '\0';
-		      return addrname;
-		    }
-		  count++;
-		}
+	      e = dns_insert (&key, NULL, DnsNegTTL);
+	      e->pending = 1;
 	    }
+	  return addrstr;
 	}
     }
+
+  t = clock_ms ();
+  err = getnameinfo (f, len, addrname, sizeof (addrname),
+		     NULL, 0, NI_NAMEREQD);
+  dns_account (clock_ms () - t);
+  if (err)
+    {
+      dbg_printf ("Host name for your address (%s) unknown.\n", addrstr);
+      if (cached)
+	dns_insert (&key, NULL, DnsNegTTL);
+      return addrstr;
+    }
+
+  trim_hostname (addrname);
+  if (cached)
+    dns_insert (&key, addrname, DnsTTL);
   return addrname;
 }
 
@@ -1747,6 +4809,7 @@ void
 domark (int signo _GL_UNUSED_PARAMETER)
 {
   struct filed *f;
+  int i;
 
   now = time ((time_t *) NULL);
   if (MarkInterval > 0)
@@ -1759,8 +4822,16 @@ domark (int signo _GL_UNUSED_PARAMETER)
 	}
     }
 
+  report_drops ();
+  report_ratelimits (0);
+
+  /* Collect compressors of rotated files.  */
+  for (i = 0; i < GZORPHANS; i++)
+    compressor_busy (&gzorphans[i]);
+
   for (f = Files; f; f = f->f_next)
     {
+      compressor_busy (&f->f_gzpid);
       if (f->f_prevcount && now >= REPEATTIME (f))
 	{
 	  dbg_printf ("flush %s: repeated %d times, %d sec.\n",
@@ -1823,6 +4894,13 @@ die (int signo)
       logerror (buf);
     }
 
+  /* Write out buffered lines, including the above.  */
+  for (f = Files; f != NULL; f = f->f_next)
+    {
+      finish_file (f);
+      drain_queue (f);
+    }
+
   if (fklog >= 0)
     close (fklog);
 
@@ -1838,6 +4916,16 @@ die (int signo)
     close (finet[IU_FD_IP4]);
   if (finet[IU_FD_IP6] >= 0)
     close (finet[IU_FD_IP6]);
+  for (i = 0; i < 2; i++)
+    {
+      if (ftcp[i] >= 0)
+	close (ftcp[i]);
+      if (fwd_sock[i] >= 0)
+	close (fwd_sock[i]);
+    }
+
+  /* The resolver leaves once its pipe is closed.  */
+  stop_resolver ();
 
   exit (EXIT_SUCCESS);
 }
@@ -2019,13 +5107,25 @@ load_conffile (const char *filename, struct filed **nextp)
 
       *++p = '\0';
 
+      if (strncmp (cbuf, "ratelimit", 9) == 0 && isspace (cbuf[9]))
+	{
+	  cfratelimit (cbuf + 9);
+	  continue;
+	}
+
       /* Send the line for more parsing.
        * Then generate the new entry,
        * inserting it at the head of
        * the already existing table.
+       * An unchanged line takes over
+       * its previous entry as it is.
        */
-      f = (struct filed *) calloc (1, sizeof (*f));
-      cfline (cbuf, f);			/* Erases *f!  */
+      f = reuse_filed (cbuf);
+      if (f == NULL)
+	{
+	  f = (struct filed *) calloc (1, sizeof (*f));
+	  cfline (cbuf, f);		/* Erases *f!  */
+	}
       f->f_next = *nextp;
       *nextp = f;
     }
@@ -2037,6 +5137,63 @@ load_conffile (const char *filename, struct filed **nextp)
   return 1;
 }
 
+/* Take the entry for the configuration line LINE, under the current
+   program selector, out of the previous table, if there is one that
+   still writes to the same place.  Its descriptor, queue, and record
+   of repeated messages are thus kept across a reload.  A file that
+   was moved away, as by an external rotation, is opened anew, and so
+   is a line containing `**', whose meaning depends on earlier lines.  */
+static struct filed *
+reuse_filed (const char *line)
+{
+  struct filed *f, **fp;
+  struct stat st, fst;
+  const char *name;
+
+  if (strstr (line, "**"))
+    return NULL;
+
+  for (fp = &OldFiles; (f = *fp) != NULL; fp = &f->f_next)
+    {
+      if (f->f_cfline == NULL || strcmp (f->f_cfline, line) != 0)
+	continue;
+      if (f->f_progname ? (selector == NULL
+			   || strcmp (f->f_progname, selector) != 0)
+	  : selector != NULL)
+	continue;
+
+      switch (f->f_type)
+	{
+	case F_UNUSED:
+	case F_FORW_UNKN:
+	  continue;		/* Try again.  */
+
+	case F_FILE:
+	case F_PIPE:
+	case F_RING:
+	  name = f->f_un.f_fname;
+	  if (*name == '|' || *name == '%')
+	    name++;
+	  if (stat (name, &st) < 0 || fstat (f->f_file, &fst) < 0
+	      || st.st_dev != fst.st_dev || st.st_ino != fst.st_ino)
+	    continue;
+	  break;
+	}
+
+      dbg_printf ("cfline(%s) unchanged\n", line);
+      *fp = f->f_next;
+      f->f_next = NULL;
+      facilities_seen |= f->f_named;
+      if ((f->f_type == F_FILE && (f->f_bufsize || f->f_syncms
+				   || f->f_rotage || (f->f_flags & GZIP_DUE)))
+	  || (f->f_flags & FORW_TCP))
+	deferred_output = 1;
+      return f;
+    }
+
+  return NULL;
+}
+
 /*
  * Return zero on error.
  */
@@ -2097,9 +5254,29 @@ init (int signo _GL_UNUSED_PARAMETER)
 
   dbg_printf ("init\n");
 
-  /* Close all open log files.  */
+  /* Limits are read anew.  */
+  report_ratelimits (1);
+  memset (&rl_sender, 0, sizeof (rl_sender));
+  memset (&rl_program, 0, sizeof (rl_program));
+
+  /* Set the current table aside.  Entries for unchanged lines are
+     taken over by the new one, the rest is closed below.  */
   Initialized = 0;
-  for (f = Files; f != NULL; f = next)
+  OldFiles = Files;
+  Files = NULL;		/* Empty the table.  */
+  free_selectors ();
+  nextp = &Files;
+  facilities_seen = 0;
+  deferred_output = 0;
+
+  rc = load_conffile (ConfFile, nextp);
+
+  ret = load_confdir (ConfDir, nextp);
+  if (!ret)
+    rc = 0;		/* Some allocation errors were found.  */
+
+  /* Close the log files no longer in use.  */
+  for (f = OldFiles; f != NULL; f = next)
     {
       int j;
 
@@ -2113,12 +5290,31 @@ init (int signo _GL_UNUSED_PARAMETER)
 	case F_TTY:
 	case F_CONSOLE:
 	case F_PIPE:
+	  finish_file (f);
+	  drain_queue (f);
+	  discard_queue (f);
+	  if (f->f_flags & GZIP_DUE)
+	    compress_file (f);
 	  free (f->f_un.f_fname);
 	  close (f->f_file);
+	  if (compressor_busy (&f->f_gzpid))
+	    {
+	      /* Leave it to domark, or wait if there is no room.  */
+	      for (j = 0; j < GZORPHANS && gzorphans[j] > 0; j++)
+		;
+	      if (j < GZORPHANS)
+		gzorphans[j] = f->f_gzpid;
+	      else
+		waitpid (f->f_gzpid, NULL, 0);
+	    }
 	  break;
 	case F_FORW:
 	case F_FORW_SUSP:
 	case F_FORW_UNKN:
+	  drain_queue (f);
+	  discard_queue (f);
+	  if ((f->f_flags & FORW_TCP) && f->f_file >= 0)
+	    close (f->f_file);
 	  free (f->f_un.f_forw.f_hname);
 	  break;
 	case F_USERS:
@@ -2126,22 +5322,25 @@ init (int signo _GL_UNUSED_PARAMETER)
 	    free (f->f_un.f_user.f_unames[j]);
 	  free (f->f_un.f_user.f_unames);
 	  break;
+#ifdef HAVE_MMAP
+	case F_RING:
+	  munmap (f->f_ring, f->f_maplen);
+	  close (f->f_file);
+	  free (f->f_un.f_fname);
+	  break;
+#endif
 	}
       free (f->f_progname);
       free (f->f_prevhost);
+      free (f->f_buf);
+      free (f->f_queue);
+      free (f->f_cfline);
       next = f->f_next;
       free (f);
     }
+  OldFiles = NULL;
 
-  Files = NULL;		/* Empty the table.  */
-  nextp = &Files;
-  facilities_seen = 0;
-
-  rc = load_conffile (ConfFile, nextp);
-
-  ret = load_confdir (ConfDir, nextp);
-  if (!ret)
-    rc = 0;		/* Some allocation errors were found.  */
+  compile_selectors ();
 
   Initialized = 1;
 
@@ -2162,6 +5361,7 @@ init (int signo _GL_UNUSED_PARAMETER)
 	    case F_TTY:
 	    case F_CONSOLE:
 	    case F_PIPE:
+	    case F_RING:
 	      dbg_printf ("%s", f->f_un.f_fname);
 	      break;
 
@@ -2195,6 +5395,252 @@ init (int signo _GL_UNUSED_PARAMETER)
   dbg_printf ("syslogd: restarted\n");
 }
 
+/* Parse a size with optional suffix `k', `m' or `g'.  */
+static int
+parse_size (const char *str, size_t *size)
+{
+  char *end;
+  unsigned long v;
+
+  errno = 0;
+  v = strtoul (str, &end, 10);
+  if (errno || end == str)
+    return 0;
+  if (*end == 'k' || *end == 'K')
+    v *= 1024, end++;
+  else if (*end == 'm' || *end == 'M')
+    v *= 1024 * 1024, end++;
+  else if (*end == 'g' || *end == 'G')
+    v *= 1024 * 1024 * 1024, end++;
+  if (*end)
+    return 0;
+  *size = v;
+  return 1;
+}
+
+/* Parse a duration in seconds with optional suffix `s', `m', `h'
+   or `d'.  */
+static int
+parse_age (const char *str, time_t *age)
+{
+  char *end;
+  long v;
+
+  errno = 0;
+  v = strtol (str, &end, 10);
+  if (errno || end == str || v < 0)
+    return 0;
+  switch (*end)
+    {
+    case 'd':
+      v *= 24;
+      /* FALLTHROUGH */
+    case 'h':
+      v *= 60;
+      /* FALLTHROUGH */
+    case 'm':
+      v *= 60;
+      /* FALLTHROUGH */
+    case 's':
+      end++;
+    }
+  if (*end)
+    return 0;
+  *age = v;
+  return 1;
+}
+
+/* Store a single action setting OPT, of the form KEY=VALUE, in F.  */
+static int
+cfoption (char *opt, struct filed *f)
+{
+  char *key = opt, *val, *end, ebuf[200];
+  long v;
+
+  val = strchr (opt, '=');
+  *val++ = '\0';
+
+  if (strcmp (key, "buffer") == 0)
+    {
+      if (!parse_size (val, &f->f_bufsize))
+	goto bad;
+      if (f->f_bufsize && f->f_bufsize < MINBUFSIZE)
+	f->f_bufsize = MINBUFSIZE;
+    }
+  else if (strcmp (key, "flush") == 0 || strcmp (key, "sync") == 0)
+    {
+      v = strtol (val, &end, 10);
+      if (*end || end == val || v < 0 || v > 3600 * 1000)
+	goto bad;
+      if (*key == 'f')
+	f->f_flushms = v;
+      else
+	f->f_syncms = v;
+    }
+  else if (strcmp (key, "queue") == 0)
+    {
+      v = strtol (val, &end, 10);
+      if (*end || end == val || v < 0 || v > 1000000)
+	goto bad;
+      f->f_qmax = v;
+    }
+  else if (strcmp (key, "overflow") == 0)
+    {
+      if (strcmp (val, "drop-newest") == 0)
+	f->f_qpolicy = Q_DROP_NEWEST;
+      else if (strcmp (val, "drop-oldest") == 0)
+	f->f_qpolicy = Q_DROP_OLDEST;
+      else if (strcmp (val, "block") == 0)
+	f->f_qpolicy = Q_BLOCK;
+      else
+	goto bad;
+    }
+  else if (strcmp (key, "timestamp") == 0)
+    {
+      if (strcmp (val, "rfc3339") == 0)
+	f->f_flags |= PRECISE_TIME;
+      else if (strcmp (val, "traditional") == 0)
+	f->f_flags &= ~PRECISE_TIME;
+      else
+	goto bad;
+    }
+  else if (strcmp (key, "size") == 0)
+    {
+      size_t size;
+
+      if (!parse_size (val, &size))
+	goto bad;
+      f->f_rotsize = size;
+    }
+  else if (strcmp (key, "age") == 0)
+    {
+      if (!parse_age (val, &f->f_rotage))
+	goto bad;
+    }
+  else if (strcmp (key, "keep") == 0)
+    {
+      v = strtol (val, &end, 10);
+      if (*end || end == val || v < 0 || v > MAXROTKEEP)
+	goto bad;
+      f->f_rotkeep = v;
+    }
+  else if (strcmp (key, "compress") == 0)
+    {
+      if (strcmp (val, "yes") == 0)
+	f->f_flags |= ROT_COMPRESS;
+      else if (strcmp (val, "no") == 0)
+	f->f_flags &= ~ROT_COMPRESS;
+      else
+	goto bad;
+    }
+  else if (strcmp (key, "flushpri") == 0)
+    {
+      f->f_flushpri = decode (val, prioritynames);
+      if (f->f_flushpri < 0 || f->f_flushpri > LOG_PRIMASK)
+	goto bad;
+    }
+  else
+    {
+      snprintf (ebuf, sizeof (ebuf), "unknown action setting \"%s\"", key);
+      logerror (ebuf);
+      return 0;
+    }
+  return 1;
+
+ bad:
+  snprintf (ebuf, sizeof (ebuf), "bad value \"%s\" for \"%s\"", val, key);
+  logerror (ebuf);
+  return 0;
+}
+
+/* Strip trailing settings KEY=VALUE, separated by white space, off
+   the action field ACTION, and store them in F.  Return zero on
+   a faulty setting.  */
+static int
+cfoptions (char *action, struct filed *f)
+{
+  char *end, *opt;
+
+  for (;;)
+    {
+      end = action + strlen (action);
+      while (end > action && isspace (end[-1]))
+	*--end = '\0';
+
+      for (opt = end; opt > action && !isspace (opt[-1]); opt--)
+	;
+      if (opt == action || strchr (opt, '=') == NULL)
+	return 1;
+
+      if (!cfoption (opt, f))
+	return 0;
+      *opt = '\0';
+    }
+}
+
+/* Parse the line "ratelimit KIND KEY=VALUE...", whose KIND is
+   `sender' or `program', given from ARGS on.  */
+static void
+cfratelimit (char *args)
+{
+  struct ratelimit *rl, new;
+  char *kind, *opt, *val, *end, ebuf[200];
+  long v;
+
+  kind = strtok (args, " \t");
+  if (kind && strcmp (kind, "sender") == 0)
+    rl = &rl_sender;
+  else if (kind && strcmp (kind, "program") == 0)
+    rl = &rl_program;
+  else
+    {
+      logerror ("ratelimit needs `sender' or `program'");
+      return;
+    }
+
+  new.interval = 5;
+  new.burst = 200;
+
+  while ((opt = strtok (NULL, " \t")) != NULL)
+    {
+      val = strchr (opt, '=');
+      if (val == NULL)
+	{
+	  snprintf (ebuf, sizeof (ebuf), "bad ratelimit setting \"%s\"",
+		    opt);
+	  logerror (ebuf);
+	  return;
+	}
+      *val++ = '\0';
+
+      v = strtol (val, &end, 10);
+      if (*end || end == val || v < 0 || v > 1000000)
+	{
+	  snprintf (ebuf, sizeof (ebuf), "bad value \"%s\" for \"%s\"",
+		    val, opt);
+	  logerror (ebuf);
+	  return;
+	}
+
+      if (strcmp (opt, "interval") == 0)
+	new.interval = v;
+      else if (strcmp (opt, "burst") == 0)
+	new.burst = v;
+      else
+	{
+	  snprintf (ebuf, sizeof (ebuf), "unknown ratelimit setting \"%s\"",
+		    opt);
+	  logerror (ebuf);
+	  return;
+	}
+    }
+
+  /* Either value zero lifts the limit.  */
+  if (new.burst == 0)
+    new.interval = 0;
+  *rl = new;
+}
+
 /* Crack a configuration file line.  */
 void
 cfline (const char *line, struct filed *f)
@@ -2214,6 +5660,7 @@ cfline (const char *line, struct filed *f)
 
   /* Clear out file entry.  */
   memset (f, 0, sizeof (*f));
+  f->f_cfline = strdup (line);
   for (i = 0; i <= LOG_NFACILITIES; i++)
     {
       f->f_pmask[i] = 0;
@@ -2320,6 +5767,7 @@ cfline (const char *line, struct filed *f)
 	      f->f_pmask[LOG_FAC (i)] |= pri_set;
 
 	      facilities_seen |= (1 << LOG_FAC (i));
+	      f->f_named |= (1 << LOG_FAC (i));
 	    }
 	  while (*p == ',' || *p == ' ')
 	    p++;
@@ -2337,6 +5785,20 @@ cfline (const char *line, struct filed *f)
       p++;
     }
 
+  /* Split off trailing settings, like "buffer=64k".  */
+  f->f_flushms = DEFFLUSHMS;
+  f->f_flushpri = LOG_CRIT;
+  f->f_qmax = -1;		/* The default depends on the action.  */
+  f->f_rotkeep = DEFROTKEEP;
+  strncpy (buf, p, sizeof (buf) - 1);
+  buf[sizeof (buf) - 1] = '\0';
+  if (!cfoptions (buf, f))
+    {
+      f->f_type = F_UNUSED;
+      return;
+    }
+  p = buf;
+
   if (!strlen(p))
     {
       /* Invalidate an entry with empty action field.  */
@@ -2348,6 +5810,21 @@ cfline (const char *line, struct filed *f)
   switch (*p)
     {
     case '@':
+      /* Forwarded lines keep the traditional time stamp.  */
+      f->f_flags &= ~PRECISE_TIME;
+
+      /* A doubled `@' selects TCP.  */
+      if (p[1] == '@')
+	{
+	  p++;
+	  f->f_flags |= FORW_TCP;
+	  f->f_file = -1;
+	  if (f->f_qmax < 0)
+	    f->f_qmax = DEFSPOOL;
+	  else if (f->f_qmax == 0)
+	    f->f_qmax = 1;	/* Messages are always queued.  */
+	  deferred_output = 1;
+	}
       f->f_un.f_forw.f_hname = strdup (++p);
       memset (&hints, 0, sizeof (hints));
       hints.ai_family = usefamily;
@@ -2431,6 +5908,24 @@ cfline (const char *line, struct filed *f)
 	f->f_type = F_FILE;
       break;
 
+    case '%':
+      f->f_un.f_fname = strdup (p);
+      /* The setting `size' gives the size of the ring.  */
+      if (f->f_rotsize == 0)
+	f->f_rotsize = DEFRINGSIZE;
+      else if (f->f_rotsize < MINRINGSIZE)
+	f->f_rotsize = MINRINGSIZE;
+      if (ring_open (f, ++p, LOGRING_ALIGN (f->f_rotsize)) < 0)
+	{
+	  f->f_type = F_UNUSED;
+	  logerror (p);
+	  free (f->f_un.f_fname);
+	  f->f_un.f_fname = NULL;
+	  break;
+	}
+      f->f_type = F_RING;
+      break;
+
     case '*':
       f->f_type = F_WALL;
       break;
@@ -2460,6 +5955,39 @@ cfline (const char *line, struct filed *f)
       break;
     }
 
+    /* Files are never stalled, others must not stall intake.  */
+    if (f->f_qmax < 0)
+      f->f_qmax = DEFQUEUE;
+    if (f->f_type == F_FILE || f->f_type == F_RING)
+      f->f_qmax = 0;
+    else if ((f->f_type == F_TTY || f->f_type == F_CONSOLE) && f->f_qmax)
+      fcntl (f->f_file, F_SETFL, fcntl (f->f_file, F_GETFL) | O_NONBLOCK);
+
+    /* Only regular files can be buffered.  */
+    if (f->f_type == F_FILE && f->f_bufsize)
+      {
+	f->f_buf = xmalloc (f->f_bufsize);
+	deferred_output = 1;
+      }
+    else
+      f->f_bufsize = 0;
+    if (f->f_type == F_FILE && f->f_syncms)
+      deferred_output = 1;
+
+    /* Only regular files are rotated.  */
+    if (f->f_type == F_FILE && (f->f_rotsize || f->f_rotage))
+      {
+	struct stat st;
+
+	if (fstat (f->f_file, &st) == 0)
+	  f->f_size = st.st_size;
+	f->f_rotstart = time (NULL);
+	if (f->f_rotage)
+	  deferred_output = 1;	/* Aged from flush_due().  */
+      }
+    else
+      f->f_rotsize = f->f_rotage = 0;
+
     /* Set program selector.  */
     if (selector)
       {
@@ -2531,6 +6059,17 @@ trigger_restart (int signo _GL_UNUSED_PARAMETER)
 #endif
 }
 
+/* Like trigger_restart(), but for SIGUSR2 requesting that the
+   socket counters be logged by the main loop.  */
+void
+trigger_stats (int signo _GL_UNUSED_PARAMETER)
+{
+  want_stats = 1;
+#ifndef HAVE_SIGACTION
+  signal (SIGUSR2, trigger_stats);
+#endif
+}
+
 /* Override default port with a non-NULL argument.
  * Otherwise identify the default syslog/udp with
  * proper fallback to avoid resolve issues.  */
@@ -54,6 +54,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/file.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <time.h>
 
@@ -66,6 +67,7 @@
 #include <error.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdio.h>
@@ -95,20 +97,27 @@
 
 char ackbuf[PKTSIZE];
 int timeout;
-jmp_buf timeoutbuf;
 
 static void nak (int);
-static int makerequest (int, const char *, struct tftphdr *, const char *);
+static int makerequest (int, const char *, struct tftphdr *, const char *,
+			long long);
 static void printstats (const char *, unsigned long);
 static void startclock (void);
 static void stopclock (void);
-static void timer (int);
 static void tpacket (const char *, struct tftphdr *, int);
 
 #define TIMEOUT		5	/* secs between rexmt's */
 
 static int rexmtval = TIMEOUT;
 static int maxtimeout = 5 * TIMEOUT;
+static int rexmt_set;		/* Ask the server for REXMTVAL.  */
+
+/* Options asked for, RFC 2347.  Zero leaves them out.  */
+static int blksize;
+static int windowsize;
+static int tsize;
+
+static struct tftpio io;	/* read-ahead/write-behind buffers */
 
 static struct sockaddr_storage peeraddr;	/* filled in by main */
 static socklen_t peerlen;
@@ -135,10 +144,13 @@ void quit (int, char **);
 void setascii (int, char **);
 void setbinary (int, char **);
 void setpeer (int, char **);
+void setblksize (int, char **);
 void setrexmt (int, char **);
 void settimeout (int, char **);
 void settrace (int, char **);
+void settsize (int, char **);
 void setverbose (int, char **);
+void setwindowsize (int, char **);
 void status (int, char **);
 
 static void command (void);
@@ -172,6 +184,9 @@ char xhelp[] = "set per-packet retransmission timeout";
 char ihelp[] = "set total retransmission timeout";
 char ashelp[] = "set mode to netascii";
 char bnhelp[] = "set mode to octet";
+char bshelp[] = "set block size, or 0 for the default";
+char wshelp[] = "set blocks sent per ack, or 0 for one";
+char tshelp[] = "toggle transfer size option";
 
 struct cmd cmdtab[] = {
   {"connect", chelp, setpeer},
@@ -186,6 +201,9 @@ struct cmd cmdtab[] = {
   {"ascii", ashelp, setascii},
   {"rexmt", xhelp, setrexmt},
   {"timeout", ihelp, settimeout},
+  {"blksize", bshelp, setblksize},
+  {"windowsize", wshelp, setwindowsize},
+  {"tsize", tshelp, settsize},
   {"?", hhelp, help},
   {NULL, NULL, NULL}
 };
@@ -765,7 +783,10 @@ setrexmt (int argc, char *argv[])
   if (t < 0)
     printf ("%s: bad value\n", argv[1]);
   else
-    rexmtval = t;
+    {
+      rexmtval = t;
+      rexmt_set = t >= 1 && t <= TFTP_TIMEOUT_MAX;
+    }
 }
 
 void
@@ -788,6 +809,54 @@ settimeout (int argc, char *argv[])
     maxtimeout = t;
 }
 
+void
+setblksize (int argc, char *argv[])
+{
+  int t;
+
+  if (argc < 2)
+    get_args ("Blocksize", "(value) ", &argc, &argv);
+
+  if (argc != 2)
+    {
+      printf ("usage: %s value\n", argv[0]);
+      return;
+    }
+  t = atoi (argv[1]);
+  if (t != 0 && (t < TFTP_BLKSIZE_MIN || t > TFTP_BLKSIZE_MAX))
+    printf ("%s: bad value, use %d to %d\n", argv[1],
+	    TFTP_BLKSIZE_MIN, TFTP_BLKSIZE_MAX);
+  else
+    blksize = t;
+}
+
+void
+setwindowsize (int argc, char *argv[])
+{
+  int t;
+
+  if (argc < 2)
+    get_args ("Windowsize", "(value) ", &argc, &argv);
+
+  if (argc != 2)
+    {
+      printf ("usage: %s value\n", argv[0]);
+      return;
+    }
+  t = atoi (argv[1]);
+  if (t < 0 || t > TFTP_WINDOW_MAX)
+    printf ("%s: bad value\n", argv[1]);
+  else
+    windowsize = t;
+}
+
+void
+settsize (int argc _GL_UNUSED_PARAMETER, char *argv[] _GL_UNUSED_PARAMETER)
+{
+  tsize = !tsize;
+  printf ("Transfer size option %s.\n", tsize ? "on" : "off");
+}
+
 void
 status (int argc _GL_UNUSED_PARAMETER, char *argv[] _GL_UNUSED_PARAMETER)
 {
@@ -799,13 +868,14 @@ status (int argc _GL_UNUSED_PARAMETER, char *argv[] _GL_UNUSED_PARAMETER)
 	  verbose ? "on" : "off", trace ? "on" : "off");
   printf ("Rexmt-interval: %d seconds, Max-timeout: %d seconds\n",
 	  rexmtval, maxtimeout);
+  printf ("Blocksize: %d, Windowsize: %d, Tsize: %s\n",
+	  blksize ? blksize : SEGSIZE, windowsize ? windowsize : 1,
+	  tsize ? "on" : "off");
 }
 
 void
 intr (int signo _GL_UNUSED_PARAMETER)
 {
-  signal (SIGALRM, SIG_IGN);
-  alarm (0);
   longjmp (toplevel, -1);
 }
 
@@ -976,6 +1046,93 @@ setverbose (int argc _GL_UNUSED_PARAMETER, char *argv[] _GL_UNUSED_PARAMETER)
   printf ("Verbose mode %s.\n", verbose ? "on" : "off");
 }
 
+/* Wait for a packet from the server, of at most LEN bytes, into TP.
+   Return its length, zero if none came within REXMTVAL seconds, or
+   -1 on an error.  */
+static int
+await_packet (struct tftphdr *tp, int len)
+{
+  struct pollfd pfd;
+  struct sockaddr_storage from;
+  socklen_t fromlen;
+  int n;
+
+  pfd.fd = f;
+  pfd.events = POLLIN;
+  for (;;)
+    {
+      n = poll (&pfd, 1, rexmtval * 1000);
+      if (n <= 0)
+	return n;
+      fromlen = sizeof (from);
+      n = recvfrom (f, (char *) tp, len, 0,
+		    (struct sockaddr *) &from, &fromlen);
+      if (n <= 0)
+	continue;
+      set_port (&peeraddr, get_port (&from));
+      if (trace)
+	tpacket ("received", tp, n);
+      return n;
+    }
+}
+
+/* Take the options acknowledged in packet TP of length N, setting
+   *SEGSIZE and *WINDOW.  Return -1 if one was not asked for, or has
+   a value that was not asked for.  */
+static int
+takeoack (struct tftphdr *tp, int n, int *segsize, int *window)
+{
+  char *cp = (char *) tp + 2, *end = (char *) tp + n;
+
+  while (cp < end)
+    {
+      char *name = cp, *value;
+      long long v;
+
+      while (cp < end && *cp)
+	cp++;
+      if (cp >= end)
+	return -1;
+      value = ++cp;
+      while (cp < end && *cp)
+	cp++;
+      if (cp >= end)
+	return -1;
+      cp++;
+      v = strtoll (value, NULL, 10);
+
+      if (blksize && strcasecmp (name, "blksize") == 0
+	  && v >= TFTP_BLKSIZE_MIN && v <= blksize)
+	*segsize = v;
+      else if (windowsize && strcasecmp (name, "windowsize") == 0
+	       && v >= 1 && v <= windowsize)
+	*window = v;
+      else if (rexmt_set && strcasecmp (name, "timeout") == 0
+	       && v == rexmtval)
+	;
+      else if (tsize && strcasecmp (name, "tsize") == 0 && v >= 0)
+	{
+	  if (verbose)
+	    printf ("transfer size %lld bytes\n", v);
+	}
+      else
+	return -1;
+    }
+  return 0;
+}
+
+/* Make room in the socket for a window of WINDOW blocks of SEGSIZE
+   bytes, should it not have that already.  */
+static void
+setrcvbuf (int segsize, int window)
+{
+  int size, want = 2 * window * (segsize + 4);
+  socklen_t len = sizeof (size);
+
+  if (getsockopt (f, SOL_SOCKET, SO_RCVBUF, &size, &len) == 0 && size < want)
+    setsockopt (f, SOL_SOCKET, SO_RCVBUF, &want, sizeof (want));
+}
+
 /*
  * Send the requested file.
  */
@@ -983,104 +1140,169 @@ void
 tftp_sendfile (int fd, char *name, char *mode)
 {
   register struct tftphdr *ap;	/* data and ack packets */
-  struct tftphdr *r_init (void), *dp;
+  struct tftphdr *dp;
+  char reqbuf[PKTSIZE];
   register int n;
-  volatile int block, size, convert;
-  volatile unsigned long amount;
-  struct sockaddr_storage from;
-  socklen_t fromlen;
+  int size, reqlen, convert, segsize = SEGSIZE, window = 1, eof = 0;
+  unsigned short block = 0, sent = 0, last = 0, acked;
+  unsigned long amount;
+  long long length = -1;
   FILE *file;
 
   startclock ();		/* start stat's clock */
-  dp = r_init ();		/* reset fillbuf/read-ahead code */
   ap = (struct tftphdr *) ackbuf;
   file = fdopen (fd, "r");
   convert = !strcmp (mode, "netascii");
-  block = 0;
   amount = 0;
 
-  signal (SIGALRM, timer);
-  do
+  /* The size of a file sent as netascii is not known in advance.  */
+  if (tsize && !convert)
     {
-      if (block == 0)
-	size = makerequest (WRQ, name, dp, mode) - 4;
-      else
+      struct stat st;
+
+      if (fstat (fd, &st) == 0)
+	length = st.st_size;
+    }
+  reqlen = makerequest (WRQ, name, (struct tftphdr *) reqbuf, mode, length);
+
+  /* Send the request until the server takes it, with an ack of
+     block zero, or with the options.  */
+  timeout = 0;
+  for (;;)
+    {
+      if (trace)
+	tpacket ("sent", (struct tftphdr *) reqbuf, reqlen);
+      if (sendto (f, reqbuf, reqlen, 0, (struct sockaddr *) &peeraddr,
+		  peerlen) != reqlen)
 	{
-	  /*      size = read(fd, dp->th_data, SEGSIZE);   */
-	  size = readit (file, &dp, convert);
-	  if (size < 0)
+	  perror ("tftp: sendto");
+	  goto abort;
+	}
+      n = await_packet (ap, sizeof (ackbuf));
+      if (n < 0)
+	{
+	  perror ("tftp: recvfrom");
+	  goto abort;
+	}
+      if (n == 0)
+	{
+	  timeout += rexmtval;
+	  if (timeout >= maxtimeout)
 	    {
-	      nak (errno + 100);
-	      break;
+	      printf ("Transfer timed out.\n");
+	      goto abort;
 	    }
-	  dp->th_opcode = htons ((unsigned short) DATA);
-	  dp->th_block = htons ((unsigned short) block);
+	  continue;
 	}
-      timeout = 0;
-      setjmp (timeoutbuf);
-
-    send_data:
-      if (trace)
-	tpacket ("sent", dp, size + 4);
-      n = sendto (f, (const char *) dp, size + 4, 0,
-		  (struct sockaddr *) &peeraddr, peerlen);
-      if (n != size + 4)
+      ap->th_opcode = ntohs (ap->th_opcode);
+      if (ap->th_opcode == ERROR)
 	{
-	  perror ("tftp: sendto");
+	  printf ("Error code %d: %s\n", ntohs (ap->th_code), ap->th_msg);
 	  goto abort;
 	}
-      read_ahead (file, convert);
-
-      for (;;)
+      if (ap->th_opcode == OACK)
 	{
-	  alarm (rexmtval);
-	  do
+	  if (takeoack (ap, n, &segsize, &window) < 0)
 	    {
-	      fromlen = sizeof (from);
-	      n = recvfrom (f, ackbuf, sizeof (ackbuf), 0,
-			    (struct sockaddr *) &from, &fromlen);
+	      nak (EOPTNEG);
+	      goto abort;
 	    }
-	  while (n <= 0);
-	  alarm (0);
-	  if (n < 0)
+	  break;
+	}
+      if (ap->th_opcode == ACK && ntohs (ap->th_block) == 0)
+	break;
+    }
+
+  /* Block N after the one acked last is N buffers after the
+     current one.  */
+  tftpio_init (&io, segsize, window + 2);
+  tftpio_r_init (&io);
+  timeout = 0;
+  for (;;)
+    {
+      while ((unsigned short) (sent - block) < window
+	     && !(eof && sent == last))
+	{
+	  size = tftpio_peek (&io, file, (unsigned short) (sent - block) + 1,
+			      &dp, convert);
+	  if (size < 0)
 	    {
-	      perror ("tftp: recvfrom");
+	      nak (errno + 100);
 	      goto abort;
 	    }
-	  set_port (&peeraddr, get_port (&from));
+	  sent++;
+	  if (size < segsize)
+	    {
+	      eof = 1;
+	      last = sent;
+	    }
+	  dp->th_opcode = htons ((unsigned short) DATA);
+	  dp->th_block = htons (sent);
 	  if (trace)
-	    tpacket ("received", ap, n);
-	  /* should verify packet came from server */
-	  ap->th_opcode = ntohs (ap->th_opcode);
-	  ap->th_block = ntohs (ap->th_block);
-	  if (ap->th_opcode == ERROR)
+	    tpacket ("sent", dp, size + 4);
+	  n = sendto (f, (const char *) dp, size + 4, 0,
+		      (struct sockaddr *) &peeraddr, peerlen);
+	  if (n != size + 4)
 	    {
-	      printf ("Error code %d: %s\n", ap->th_code, ap->th_msg);
+	      perror ("tftp: sendto");
 	      goto abort;
 	    }
-	  if (ap->th_opcode == ACK)
+	}
+      tftpio_read_ahead (&io, file, convert);
+
+      n = await_packet (ap, sizeof (ackbuf));
+      if (n < 0)
+	{
+	  perror ("tftp: recvfrom");
+	  goto abort;
+	}
+      if (n == 0)
+	{
+	  timeout += rexmtval;
+	  if (timeout >= maxtimeout)
 	    {
-	      int j;
+	      printf ("Transfer timed out.\n");
+	      goto abort;
+	    }
+	  sent = block;		/* send the window again */
+	  continue;
+	}
+      /* should verify packet came from server */
+      ap->th_opcode = ntohs (ap->th_opcode);
+      if (ap->th_opcode == ERROR)
+	{
+	  printf ("Error code %d: %s\n", ntohs (ap->th_code), ap->th_msg);
+	  goto abort;
+	}
+      if (ap->th_opcode != ACK)
+	continue;
+      ap->th_block = ntohs (ap->th_block);
 
-	      if (ap->th_block == block)
-		break;
+      acked = ap->th_block - block;
+      if (acked == 0 || acked > (unsigned short) (sent - block))
+	{
+	  int j;
 
-	      /* On an error, try to synchronize
-	       * both sides.
-	       */
-	      j = synchnet (f);
-	      if (j && trace)
-		printf ("discarded %d packets\n", j);
+	  /* On an error, try to synchronize
+	   * both sides.
+	   */
+	  j = synchnet (f);
+	  if (j && trace)
+	    printf ("discarded %d packets\n", j);
 
-	      if (ap->th_block == (block - 1))
-		goto send_data;
-	    }
+	  if (acked == 0)
+	    sent = block;
+	  continue;
 	}
-      if (block > 0)
-	amount += size;
-      block++;
+      while (acked--)
+	amount += tftpio_readit (&io, file, &dp, convert);
+      block = ap->th_block;
+      timeout = 0;
+      if (eof && block == last)
+	break;
+      /* An ack short of the window tells of a lost block.  */
+      sent = block;
     }
-  while (size == SEGSIZE || block == 1);
 
 abort:
   fclose (file);
@@ -1096,128 +1318,180 @@ void
 recvfile (int fd, char *name, char *mode)
 {
   register struct tftphdr *ap;
-  struct tftphdr *dp, *w_init (void);
+  struct tftphdr *dp;
+  char reqbuf[PKTSIZE];
+  char *pkt;
   register int n;
-  volatile int block, size, firsttrip;
-  volatile unsigned long amount;
-  struct sockaddr_storage from;
-  socklen_t fromlen;
+  int size, pktlen, segsize = SEGSIZE, window = 1, gap = 0;
+  unsigned short block = 1, acked = 0;
+  unsigned long amount;
   FILE *file;
-  volatile int convert;		/* true if converting crlf -> lf */
+  int convert;			/* true if converting crlf -> lf */
 
   startclock ();
-  dp = w_init ();
+  tftpio_init (&io, blksize ? blksize : SEGSIZE, 2);
+  dp = tftpio_w_init (&io);
   ap = (struct tftphdr *) ackbuf;
   file = fdopen (fd, "w");
   convert = !strcmp (mode, "netascii");
-  block = 1;
-  firsttrip = 1;
   amount = 0;
 
-  signal (SIGALRM, timer);
-  do
+  /* The request is resent until data or options come, and then
+     the last ack sent.  */
+  pktlen = makerequest (RRQ, name, (struct tftphdr *) reqbuf, mode,
+			tsize ? 0 : -1);
+  pkt = reqbuf;
+  timeout = 0;
+  for (;;)
     {
-      if (firsttrip)
-	{
-	  size = makerequest (RRQ, name, ap, mode);
-	  firsttrip = 0;
-	}
-      else
+      if (pkt)
 	{
-	  ap->th_opcode = htons ((unsigned short) ACK);
-	  ap->th_block = htons ((unsigned short) (block));
-	  size = 4;
-	  block++;
+	  if (trace)
+	    tpacket ("sent", (struct tftphdr *) pkt, pktlen);
+	  if (sendto (f, pkt, pktlen, 0, (struct sockaddr *) &peeraddr,
+		      peerlen) != pktlen)
+	    {
+	      perror ("tftp: sendto");
+	      goto abort;
+	    }
+	  tftpio_write_behind (&io, file, convert);
+	  if (pkt == ackbuf)
+	    pkt = NULL;
 	}
-      timeout = 0;
-      setjmp (timeoutbuf);
 
-    send_ack:
-      if (trace)
-	tpacket ("sent", ap, size);
-      if (sendto (f, ackbuf, size, 0, (struct sockaddr *) &peeraddr,
-		  peerlen) != size)
+      n = await_packet (dp, io.segsize + 4);
+      if (n < 0)
 	{
-	  alarm (0);
-	  perror ("tftp: sendto");
+	  perror ("tftp: recvfrom");
 	  goto abort;
 	}
-      write_behind (file, convert);
-
-      for (;;)
+      if (n == 0)
 	{
-	  alarm (rexmtval);
-	  do
+	  timeout += rexmtval;
+	  if (timeout >= maxtimeout)
 	    {
-	      fromlen = sizeof (from);
-	      n = recvfrom (f, (char *) dp, PKTSIZE, 0,
-			    (struct sockaddr *) &from, &fromlen);
+	      printf ("Transfer timed out.\n");
+	      goto out;
 	    }
-	  while (n <= 0);
-
-	  alarm (0);
-	  if (n < 0)
+	  if (pkt != reqbuf)
 	    {
-	      perror ("tftp: recvfrom");
-	      goto abort;
+	      /* ack the last block in sequence */
+	      ap->th_opcode = htons ((unsigned short) ACK);
+	      ap->th_block = htons (acked = block - 1);
+	      pkt = ackbuf;
+	      pktlen = 4;
 	    }
-	  set_port (&peeraddr, get_port (&from));
-	  if (trace)
-	    tpacket ("received", dp, n);
-	  /* should verify client address */
-	  dp->th_opcode = ntohs (dp->th_opcode);
-	  dp->th_block = ntohs (dp->th_block);
-	  if (dp->th_opcode == ERROR)
+	  continue;
+	}
+      /* should verify client address */
+      dp->th_opcode = ntohs (dp->th_opcode);
+      if (dp->th_opcode == ERROR)
+	{
+	  printf ("Error code %d: %s\n", ntohs (dp->th_code), dp->th_msg);
+	  goto abort;
+	}
+      if (dp->th_opcode == OACK && pkt == reqbuf)
+	{
+	  if (takeoack (dp, n, &segsize, &window) < 0)
 	    {
-	      printf ("Error code %d: %s\n", dp->th_code, dp->th_msg);
-	      goto abort;
+	      nak (EOPTNEG);
+	      goto out;
 	    }
-	  if (dp->th_opcode == DATA)
-	    {
-	      int j;
-
-	      if (dp->th_block == block)
-		break;		/* have next packet */
+	  tftpio_init (&io, segsize, 2);
+	  dp = tftpio_w_init (&io);
+	  setrcvbuf (segsize, window);
+	  ap->th_opcode = htons ((unsigned short) ACK);
+	  ap->th_block = htons (0);
+	  pkt = ackbuf;
+	  pktlen = 4;
+	  timeout = 0;
+	  continue;
+	}
+      if (dp->th_opcode != DATA)
+	continue;
+      dp->th_block = ntohs (dp->th_block);
+      if (dp->th_block != block)
+	{
+	  int j;
 
-	      /* On an error, try to synchronize
-	       * both sides.
-	       */
-	      j = synchnet (f);
-	      if (j && trace)
-		printf ("discarded %d packets\n", j);
+	  /* On an error, try to synchronize
+	   * both sides, and tell once which
+	   * block comes next.
+	   */
+	  j = synchnet (f);
+	  if (j && trace)
+	    printf ("discarded %d packets\n", j);
 
-	      if (dp->th_block == (block - 1))
-		goto send_ack;	/* resend ack */
+	  if (!gap && pkt != reqbuf)
+	    {
+	      ap->th_opcode = htons ((unsigned short) ACK);
+	      ap->th_block = htons (acked = block - 1);
+	      pkt = ackbuf;
+	      pktlen = 4;
 	    }
+	  gap = 1;
+	  continue;
 	}
+      if (pkt == reqbuf)
+	pkt = NULL;		/* the request is answered */
+
       /*      size = write(fd, dp->th_data, n - 4); */
-      size = writeit (file, &dp, n - 4, convert);
+      size = tftpio_writeit (&io, file, &dp, n - 4, convert);
       if (size < 0)
 	{
 	  nak (errno + 100);
 	  break;
 	}
       amount += size;
+      timeout = 0;
+      gap = 0;
+      if (size < segsize)
+	break;
+
+      /* A window of blocks is acked at once.  */
+      if ((unsigned short) (block - acked) >= window)
+	{
+	  ap->th_opcode = htons ((unsigned short) ACK);
+	  ap->th_block = htons (acked = block);
+	  pkt = ackbuf;
+	  pktlen = 4;
+	}
+      block++;
     }
-  while (size == SEGSIZE);
 
 abort:				/* ok to ack, since user */
   ap->th_opcode = htons ((unsigned short) ACK);	/* has seen err msg */
   ap->th_block = htons ((unsigned short) block);
+  if (trace)
+    tpacket ("sent", ap, 4);
   sendto (f, ackbuf, 4, 0, (struct sockaddr *) &peeraddr, peerlen);
-  write_behind (file, convert);	/* flush last buffer */
+out:
+  tftpio_write_behind (&io, file, convert);	/* flush last buffer */
   fclose (file);
   stopclock ();
   if (amount > 0)
     printstats ("Received", amount);
 }
 
+/* Build a request for NAME in MODE, with the options asked for.
+   LENGTH is the value of tsize, or negative to leave it out.  */
 static int
 makerequest (int request, const char *name, struct tftphdr *tp,
-	     const char *mode)
+	     const char *mode, long long length)
 {
   register char *cp;
   size_t arglen, len;
+  char opts[128];
+  int optlen = 0;
+
+  if (blksize)
+    optlen += sprintf (opts + optlen, "blksize%c%d%c", 0, blksize, 0);
+  if (windowsize)
+    optlen += sprintf (opts + optlen, "windowsize%c%d%c", 0, windowsize, 0);
+  if (rexmt_set)
+    optlen += sprintf (opts + optlen, "timeout%c%d%c", 0, rexmtval, 0);
+  if (length >= 0)
+    optlen += sprintf (opts + optlen, "tsize%c%lld%c", 0, length, 0);
 
   tp->th_opcode = htons ((unsigned short) request);
 #if HAVE_STRUCT_TFTPHDR_TH_U
@@ -1238,7 +1512,7 @@ makerequest (int request, const char *name, struct tftphdr *tp,
 #endif
 
   /* Available space for naming the target file.  */
-  len = PKTSIZE - sizeof (struct tftphdr) - sizeof ("netascii");
+  len = PKTSIZE - sizeof (struct tftphdr) - sizeof ("netascii") - optlen;
   arglen = strlen (name);
 
   strncpy (cp, name, len);
@@ -1251,6 +1525,8 @@ makerequest (int request, const char *name, struct tftphdr *tp,
   strcpy (cp, mode);
   cp += strlen (mode);
   *cp++ = '\0';
+  memcpy (cp, opts, optlen);
+  cp += optlen;
   return cp - (char *) tp;
 }
 
@@ -1308,11 +1584,12 @@ nak (int error)
 static void
 tpacket (const char *s, struct tftphdr *tp, int n)
 {
-  static char *opcodes[] = { "#0", "RRQ", "WRQ", "DATA", "ACK", "ERROR" };
+  static char *opcodes[] = { "#0", "RRQ", "WRQ", "DATA", "ACK", "ERROR",
+			      "OACK" };
   register char *cp, *file;
   unsigned short op = ntohs (tp->th_opcode);
 
-  if (op < RRQ || op > ERROR)
+  if (op < RRQ || op > OACK)
     printf ("%s opcode=%x ", s, op);
   else
     printf ("%s %s ", s, opcodes[op]);
@@ -1341,6 +1618,15 @@ tpacket (const char *s, struct tftphdr *tp, int n)
     case ERROR:
       printf ("<code=%d, msg=%s>\n", ntohs (tp->th_code), tp->th_msg);
       break;
+
+    case OACK:
+      /* Options are pairs of name and value.  */
+      printf ("<");
+      for (cp = (char *) tp + 2, file = ""; cp < (char *) tp + n;
+	   cp += strlen (cp) + 1, file = file[0] == '=' ? ", " : "=")
+	printf ("%s%s", file, cp);
+      printf (">\n");
+      break;
     }
 }
 
@@ -1374,14 +1660,3 @@ printstats (const char *direction, unsigned long amount)
   putchar ('\n');
 }
 
-static void
-timer (int sig _GL_UNUSED_PARAMETER)
-{
-  timeout += rexmtval;
-  if (timeout >= maxtimeout)
-    {
-      printf ("Transfer timed out.\n");
-      longjmp (toplevel, -1);
-    }
-  longjmp (timeoutbuf, 1);
-}
@@ -63,6 +63,11 @@
 #endif
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#ifdef HAVE_MMAP
+# include <sys/mman.h>
+#endif
 
 #include <netinet/in.h>
 #include <arpa/tftp.h>
@@ -70,10 +75,12 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <error.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
-#include <setjmp.h>
-#include <signal.h>
+#include <poll.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -81,6 +88,7 @@
 #include <unistd.h>
 #include <grp.h>
 #include <pwd.h>
+#include <signal.h>
 
 #include "tftpsubs.h"
 
@@ -92,17 +100,48 @@
 
 #define TIMEOUT		5
 
+/* Transfers served at once in daemon mode, unless told otherwise.  */
+#define MAXTRANSFERS	1024
+
+/* Requests read from the server socket at each wakeup.  */
+#define REQUESTMAX	32
+
+/* Blocks in flight at most, whatever window a client asks for.  */
+#define WINDOWMAX	64
+
+/* Retransmissions are kept in a timer wheel of WHEEL_SIZE slots,
+   each covering WHEEL_TICK milliseconds.  */
+#define WHEEL_TICK	10
+#define WHEEL_SIZE	512
+
+/* Least retransmission timeout, in milliseconds, once round trips
+   have been timed.  */
+#define RTO_MIN		200
+
+/* Cached files are looked at again after this many milliseconds.  */
+#define CACHE_RECHECK	1000
+
+/* Seconds a server started by inetd waits for further requests.  */
+#define LINGER		30
+
 #ifndef LOG_FTP
 # define LOG_FTP LOG_DAEMON	/* Use generic facility.  */
 #endif
 
-static int peer;
 static int rexmtval = TIMEOUT;
 static int maxtimeout = 5 * TIMEOUT;
 static char *chrootdir = NULL;
 static char *group = NULL;
 static char *user;
 
+static int daemon_mode;
+static int no_detach;
+static int usefamily = AF_UNSPEC;
+static char *port = "tftp";
+static int maxtransfers = MAXTRANSFERS;
+static size_t cache_size;
+static char *cache_list;
+
 #ifndef DEFAULT_USER
 # define DEFAULT_USER	"nobody"
 #endif
@@ -111,12 +150,86 @@ static char *user;
 #ifndef PKTSIZE
 #define PKTSIZE	SEGSIZE+4
 #endif
+
+/* Requests, and all packets other than received data.  */
 static char buf[PKTSIZE];
-static char ackbuf[PKTSIZE];
-static struct sockaddr_storage from;
-static socklen_t fromlen;
 
-void tftp (struct tftphdr *, int);
+struct formats;
+
+/* A file mapped for sending in octet mode, shared by all transfers
+   of the same unchanged file.  */
+struct mapping
+{
+  struct mapping *next;
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  time_t mtime;
+  time_t ctime;
+  char *addr;
+  int refs;
+  char *name;			/* Name requested by, if cached.  */
+  char *path;			/* The file found for the name.  */
+  long long checked;		/* When last seen unchanged, in msecs.  */
+};
+
+/* State of one transfer.  Each has a socket of its own, connected
+   to the client, and at most one timer pending.  */
+struct transfer
+{
+  struct transfer *next;	/* List of all transfers.  */
+  struct transfer **prev;
+  struct transfer *tnext;	/* Slot in the timer wheel.  */
+  struct transfer **tprev;	/* NULL if no timer is set.  */
+  long long due;		/* Expiry of the timer, in msecs.  */
+  int fd;
+  struct sockaddr_storage from;
+  socklen_t fromlen;
+  FILE *file;
+  struct formats *pf;
+  int state;
+  unsigned short block;		/* Block acked, or expected.  */
+  unsigned short sent;		/* Last block sent.  */
+  unsigned short acked;		/* Last block acked to the client.  */
+  unsigned short last;		/* Final block, once EOF is set.  */
+  int eof;
+  int gap;			/* Client was told of a missing block.  */
+  int heard;			/* Client has answered.  */
+  struct tftphdr *dp;		/* Room for the next block received.  */
+  int blksize;			/* Options in effect.  */
+  int window;
+  int rexmt;
+  int maxtimeout;
+  int timeout;			/* Msecs waited for the client.  */
+  unsigned short high;		/* Highest block sent.  */
+  unsigned short resent;	/* Highest block sent twice, ...  */
+  int rexmitted;		/* ... if not acked yet.  */
+  int adaptive;			/* Timeout follows the round trip time.  */
+  long rto;			/* Retransmission timeout, in msecs.  */
+  long srtt;			/* Smoothed round trip time, or -1.  */
+  long rttvar;
+  int timing;			/* Round trip of block TIMED is timed, ...  */
+  unsigned short timed;
+  long long stamp;		/* ... since it was sent.  */
+  int early;			/* Timer set by hold_back.  */
+  char *oack;			/* Option acknowledgement, until answered.  */
+  int oacklen;
+  struct tftpio io;
+  struct mapping *map;		/* File sent from memory, or NULL.  */
+  off_t offset;			/* Offset of the block after the one acked.  */
+};
+
+/* Values of transfer.state.  */
+#define T_SEND		0	/* Sending data, awaiting acks.  */
+#define T_RECV		1	/* Receiving data.  */
+#define T_DALLY		2	/* Final ack sent, in case it got lost.  */
+
+static struct transfer *transfers;
+static int ntransfers;
+static int exit_status = EXIT_FAILURE;
+
+static void tftp (struct transfer *, struct tftphdr *, int);
+static void cache_warm (FILE *);
 
 /*
  * Null-terminated directory prefix list for absolute pathname requests and
@@ -135,10 +248,15 @@ static int suppress_naks;
 static int logging;
 
 static const char *errtomsg (int);
-static void nak (int);
+static void nak (struct transfer *, int);
 static const char *verifyhost (struct sockaddr_storage *, socklen_t);
 
-
+enum {
+  OPT_MAXTRANSFERS = CHAR_MAX + 1,
+  OPT_NODETACH,
+  OPT_CACHESIZE,
+  OPT_CACHELIST
+};
 
 static struct argp_option options[] = {
 #define GRP 0
@@ -151,21 +269,66 @@ static struct argp_option options[] = {
 #define GRP 10
   { NULL, 0, NULL, 0, "", GRP},
   { "group", 'g', "GRP", 0,
-    "set explicit group of process owner, used with '-s'", GRP+1},
+    "set explicit group of process owner, used with '-s' "
+    "or '-D'", GRP+1},
   { "secure-dir", 's', "DIR", 0,
     "change root directory to DIR before searching and "
     "serving content", GRP+1},
   { "user", 'u', "USR", 0,
-    "set name of process owner, used with '-s' and "
+    "set name of process owner, used with '-s' or '-D', and "
     "defaults to 'nobody'", GRP+1},
+#undef GRP
+#define GRP 20
+  { NULL, 0, NULL, 0, "", GRP},
+  { "daemon", 'D', NULL, 0,
+    "run standalone, serving all clients in one process", GRP+1},
+  { "ipv4", '4', NULL, 0,
+    "restrict daemon to IPv4", GRP+1},
+  { "ipv6", '6', NULL, 0,
+    "restrict daemon to IPv6", GRP+1},
+  { "port", 'p', "PORT", 0,
+    "listen on PORT in daemon mode, instead of 'tftp'", GRP+1},
+  { "max-transfers", OPT_MAXTRANSFERS, "NUM", 0,
+    "serve at most NUM transfers at once in daemon mode", GRP+1},
+  { "no-detach", OPT_NODETACH, NULL, 0,
+    "do not detach from the terminal in daemon mode", GRP+1},
+  { "cache-size", OPT_CACHESIZE, "SIZE", 0,
+    "keep up to SIZE bytes of files in memory in daemon mode", GRP+1},
+  { "cache-list", OPT_CACHELIST, "FILE", 0,
+    "load the files named in FILE into the cache at startup", GRP+1},
 #undef GRP
   { NULL, 0, NULL, 0, NULL, 0}
 };
 
+/* Parse a size with optional suffix `k', `m' or `g'.  */
+static int
+parse_size (const char *str, size_t *size)
+{
+  char *end;
+  unsigned long v;
+
+  errno = 0;
+  v = strtoul (str, &end, 10);
+  if (errno || end == str)
+    return 0;
+  if (*end == 'k' || *end == 'K')
+    v *= 1024, end++;
+  else if (*end == 'm' || *end == 'M')
+    v *= 1024 * 1024, end++;
+  else if (*end == 'g' || *end == 'G')
+    v *= 1024 * 1024 * 1024, end++;
+  if (*end)
+    return 0;
+  *size = v;
+  return 1;
+}
+
 static error_t
-parse_opt (int key, char *arg,
-	   struct argp_state *state _GL_UNUSED_PARAMETER)
+parse_opt (int key, char *arg, struct argp_state *state)
 {
+  char *end;
+  long n;
+
   switch (key)
     {
     case 'l':
@@ -190,6 +353,42 @@ parse_opt (int key, char *arg,
       user = xstrdup (arg);
       break;
 
+    case 'D':
+      daemon_mode = 1;
+      break;
+
+    case '4':
+      usefamily = AF_INET;
+      break;
+
+    case '6':
+      usefamily = AF_INET6;
+      break;
+
+    case 'p':
+      port = arg;
+      break;
+
+    case OPT_MAXTRANSFERS:
+      n = strtol (arg, &end, 10);
+      if (*end || end == arg || n <= 0 || n > INT_MAX)
+	argp_error (state, "invalid number of transfers: %s", arg);
+      maxtransfers = n;
+      break;
+
+    case OPT_NODETACH:
+      no_detach = 1;
+      break;
+
+    case OPT_CACHESIZE:
+      if (!parse_size (arg, &cache_size))
+	argp_error (state, "invalid cache size: %s", arg);
+      break;
+
+    case OPT_CACHELIST:
+      cache_list = arg;
+      break;
+
     default:
       return ARGP_ERR_UNKNOWN;
     }
@@ -206,225 +405,938 @@ static struct argp argp =
     NULL, NULL, NULL
   };
 
-
-int
-main (int argc, char *argv[])
+/* Change the root directory, if asked to, and give up the privileges
+   of root.  Return zero, or the error code to send to the client.  */
+static int
+drop_privileges (void)
 {
-  int index;
-  register struct tftphdr *tp;
-  int on, n;
-  struct sockaddr_storage sin;
+  struct passwd *pwd = NULL;
+  struct group *grp = NULL;
+  int chrooted = chrootdir && *chrootdir;
 
-  user = xstrdup (DEFAULT_USER);
+  if (!chrooted && !daemon_mode)
+    return 0;
 
-  set_program_name (argv[0]);
-  iu_argp_init ("tftpd", default_program_authors);
-  argp_parse (&argp, argc, argv, 0, &index, NULL);
-
-  openlog ("tftpd", LOG_PID, LOG_FTP);
-
-  if (index < argc)
+  /* Ignore user and group setting for non-root invocations.  */
+  if (!getuid())
     {
-      struct dirlist *dirp;
+      pwd = getpwnam (user);
+      if (!pwd)
+	{
+	  syslog (LOG_ERR, "getpwnam('%s'): %m", user);
+	  return ENOUSER;
+	}
 
-      /* Get list of directory prefixes. Skip relative pathnames. */
-      for (dirp = dirs; index < argc && dirp < &dirs[MAXDIRS]; index++)
+      /* Group names are not portable enough to allow
+       * for a preset value.  The server inherits
+       * group membership from owner, in other cases.
+       */
+      if (group && *group)
 	{
-	  if (argv[index][0] == '/')
+	  grp = getgrnam (group);
+	  if (!grp)
 	    {
-	      dirp->name = argv[index];
-	      dirp->len = strlen (dirp->name);
-	      dirp++;
+	      syslog (LOG_ERR, "getgrnam('%s'): %m", group);
+	      return ENOUSER;
 	    }
 	}
     }
 
-  on = 1;
-  if (ioctl (0, FIONBIO, &on) < 0)
+  if (chrooted && (chroot (chrootdir) || chdir ("/")))
+    {
+      syslog (LOG_ERR, "chroot('%s'): %m", chrootdir);
+      return EACCESS;
+    }
+
+  if (pwd)
+    {
+      gid_t gid = grp ? grp->gr_gid : pwd->pw_gid;
+
+      /* A daemon started by root must not keep the groups of root.  */
+      if (daemon_mode && setgroups (1, &gid))
+	{
+	  syslog (LOG_ERR, "setgroups: %m");
+	  return ENOUSER;
+	}
+
+      if (setgid (gid))
+	{
+	  syslog (LOG_ERR, "setgid: %m");
+	  return ENOUSER;
+	}
+
+      if (setuid (pwd->pw_uid))
+	{
+	  syslog (LOG_ERR, "setuid: %m");
+	  return ENOUSER;
+	}
+    }
+
+  return 0;
+}
+
+
+/* Timer wheel.  A transfer waiting for its client sits in the slot
+   of the tick its timer expires in.  Timers further ahead than the
+   wheel turns around share the slots, and are passed over until
+   their turn comes.  */
+
+static struct transfer *wheel[WHEEL_SIZE];
+static long long wheel_tick;	/* Tick of the slot to run next.  */
+static int ntimers;
+
+static void transfer_timeout (struct transfer *);
+
+static long long
+msec_now (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec * 1000LL + tv.tv_usec / 1000;
+}
+
+static void
+timer_cancel (struct transfer *t)
+{
+  if (!t->tprev)
+    return;
+  if (t->tnext)
+    t->tnext->tprev = t->tprev;
+  *t->tprev = t->tnext;
+  t->tprev = NULL;
+  ntimers--;
+}
+
+static void
+timer_set (struct transfer *t, long msecs)
+{
+  struct transfer **slot;
+
+  timer_cancel (t);
+  t->due = msec_now () + msecs;
+  slot = &wheel[(t->due / WHEEL_TICK) % WHEEL_SIZE];
+  t->tnext = *slot;
+  if (*slot)
+    (*slot)->tprev = &t->tnext;
+  *slot = t;
+  t->tprev = slot;
+  ntimers++;
+}
+
+/* Run the timers expired since the last call.  The slot of the
+   current tick is left to be run again, since timers set in this
+   tick may still land in it.  */
+static void
+timer_run (void)
+{
+  long long now = msec_now ();
+  long long tick, last = now / WHEEL_TICK;
+  struct transfer *t, *next;
+
+  if (last - wheel_tick >= WHEEL_SIZE)
+    wheel_tick = last - WHEEL_SIZE + 1;
+  for (tick = wheel_tick; tick <= last && ntimers; tick++)
+    for (t = wheel[tick % WHEEL_SIZE]; t; t = next)
+      {
+	next = t->tnext;
+	if (t->due <= now)
+	  {
+	    timer_cancel (t);
+	    transfer_timeout (t);
+	  }
+      }
+  wheel_tick = last;
+}
+
+/* Return the milliseconds until the next slot holding timers is
+   over, or -1 if no timer is set.  */
+static int
+timer_next (void)
+{
+  long long tick, delay;
+  int i;
+
+  if (!ntimers)
+    return -1;
+  for (i = 0; i < WHEEL_SIZE - 1; i++)
+    if (wheel[(wheel_tick + i) % WHEEL_SIZE])
+      break;
+  tick = wheel_tick + i;
+  delay = (tick + 1) * WHEEL_TICK - msec_now ();
+  return delay < 0 ? 0 : delay;
+}
+
+
+/* Transfers.  */
+
+/* Mappings of files being sent.  Clients booting from the same image
+   all send from one mapping, and no block is read or copied by the
+   server itself.  A file changed on disk gets a new mapping, while
+   transfers already running keep the old one.
+
+   With a cache, a mapping also remembers the name it was requested
+   by, and stays when its last transfer ends, as long as the budget
+   allows.  A request for a cached name is answered without looking
+   at the file system, except to see now and then that the file is
+   unchanged.  The list is kept with the most recently used first.  */
+static struct mapping *mappings;
+static size_t cache_bytes;
+
+static void
+mapping_unmap (struct mapping *m)
+{
+#ifdef HAVE_MMAP
+  struct mapping **mp;
+
+  for (mp = &mappings; *mp != m; mp = &(*mp)->next)
+    ;
+  *mp = m->next;
+  munmap (m->addr, m->size);
+  free (m);
+#else
+  (void) m;
+#endif
+}
+
+/* Take M out of the cache.  It is unmapped once no transfer uses it.  */
+static void
+cache_forget (struct mapping *m)
+{
+  free (m->name);
+  free (m->path);
+  m->name = m->path = NULL;
+  cache_bytes -= m->size;
+  if (m->refs == 0)
+    mapping_unmap (m);
+}
+
+/* Evict the least recently used mappings not in use, until the
+   cache fits into its budget.  */
+static void
+cache_trim (void)
+{
+  struct mapping *m, *victim;
+
+  while (cache_bytes > cache_size)
+    {
+      victim = NULL;
+      for (m = mappings; m; m = m->next)
+	if (m->name && m->refs == 0)
+	  victim = m;
+      if (!victim)
+	break;
+      cache_forget (victim);
+    }
+}
+
+/* Return the cached mapping of the file requested as NAME, with one
+   more reference, or NULL.  */
+static struct mapping *
+cache_find (const char *name)
+{
+  struct mapping *m, **mp;
+  struct stat st;
+  long long now;
+
+  for (mp = &mappings; (m = *mp); mp = &m->next)
+    if (m->name && strcmp (m->name, name) == 0)
+      break;
+  if (!m)
+    return NULL;
+
+  now = msec_now ();
+  if (now - m->checked >= CACHE_RECHECK)
+    {
+      /* A change of permissions changes the ctime as well.  */
+      if (stat (m->path, &st) < 0
+	  || m->dev != st.st_dev || m->ino != st.st_ino
+	  || m->size != st.st_size || m->mtime != st.st_mtime
+	  || m->ctime != st.st_ctime)
+	{
+	  cache_forget (m);
+	  return NULL;
+	}
+      m->checked = now;
+    }
+
+  *mp = m->next;
+  m->next = mappings;
+  mappings = m;
+  m->refs++;
+  return m;
+}
+
+/* Return the mapping of the open file FD, with one more reference.
+   Return NULL if the file cannot be mapped, and should be read.
+   Unless NAME is NULL, the mapping is cached for requests of NAME,
+   which is found at PATH.  */
+static struct mapping *
+mapping_get (int fd, const char *name, const char *path)
+{
+#ifdef HAVE_MMAP
+  struct stat st;
+  struct mapping *m;
+  void *addr;
+
+  if (fstat (fd, &st) < 0 || !S_ISREG (st.st_mode) || st.st_size <= 0
+      || (uintmax_t) st.st_size > SIZE_MAX)
+    return NULL;
+
+  for (m = mappings; m; m = m->next)
+    if (m->dev == st.st_dev && m->ino == st.st_ino && m->size == st.st_size
+	&& m->mtime == st.st_mtime && m->ctime == st.st_ctime)
+      break;
+
+  if (!m)
+    {
+      addr = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      if (addr == MAP_FAILED)
+	{
+	  syslog (LOG_WARNING, "mmap: %m");
+	  return NULL;
+	}
+# ifdef MADV_SEQUENTIAL
+      madvise (addr, st.st_size, MADV_SEQUENTIAL);
+# endif
+
+      m = xzalloc (sizeof (*m));
+      m->dev = st.st_dev;
+      m->ino = st.st_ino;
+      m->size = st.st_size;
+      m->mtime = st.st_mtime;
+      m->ctime = st.st_ctime;
+      m->addr = addr;
+      m->next = mappings;
+      mappings = m;
+    }
+  m->refs++;
+
+  if (name && !m->name && (size_t) m->size <= cache_size)
+    {
+# ifdef MADV_WILLNEED
+      madvise (m->addr, m->size, MADV_WILLNEED);
+# endif
+      m->name = xstrdup (name);
+      m->path = xstrdup (path);
+      m->checked = msec_now ();
+      cache_bytes += m->size;
+      cache_trim ();
+    }
+  return m;
+#else /* !HAVE_MMAP */
+  (void) fd;
+  (void) name;
+  (void) path;
+  return NULL;
+#endif
+}
+
+static void
+mapping_put (struct mapping *m)
+{
+  if (--m->refs > 0)
+    return;
+  if (m->name)
+    cache_trim ();
+  else
+    mapping_unmap (m);
+}
+
+static struct transfer *
+transfer_new (struct sockaddr_storage *from, socklen_t fromlen)
+{
+  struct transfer *t;
+  struct sockaddr_storage sin;
+  int fd, on = 1;
+
+  /* The peer's address 'from' is valid at this point.
+   * 'from.ss_family' contains the correct address
+   * family for any callback connection, and 'fromlen'
+   * is the length of the corresponding address structure.  */
+  fd = socket (from->ss_family, SOCK_DGRAM, 0);
+  if (fd < 0)
+    {
+      syslog (LOG_ERR, "socket: %m\n");
+      return NULL;
+    }
+#if defined IPV6 && defined IPV6_V6ONLY
+  /* Mapped IPv4 clients of a daemon listening on IPv6.  */
+  if (from->ss_family == AF_INET6
+      && IN6_IS_ADDR_V4MAPPED (&((struct sockaddr_in6 *) from)->sin6_addr))
+    {
+      int off = 0;
+      setsockopt (fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof (off));
+    }
+#endif
+  memset (&sin, 0, sizeof (sin));
+  sin.ss_family = from->ss_family;
+#if HAVE_STRUCT_SOCKADDR_STORAGE_SS_LEN
+  sin.ss_len = from->ss_len;
+#endif
+  if (bind (fd, (struct sockaddr *) &sin, fromlen) < 0)
+    {
+      syslog (LOG_ERR, "bind: %m\n");
+      close (fd);
+      return NULL;
+    }
+  /* Only the client may talk to this socket, and all it sends is
+     found with recv(), sent with send().  */
+  if (connect (fd, (struct sockaddr *) from, fromlen) < 0)
+    {
+      syslog (LOG_ERR, "connect: %m\n");
+      close (fd);
+      return NULL;
+    }
+  if (ioctl (fd, FIONBIO, &on) < 0)
     {
       syslog (LOG_ERR, "ioctl(FIONBIO): %m");
-      exit (EXIT_FAILURE);
+      close (fd);
+      return NULL;
+    }
+
+  t = xzalloc (sizeof (*t));
+  t->fd = fd;
+  t->blksize = SEGSIZE;
+  t->window = 1;
+  t->rexmt = rexmtval;
+  t->maxtimeout = maxtimeout;
+  t->adaptive = 1;
+  t->rto = rexmtval * 1000L;
+  t->srtt = -1;
+  memcpy (&t->from, from, fromlen);
+  t->fromlen = fromlen;
+  t->next = transfers;
+  if (transfers)
+    transfers->prev = &t->next;
+  t->prev = &transfers;
+  transfers = t;
+  ntransfers++;
+  return t;
+}
+
+static void
+transfer_end (struct transfer *t, int status)
+{
+  timer_cancel (t);
+  if (t->file)
+    fclose (t->file);
+  close (t->fd);
+  tftpio_free (&t->io);
+  if (t->map)
+    mapping_put (t->map);
+  free (t->oack);
+  if (t->next)
+    t->next->prev = t->prev;
+  *t->prev = t->next;
+  ntransfers--;
+  exit_status = status;
+  free (t);
+}
+
+/* Look for the transfer of a client at FROM, to which a retransmitted
+   request belongs.  Once the client has answered, it has no reason
+   to repeat its request, and a new one starts another transfer.  */
+static struct transfer *
+transfer_find (struct sockaddr_storage *from)
+{
+  struct transfer *t;
+
+  for (t = transfers; t; t = t->next)
+    {
+      if (t->heard || t->from.ss_family != from->ss_family)
+	continue;
+      if (from->ss_family == AF_INET)
+	{
+	  struct sockaddr_in *a = (struct sockaddr_in *) &t->from;
+	  struct sockaddr_in *b = (struct sockaddr_in *) from;
+
+	  if (a->sin_port == b->sin_port
+	      && a->sin_addr.s_addr == b->sin_addr.s_addr)
+	    return t;
+	}
+#ifdef IPV6
+      else if (from->ss_family == AF_INET6)
+	{
+	  struct sockaddr_in6 *a = (struct sockaddr_in6 *) &t->from;
+	  struct sockaddr_in6 *b = (struct sockaddr_in6 *) from;
+
+	  if (a->sin6_port == b->sin6_port
+	      && IN6_ARE_ADDR_EQUAL (&a->sin6_addr, &b->sin6_addr))
+	    return t;
+	}
+#endif
     }
+  return NULL;
+}
 
-  fromlen = sizeof (from);
-  n = recvfrom (0, buf, sizeof (buf), 0, (struct sockaddr *) &from, &fromlen);
+static void send_input (struct transfer *, struct tftphdr *, int);
+static void recv_input (struct transfer *, struct tftphdr *, int);
+static void send_window (struct transfer *);
+static void send_ack (struct transfer *, unsigned short);
+
+/* Read a packet from the client of T.  Data is received straight
+   into the buffer it is written from.  */
+static void
+transfer_input (struct transfer *t)
+{
+  struct tftphdr *tp;
+  int n;
+
+  if (t->state == T_RECV)
+    {
+      tp = t->dp;
+      n = recv (t->fd, (char *) tp, t->blksize + 4, 0);
+    }
+  else
+    {
+      tp = (struct tftphdr *) buf;
+      n = recv (t->fd, buf, sizeof (buf), 0);
+    }
   if (n < 0)
     {
-      syslog (LOG_ERR, "recvfrom: %m\n");
-      exit (EXIT_FAILURE);
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+	return;
+      syslog (LOG_ERR, "tftpd: read: %m\n");
+      transfer_end (t, EXIT_SUCCESS);
+      return;
     }
-  /*
-   * Now that we have read the message out of the UDP
-   * socket, we fork and exit.  Thus, inetd will go back
-   * to listening to the tftp port, and the next request
-   * to come in will start up a new instance of tftpd.
-   *
-   * We do this so that inetd can run tftpd in "wait" mode.
-   * The problem with tftpd running in "nowait" mode is that
-   * inetd may get one or more successful "selects" on the
-   * tftp port before we do our receive, so more than one
-   * instance of tftpd may be started up.  Worse, if tftpd
-   * break before doing the above "recvfrom", inetd would
-   * spawn endless instances, clogging the system.
-   */
-  {
-    int pid;
-    int i;
-    socklen_t j;
+  if (n < 4)
+    return;
+  t->heard = 1;
+  tp->th_opcode = ntohs ((unsigned short) tp->th_opcode);
+  tp->th_block = ntohs ((unsigned short) tp->th_block);
 
-    for (i = 1; i < 20; i++)
+  if (tp->th_opcode == ERROR)
+    {
+      transfer_end (t, EXIT_SUCCESS);
+      return;
+    }
+
+  switch (t->state)
+    {
+    case T_SEND:
+      send_input (t, tp, n);
+      break;
+
+    case T_RECV:
+      recv_input (t, tp, n);
+      break;
+
+    case T_DALLY:
+      if (tp->th_opcode == DATA && tp->th_block == t->block)
+	{
+	  /* My last ack was lost, resend it.  */
+	  send_ack (t, t->block);
+	  transfer_end (t, EXIT_SUCCESS);
+	}
+      break;
+    }
+}
+
+static void
+transfer_timeout (struct transfer *t)
+{
+  if (t->state == T_DALLY)
+    {
+      transfer_end (t, EXIT_SUCCESS);
+      return;
+    }
+  if (t->early)
+    {
+      /* Held back in send_input, not a timeout.  */
+      t->sent = t->block;
+      send_window (t);
+      return;
+    }
+
+  t->timeout += t->rto;
+  if (t->timeout >= t->maxtimeout * 1000L)
+    {
+      transfer_end (t, EXIT_FAILURE);
+      return;
+    }
+  /* Back off, until the client is heard again.  */
+  t->rto = 2 * t->rto < t->rexmt * 1000L ? 2 * t->rto : t->rexmt * 1000L;
+  if (t->state == T_SEND)
+    {
+      t->sent = t->block;
+      send_window (t);
+    }
+  else
+    send_ack (t, t->block - 1);
+}
+
+/* Accept a request arriving at the server socket.  */
+static void
+request (struct sockaddr_storage *from, socklen_t fromlen, int n)
+{
+  static int busy;
+  struct tftphdr *tp = (struct tftphdr *) buf;
+  struct transfer *t;
+
+  if (n < 2)
+    return;
+  tp->th_opcode = ntohs (tp->th_opcode);
+  if (tp->th_opcode != RRQ && tp->th_opcode != WRQ)
+    return;
+
+  /* A client repeats its request until the transfer begins.  */
+  if (transfer_find (from))
+    return;
+
+  /* Requests beyond the limit are dropped, the clients will ask
+     again.  Complain once while the limit holds.  */
+  if (ntransfers >= maxtransfers)
+    {
+      if (!busy)
+	syslog (LOG_WARNING, "%d transfers in progress, dropping requests",
+		ntransfers);
+      busy = 1;
+      return;
+    }
+  busy = 0;
+
+  t = transfer_new (from, fromlen);
+  if (t)
+    tftp (t, tp, n);
+}
+
+static void
+server_input (int fd)
+{
+  struct sockaddr_storage from;
+  socklen_t fromlen;
+  int i, n;
+
+  for (i = 0; i < REQUESTMAX; i++)
+    {
+      fromlen = sizeof (from);
+      n = recvfrom (fd, buf, sizeof (buf), 0,
+		    (struct sockaddr *) &from, &fromlen);
+      if (n < 0)
+	{
+	  if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+	    syslog (LOG_ERR, "recvfrom: %m");
+	  return;
+	}
+      request (&from, fromlen, n);
+    }
+}
+
+/* Wait up to LINGER seconds for a request on the socket inherited
+   from inetd.  Return nonzero if one has arrived.  */
+static int
+await_request (void)
+{
+  struct pollfd pfd;
+  int rc;
+
+  pfd.fd = 0;
+  pfd.events = POLLIN;
+  do
+    rc = poll (&pfd, 1, LINGER * 1000);
+  while (rc < 0 && errno == EINTR);
+  return rc > 0;
+}
+
+/* Serve requests arriving at SFD, and all transfers, until no
+   transfer is left when SFD is negative.  */
+static void
+serve (int sfd)
+{
+  struct pollfd *pfds = NULL;
+  struct transfer **pts = NULL;
+  size_t size = 0;
+
+  wheel_tick = msec_now () / WHEEL_TICK;
+  for (;;)
+    {
+      struct transfer *t;
+      size_t n = 0, i;
+      int rc;
+
+      if (sfd < 0 && !transfers)
+	break;
+
+      if (size < (size_t) ntransfers + 1)
+	{
+	  size = ntransfers + 1;
+	  pfds = xnrealloc (pfds, size, sizeof (*pfds));
+	  pts = xnrealloc (pts, size, sizeof (*pts));
+	}
+      if (sfd >= 0)
+	{
+	  pfds[n].fd = sfd;
+	  pfds[n].events = POLLIN;
+	  pts[n++] = NULL;
+	}
+      for (t = transfers; t; t = t->next)
+	{
+	  pfds[n].fd = t->fd;
+	  pfds[n].events = POLLIN;
+	  pts[n++] = t;
+	}
+
+      rc = poll (pfds, n, timer_next ());
+      if (rc < 0 && errno != EINTR)
+	{
+	  syslog (LOG_ERR, "poll: %m");
+	  exit (EXIT_FAILURE);
+	}
+
+      /* A transfer may only end itself, so those later in the
+	 array are still there.  */
+      for (i = 0; rc > 0 && i < n; i++)
+	{
+	  if (!pfds[i].revents)
+	    continue;
+	  if (pts[i])
+	    transfer_input (pts[i]);
+	  else
+	    server_input (sfd);
+	}
+      timer_run ();
+    }
+
+  free (pfds);
+  free (pts);
+}
+
+/* Open the socket for requests in daemon mode.  IPv6 is preferred,
+   since it takes IPv4 requests as well, unless told otherwise.  */
+static int
+server_socket (void)
+{
+  struct addrinfo hints, *res, *ai;
+  int fd = -1, err = 0, pass, rc, on = 1;
+
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_family = usefamily;
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_flags = AI_PASSIVE;
+  rc = getaddrinfo (NULL, port, &hints, &res);
+  if (rc)
+    error (EXIT_FAILURE, 0, "%s: %s", port, gai_strerror (rc));
+
+  for (pass = 0; pass < 2 && fd < 0; pass++)
+    for (ai = res; ai && fd < 0; ai = ai->ai_next)
       {
-	pid = fork ();
-	if (pid < 0)
+	if ((ai->ai_family == AF_INET6) != (pass == 0))
+	  continue;
+	fd = socket (ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	if (fd < 0)
 	  {
-	    sleep (i);
-	    /*
-	     * flush out to most recently sent request.
-	     *
-	     * This may drop some request, but those
-	     * will be resent by the clients when
-	     * they timeout.  The positive effect of
-	     * this flush is to (try to) prevent more
-	     * than one tftpd being started up to service
-	     * a single request from a single client.
-	     */
-	    j = sizeof from;
-	    i = recvfrom (0, buf, sizeof (buf), 0,
-			  (struct sockaddr *) &from, &j);
-	    if (i > 0)
-	      {
-		n = i;
-		fromlen = j;
-	      }
+	    err = errno;
+	    continue;
 	  }
-	else
+#if defined IPV6 && defined IPV6_V6ONLY
+	if (ai->ai_family == AF_INET6)
 	  {
-	    break;
+	    int only = usefamily == AF_INET6;
+	    setsockopt (fd, IPPROTO_IPV6, IPV6_V6ONLY, &only, sizeof (only));
+	  }
+#endif
+	if (bind (fd, ai->ai_addr, ai->ai_addrlen) < 0)
+	  {
+	    err = errno;
+	    close (fd);
+	    fd = -1;
 	  }
       }
-    if (pid < 0)
-      {
-	syslog (LOG_ERR, "fork: %m\n");
-	exit (EXIT_FAILURE);
-      }
-    else if (pid != 0)
-      {
-	exit (EXIT_SUCCESS);
-      }
-  }
+  freeaddrinfo (res);
+
+  if (fd < 0)
+    error (EXIT_FAILURE, err, "cannot listen on port %s", port);
+  if (ioctl (fd, FIONBIO, &on) < 0)
+    error (EXIT_FAILURE, errno, "ioctl(FIONBIO)");
+  return fd;
+}
+
+int
+main (int argc, char *argv[])
+{
+  int index;
+  register struct tftphdr *tp;
+  int on, n, err;
+  struct sockaddr_storage from;
+  socklen_t fromlen;
+  struct transfer *t;
+
+  user = xstrdup (DEFAULT_USER);
+
+  set_program_name (argv[0]);
+  iu_argp_init ("tftpd", default_program_authors);
+  argp_parse (&argp, argc, argv, 0, &index, NULL);
 
-  alarm (0);
-  close (0);
-  close (1);
+  /* Keep the log open across a change of the root directory.  */
+  openlog ("tftpd", LOG_PID | (daemon_mode ? LOG_NDELAY : 0), LOG_FTP);
 
-  /* The peer's address 'from' is valid at this point.
-   * 'from.ss_family' contains the correct address
-   * family for any callback connection, and 'fromlen'
-   * is the length of the corresponding address structure.  */
-  peer = socket (from.ss_family, SOCK_DGRAM, 0);
-  if (peer < 0)
+  if (index < argc)
     {
-      syslog (LOG_ERR, "socket: %m\n");
-      exit (EXIT_FAILURE);
+      struct dirlist *dirp;
+
+      /* Get list of directory prefixes. Skip relative pathnames. */
+      for (dirp = dirs; index < argc && dirp < &dirs[MAXDIRS]; index++)
+	{
+	  if (argv[index][0] == '/')
+	    {
+	      dirp->name = argv[index];
+	      dirp->len = strlen (dirp->name);
+	      dirp++;
+	    }
+	}
     }
-  memset (&sin, 0, sizeof (sin));
-  sin.ss_family = from.ss_family;
-#if HAVE_STRUCT_SOCKADDR_STORAGE_SS_LEN
-  sin.ss_len = from.ss_len;
-#endif
-  if (bind (peer, (struct sockaddr *) &sin, fromlen) < 0)
+
+  if (daemon_mode)
     {
-      syslog (LOG_ERR, "bind: %m\n");
+      int sfd = server_socket ();
+      FILE *warm = NULL;
+
+      /* The list is read outside of the new root.  */
+      if (cache_list)
+	{
+	  if (!cache_size)
+	    error (EXIT_FAILURE, 0, "--cache-list needs --cache-size");
+	  warm = fopen (cache_list, "r");
+	  if (!warm)
+	    error (EXIT_FAILURE, errno, "%s", cache_list);
+	}
+      if (!no_detach && daemon (0, 0) < 0)
+	error (EXIT_FAILURE, errno, "cannot become daemon");
+      if (drop_privileges ())
+	exit (EXIT_FAILURE);
+      if (warm)
+	cache_warm (warm);
+      serve (sfd);
       exit (EXIT_FAILURE);
     }
 
-  if (chrootdir && *chrootdir)
+  on = 1;
+  if (ioctl (0, FIONBIO, &on) < 0)
     {
-      struct passwd *pwd = NULL;
-      struct group *grp = NULL;
+      syslog (LOG_ERR, "ioctl(FIONBIO): %m");
+      exit (EXIT_FAILURE);
+    }
 
-      /* Ignore user and group setting for non-root invocations.  */
-      if (!getuid())
-	{
-	  pwd = getpwnam (user);
-	  if (!pwd)
-	    {
-	      syslog (LOG_ERR, "getpwnam('%s'): %m", user);
-	      nak (ENOUSER);
-	      exit (EXIT_FAILURE);
-	    }
+  /* Children need not be waited for.  */
+  signal (SIGCHLD, SIG_IGN);
 
-	  /* Group names are not portable enough to allow
-	   * for a preset value.  The server inherits
-	   * group membership from owner, in other cases.
-	   */
-	  if (group && *group)
+  for (;;)
+    {
+      int pid;
+      int i;
+      socklen_t j;
+
+      fromlen = sizeof (from);
+      n = recvfrom (0, buf, sizeof (buf), 0, (struct sockaddr *) &from,
+		    &fromlen);
+      if (n < 0)
+	{
+	  /* Another server of a pool may have taken the request.  */
+	  if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
 	    {
-	      grp = getgrnam (group);
-	      if (!grp)
-		{
-		  syslog (LOG_ERR, "getgrnam('%s'): %m", group);
-		  nak (ENOUSER);
-		  exit (EXIT_FAILURE);
-		}
+	      if (!await_request ())
+		exit (EXIT_SUCCESS);
+	      continue;
 	    }
-	}
-
-      if (chroot (chrootdir) || chdir ("/"))
-	{
-	  syslog (LOG_ERR, "chroot('%s'): %m", chrootdir);
-	  nak (EACCESS);
+	  syslog (LOG_ERR, "recvfrom: %m\n");
 	  exit (EXIT_FAILURE);
 	}
-
-      if (pwd)
+      /*
+       * Now that we have read the message out of the UDP
+       * socket, we fork, and wait for the next request.
+       * Only when none has come for LINGER seconds do we
+       * exit.  Thus, inetd will go back to listening to the
+       * tftp port, and a later request will start up a new
+       * instance of tftpd, while a server in a pool of inetd
+       * serves request after request without being replaced.
+       *
+       * We do this so that inetd can run tftpd in "wait" mode.
+       * The problem with tftpd running in "nowait" mode is that
+       * inetd may get one or more successful "selects" on the
+       * tftp port before we do our receive, so more than one
+       * instance of tftpd may be started up.  Worse, if tftpd
+       * break before doing the above "recvfrom", inetd would
+       * spawn endless instances, clogging the system.
+       */
+      for (i = 1; i < 20; i++)
 	{
-	  if (grp)
+	  pid = fork ();
+	  if (pid < 0)
 	    {
-	      if (setgid (grp->gr_gid))
+	      sleep (i);
+	      /*
+	       * flush out to most recently sent request.
+	       *
+	       * This may drop some request, but those
+	       * will be resent by the clients when
+	       * they timeout.  The positive effect of
+	       * this flush is to (try to) prevent more
+	       * than one tftpd being started up to service
+	       * a single request from a single client.
+	       */
+	      j = sizeof from;
+	      i = recvfrom (0, buf, sizeof (buf), 0,
+			    (struct sockaddr *) &from, &j);
+	      if (i > 0)
 		{
-		  syslog (LOG_ERR, "setgid: %m");
-		  nak (ENOUSER);
-		  exit (EXIT_FAILURE);
+		  n = i;
+		  fromlen = j;
 		}
 	    }
 	  else
 	    {
-	      if (setgid (pwd->pw_gid))
-		{
-		  syslog (LOG_ERR, "setgid: %m");
-		  nak (ENOUSER);
-		  exit (EXIT_FAILURE);
-		}
-	    }
-
-	  if (setuid (pwd->pw_uid))
-	    {
-	      syslog (LOG_ERR, "setuid: %m");
-	      nak (ENOUSER);
-	      exit (EXIT_FAILURE);
+	      break;
 	    }
 	}
+      if (pid < 0)
+	{
+	  syslog (LOG_ERR, "fork: %m\n");
+	  exit (EXIT_FAILURE);
+	}
+      else if (pid == 0)
+	break;
+
+      if (!await_request ())
+	exit (EXIT_SUCCESS);
+    }
+
+  signal (SIGCHLD, SIG_DFL);
+  close (0);
+  close (1);
+
+  t = transfer_new (&from, fromlen);
+  if (!t)
+    exit (EXIT_FAILURE);
+
+  err = drop_privileges ();
+  if (err)
+    {
+      nak (t, err);
+      exit (EXIT_FAILURE);
     }
 
+  /* The one transfer is served the same as those of a daemon.  */
   tp = (struct tftphdr *) buf;
   tp->th_opcode = ntohs (tp->th_opcode);
-  if (tp->th_opcode == RRQ || tp->th_opcode == WRQ)
-    tftp (tp, n);
-  exit (EXIT_FAILURE);
+  if (tp->th_opcode != RRQ && tp->th_opcode != WRQ)
+    exit (EXIT_FAILURE);
+  tftp (t, tp, n);
+  serve (-1);
+  exit (exit_status);
 }
 
-struct formats;
-int validate_access (char **, int);
-void tftpd_sendfile (struct formats *);
-void recvfile (struct formats *);
+static int validate_access (char **, int, FILE **);
+static void tftpd_sendfile (struct transfer *);
+static void recvfile (struct transfer *);
 
 struct formats
 {
   char *f_mode;
-  int (*f_validate) (char **, int);
-  void (*f_send) (struct formats *);
-  void (*f_recv) (struct formats *);
+  int (*f_validate) (char **, int, FILE **);
+  void (*f_send) (struct transfer *);
+  void (*f_recv) (struct transfer *);
   int f_convert;
 } formats[] =
   {
@@ -433,16 +1345,60 @@ struct formats
     {0, NULL, NULL, NULL, 0}
   };
 
+/* Largest block that fits into a datagram on the path to the client
+   of T, without fragments.  */
+static int
+path_blksize (struct transfer *t)
+{
+  int mtu = 0, hdr = 0;
+  socklen_t len = sizeof (mtu);
+
+#ifdef IP_MTU
+  if (t->from.ss_family == AF_INET
+      && getsockopt (t->fd, IPPROTO_IP, IP_MTU, &mtu, &len) == 0)
+    hdr = 20 + 8;
+#endif
+#if defined IPV6 && defined IPV6_MTU
+  if (t->from.ss_family == AF_INET6
+      && getsockopt (t->fd, IPPROTO_IPV6, IPV6_MTU, &mtu, &len) == 0)
+    hdr = 40 + 8;
+#endif
+  if (!hdr || mtu - hdr - 4 < TFTP_BLKSIZE_MIN
+      || mtu - hdr - 4 > TFTP_BLKSIZE_MAX)
+    return TFTP_BLKSIZE_MAX;
+  return mtu - hdr - 4;
+}
+
+/* Add option NAME with VALUE to the acknowledgement of T.  */
+static void
+oack_add (struct transfer *t, const char *name, long long value)
+{
+  int n;
+
+  if (!t->oack)
+    {
+      t->oack = xmalloc (PKTSIZE);
+      ((struct tftphdr *) t->oack)->th_opcode = htons ((unsigned short) OACK);
+      t->oacklen = 2;
+    }
+  n = snprintf (t->oack + t->oacklen, PKTSIZE - t->oacklen, "%s%c%lld",
+		name, '\0', value);
+  if (n > 0 && t->oacklen + n < PKTSIZE)
+    t->oacklen += n + 1;
+}
+
 /*
  * Handle initial connection protocol.
  */
-void
-tftp (struct tftphdr *tp, int size)
+static void
+tftp (struct transfer *t, struct tftphdr *tp, int size)
 {
   register char *cp;
   int first = 1, ecode;
   register struct formats *pf;
-  char *filename, *mode;
+  char *filename, *request, *mode, *end = (char *) tp + size;
+  long blksize = 0, timeout = 0, window = 0;
+  long long tsize = -1;
 
 #if HAVE_STRUCT_TFTPHDR_TH_U
   filename = cp = tp->th_stuff;
@@ -450,7 +1406,7 @@ tftp (struct tftphdr *tp, int size)
   filename = cp = (char *) &(tp->th_stuff);
 #endif
 again:
-  while (cp < buf + size)
+  while (cp < (char *) tp + size)
     {
       if (*cp == '\0')
 	break;
@@ -458,8 +1414,9 @@ again:
     }
   if (*cp != '\0')
     {
-      nak (EBADOP);
-      exit (EXIT_FAILURE);
+      nak (t, EBADOP);
+      transfer_end (t, EXIT_FAILURE);
+      return;
     }
   if (first)
     {
@@ -475,15 +1432,59 @@ again:
       break;
   if (pf->f_mode == 0)
     {
-      nak (EBADOP);
-      exit (EXIT_FAILURE);
+      nak (t, EBADOP);
+      transfer_end (t, EXIT_FAILURE);
+      return;
+    }
+
+  /* Options follow the mode, as pairs of name and value.  Those
+     not known or not valid are ignored, as RFC 2347 asks.  */
+  for (cp++; cp < end; )
+    {
+      char *name = cp, *value, *ep;
+      long long n;
+
+      while (cp < end && *cp)
+	cp++;
+      if (cp >= end)
+	break;
+      value = ++cp;
+      while (cp < end && *cp)
+	cp++;
+      if (cp >= end)
+	break;
+      cp++;
+
+      n = strtoll (value, &ep, 10);
+      if (*ep || ep == value || n < 0)
+	continue;
+      if (strcasecmp (name, "blksize") == 0
+	  && n >= TFTP_BLKSIZE_MIN && n <= TFTP_BLKSIZE_MAX)
+	blksize = n;
+      else if (strcasecmp (name, "timeout") == 0
+	       && n >= 1 && n <= TFTP_TIMEOUT_MAX)
+	timeout = n;
+      else if (strcasecmp (name, "windowsize") == 0
+	       && n >= 1 && n <= TFTP_WINDOW_MAX)
+	window = n;
+      else if (strcasecmp (name, "tsize") == 0)
+	tsize = n;
     }
-  ecode = (*pf->f_validate) (&filename, tp->th_opcode);
+  /* A cached name has been validated before.  */
+  request = filename;
+  if (tp->th_opcode == RRQ && !pf->f_convert
+      && (t->map = cache_find (filename)))
+    {
+      filename = t->map->path;
+      ecode = 0;
+    }
+  else
+    ecode = (*pf->f_validate) (&filename, tp->th_opcode, &t->file);
   if (logging)
     {
       char *family;
 
-      switch (from.ss_family)
+      switch (t->from.ss_family)
 	{
 	case AF_INET:
 	  family = "IPv4";
@@ -496,7 +1497,7 @@ again:
 	  family = "?";
 	}
       syslog (LOG_INFO, "%s (%s): %s request for %s: %s",
-	      verifyhost (&from, fromlen), family,
+	      verifyhost (&t->from, t->fromlen), family,
 	      tp->th_opcode == WRQ ? "write" : "read",
 	      filename, errtomsg (ecode));
     }
@@ -507,20 +1508,72 @@ again:
        * bootfile pathname from a diskless Sun.
        */
       if (suppress_naks && *filename != '/' && ecode == ENOTFOUND)
-	exit (EXIT_SUCCESS);
-      nak (ecode);
-      exit (EXIT_FAILURE);
+	{
+	  transfer_end (t, EXIT_SUCCESS);
+	  return;
+	}
+      nak (t, ecode);
+      transfer_end (t, EXIT_FAILURE);
+      return;
+    }
+
+  /* Octet blocks are sent straight from the file in memory, and the
+     descriptor is of no further use.  */
+  if (tp->th_opcode == RRQ && !pf->f_convert && !t->map
+      && (t->map = mapping_get (fileno (t->file),
+				daemon_mode ? request : NULL, filename)))
+    {
+      fclose (t->file);
+      t->file = NULL;
+    }
+
+  if (blksize)
+    {
+      t->blksize = blksize < path_blksize (t) ? blksize : path_blksize (t);
+      oack_add (t, "blksize", t->blksize);
+    }
+  if (timeout)
+    {
+      t->rexmt = timeout;
+      t->maxtimeout = timeout * (maxtimeout / rexmtval);
+      t->adaptive = 0;
+      t->rto = timeout * 1000L;
+      oack_add (t, "timeout", timeout);
+    }
+  if (window)
+    {
+      int size, want, opt = tp->th_opcode == WRQ ? SO_RCVBUF : SO_SNDBUF;
+      socklen_t len = sizeof (size);
+
+      t->window = window < WINDOWMAX ? window : WINDOWMAX;
+      oack_add (t, "windowsize", t->window);
+
+      /* Room for a window of data, received or sent.  */
+      want = 2 * t->window * (t->blksize + 4);
+      if (getsockopt (t->fd, SOL_SOCKET, opt, &size, &len) == 0
+	  && size < want)
+	setsockopt (t->fd, SOL_SOCKET, opt, &want, sizeof (want));
+    }
+  /* The size of a file sent as netascii is not known in advance.  */
+  if (tsize >= 0 && tp->th_opcode == RRQ && !pf->f_convert)
+    {
+      struct stat st;
+
+      if (t->map)
+	oack_add (t, "tsize", t->map->size);
+      else if (fstat (fileno (t->file), &st) == 0)
+	oack_add (t, "tsize", st.st_size);
     }
+  else if (tsize >= 0 && tp->th_opcode == WRQ)
+    oack_add (t, "tsize", tsize);
+
+  t->pf = pf;
   if (tp->th_opcode == WRQ)
-    (*pf->f_recv) (pf);
+    (*pf->f_recv) (t);
   else
-    (*pf->f_send) (pf);
-  exit (EXIT_SUCCESS);
+    (*pf->f_send) (t);
 }
 
-
-FILE *file;
-
 /*
  * Validate file access.  Since we
  * have no uid or gid, for now require
@@ -532,8 +1585,8 @@ FILE *file;
  * Note also, full path name must be
  * given as we have no login directory.
  */
-int
-validate_access (char **filep, int mode)
+static int
+validate_access (char **filep, int mode, FILE **filp)
 {
   struct stat stbuf;
   int fd;
@@ -623,190 +1676,454 @@ validate_access (char **filep, int mode)
   fd = open (filename, mode == RRQ ? O_RDONLY : (O_WRONLY | O_TRUNC));
   if (fd < 0)
     return (errno + 100);
-  file = fdopen (fd, (mode == RRQ) ? "r" : "w");
-  if (file == NULL)
+  *filp = fdopen (fd, (mode == RRQ) ? "r" : "w");
+  if (*filp == NULL)
     {
-      return errno + 100;
+      int err = errno;
+
+      close (fd);
+      return err + 100;
     }
   return (0);
 }
 
-int timeout;
-sigjmp_buf timeoutbuf;
-
-void
-timer (int sig _GL_UNUSED_PARAMETER)
+/* Load the files named in FP, one on each line, into the cache, as
+   if they were requested.  Empty lines, and lines starting with `#',
+   are skipped.  */
+static void
+cache_warm (FILE *fp)
 {
-
-  timeout += rexmtval;
-  if (timeout >= maxtimeout)
-    exit (EXIT_FAILURE);
-  siglongjmp (timeoutbuf, 1);
+  char *line = NULL, *filename;
+  size_t len = 0;
+  ssize_t n;
+  FILE *file;
+  struct mapping *m;
+  int ecode, cached;
+
+  while ((n = getline (&line, &len, fp)) > 0)
+    {
+      if (line[n - 1] == '\n')
+	line[--n] = '\0';
+      if (n == 0 || *line == '#')
+	continue;
+      filename = line;
+      ecode = validate_access (&filename, RRQ, &file);
+      if (ecode)
+	{
+	  syslog (LOG_WARNING, "cannot cache %s: %s", line, errtomsg (ecode));
+	  continue;
+	}
+      m = mapping_get (fileno (file), line, filename);
+      fclose (file);
+      /* Dropping the reference may free an uncached mapping.  */
+      cached = m && m->name;
+      if (m)
+	mapping_put (m);
+      if (!cached)
+	syslog (LOG_WARNING, "cannot cache %s", line);
+    }
+  free (line);
+  fclose (fp);
 }
 
 /*
  * Send the requested file.
  */
-void
-tftpd_sendfile (struct formats *pf)
-{
-  struct tftphdr *dp, *r_init (void);
-  register struct tftphdr *ap;	/* ack packet */
-  register int size, n;
-  volatile int block;
-
-  signal (SIGALRM, timer);
-  dp = r_init ();
-  ap = (struct tftphdr *) ackbuf;
-  block = 1;
-  do
+static void
+tftpd_sendfile (struct transfer *t)
+{
+  t->state = T_SEND;
+  t->block = t->sent = 0;
+  t->offset = 0;
+  if (!t->map)
     {
-      size = readit (file, &dp, pf->f_convert);
-      if (size < 0)
+      tftpio_init (&t->io, t->blksize, t->window + 2);
+      tftpio_r_init (&t->io);
+    }
+  send_window (t);
+}
+
+/* The blocks of a window, sent together.  */
+static unsigned short batch_hdr[WINDOWMAX][2];
+static struct iovec batch_iov[WINDOWMAX][2];
+#ifdef HAVE_SENDMMSG
+static struct mmsghdr batch[WINDOWMAX];
+# define BATCH_MSG(n)	(batch[n].msg_hdr)
+#else
+static struct msghdr batch[WINDOWMAX];
+# define BATCH_MSG(n)	(batch[n])
+#endif
+
+/* Add block BLOCK of SIZE bytes to the batch, as message N.  The
+   block is the packet DP, or else the data at DATA, with a header of
+   its own.  */
+static void
+batch_add (int n, struct tftphdr *dp, unsigned short block, char *data,
+	   int size)
+{
+  struct msghdr *msg = &BATCH_MSG (n);
+
+  if (dp)
+    {
+      batch_iov[n][0].iov_base = (char *) dp;
+      batch_iov[n][0].iov_len = size + 4;
+      msg->msg_iovlen = 1;
+    }
+  else
+    {
+      batch_hdr[n][0] = htons ((unsigned short) DATA);
+      batch_hdr[n][1] = htons (block);
+      batch_iov[n][0].iov_base = batch_hdr[n];
+      batch_iov[n][0].iov_len = sizeof (batch_hdr[n]);
+      batch_iov[n][1].iov_base = data;
+      batch_iov[n][1].iov_len = size;
+      msg->msg_iovlen = size ? 2 : 1;
+    }
+  msg->msg_iov = batch_iov[n];
+}
+
+/* Send the first N messages of the batch on FD, with as few calls
+   as possible.  Return the number sent before the socket buffer ran
+   full, or -1 on failure.  Data sent from a mapping of a file that
+   has shrunk meanwhile cannot be copied, and fails with EFAULT.  */
+static int
+batch_send (int fd, int n)
+{
+  int i = 0, r;
+
+  while (i < n)
+    {
+#ifdef HAVE_SENDMMSG
+      r = sendmmsg (fd, batch + i, n - i, 0);
+#else
+      r = sendmsg (fd, &batch[i], 0) < 0 ? -1 : 1;
+#endif
+      if (r < 0)
+	return (i || errno == EAGAIN || errno == EWOULDBLOCK
+		|| errno == ENOBUFS) ? i : -1;
+      i += r;
+    }
+  return i;
+}
+
+/* Take a round trip time of R msecs into account, as RFC 6298 does.
+   The timeout follows, unless the client has set it.  */
+static void
+rtt_sample (struct transfer *t, long r)
+{
+  if (t->srtt < 0)
+    {
+      t->srtt = r;
+      t->rttvar = r / 2;
+    }
+  else
+    {
+      t->rttvar = (3 * t->rttvar + labs (t->srtt - r)) / 4;
+      t->srtt = (7 * t->srtt + r) / 8;
+    }
+  if (!t->adaptive)
+    return;
+  t->rto = t->srtt + (4 * t->rttvar > WHEEL_TICK
+		      ? 4 * t->rttvar : WHEEL_TICK);
+  if (t->rto < RTO_MIN)
+    t->rto = RTO_MIN;
+  if (t->rto > t->rexmt * 1000L)
+    t->rto = t->rexmt * 1000L;
+}
+
+/* Send the option acknowledgement, or the blocks of the window not
+   yet sent, and wait for the ack.  Block N after the one acked last
+   is found N buffers after the current one, or N - 1 blocks past the
+   offset in a mapping.  The blocks go out together.  */
+static void
+send_window (struct transfer *t)
+{
+  struct tftphdr *dp;
+  unsigned short first = t->sent;
+  int size, n = 0, done, resend = 0;
+
+  if (t->oack)
+    {
+      if (send (t->fd, t->oack, t->oacklen, 0) != t->oacklen)
 	{
-	  nak (errno + 100);
-	  goto abort;
+	  syslog (LOG_ERR, "tftpd: write: %m\n");
+	  transfer_end (t, EXIT_SUCCESS);
+	  return;
 	}
-      dp->th_opcode = htons ((unsigned short) DATA);
-      dp->th_block = htons ((unsigned short) block);
-      timeout = 0;
-      sigsetjmp (timeoutbuf, SIGALRM);
+      t->timing = t->timeout == 0;
+      t->stamp = msec_now ();
+      timer_set (t, t->rto);
+      return;
+    }
+
+  while ((unsigned short) (t->sent - t->block) < t->window
+	 && !(t->eof && t->sent == t->last))
+    {
+      int k = (unsigned short) (t->sent - t->block) + 1;
 
-    send_data:
-      if (sendto (peer, (const char *) dp, size + 4, 0,
-		 (struct sockaddr *) &from, fromlen) != size + 4)
+      if (t->map)
 	{
-	  syslog (LOG_ERR, "tftpd: write: %m\n");
-	  goto abort;
+	  off_t off = t->offset + (off_t) (k - 1) * t->blksize;
+
+	  size = t->map->size - off < t->blksize
+	    ? t->map->size - off : t->blksize;
+	  batch_add (n, NULL, t->sent + 1, t->map->addr + off, size);
 	}
-      read_ahead (file, pf->f_convert);
-      for (;;)
+      else
 	{
-	  alarm (rexmtval);	/* read the ack */
-	  n = recv (peer, ackbuf, sizeof (ackbuf), 0);
-	  alarm (0);
-	  if (n < 0)
+	  size = tftpio_peek (&t->io, t->file, k, &dp, t->pf->f_convert);
+	  if (size < 0)
 	    {
-	      syslog (LOG_ERR, "tftpd: read: %m\n");
-	      goto abort;
+	      nak (t, errno + 100);
+	      transfer_end (t, EXIT_SUCCESS);
+	      return;
 	    }
-	  ap->th_opcode = ntohs ((unsigned short) ap->th_opcode);
-	  ap->th_block = ntohs ((unsigned short) ap->th_block);
+	  dp->th_opcode = htons ((unsigned short) DATA);
+	  dp->th_block = htons (t->sent + 1);
+	  batch_add (n, dp, t->sent + 1, NULL, size);
+	}
+      n++;
+      t->sent++;
+      if (size < t->blksize)
+	{
+	  t->eof = 1;
+	  t->last = t->sent;
+	}
+      if ((unsigned short) (t->sent - t->block)
+	  <= (unsigned short) (t->high - t->block))
+	{
+	  resend = 1;
+	  t->resent = t->sent;
+	}
+    }
 
-	  if (ap->th_opcode == ERROR)
-	    goto abort;
+  if (n > 0)
+    {
+      done = batch_send (t->fd, n);
+      if (done < 0)
+	{
+	  syslog (LOG_ERR, "tftpd: write: %m\n");
+	  transfer_end (t, EXIT_SUCCESS);
+	  return;
+	}
+      /* The rest goes with the next ack, or after the timeout.  */
+      t->sent = first + done;
+      if ((unsigned short) (t->sent - t->block)
+	  > (unsigned short) (t->high - t->block))
+	t->high = t->sent;
+      /* An ack after a retransmission tells nothing of the round
+	 trip time, since either copy may have caused it.  */
+      if (resend)
+	{
+	  t->timing = 0;
+	  t->rexmitted = 1;
+	}
+      else if (done > 0 && !t->timing)
+	{
+	  t->timing = 1;
+	  t->timed = t->sent;
+	  t->stamp = msec_now ();
+	}
+    }
+  if (!t->map)
+    tftpio_read_ahead (&t->io, t->file, t->pf->f_convert);
+  t->early = 0;
+  timer_set (t, t->rto);
+}
 
-	  if (ap->th_opcode == ACK)
-	    {
-	      if ((unsigned short) ap->th_block == (unsigned short) block)
-		break;
-	      /* Re-synchronize with the other side */
-	      synchnet (peer);
-	      if ((unsigned short) ap->th_block == (unsigned short) (block - 1))
-		goto send_data;
-	    }
+/* Resend the window after a round trip, unless an ack comes first.
+   The ack of an echo is followed by that of the window in time.  */
+static void
+hold_back (struct transfer *t)
+{
+  long delay;
 
-	}
-      block++;
+  if (t->srtt < 0 || t->early)
+    return;
+  delay = t->srtt + 4 * t->rttvar + WHEEL_TICK;
+  if (delay < t->due - msec_now ())
+    {
+      t->early = 1;
+      timer_set (t, delay);
     }
-  while (size == SEGSIZE);
-abort:
-  fclose (file);
 }
 
-void
-justquit (int sig _GL_UNUSED_PARAMETER)
+/* An ack of the highest block sent twice may have been caused by
+   the second copy.  An earlier one tells of blocks still missing.  */
+#define ECHO(t)	((t)->rexmitted && (t)->resent == (t)->block)
+
+static void
+send_input (struct transfer *t, struct tftphdr *ap, int n _GL_UNUSED_PARAMETER)
 {
-  exit (EXIT_SUCCESS);
+  struct tftphdr *dp;
+  unsigned short acked;
+  int partial;
+
+  if (ap->th_opcode != ACK)
+    return;
+
+  /* The client takes the options with an ack of block zero.  */
+  if (t->oack)
+    {
+      if (ap->th_block != 0)
+	return;
+      if (t->timing)
+	rtt_sample (t, msec_now () - t->stamp);
+      t->timing = 0;
+      free (t->oack);
+      t->oack = NULL;
+      t->timeout = 0;
+      send_window (t);
+      return;
+    }
+
+  acked = ap->th_block - t->block;
+  if (acked > (unsigned short) (t->high - t->block))
+    return;			/* Late, or not ours.  */
+  if (acked == 0)
+    {
+      /* A duplicate ack tells of a lost block, and the window goes
+	 again at once.  Not so if it may answer the second copy of
+	 blocks sent twice, lest each block be sent twice from then
+	 on.  */
+      if (t->sent == t->block)
+	return;
+      if (ECHO (t))
+	hold_back (t);
+      else
+	{
+	  t->sent = t->block;
+	  send_window (t);
+	}
+      return;
+    }
+
+  if (t->timing && (unsigned short) (t->timed - t->block) <= acked)
+    {
+      rtt_sample (t, msec_now () - t->stamp);
+      t->timing = 0;
+    }
+  if (t->rexmitted && (unsigned short) (t->resent - t->block) < acked)
+    t->rexmitted = 0;
+  if (acked > (unsigned short) (t->sent - t->block))
+    t->sent = ap->th_block;
+
+  if (t->map)
+    t->offset += (off_t) acked * t->blksize;
+  else
+    while (acked--)
+      tftpio_readit (&t->io, t->file, &dp, t->pf->f_convert);
+  t->block = ap->th_block;
+  t->timeout = 0;
+  if (t->eof && t->block == t->last)
+    {
+      transfer_end (t, EXIT_SUCCESS);
+      return;
+    }
+  /* An ack short of the window tells of a lost block, unless
+     it may answer blocks sent twice.  */
+  partial = t->sent != t->block;
+  if (!ECHO (t))
+    t->sent = t->block;
+  send_window (t);
+  if (partial && ECHO (t))
+    hold_back (t);
 }
 
 
 /*
  * Receive a file.
  */
-void
-recvfile (struct formats *pf)
-{
-  struct tftphdr *dp, *w_init (void);
-  register struct tftphdr *ap;	/* ack buffer */
-  register int n, size;
-  volatile int block;
-
-  signal (SIGALRM, timer);
-  dp = w_init ();
-  ap = (struct tftphdr *) ackbuf;
-  block = 0;
-  do
+static void
+recvfile (struct transfer *t)
+{
+  t->state = T_RECV;
+  tftpio_init (&t->io, t->blksize, 2);
+  t->dp = tftpio_w_init (&t->io);
+  t->block = 1;
+  send_ack (t, 0);
+}
+
+/* Acknowledge BLOCK, or the options in place of block zero, and wait
+   for the next one.  */
+static void
+send_ack (struct transfer *t, unsigned short block)
+{
+  struct tftphdr ack;
+  char *pkt = (char *) &ack;
+  int len = 4;
+
+  ack.th_opcode = htons ((unsigned short) ACK);
+  ack.th_block = htons (block);
+  if (t->oack)
     {
-      timeout = 0;
-      ap->th_opcode = htons ((unsigned short) ACK);
-      ap->th_block = htons ((unsigned short) block);
-      block++;
-      sigsetjmp (timeoutbuf, SIGALRM);
-    send_ack:
-      if (sendto (peer, ackbuf, 4, 0, (struct sockaddr *) &from, fromlen) != 4)
-	{
-	  syslog (LOG_ERR, "tftpd: write: %m\n");
-	  goto abort;
-	}
-      write_behind (file, pf->f_convert);
-      for (;;)
-	{
-	  alarm (rexmtval);
-	  n = recv (peer, (char *) dp, PKTSIZE, 0);
-	  alarm (0);
-	  if (n < 0)
-	    {			/* really? */
-	      syslog (LOG_ERR, "tftpd: read: %m\n");
-	      goto abort;
-	    }
-	  dp->th_opcode = ntohs ((unsigned short) dp->th_opcode);
-	  dp->th_block = ntohs ((unsigned short) dp->th_block);
-	  if (dp->th_opcode == ERROR)
-	    goto abort;
-	  if (dp->th_opcode == DATA)
-	    {
-	      if (dp->th_block == block)
-		{
-		  break;	/* normal */
-		}
-	      /* Re-synchronize with the other side */
-	      synchnet (peer);
-	      if (dp->th_block == (block - 1))
-		goto send_ack;	/* rexmit */
-	    }
-	}
-      /*  size = write(file, dp->th_data, n - 4); */
-      size = writeit (file, &dp, n - 4, pf->f_convert);
-      if (size != (n - 4))
-	{			/* ahem */
-	  if (size < 0)
-	    nak (errno + 100);
-	  else
-	    nak (ENOSPACE);
-	  goto abort;
-	}
+      pkt = t->oack;
+      len = t->oacklen;
+    }
+  if (send (t->fd, pkt, len, 0) != len)
+    {
+      syslog (LOG_ERR, "tftpd: write: %m\n");
+      transfer_end (t, EXIT_SUCCESS);
+      return;
+    }
+  t->acked = block;
+  if (t->state == T_RECV)
+    tftpio_write_behind (&t->io, t->file, t->pf->f_convert);
+  timer_set (t, t->rto);
+}
+
+/* Receive data, acking a window of blocks at a time.  */
+static void
+recv_input (struct transfer *t, struct tftphdr *dp, int n)
+{
+  int size;
+
+  if (dp->th_opcode != DATA)
+    return;
+  if (dp->th_block != t->block)
+    {
+      /* Re-synchronize with the other side, and tell it once
+	 which block comes next.  */
+      synchnet (t->fd);
+      if (!t->gap)
+	send_ack (t, t->block - 1);	/* rexmit */
+      t->gap = 1;
+      return;
     }
-  while (size == SEGSIZE);
-  write_behind (file, pf->f_convert);
-  fclose (file);		/* close data file */
 
-  ap->th_opcode = htons ((unsigned short) ACK);	/* send the "final" ack */
-  ap->th_block = htons ((unsigned short) (block));
-  sendto (peer, ackbuf, 4, 0, (struct sockaddr *) &from, fromlen);
+  /* Data for block one takes the options.  */
+  free (t->oack);
+  t->oack = NULL;
 
-  signal (SIGALRM, justquit);	/* just quit on timeout */
-  alarm (rexmtval);
-  n = recv (peer, buf, sizeof (buf), 0);	/* normally times out and quits */
-  alarm (0);
-  if (n >= 4 &&			/* if read some data */
-      dp->th_opcode == DATA &&	/* and got a data block */
-      block == dp->th_block)
-    {				/* then my last ack was lost */
-      sendto (peer, ackbuf, 4, 0, (struct sockaddr *) &from, fromlen);	/* resend final ack */
+  /*  size = write(file, dp->th_data, n - 4); */
+  size = tftpio_writeit (&t->io, t->file, &t->dp, n - 4, t->pf->f_convert);
+  if (size != (n - 4))
+    {				/* ahem */
+      if (size < 0)
+	nak (t, errno + 100);
+      else
+	nak (t, ENOSPACE);
+      transfer_end (t, EXIT_SUCCESS);
+      return;
+    }
+  t->timeout = 0;
+  t->gap = 0;
+  if (size == t->blksize)
+    {
+      t->block++;
+      if ((unsigned short) (t->block - 1 - t->acked) >= t->window)
+	send_ack (t, t->block - 1);
+      else
+	timer_set (t, t->rto);
+      return;
     }
-abort:
-  return;
+
+  tftpio_write_behind (&t->io, t->file, t->pf->f_convert);
+  fclose (t->file);		/* close data file */
+  t->file = NULL;
+
+  t->state = T_DALLY;		/* send the "final" ack */
+  send_ack (t, t->block);	/* and quit on timeout */
 }
 
 struct errmsg
@@ -847,7 +2164,7 @@ errtomsg (int error)
  * offset by 100.
  */
 static void
-nak (int error)
+nak (struct transfer *t, int error)
 {
   register struct tftphdr *tp;
   int length;
@@ -868,10 +2185,11 @@ nak (int error)
   length = strlen (pe->e_msg);
   tp->th_msg[length] = '\0';
   length += 5;
-  if (sendto (peer, buf, length, 0, (struct sockaddr *) &from, fromlen) != length)
+  if (send (t->fd, buf, length, 0) != length)
     syslog (LOG_ERR, "nak: %m\n");
 }
 
+/* A daemon does not wait for the name server.  */
 static const char *
 verifyhost (struct sockaddr_storage *fromp, socklen_t frlen)
 {
@@ -879,7 +2197,8 @@ verifyhost (struct sockaddr_storage *fromp, socklen_t frlen)
   static char host[NI_MAXHOST];
 
   rc = getnameinfo ((struct sockaddr *) fromp, frlen,
-		    host, sizeof (host), NULL, 0, 0);
+		    host, sizeof (host), NULL, 0,
+		    daemon_mode ? NI_NUMERICHOST : 0);
   if (rc == 0)
     return host;
   else
@@ -25,6 +25,9 @@
  *
  *    addr : Reply with "Your address is $IP."
  *    env  : Reply with all known environment variables and their values.
+ *    listen : Accept a connection on the socket passed on as systemd
+ *             does, using LISTEN_FDS, and reply on it to the tasks
+ *             that follow.
  *
  * Reasonable entries in `inetf.conf' could be
  *
@@ -39,6 +42,10 @@
  *    tcpmux stream tcp nowait nobody internal
  *    tcpmux stream tcp6 nowait nobody internal
  *    tcpmux/env stream tcp nowait nobody /tmp/addrpeek addrkeep env addr
+ *    #
+ *    # Started with the socket, like a server activated by systemd.
+ *    #
+ *    7891 stream tcp listen nobody /tmp/addrpeek addrpeek listen addr
  */
 
 #include <config.h>
@@ -110,26 +117,51 @@ write_environment (int fd, char *envp[])
     }
 }
 
+/* Accept a connection on the first socket passed on, which is
+ * descriptor 3 when LISTEN_FDS and LISTEN_PID are set for us.
+ */
+static int
+accept_passed (void)
+{
+  const char *fds = getenv ("LISTEN_FDS");
+  const char *pid = getenv ("LISTEN_PID");
+
+  if (!fds || atoi (fds) < 1 || !pid || atoi (pid) != (int) getpid ())
+    return -1;
+
+  return accept (3, NULL, NULL);
+}
+
 int
 main (int argc, char *argv[])
 {
-  int j;
+  int j, fd = STDOUT_FILENO;
   set_program_name (argv[0]);
   for (j = 1; j < argc; ++j)
     {
       if (strncmp (argv[j], "addr", strlen ("addr")) == 0)
         {
-          write_address (STDOUT_FILENO);
+          write_address (fd);
           continue;
         }
 
       if (strncmp (argv[j], "env", strlen ("env")) == 0)
         {
-          write_environment (STDOUT_FILENO, environ);
+          write_environment (fd, environ);
+          continue;
+        }
+
+      if (strncmp (argv[j], "listen", strlen ("listen")) == 0)
+        {
+          fd = accept_passed ();
+          if (fd < 0)
+            return EXIT_FAILURE;
           continue;
         }
     }
 
+  if (fd != STDOUT_FILENO)
+    close (fd);
   close (STDIN_FILENO);
   close (STDOUT_FILENO);
   close (STDERR_FILENO);
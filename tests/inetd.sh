@@ -19,7 +19,9 @@
 
 # Test to establish functionality of inetd.
 # An important part is to run in daemon mode
-# and to send SIGHUP repeatedly.
+# and to send SIGHUP repeatedly.  Then limit
+# the connections of a client, and query the
+# counters on the control socket.
 #
 # Written by Mats Erik Andersson.
 
@@ -122,6 +124,7 @@ fi
 #
 CONF="$IU_TESTDIR"/inetd.conf
 PID="$IU_TESTDIR"/inetd.pid
+CTL="$IU_TESTDIR"/inetd.ctl
 
 # Are we able to write in IU_TESTDIR?
 # This could happen with preset IU_TESTDIR.
@@ -144,11 +147,17 @@ clean_testdir () {
 
 # Write a fresh configuration file.  Port is input parameter.
 write_conf () {
-    # First argument is port number.  Node is fixed.
-    echo "$TARGET:$1 stream tcp4 nowait $USER $ADDRPEEK addrpeek addr" \
+    # First argument is port number, the second a replacement
+    # for `nowait'.  Node is fixed.
+    echo "$TARGET:$1 stream tcp4 ${2:-nowait} $USER $ADDRPEEK addrpeek addr" \
 	> $CONF
 }
 
+# Send a command to the control socket, and print the reply.
+control () {
+    $TCPGET -c "$1" -u "$CTL" 2>/dev/null
+}
+
 errno=0
 
 PORT=`expr 12347 + ${RANDOM:-$$} % 521`
@@ -157,7 +166,7 @@ write_conf $PORT
 
 # The daemon is launched only once.
 #
-$INETD -p$PID $CONF
+$INETD -p$PID --control="$CTL" $CONF
 
 # Allow for the service to settle.
 sleep 2
@@ -193,6 +202,152 @@ else
     $silence echo "Passed `expr $nn - 1` SIGHUP rounds."
 fi
 
+# Accept two connections a minute from any one client, and
+# let the control socket reload the configuration.  The third
+# connection must be closed at once.
+#
+if test $errno -eq 0; then
+    write_conf $PORT nowait/2
+    control reload | grep '^ok$' >/dev/null 2>&1 || errno=1
+    sleep 1
+
+    served=0
+    for nn in 1 2 3; do
+	$TCPGET $TARGET $PORT 2>/dev/null |
+	    grep "Your address is $TARGET." >/dev/null 2>&1 &&
+	    served=`expr $served + 1`
+    done
+    test $served -eq 2 || errno=1
+
+    test $errno -eq 0 ||
+	echo >&2 "*** Limit per client served $served of 3, expected 2. ***"
+fi
+
+# The counters must show the refused connection, and be gone
+# after a reset.
+#
+if test $errno -eq 0; then
+    control stats | grep "^inetd pid=`cat $PID` " >/dev/null 2>&1 ||
+	errno=1
+    control stats |
+	grep "^service name=$PORT .* started=2 failed=0 refused=1 " \
+	    >/dev/null 2>&1 || errno=1
+    control reset | grep '^ok$' >/dev/null 2>&1 || errno=1
+    control stats |
+	grep "^service name=$PORT .* started=0 failed=0 refused=0 " \
+	    >/dev/null 2>&1 || errno=1
+
+    test $errno -eq 0 ||
+	{ cat >&2 <<-EOT
+		*** Control socket test has failed. ***
+		`control stats`
+		EOT
+	}
+fi
+
+# A server started with the listening socket, as by systemd,
+# accepts a connection itself.  Once it exits, the socket is
+# watched again.
+#
+if test $errno -eq 0; then
+    echo "$TARGET:$PORT stream tcp4 listen $USER" \
+	"$ADDRPEEK addrpeek listen addr" > $CONF
+    control reload | grep '^ok$' >/dev/null 2>&1 || errno=1
+    sleep 1
+
+    served=0
+    for nn in 1 2; do
+	$TCPGET $TARGET $PORT 2>/dev/null |
+	    grep "Your address is $TARGET." >/dev/null 2>&1 &&
+	    served=`expr $served + 1`
+	sleep 1
+    done
+    test $served -eq 2 || errno=1
+
+    test $errno -eq 0 ||
+	echo >&2 "*** Inherited socket served $served of 2 connections. ***"
+fi
+
+# A server which can not be executed was never started.
+#
+if test $errno -eq 0; then
+    PORT=`expr $PORT + 1 + ${RANDOM:-$$} % 521`
+    echo "$TARGET:$PORT stream tcp4 nowait $USER" \
+	"$IU_TESTDIR/missing missing" > $CONF
+    control reload | grep '^ok$' >/dev/null 2>&1 || errno=1
+    sleep 1
+
+    $TCPGET -t 1 $TARGET $PORT >/dev/null 2>&1
+    sleep 1
+    control stats |
+	grep "^service name=$PORT .* started=0 failed=1 " \
+	    >/dev/null 2>&1 || errno=1
+
+    test $errno -eq 0 ||
+	{ cat >&2 <<-EOT
+		*** Failed execution was not counted. ***
+		`control stats`
+		EOT
+	}
+fi
+
+# Internal services need their well known ports, thus privileges.
+# A daemon of their own answers echo and chargen, but serves only
+# one connection at a time.
+#
+listening () {
+    $NETSTAT -na 2>/dev/null |
+	$GREP -i "[.:]$1[^0-9].*listen" >/dev/null 2>&1
+}
+
+if test $errno -eq 0 && test `func_id_uid` = 0 &&
+    ! listening 7 && ! listening 19; then
+    CONF2="$IU_TESTDIR"/internal.conf
+    PID2="$IU_TESTDIR"/internal.pid
+    cat > "$CONF2" <<-EOT
+	$TARGET:echo stream tcp4 nowait $USER internal
+	$TARGET:chargen stream tcp4 nowait $USER internal
+	EOT
+    $INETD -p"$PID2" --max-internal=1 "$CONF2"
+    sleep 2
+
+    # The connection lingers until the timer of tcpget expires.
+    { $TCPGET -t 1 -c "Echo this line." $TARGET 7; } 2>/dev/null |
+	tr -d '\r' > "$IU_TESTDIR"/echo
+    test "`cat "$IU_TESTDIR"/echo`" = "Echo this line." || {
+	echo >&2 "*** Internal echo has failed. ***"
+	errno=1
+    }
+
+    # A line of 72 characters is shifted by one for each line,
+    # repeating after the 95 printable characters.
+    { $TCPGET -t 1 $TARGET 19; } 2>/dev/null | head -n 96 |
+	tr -d '\r' > "$IU_TESTDIR"/chargen
+    test `$GREP -c '^.\{72\}$' "$IU_TESTDIR"/chargen` -eq 96 &&
+	sed -n 1p "$IU_TESTDIR"/chargen | $GREP '^ !"#.*efg$' >/dev/null &&
+	test "`sed -n 1p "$IU_TESTDIR"/chargen | cut -c2-`" = \
+	    "`sed -n 2p "$IU_TESTDIR"/chargen | cut -c1-71`" &&
+	test "`sed -n 1p "$IU_TESTDIR"/chargen`" = \
+	    "`sed -n 96p "$IU_TESTDIR"/chargen`" || {
+	echo >&2 "*** Internal chargen has failed. ***"
+	errno=1
+    }
+
+    # While one connection is held, the next is closed at once.
+    sleep 1
+    { $TCPGET -t 3 $TARGET 7; } >/dev/null 2>&1 &
+    holder=$!
+    sleep 1
+    { $TCPGET -t 1 -c "Refused line." $TARGET 7; } 2>/dev/null |
+	$GREP "Refused line" >/dev/null 2>&1 && {
+	echo >&2 "*** Limit of internal connections has failed. ***"
+	errno=1
+    }
+    wait $holder 2>/dev/null
+
+    kill "`cat "$PID2"`"
+fi
+
 test $errno -ne 0 || $silence echo 'Successful testing.'
 
 clean_testdir
@@ -0,0 +1,449 @@
+/* logload - generate load for syslogd and measure its throughput.
+  Copyright (C) 2017 Free Software Foundation, Inc.
+
+  This file is part of GNU Inetutils.
+
+  GNU Inetutils is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or (at
+  your option) any later version.
+
+  GNU Inetutils is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see `http://www.gnu.org/licenses/'. */
+
+/* Logload sends messages to syslogd over UNIX, UDP, or TCP sockets,
+ * from several sources, with a mix of facilities and sizes, and at
+ * a fixed rate or as fast as possible.  Syslogd is expected to write
+ * the messages to a named pipe, which logload reads at the same time.
+ * Every message carries its sequence number, so that losses and the
+ * latency from sending to output can be determined.
+ *
+ * Usage: logload [-t unix|udp|tcp] [-c sources] [-n count] [-r rate]
+ *                [-s min[-max]] [-f fac,...] [-w msecs] [-o fifo] target
+ *
+ * The target is a socket path for `unix', otherwise `host:port'.
+ * Without `-o', only the sending rate is reported.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <progname.h>
+
+#define SYSLOG_NAMES
+#include <syslog.h>
+
+#define TAG		"logload"
+#define MAXMSG		8192
+#define MAXSOURCES	1024
+
+enum transport { T_UNIX, T_UDP, T_TCP };
+
+static enum transport transport = T_UNIX;
+static int nsources = 1;
+static unsigned long count = 100000;
+static unsigned long rate;		/* Messages per second, 0 is unlimited.  */
+static size_t minsize = 64, maxsize = 64;
+static int facs[LOG_NFACILITIES];
+static int nfacs;
+static int waitms = 2000;		/* Quiet time ending the collection.  */
+
+static int sources[MAXSOURCES];
+static long long *sent;			/* Sending time of each message.  */
+static long long *latency;		/* Latencies of received messages.  */
+static unsigned long received, duplicates;
+
+static int fifo = -1;
+static char rbuf[4 * MAXMSG];
+static size_t rlen;
+
+static long long
+now_usec (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return (long long) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void
+usage (void)
+{
+  fprintf (stderr, "Usage: %s [-t unix|udp|tcp] [-c sources] [-n count] "
+	   "[-r rate]\n\t[-s min[-max]] [-f fac,...] [-w msecs] [-o fifo] "
+	   "target\n", program_name);
+  exit (EXIT_FAILURE);
+}
+
+static void
+parse_facilities (char *list)
+{
+  char *name;
+
+  nfacs = 0;
+  for (name = strtok (list, ","); name && nfacs < LOG_NFACILITIES;
+       name = strtok (NULL, ","))
+    {
+      CODE *c;
+
+      for (c = facilitynames; c->c_name; c++)
+	if (strcmp (c->c_name, name) == 0)
+	  break;
+      if (c->c_name == NULL)
+	{
+	  fprintf (stderr, "%s: unknown facility `%s'\n",
+		   program_name, name);
+	  exit (EXIT_FAILURE);
+	}
+      facs[nfacs++] = c->c_val;
+    }
+}
+
+static int
+open_source (const char *target)
+{
+  int fd;
+
+  if (transport == T_UNIX)
+    {
+      struct sockaddr_un sun;
+
+      memset (&sun, 0, sizeof (sun));
+      sun.sun_family = AF_UNIX;
+      strncpy (sun.sun_path, target, sizeof (sun.sun_path) - 1);
+      fd = socket (AF_UNIX, SOCK_DGRAM, 0);
+      if (fd >= 0 && connect (fd, (struct sockaddr *) &sun,
+			      sizeof (sun)) < 0)
+	{
+	  close (fd);
+	  fd = -1;
+	}
+    }
+  else
+    {
+      struct addrinfo hints, *ai, *res;
+      char *host = strdup (target), *port;
+      int rc;
+
+      port = strrchr (host, ':');
+      if (port == NULL)
+	usage ();
+      *port++ = '\0';
+
+      memset (&hints, 0, sizeof (hints));
+      hints.ai_family = AF_UNSPEC;
+      hints.ai_socktype = transport == T_TCP ? SOCK_STREAM : SOCK_DGRAM;
+      rc = getaddrinfo (host, port, &hints, &res);
+      if (rc)
+	{
+	  fprintf (stderr, "%s: %s\n", program_name,
+		   gai_strerror (rc));
+	  exit (EXIT_FAILURE);
+	}
+      fd = -1;
+      for (ai = res; ai; ai = ai->ai_next)
+	{
+	  fd = socket (ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	  if (fd < 0)
+	    continue;
+	  if (connect (fd, ai->ai_addr, ai->ai_addrlen) == 0)
+	    break;
+	  close (fd);
+	  fd = -1;
+	}
+      freeaddrinfo (res);
+      free (host);
+    }
+
+  if (fd < 0)
+    {
+      fprintf (stderr, "%s: cannot connect to %s: %s\n",
+	       program_name, target, strerror (errno));
+      exit (EXIT_FAILURE);
+    }
+  return fd;
+}
+
+/* Read what syslogd has written to the pipe, and note the arrival
+   of every complete line.  */
+static void
+collect (void)
+{
+  ssize_t n;
+
+  while ((n = read (fifo, rbuf + rlen, sizeof (rbuf) - rlen - 1)) > 0)
+    {
+      long long t = now_usec ();
+      char *p, *eol;
+
+      rlen += n;
+      rbuf[rlen] = '\0';
+      for (p = rbuf; (eol = strchr (p, '\n')); p = eol + 1)
+	{
+	  char *q;
+	  unsigned long seq;
+
+	  *eol = '\0';
+	  q = strstr (p, TAG "[");
+	  if (q == NULL || (q = strstr (q, "]: ")) == NULL)
+	    continue;
+	  seq = strtoul (q + 3, NULL, 10);
+	  if (seq >= count || sent[seq] == 0)
+	    continue;
+	  if (sent[seq] < 0)
+	    {
+	      duplicates++;
+	      continue;
+	    }
+	  latency[received++] = t - sent[seq];
+	  sent[seq] = -1;
+	}
+      rlen -= p - rbuf;
+      memmove (rbuf, p, rlen);
+      if (rlen == sizeof (rbuf) - 1)
+	rlen = 0;		/* No line that long is ours.  */
+    }
+}
+
+/* Wait up to MS milliseconds for output from syslogd.  */
+static int
+await (int ms)
+{
+  struct pollfd pfd;
+
+  if (fifo < 0)
+    {
+      if (ms > 0)
+	poll (NULL, 0, ms);
+      return 0;
+    }
+
+  pfd.fd = fifo;
+  pfd.events = POLLIN;
+  if (poll (&pfd, 1, ms) > 0)
+    {
+      collect ();
+      return 1;
+    }
+  return 0;
+}
+
+static int
+compare (const void *a, const void *b)
+{
+  long long x = *(const long long *) a, y = *(const long long *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+static double
+percentile (double p)
+{
+  unsigned long i = (unsigned long) (p * (received - 1));
+
+  return latency[i] / 1000.0;
+}
+
+int
+main (int argc, char *argv[])
+{
+  char msg[MAXMSG], frame[MAXMSG + 64];
+  const char *fifoname = NULL;
+  unsigned long i, failed = 0;
+  long long start, elapsed, last;
+  int opt;
+
+  set_program_name (argv[0]);
+
+  while ((opt = getopt (argc, argv, "c:f:n:o:r:s:t:w:")) != -1)
+    {
+      char *end;
+
+      switch (opt)
+	{
+	case 'c':
+	  nsources = atoi (optarg);
+	  if (nsources < 1 || nsources > MAXSOURCES)
+	    usage ();
+	  break;
+
+	case 'f':
+	  parse_facilities (optarg);
+	  break;
+
+	case 'n':
+	  count = strtoul (optarg, NULL, 10);
+	  break;
+
+	case 'o':
+	  fifoname = optarg;
+	  break;
+
+	case 'r':
+	  rate = strtoul (optarg, NULL, 10);
+	  break;
+
+	case 's':
+	  minsize = maxsize = strtoul (optarg, &end, 10);
+	  if (*end == '-')
+	    maxsize = strtoul (end + 1, &end, 10);
+	  if (*end || maxsize < minsize || maxsize > MAXMSG)
+	    usage ();
+	  break;
+
+	case 't':
+	  if (strcmp (optarg, "unix") == 0)
+	    transport = T_UNIX;
+	  else if (strcmp (optarg, "udp") == 0)
+	    transport = T_UDP;
+	  else if (strcmp (optarg, "tcp") == 0)
+	    transport = T_TCP;
+	  else
+	    usage ();
+	  break;
+
+	case 'w':
+	  waitms = atoi (optarg);
+	  break;
+
+	default:
+	  usage ();
+	}
+    }
+
+  if (argc != optind + 1 || count == 0)
+    usage ();
+
+  if (nfacs == 0)
+    facs[nfacs++] = LOG_USER;
+
+  sent = calloc (count, sizeof (*sent));
+  latency = calloc (count, sizeof (*latency));
+  if (sent == NULL || latency == NULL)
+    {
+      fprintf (stderr, "%s: out of memory\n", program_name);
+      exit (EXIT_FAILURE);
+    }
+
+  if (fifoname)
+    {
+      fifo = open (fifoname, O_RDONLY | O_NONBLOCK);
+      if (fifo < 0)
+	{
+	  fprintf (stderr, "%s: %s: %s\n", program_name, fifoname,
+		   strerror (errno));
+	  exit (EXIT_FAILURE);
+	}
+    }
+
+  for (i = 0; i < (unsigned long) nsources; i++)
+    sources[i] = open_source (argv[optind]);
+
+  memset (msg, 'x', sizeof (msg));
+  srand (getpid ());
+  start = now_usec ();
+
+  for (i = 0; i < count; i++)
+    {
+      size_t size = minsize;
+      int src = i % nsources, len, hdr;
+      ssize_t n;
+
+      if (rate)
+	{
+	  long long due = start + (long long) i * 1000000 / rate;
+	  long long t;
+
+	  while ((t = now_usec ()) < due)
+	    await ((due - t + 999) / 1000);
+	}
+      else if (i % 256 == 0)
+	await (0);
+
+      if (maxsize > minsize)
+	size += rand () % (maxsize - minsize + 1);
+
+      hdr = sprintf (frame, "<%d>" TAG "[%d]: %lu ",
+		     facs[i % nfacs] | LOG_INFO, src, i);
+      len = hdr + (size > (size_t) hdr ? size - hdr : 0);
+      memcpy (frame + hdr, msg, len - hdr);
+
+      sent[i] = now_usec ();
+      if (transport == T_TCP)
+	{
+	  char prefix[16];	/* Octet counting, as of RFC 6587.  */
+	  int plen = sprintf (prefix, "%d ", len);
+
+	  memmove (frame + plen, frame, len);
+	  memcpy (frame, prefix, plen);
+	  len += plen;
+	}
+
+      do
+	n = send (sources[src], frame, len, 0);
+      while (n < 0 && (errno == EINTR || errno == ENOBUFS
+		       || errno == EAGAIN));
+      if (n < 0)
+	{
+	  failed++;
+	  sent[i] = 0;
+	}
+    }
+  last = now_usec ();
+  elapsed = last - start;
+
+  /* Collect output until syslogd falls quiet.  */
+  if (fifo >= 0)
+    {
+      while (received + failed < count && await (waitms))
+	last = now_usec ();
+    }
+
+  printf ("sent %lu messages in %.3f s, %.0f msg/s",
+	  count - failed, elapsed / 1e6,
+	  (count - failed) / (elapsed / 1e6));
+  if (failed)
+    printf (", %lu failed", failed);
+  printf ("\n");
+
+  if (fifo >= 0)
+    {
+      double secs = (last - start) / 1e6;
+
+      printf ("received %lu messages in %.3f s, %.0f msg/s, "
+	      "lost %lu (%.2f%%)", received, secs, received / secs,
+	      count - failed - received,
+	      100.0 * (count - failed - received) / (count - failed));
+      if (duplicates)
+	printf (", %lu duplicates", duplicates);
+      printf ("\n");
+
+      if (received)
+	{
+	  qsort (latency, received, sizeof (*latency), compare);
+	  printf ("latency ms: p50 %.3f  p90 %.3f  p99 %.3f  p99.9 %.3f  "
+		  "max %.3f\n", percentile (0.5), percentile (0.9),
+		  percentile (0.99), percentile (0.999),
+		  latency[received - 1] / 1000.0);
+	}
+    }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,172 @@
+#!/bin/sh
+
+# Copyright (C) 2017 Free Software Foundation, Inc.
+#
+# This file is part of GNU Inetutils.
+#
+# GNU Inetutils is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or (at
+# your option) any later version.
+#
+# GNU Inetutils is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see `http://www.gnu.org/licenses/'.
+
+# Measure the throughput of the SYSLOG daemon.
+#
+# This is no test with a verdict, and not part of `make check'.
+# Run it with `make bench-syslogd' in `tests/'.  Every mix of
+# messages sent by logload is reported with its sending and its
+# logging rate, its losses, and the latencies from sending until
+# the message has been written by syslogd.  Last come the counters
+# of syslogd itself, which include the processor time of its stages
+# when built with `-DSYSLOGD_PROFILE' in CPPFLAGS.
+
+# Prerequisites:
+#
+#  * Shell: SVR4 Bourne shell, or newer.
+#
+#  * kill(1), mkfifo(1), mktemp(1).
+
+
+# Is usage explanation in demand?
+#
+if test "$1" = "-h" || test "$1" = "--help" || test "$1" = "--usage"; then
+    cat <<HERE
+Throughput benchmark for syslogd.
+
+The following environment variables are used:
+
+NOCLEAN		No clean up of testing directory, if set.
+VERBOSE		Be verbose, if set.
+OPTIONS		Further options for syslogd.
+COUNT		Messages sent in each mix, default 100000.
+PORT		Port for UDP and TCP, otherwise chosen at random.
+TARGET		Receiving IPv4 address.
+IU_TESTDIR	If set, use this as testing dir.
+
+HERE
+    exit 0
+fi
+
+# Step into `tests/', should the invokation
+# have been made outside of it.
+#
+[ -d src ] && [ -f tests/syslogd-bench.sh ] && cd tests/
+
+. ./tools.sh
+
+$need_mktemp || exit_no_mktemp
+
+PWD="${PWD:-`pwd`}"
+
+# The executables under test.
+#
+SYSLOGD=${SYSLOGD:-../src/syslogd$EXEEXT}
+LOGLOAD=${LOGLOAD:-./logload$EXEEXT}
+
+for prog in $SYSLOGD $LOGLOAD; do
+    if [ ! -x $prog ]; then
+	echo "Missing executable '$prog'.  Failing." >&2
+	exit 77
+    fi
+done
+
+if [ $VERBOSE ]; then
+    set -x
+    $SYSLOGD --version | $SED '1q'
+fi
+
+COUNT=${COUNT:-100000}
+PORT=${PORT:-`expr 10514 + ${RANDOM:-$$} % 2711`}
+: ${TARGET:=127.0.0.1}
+
+umask 0077
+
+do_cleandir=false
+: ${IU_TESTDIR:=$PWD/iu_bench.XXXXXX}
+
+if [ ! -d "$IU_TESTDIR" ]; then
+    do_cleandir=true
+    IU_TESTDIR="`$MKTEMP -d "$IU_TESTDIR" 2>/dev/null`" ||
+	{
+	    echo 'Failed at creating test directory.  Aborting.' >&2
+	    exit 77
+	}
+fi
+
+CONF="$IU_TESTDIR"/syslog.conf
+CONFD="$IU_TESTDIR"/syslog.d
+PID="$IU_TESTDIR"/syslogd.pid
+FIFO="$IU_TESTDIR"/fifo
+STATS="$IU_TESTDIR"/stats
+SOCKET="$IU_TESTDIR"/log
+
+clean_testdir () {
+    if test -f "$PID" && kill -0 "`cat "$PID"`" >/dev/null 2>&1; then
+	kill "`cat "$PID"`" || kill -9 "`cat "$PID"`"
+    fi
+    if test -z "${NOCLEAN+no}" && $do_cleandir; then
+	rm -r -f "$IU_TESTDIR"
+    fi
+}
+
+trap clean_testdir EXIT HUP INT QUIT TERM
+
+mkdir -p "$CONFD"
+mkfifo "$FIFO" || exit 77
+
+# Everything goes to the named pipe read by logload,
+# and the statistics of syslogd to a file as well.
+#
+cat > "$CONF" <<EOT
+*.*	|$FIFO
+syslog.*	$STATS
+EOT
+
+# Keep the pipe open, so that syslogd can write to it
+# while no logload is running.
+#
+exec 3<>"$FIFO"
+
+if [ -c /dev/klog ] || [ -c /dev/kmsg ]; then
+    OPTIONS="--no-klog $OPTIONS"
+fi
+
+$SYSLOGD --rcfile="$CONF" --rcdir="$CONFD" --pidfile="$PID" \
+    --socket="$SOCKET" --ipany --inet -B$PORT --tcp $OPTIONS
+
+sleep 1
+
+if [ ! -r "$PID" ]; then
+    echo "The service daemon never started.  Failing." >&2
+    exit 1
+fi
+
+# bench description logload-arguments
+#
+bench () {
+    echo "$1:"
+    shift
+    $LOGLOAD -n $COUNT -o "$FIFO" "$@" | $SED 's/^/    /'
+}
+
+bench "unix socket, 64 bytes" "$SOCKET"
+bench "unix socket, 40-1000 bytes, 16 senders, 4 facilities" \
+    -s 40-1000 -c 16 -f user,daemon,mail,local0 "$SOCKET"
+bench "unix socket, 20000 per second" -r 20000 "$SOCKET"
+bench "udp, 64 bytes" -t udp "$TARGET:$PORT"
+bench "tcp, 64 bytes, 8 connections" -t tcp -c 8 "$TARGET:$PORT"
+
+kill -USR2 "`cat "$PID"`"
+sleep 1
+
+echo "syslogd:"
+$SED -n 's/^.*syslogd: /    /p' "$STATS"
+
+exit 0
@@ -101,6 +101,8 @@ fi
 #
 SYSLOGD=${SYSLOGD:-../src/syslogd$EXEEXT}
 LOGGER=${LOGGER:-../src/logger$EXEEXT}
+TCPGET=${TCPGET:-$PWD/tcpget$EXEEXT}
+LOGRING=${LOGRING:-../src/logring$EXEEXT}
 
 if [ ! -x $SYSLOGD ]; then
     echo "Missing executable '$SYSLOGD'.  Failing." >&2
@@ -377,7 +379,7 @@ if $do_inet_socket; then
 fi
 ## Bring in additional options from command line.
 ## Disable kernel messages otherwise.
-if [ -c /dev/klog ]; then
+if [ -c /dev/klog ] || [ -c /dev/kmsg ]; then
     : OPTIONS=${OPTIONS:=--no-klog}
 fi
 IU_OPTIONS="$IU_OPTIONS $OPTIONS"
@@ -707,6 +709,183 @@ else
     fi
 fi
 
+# Further features are tested with a daemon of their own,
+# each restarted with a new configuration.
+#
+restart_syslogd () {
+    test -r "$PID" && kill -0 "`cat "$PID"`" >/dev/null 2>&1 &&
+	kill "`cat "$PID"`" && sleep 1
+    rm -f "$PID" "$CONFD"/*
+    eval $SYSLOGD --rcfile="'$CONF'" --rcdir="'$CONFD'" \
+	--pidfile="'$PID'" --socket="'$SOCKET'" $OPTIONS "$@"
+    sleep 1
+}
+
+# feature_result description status
+#
+feature_result () {
+    if test $2 -eq 0; then
+	$silence echo "Successful testing of $1."
+    else
+	echo >&2 "** Failed testing of $1."
+	EXITCODE=1
+    fi
+}
+
+# A program logging at its limit, after an initial burst,
+# must not be suppressed, while a flood must be.
+#
+if $do_unix_socket; then
+    OUT_RATE="$IU_TESTDIR"/rate.log
+    TAG3="syslogd-rate-test"
+    cat > "$CONF" <<-EOT
+	ratelimit program interval=2 burst=2
+	*.*	$OUT_RATE
+	EOT
+    restart_syslogd
+
+    for n in 1 2 3 4 5; do
+	$LOGGER -h "$SOCKET" -t "$TAG3" "Steady message $n. (pid $$)"
+	test $n -eq 1 || sleep 1
+    done
+    for n in 1 2 3 4; do
+	$LOGGER -h "$SOCKET" -t "$TAG3" "Flooding message $n. (pid $$)"
+    done
+    sleep 1
+
+    steady=`$GREP -c "$TAG3.*Steady" "$OUT_RATE"`
+    flood=`$GREP -c "$TAG3.*Flooding" "$OUT_RATE"`
+    test $steady -eq 5 && test $flood -lt 4
+    feature_result "rate limits" $?
+fi
+
+# Files are rotated once they reach their size limit, and by age
+# even while no message arrives.
+#
+if $do_unix_socket; then
+    OUT_SIZE="$IU_TESTDIR"/size.log
+    OUT_AGE="$IU_TESTDIR"/age.log
+    TAG5="syslogd-rotate-test"
+    cat > "$CONF" <<-EOT
+	*.*	$OUT_SIZE	size=200 keep=2
+	*.*	$OUT_AGE	age=2 keep=1
+	EOT
+    restart_syslogd
+
+    for n in 1 2 3 4 5 6 7 8; do
+	$LOGGER -h "$SOCKET" -t "$TAG5" "Rotated message $n. (pid $$)"
+    done
+    sleep 3
+
+    test `cat "$OUT_SIZE" "$OUT_SIZE".1 "$OUT_SIZE".2 |
+	    $GREP -c "$TAG5"` -eq 8 &&
+	test ! -f "$OUT_SIZE".3
+    feature_result "rotation by size" $?
+
+    test `$GREP -c "$TAG5" "$OUT_AGE".1` -eq 8 &&
+	test `$GREP -c "$TAG5" "$OUT_AGE"` -eq 0
+    feature_result "rotation by age" $?
+fi
+
+# A reload keeps the descriptors and buffered data of unchanged
+# actions, while changed ones take effect.
+#
+if $do_unix_socket; then
+    OUT_KEPT="$IU_TESTDIR"/kept.log
+    OUT_OLD="$IU_TESTDIR"/old.log
+    OUT_NEW="$IU_TESTDIR"/new.log
+    TAG6="syslogd-keep-test"
+    cat > "$CONF" <<-EOT
+	*.*	$OUT_KEPT	buffer=4k flush=600000
+	user.*	$OUT_OLD
+	EOT
+    restart_syslogd
+
+    $LOGGER -h "$SOCKET" -t "$TAG6" "Buffered message. (pid $$)"
+    sleep 1
+    cat > "$CONF" <<-EOT
+	*.*	$OUT_KEPT	buffer=4k flush=600000
+	user.*	$OUT_NEW
+	EOT
+    kill -HUP "`cat "$PID"`"
+    sleep 1
+    $LOGGER -h "$SOCKET" -t "$TAG6" "Reloaded message. (pid $$)"
+    sleep 1
+
+    # Only once the daemon stops is the buffer written.
+    $GREP "$TAG6" "$OUT_KEPT" >/dev/null 2>&1
+    kept=$?
+    kill "`cat "$PID"`"
+    sleep 1
+
+    test $kept -ne 0 &&
+	test `$GREP -c "$TAG6" "$OUT_KEPT"` -eq 2 &&
+	test `$GREP -c "$TAG6" "$OUT_OLD"` -eq 1 &&
+	$GREP "$TAG6: Reloaded" "$OUT_NEW" >/dev/null 2>&1
+    feature_result "incremental reload" $?
+fi
+
+# Messages kept in a ring are read back by logring, in full,
+# the last few, or as they arrive.
+#
+if $do_unix_socket && test -x "$LOGRING"; then
+    OUT_RING="$IU_TESTDIR"/ring
+    TAG7="syslogd-ring-test"
+    cat > "$CONF" <<-EOT
+	*.*	%$OUT_RING	size=16k
+	EOT
+    restart_syslogd
+
+    for n in 1 2 3; do
+	$LOGGER -h "$SOCKET" -t "$TAG7" "Ring message $n. (pid $$)"
+    done
+    sleep 1
+    all=`$LOGRING "$OUT_RING" | $GREP -c "$TAG7"`
+    $LOGRING -n 1 "$OUT_RING" > "$IU_TESTDIR"/last
+
+    $LOGRING -f "$OUT_RING" > "$IU_TESTDIR"/follow &
+    follower=$!
+    sleep 1
+    $LOGGER -h "$SOCKET" -t "$TAG7" "Ring message 4. (pid $$)"
+    sleep 1
+    kill $follower
+    wait $follower 2>/dev/null
+
+    test $all -eq 3 &&
+	test `wc -l < "$IU_TESTDIR"/last` -eq 1 &&
+	$GREP "$TAG7: Ring message 3" "$IU_TESTDIR"/last >/dev/null &&
+	test `$GREP -c "$TAG7" "$IU_TESTDIR"/follow` -eq 4 &&
+	$GREP "$TAG7: Ring message 4" "$IU_TESTDIR"/follow >/dev/null
+    feature_result "message rings" $?
+fi
+
+# Messages received over TCP are framed either by a leading
+# octet count, or by a terminating newline.  Both are logged.
+#
+TPORT=`expr $PORT + 1 + ${RANDOM:-$$} % 917`
+if $do_unix_socket && test -x "$TCPGET" && ! locate_port tcp $TPORT; then
+    OUT_TCP="$IU_TESTDIR"/tcp.log
+    TAG4="syslogd-tcp-test"
+    cat > "$CONF" <<-EOT
+	*.*	$OUT_TCP
+	EOT
+    restart_syslogd --ipany --tcp -B$TPORT
+
+    # The client lingers until its timer expires.
+    msg1="<13>$TAG4: Octet counted message 1."
+    msg2="<13>$TAG4: Octet counted message 2."
+    len=`expr X"$msg1" : X'.*' - 1`
+    {
+	$TCPGET -t 1 -c "<13>$TAG4: Newline framed message." $TARGET $TPORT
+	$TCPGET -t 1 -c "$len $msg1$len $msg2" $TARGET $TPORT
+    } >/dev/null 2>&1
+    sleep 1
+
+    $GREP "$TAG4: Newline framed" "$OUT_TCP" >/dev/null 2>&1 &&
+	test `$GREP -c "$TAG4: Octet counted" "$OUT_TCP"` -eq 2
+    feature_result "reception over TCP" $?
+fi
+
 # Remove the daemon process.
 test -r "$PID" && kill -0 "`cat "$PID"`" >/dev/null 2>&1 &&
     kill "`cat "$PID"`"
@@ -25,19 +25,25 @@
  * can be set to another value with a command line switch, starting
  * at one second, but limited upwards to one hour!
  *
+ * A line of text can be sent first, with a switch, and a local
+ * socket can be used in place of a host and a port.
+ *
  * Invocation:
  *
- *   tcpget [-t secs] host tcp-port
+ *   tcpget [-t secs] [-c line] host tcp-port
+ *   tcpget [-t secs] [-c line] -u socket
  */
 
 #include <config.h>
 
 #include <stdio.h>
+#include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <progname.h>
@@ -45,13 +51,74 @@
 # include <locale.h>
 #endif
 
+/* Connect to HOST at PORT, returning a descriptor, or -1.  */
+static int
+connect_remote (const char *host, const char *port)
+{
+  int fd = -1, rc;
+  struct addrinfo hints, *ai, *res;
+
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  rc = getaddrinfo (host, port, &hints, &res);
+
+  if (rc)
+    {
+      fprintf (stderr, "%s: %s\n", program_name, gai_strerror (rc));
+      exit (EXIT_FAILURE);
+    }
+
+  for (ai = res; ai; ai = ai->ai_next)
+    {
+      fd = socket (ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+      if (fd < 0)
+	continue;
+
+      if (connect (fd, ai->ai_addr, ai->ai_addrlen) >= 0)
+	break;
+
+      close (fd);
+      fd = -1;
+    }
+
+  freeaddrinfo (res);
+
+  return fd;
+}
+
+/* Connect to the local stream socket PATH.  */
+static int
+connect_local (const char *path)
+{
+  int fd;
+  struct sockaddr_un addr;
+
+  if (strlen (path) >= sizeof (addr.sun_path))
+    return -1;
+
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, path);
+
+  fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd >= 0 && connect (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0)
+    {
+      close (fd);
+      fd = -1;
+    }
+
+  return fd;
+}
+
 int
 main (int argc, char *argv[])
 {
-  int fd, opt, rc;
+  int fd, opt;
   int timeout = 5;	/* Defaulting to five seconds of waiting time.  */
   char buffer[256];
-  struct addrinfo hints, *ai, *res;
+  char *line = NULL, *path = NULL;
 
   set_program_name (argv[0]);
 
@@ -59,7 +126,7 @@ main (int argc, char *argv[])
   setlocale (LC_ALL, "");
 #endif
 
-  while ((opt = getopt (argc, argv, "t:")) != -1)
+  while ((opt = getopt (argc, argv, "c:t:u:")) != -1)
     {
       int t;
 
@@ -71,47 +138,43 @@ main (int argc, char *argv[])
 	    timeout = t;
 	  break;
 
+	case 'c':
+	  line = optarg;
+	  break;
+
+	case 'u':
+	  path = optarg;
+	  break;
+
 	default:
-	  fprintf (stderr, "Usage: %s [-t secs] host port\n", argv[0]);
+	  fprintf (stderr, "Usage: %s [-t secs] [-c line] host port\n"
+		   "       %s [-t secs] [-c line] -u socket\n",
+		   argv[0], argv[0]);
 	  exit (EXIT_FAILURE);
 	}
     }
 
-  if (argc < optind + 2)
+  if (path)
+    fd = connect_local (path);
+  else if (argc < optind + 2)
     return (EXIT_FAILURE);
+  else
+    fd = connect_remote (argv[optind], argv[optind + 1]);
 
-  memset (&hints, 0, sizeof (hints));
-  hints.ai_family = AF_UNSPEC;
-  hints.ai_socktype = SOCK_STREAM;
-
-  rc = getaddrinfo (argv[optind], argv[optind + 1], &hints, &res);
-
-  if (rc)
-    {
-      fprintf (stderr, "%s: %s\n", argv[0], gai_strerror (rc));
-      return (EXIT_FAILURE);
-    }
-
-  for (ai = res; ai; ai = ai->ai_next)
-    {
-      fd = socket (ai->ai_family, ai->ai_socktype, ai->ai_protocol);
-      if (fd < 0)
-	continue;
-
-      if (connect (fd, ai->ai_addr, ai->ai_addrlen) >= 0)
-	break;
-
-      close (fd);
-    }
-
-  freeaddrinfo (res);
-
-  if (ai && (fd >= 0))
+  if (fd >= 0)
     {
       ssize_t n;
 
       alarm (timeout);
 
+      if (line
+	  && (write (fd, line, strlen (line)) < 0
+	      || write (fd, "\n", 1) < 0))
+	{
+	  fprintf (stderr, "%s: %s\n", program_name, strerror (errno));
+	  exit (EXIT_FAILURE);
+	}
+
       while ((n = recv (fd, buffer, sizeof (buffer), 0)))
 	write (STDOUT_FILENO, buffer, n);
 
@@ -32,13 +32,20 @@
 #    OpenBSD uses /etc/services directly, not via /etc/nsswitch.conf.
 
 #
-# Currently implemented tests (10 or 12 in total):
+# Currently implemented tests (15 or 17 in total):
 #
 #  * Read three files in binary mode, from 127.0.0.1 and ::1,
 #    needing one, two, and multiple data packets, respectively.
 #
 #  * Read one moderate size ascii file from 127.0.0.1 and ::1.
 #
+#  * With the options blksize, windowsize, and tsize, read a
+#    large file and one whose size is a multiple of the block
+#    size, then write a file.
+#
+#  * Run tftpd as a daemon and read a large file from it with
+#    two clients at once.
+#
 #  * Reload configuration and read a small binary file twice.
 #
 #  * (root only) Reload configuration for chrooted mode.
@@ -130,8 +137,10 @@ TMPDIR=`$MKTEMP -d $PWD/tmp.XXXXXXXXXX` ||
 
 INETD_CONF="$TMPDIR/inetd.conf.tmp"
 INETD_PID="$TMPDIR/inetd.pid.$$"
+TFTPD_PID=
 
 posttesting () {
+    test -n "$TFTPD_PID" && kill "$TFTPD_PID" 2>/dev/null
     if test -n "$TMPDIR" && test -f "$INETD_PID" \
 	&& test -r "$INETD_PID" \
 	&& kill -0 "`cat $INETD_PID`" >/dev/null 2>&1
@@ -370,6 +379,55 @@ get $name" | \
    done
 done
 
+# Transfer with negotiated options: large blocks, a window of
+# several blocks, and the transfer size.  A file whose size is
+# a multiple of the block size ends in an empty data packet.
+#
+OPTIONS="blksize 1428
+windowsize 8
+tsize"
+
+$DD if="$input" of="$TMPDIR/tftp-test/file-1428" bs=1428 count=16 \
+    2>/dev/null
+$DD if="$input" of="$TMPDIR/file-upload" bs=1000 count=100 2>/dev/null
+: > "$TMPDIR/tftp-test/file-upload"
+chmod a+w "$TMPDIR/tftp-test/file-upload"
+
+addr=`echo "$ADDRESSES" | $SED 's/ .*//'`
+$silence echo >&2 "Testing options with '$addr'."
+
+for name in tftp-test-file file-1428; do
+    EFFORTS=`expr $EFFORTS + 1`
+    rm -f "$TMPDIR/$name"
+    echo "binary
+$OPTIONS
+get $name $TMPDIR/$name" | \
+    eval "$TFTP" ${VERBOSE:+-v} "$addr" $PORT $bucket
+
+    if cmp "$TMPDIR/tftp-test/$name" "$TMPDIR/$name" 2>/dev/null; then
+	SUCCESSES=`expr $SUCCESSES + 1`
+	test -z "$VERBOSE" || echo >&2 "Successful options for $addr/$name."
+    else
+	test -z "$VERBOSE" || echo >&2 "Failed options for $addr/$name."
+	RESULT=1
+    fi
+done
+
+EFFORTS=`expr $EFFORTS + 1`
+echo "binary
+$OPTIONS
+put $TMPDIR/file-upload $TMPDIR/tftp-test/file-upload" | \
+eval "$TFTP" ${VERBOSE:+-v} "$addr" $PORT $bucket
+
+if cmp "$TMPDIR/file-upload" "$TMPDIR/tftp-test/file-upload" 2>/dev/null
+then
+    SUCCESSES=`expr $SUCCESSES + 1`
+    test -z "$VERBOSE" || echo >&2 "Successful options for writing."
+else
+    test -z "$VERBOSE" || echo >&2 "Failed options for writing."
+    RESULT=1
+fi
+
 # Test the ability of inetd to reload configuration:
 #
 # Assign a new port in the configuration file. Send SIGHUP
@@ -469,6 +527,50 @@ else
     $silence echo >&2 'Informational: Inhibiting chroot test.'
 fi
 
+# Run tftpd standalone, without inetd, and let two clients
+# read from it at the same time.
+#
+for DPORT in `expr $PORT + 11` `expr $PORT + 23` none; do
+    test $DPORT = none && break
+    locate_port $PROTO $DPORT || break
+done
+
+if test $DPORT != none; then
+    $silence echo >&2 'Testing tftpd in daemon mode.'
+    eval "$TFTPD -D --no-detach -p $DPORT -u $USER -l $TMPDIR/tftp-test \
+	$REDIRECT &"
+    TFTPD_PID=$!
+    sleep 1
+
+    addr=`echo "$ADDRESSES" | $SED 's/ .*//'`
+    name=tftp-test-file
+    rm -f "$TMPDIR/daemon-1" "$TMPDIR/daemon-2"
+    for n in 1 2; do
+	echo "binary
+get $name $TMPDIR/daemon-$n" | \
+	eval "$TFTP" ${VERBOSE:+-v} "$addr" $DPORT $bucket &
+	eval client_$n=$!
+    done
+    wait $client_1 $client_2
+
+    for n in 1 2; do
+	EFFORTS=`expr $EFFORTS + 1`
+	if cmp "$TMPDIR/tftp-test/$name" "$TMPDIR/daemon-$n" 2>/dev/null
+	then
+	    SUCCESSES=`expr $SUCCESSES + 1`
+	    test -z "$VERBOSE" || echo >&2 "Success with daemon, client $n."
+	else
+	    test -z "$VERBOSE" || echo >&2 "Failed with daemon, client $n."
+	    RESULT=1
+	fi
+    done
+
+    kill $TFTPD_PID 2>/dev/null
+    TFTPD_PID=
+else
+    $silence echo >&2 'Informational: Inhibiting daemon test.'
+fi
+
 # Minimal clean up. Main work in posttesting().
 $silence echo
 test $RESULT -eq 0 && $silence false \